@@ -0,0 +1,392 @@
+/*
+ * Throughput harness. Runs each ROM given on the command line headless for
+ * a fixed number of instructions on every backend, then times Dxyn on its
+ * own and update_display() on an offscreen window. Results are written as
+ * CSV (or JSON) with one row per benchmark and backend:
+ *
+ *   benchmark,backend,operations,ns_per_op,ops_per_sec
+ *
+ * --compare OLD NEW reads two CSV results, e.g. from two builds, and exits
+ * with status 1 if any benchmark got slower by more than the threshold.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "backend.h"
+#include "debugger.h"
+#include "display.h"
+#include "scheduler.h"
+
+#define DEFAULT_INSTRUCTIONS 20000000ull
+#define CHUNK 10000                  // Instructions between timer ticks
+#define WARMUP 100000
+#define DXYN_ITERATIONS 2000000
+#define DISPLAY_ITERATIONS 20000
+#define DEFAULT_THRESHOLD 5.0       // Percent
+#define MAX_RESULTS 256
+#define DEBUGGER_BREAKPOINTS 8      // Armed at the top of memory, where the ROMs never go
+
+typedef struct {
+    char benchmark[64];
+    char backend[16];
+    uint64_t operations;
+    double ns_per_op;
+} Result;
+
+static Result results[MAX_RESULTS];
+static int num_results = 0;
+
+static void add_result(const char* benchmark, const char* backend, uint64_t operations, uint64_t elapsed_ns) {
+    if (num_results == MAX_RESULTS) {
+        return;
+    }
+
+    Result* r = &results[num_results++];
+    snprintf(r->benchmark, sizeof(r->benchmark), "%s", benchmark);
+    snprintf(r->backend, sizeof(r->backend), "%s", backend);
+    r->operations = operations;
+    r->ns_per_op = operations ? (double)elapsed_ns / operations : 0.0;
+
+    fprintf(stderr, "%-24s %-12s %8.2f ns/op\n", r->benchmark, r->backend, r->ns_per_op);
+}
+
+// "path/to/draw.ch8" -> "rom:draw"
+static void rom_benchmark_name(const char* path, char* name, size_t size) {
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    size_t length = strcspn(base, ".");
+    snprintf(name, size, "rom:%.*s", (int)length, base);
+}
+
+static int bench_rom(const char* path, BackendType type, const char* backend_name, uint64_t instructions) {
+    CPU* cpu = malloc(sizeof(CPU));
+    if (cpu == NULL || initialize_cpu(cpu) < 0) {
+        free(cpu);
+        return -1;
+    }
+    seed_cpu(cpu, 1);
+
+    if (load_rom(cpu, path) < 0) {
+        free(cpu);
+        return -1;
+    }
+
+    Backend backend;
+    if (initialize_backend(&backend, type, 0, cpu) < 0) {
+        free(cpu);
+        return -1;
+    }
+
+    run_backend(&backend, cpu, WARMUP);
+
+    uint64_t start = scheduler_now_ns();
+    for (uint64_t done = 0; done < instructions; done += CHUNK) {
+        run_backend(&backend, cpu, CHUNK);
+        tick_timers(cpu);
+    }
+    uint64_t elapsed = scheduler_now_ns() - start;
+
+    char name[64];
+    rom_benchmark_name(path, name, sizeof(name));
+    add_result(name, backend_name, (instructions + CHUNK - 1) / CHUNK * CHUNK, elapsed);
+
+    cleanup_backend(&backend);
+    free(cpu);
+    return 0;
+}
+
+// The interpreter under the debugger with breakpoints armed, which should cost only a bit test per instruction
+static int bench_rom_debugger(const char* path, uint64_t instructions) {
+    CPU* cpu = malloc(sizeof(CPU));
+    Debugger* debugger = malloc(sizeof(Debugger));
+    if (cpu == NULL || debugger == NULL || initialize_cpu(cpu) < 0 || load_rom(cpu, path) < 0) {
+        free(cpu);
+        free(debugger);
+        return -1;
+    }
+    seed_cpu(cpu, 1);
+
+    initialize_debugger(debugger, NULL);
+    for (int i = 0; i < DEBUGGER_BREAKPOINTS; i++) {
+        add_breakpoint(debugger, (uint16_t)(CHIP8_MEM_SIZE - 2 - 2 * i), NULL);
+    }
+
+    debug_run(debugger, cpu, WARMUP, 1);
+
+    // Resuming keeps it going should a breakpoint be hit after all
+    uint64_t done = 0;
+    uint64_t start = scheduler_now_ns();
+    while (done < instructions) {
+        done += debug_run(debugger, cpu, CHUNK, 1);
+        tick_timers(cpu);
+    }
+    uint64_t elapsed = scheduler_now_ns() - start;
+
+    char name[64];
+    rom_benchmark_name(path, name, sizeof(name));
+    add_result(name, "debugger", done, elapsed);
+
+    free(debugger);
+    free(cpu);
+    return 0;
+}
+
+// Dxyn alone through the handler table, full-height sprites at shifting positions
+static void bench_dxyn(void) {
+    CPU* cpu = malloc(sizeof(CPU));
+    if (cpu == NULL) {
+        return;
+    }
+    initialize_cpu(cpu);
+    cpu->I = START_FONT_MEM;
+
+    for (int r = 0; r < NUM_REGS; r++) {
+        cpu->v[r] = r * 11;
+    }
+
+    DecodedOp ops[64];
+    for (int i = 0; i < 64; i++) {
+        ops[i] = decode(0xD00F | (i % 16) << 8 | ((i / 4) % 16) << 4, MACHINE_CHIP8);
+    }
+
+    uint64_t start = scheduler_now_ns();
+    for (int i = 0; i < DXYN_ITERATIONS; i++) {
+        op_handlers[cpu->quirks][OP_DRW](cpu, &ops[i & 63]);
+    }
+    add_result("op:dxyn", "-", DXYN_ITERATIONS, scheduler_now_ns() - start);
+
+    free(cpu);
+}
+
+// update_display() on a hidden window, with every row dirty and with one
+static void bench_update_display(void) {
+    // Offscreen unless the caller picked drivers
+    setenv("SDL_VIDEODRIVER", "dummy", 0);
+    setenv("SDL_AUDIODRIVER", "dummy", 0);
+    setenv("SDL_RENDER_DRIVER", "software", 0);
+
+    // Probe first, initialize_display() reports failures on stdout
+    Display display;
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0 || initialize_display(&display) < 0) {
+        fprintf(stderr, "update_display benchmarks skipped, no display available\n");
+        return;
+    }
+
+    Frame* frame = calloc(1, sizeof(Frame));
+    if (frame == NULL) {
+        cleanup_display(&display);
+        return;
+    }
+    for (int y = 0; y < LORES_HEIGHT; y++) {
+        frame->framebuffer[0][y][0] = 0xF0F0F0F00F0F0F0Full ^ ((uint64_t)y * 0x9E3779B97F4A7C15ull);
+    }
+
+    uint64_t start = scheduler_now_ns();
+    for (int i = 0; i < DISPLAY_ITERATIONS; i++) {
+        update_display(&display, frame, ~0ull);
+    }
+    add_result("update_display:full", "-", DISPLAY_ITERATIONS, scheduler_now_ns() - start);
+
+    start = scheduler_now_ns();
+    for (int i = 0; i < DISPLAY_ITERATIONS; i++) {
+        update_display(&display, frame, 1ull << (i & 31));
+    }
+    add_result("update_display:one_row", "-", DISPLAY_ITERATIONS, scheduler_now_ns() - start);
+
+    start = scheduler_now_ns();
+    for (int i = 0; i < DISPLAY_ITERATIONS; i++) {
+        update_display(&display, frame, 0);
+    }
+    add_result("update_display:clean", "-", DISPLAY_ITERATIONS, scheduler_now_ns() - start);
+
+    free(frame);
+    cleanup_display(&display);
+}
+
+static void write_csv(FILE* out) {
+    fprintf(out, "benchmark,backend,operations,ns_per_op,ops_per_sec\n");
+    for (int i = 0; i < num_results; i++) {
+        const Result* r = &results[i];
+        fprintf(out, "%s,%s,%llu,%.3f,%.0f\n", r->benchmark, r->backend, (unsigned long long)r->operations,
+                r->ns_per_op, r->ns_per_op > 0 ? 1e9 / r->ns_per_op : 0.0);
+    }
+}
+
+static void write_json(FILE* out) {
+    fprintf(out, "[\n");
+    for (int i = 0; i < num_results; i++) {
+        const Result* r = &results[i];
+        fprintf(out, "  {\"benchmark\": \"%s\", \"backend\": \"%s\", \"operations\": %llu, "
+                     "\"ns_per_op\": %.3f, \"ops_per_sec\": %.0f}%s\n",
+                r->benchmark, r->backend, (unsigned long long)r->operations, r->ns_per_op,
+                r->ns_per_op > 0 ? 1e9 / r->ns_per_op : 0.0, i + 1 < num_results ? "," : "");
+    }
+    fprintf(out, "]\n");
+}
+
+// Reads a CSV written by write_csv() into `out`, returns the number of rows or -1
+static int read_csv(const char* path, Result* out, int max) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int count = 0;
+    while (fgets(line, sizeof(line), file) != NULL && count < max) {
+        Result r;
+        unsigned long long operations;
+        if (sscanf(line, "%63[^,],%15[^,],%llu,%lf", r.benchmark, r.backend, &operations, &r.ns_per_op) == 4) {
+            r.operations = operations;
+            out[count++] = r;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+static int compare(const char* old_path, const char* new_path, double threshold) {
+    static Result old_results[MAX_RESULTS];
+    static Result new_results[MAX_RESULTS];
+    int old_count = read_csv(old_path, old_results, MAX_RESULTS);
+    int new_count = read_csv(new_path, new_results, MAX_RESULTS);
+    if (old_count < 0 || new_count < 0) {
+        return 2;
+    }
+
+    int regressions = 0;
+    printf("benchmark,backend,old_ns_per_op,new_ns_per_op,change_percent\n");
+    for (int i = 0; i < new_count; i++) {
+        const Result* n = &new_results[i];
+        for (int j = 0; j < old_count; j++) {
+            const Result* o = &old_results[j];
+            if (strcmp(n->benchmark, o->benchmark) != 0 || strcmp(n->backend, o->backend) != 0) {
+                continue;
+            }
+
+            double change = o->ns_per_op > 0 ? (n->ns_per_op - o->ns_per_op) / o->ns_per_op * 100.0 : 0.0;
+            int regressed = change > threshold;
+            regressions += regressed;
+            printf("%s,%s,%.3f,%.3f,%+.1f%s\n", n->benchmark, n->backend, o->ns_per_op, n->ns_per_op,
+                   change, regressed ? ",REGRESSION" : "");
+            break;
+        }
+    }
+
+    if (regressions > 0) {
+        fprintf(stderr, "%d benchmark(s) slower by more than %.1f%%\n", regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--instructions N] [--backend interpreter|threaded|debugger|all] [--json] [--out FILE] ROM...\n"
+            "       %s --compare OLD.csv NEW.csv [--threshold PERCENT]\n", program, program);
+}
+
+int main(int argc, char** argv) {
+    uint64_t instructions = DEFAULT_INSTRUCTIONS;
+    const char* backend_name = "all";
+    const char* out_path = NULL;
+    const char* compare_path = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    int json = 0;
+
+    static const struct option long_options[] = {
+        {"instructions", required_argument, NULL, 'n'},
+        {"backend",      required_argument, NULL, 'b'},
+        {"json",         no_argument,       NULL, 'j'},
+        {"out",          required_argument, NULL, 'o'},
+        {"compare",      required_argument, NULL, 'C'},
+        {"threshold",    required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:b:jo:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                instructions = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                backend_name = optarg;
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 'C':
+                compare_path = optarg;
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (compare_path != NULL) {
+        if (optind != argc - 1) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        return compare(compare_path, argv[optind], threshold);
+    }
+
+    static const struct {
+        const char* name;
+        BackendType type;
+    } backends[] = {
+        {"interpreter", BACKEND_INTERPRETER},
+        {"threaded", BACKEND_THREADED},
+    };
+
+    for (int i = optind; i < argc; i++) {
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            if (strcmp(backend_name, "all") != 0 && strcmp(backend_name, backends[b].name) != 0) {
+                continue;
+            }
+            if (bench_rom(argv[i], backends[b].type, backends[b].name, instructions) < 0) {
+                fprintf(stderr, "Skipping %s\n", argv[i]);
+                break;
+            }
+        }
+        if (strcmp(backend_name, "all") == 0 || strcmp(backend_name, "debugger") == 0) {
+            bench_rom_debugger(argv[i], instructions);
+        }
+    }
+
+    bench_dxyn();
+    bench_update_display();
+
+    FILE* out = stdout;
+    if (out_path != NULL) {
+        out = fopen(out_path, "w");
+        if (out == NULL) {
+            perror(out_path);
+            return 2;
+        }
+    }
+
+    if (json) {
+        write_json(out);
+    } else {
+        write_csv(out);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
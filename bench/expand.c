@@ -0,0 +1,94 @@
+/*
+ * Micro-benchmark for the framebuffer to RGBA expansion kernels.
+ * Converts full 64x32 frames with every kernel supported on this CPU,
+ * checks that they all agree with the scalar one and reports ns/frame.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pixels.h"
+
+#define WIDTH 64
+#define HEIGHT 32
+#define NUM_FRAMES 64
+#define ITERATIONS 20000
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int main(void) {
+    static uint64_t frames[NUM_FRAMES][HEIGHT];
+    static uint32_t expected[HEIGHT][WIDTH];
+    static uint32_t pixels[HEIGHT][WIDTH];
+    const uint32_t on = DEFAULT_PALETTE_ON;
+    const uint32_t off = DEFAULT_PALETTE_OFF;
+
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    for (int f = 0; f < NUM_FRAMES; f++) {
+        for (int y = 0; y < HEIGHT; y++) {
+            frames[f][y] = next_random(&seed);
+        }
+    }
+
+    const ExpandKernel* kernels = supported_expand_kernels();
+    int failed = 0;
+
+    printf("kernel,ns_per_frame\n");
+    for (int k = 0; kernels[k].name != NULL; k++) {
+        // Correctness first
+        for (int f = 0; f < NUM_FRAMES; f++) {
+            for (int y = 0; y < HEIGHT; y++) {
+                expand_row_scalar(frames[f][y], expected[y], on, off);
+                kernels[k].expand_row(frames[f][y], pixels[y], on, off);
+            }
+
+            if (memcmp(expected, pixels, sizeof(pixels)) != 0) {
+                fprintf(stderr, "%s does not match the scalar kernel\n", kernels[k].name);
+                failed = 1;
+                break;
+            }
+        }
+
+        uint64_t start = now_ns();
+        for (int i = 0; i < ITERATIONS; i++) {
+            const uint64_t* frame = frames[i % NUM_FRAMES];
+            for (int y = 0; y < HEIGHT; y++) {
+                kernels[k].expand_row(frame[y], pixels[y], on, off);
+            }
+            // Keep the compiler from dropping the stores
+            __asm__ volatile("" : : "r"(pixels) : "memory");
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        printf("%s,%.1f\n", kernels[k].name, (double)elapsed / ITERATIONS);
+    }
+
+    // Phosphor decay is scalar only, report it for comparison
+    static uint8_t intensity[HEIGHT][WIDTH];
+    Palette palette = { on, off };
+    static uint32_t ramp[256];
+    build_phosphor_ramp(&palette, ramp);
+    uint64_t start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        const uint64_t* frame = frames[i % NUM_FRAMES];
+        for (int y = 0; y < HEIGHT; y++) {
+            expand_row_phosphor(frame[y], intensity[y], pixels[y], ramp, 200);
+        }
+        __asm__ volatile("" : : "r"(pixels) : "memory");
+    }
+    printf("phosphor,%.1f\n", (double)(now_ns() - start) / ITERATIONS);
+
+    return failed;
+}
@@ -0,0 +1,207 @@
+/*
+ * Generates the synthetic ROMs used by the benchmark harness, one per
+ * opcode family. Each ROM sets up its registers once and then loops over
+ * a body made almost entirely of the family's instructions, so
+ * ns/instruction on it is the cost of that family (plus one jump in 33).
+ *
+ * Usage: genroms OUTPUT_DIR
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define START 0x200
+#define BODY 32
+#define SCRATCH 0x800    // Memory written by Fx33/Fx55
+#define SPRITE 0x600     // 15 bytes of sprite data
+
+typedef struct {
+    uint16_t words[1024];
+    int count;
+} Rom;
+
+static void emit(Rom* rom, uint16_t word) {
+    rom->words[rom->count++] = word;
+}
+
+static uint16_t here(const Rom* rom) {
+    return START + rom->count * 2;
+}
+
+// Registers that every body expects: v0-v7 x positions, v8-vE y positions, vF zero
+static void setup_registers(Rom* rom) {
+    for (int x = 0; x < 15; x++) {
+        emit(rom, 0x6000 | x << 8 | (uint8_t)(x * 9 + 1));
+    }
+    emit(rom, 0x6F00);
+}
+
+// Sprite data for Dxyn, past the end of the code
+static void place_sprite(Rom* rom) {
+    while (here(rom) < SPRITE) {
+        emit(rom, 0x0000);
+    }
+    for (int i = 0; i < 8; i++) {
+        emit(rom, 0xA55A ^ (i * 0x1111));
+    }
+}
+
+static void write_rom(const Rom* rom, const char* dir, const char* name) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.ch8", dir, name);
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (int i = 0; i < rom->count; i++) {
+        fputc(rom->words[i] >> 8, file);
+        fputc(rom->words[i] & 0xFF, file);
+    }
+    fclose(file);
+}
+
+/*
+ * Builds a ROM: setup, then a loop of BODY instructions from `body`
+ * (called with the instruction index and the address it will live at).
+ */
+static void generate(const char* dir, const char* name, uint16_t setup_i, uint16_t (*body)(int i, uint16_t address)) {
+    Rom rom = { .count = 0 };
+    setup_registers(&rom);
+    emit(&rom, 0xA000 | setup_i);
+
+    uint16_t loop = here(&rom);
+    for (int i = 0; i < BODY; i++) {
+        emit(&rom, body(i, here(&rom)));
+    }
+    emit(&rom, 0x1000 | loop);
+
+    place_sprite(&rom);
+    write_rom(&rom, dir, name);
+}
+
+static uint16_t load_body(int i, uint16_t address) {
+    (void)address;
+    return i & 1 ? 0xA000 | SCRATCH : 0x6000 | (i % 15) << 8 | i;
+}
+
+static uint16_t add_body(int i, uint16_t address) {
+    (void)address;
+    return i & 1 ? 0x8004 | (i % 7) << 8 | ((i + 3) % 7) << 4 : 0x7000 | (i % 15) << 8 | 3;
+}
+
+static uint16_t logic_body(int i, uint16_t address) {
+    (void)address;
+    return 0x8001 | (i % 3) | (i % 7) << 8 | ((i + 2) % 7) << 4;
+}
+
+static uint16_t shift_body(int i, uint16_t address) {
+    (void)address;
+    return (i & 1 ? 0x800E : 0x8006) | (i % 7) << 8 | ((i + 1) % 7) << 4;
+}
+
+static uint16_t sub_body(int i, uint16_t address) {
+    (void)address;
+    return (i & 1 ? 0x8007 : 0x8005) | (i % 7) << 8 | ((i + 4) % 7) << 4;
+}
+
+// Conditions chosen so nothing is skipped: v0 is 1, v1 is 10, vF is 0
+static uint16_t skip_body(int i, uint16_t address) {
+    (void)address;
+    switch (i % 4) {
+        case 0: return 0x3F01;      // vF == 1
+        case 1: return 0x4F00;      // vF != 0
+        case 2: return 0x5010;      // v0 == v1
+        default: return 0x9000;     // v0 != v0
+    }
+}
+
+static uint16_t jump_body(int i, uint16_t address) {
+    (void)i;
+    return 0x1000 | (address + 2);
+}
+
+// Groups of four: call the 00EE two words ahead, and once it returns jump
+// over it to a 7xnn
+static uint16_t call_body(int i, uint16_t address) {
+    switch (i % 4) {
+        case 0: return 0x2000 | (address + 4);    // call the 00EE two words ahead
+        case 1: return 0x1000 | (address + 4);    // after returning, jump past it
+        case 2: return 0x00EE;
+        default: return 0x7001;
+    }
+}
+
+static uint16_t timer_body(int i, uint16_t address) {
+    (void)address;
+    static const uint16_t ops[] = { 0xF007, 0xF115, 0xF218, 0xF307 };
+    return ops[i % 4];
+}
+
+static uint16_t rand_body(int i, uint16_t address) {
+    (void)address;
+    return 0xC000 | (i % 15) << 8 | 0xFF;
+}
+
+static uint16_t bcd_body(int i, uint16_t address) {
+    (void)address;
+    return 0xF033 | (i % 15) << 8;
+}
+
+static uint16_t regmem_body(int i, uint16_t address) {
+    (void)address;
+    return (i & 1 ? 0xF065 : 0xF055) | 0x0700;
+}
+
+static uint16_t index_body(int i, uint16_t address) {
+    (void)address;
+    return i & 1 ? 0xF029 | (i % 15) << 8 : 0xA000 | SCRATCH;
+}
+
+// Full-height sprites at every x/y combination of the setup registers
+static uint16_t draw_body(int i, uint16_t address) {
+    (void)address;
+    return 0xD00F | (i % 8) << 8 | (8 + i % 7) << 4;
+}
+
+static uint16_t cls_body(int i, uint16_t address) {
+    (void)address;
+    return i & 1 ? 0x00E0 : 0xD00F | (i % 8) << 8 | 8 << 4;
+}
+
+// Roughly what a game's frame loop does
+static uint16_t mix_body(int i, uint16_t address) {
+    static const uint16_t ops[] = {
+        0x7001, 0x8014, 0x3F01, 0xF007, 0x8126, 0x6205, 0xC30F, 0x4F00,
+        0x8232, 0xA600, 0x7102, 0x8315, 0x5010, 0xD01F, 0x8031, 0xF129,
+    };
+    (void)address;
+    return ops[i % 16];
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s OUTPUT_DIR\n", argv[0]);
+        return 1;
+    }
+    const char* dir = argv[1];
+
+    generate(dir, "load", SPRITE, load_body);
+    generate(dir, "add", SPRITE, add_body);
+    generate(dir, "logic", SPRITE, logic_body);
+    generate(dir, "shift", SPRITE, shift_body);
+    generate(dir, "sub", SPRITE, sub_body);
+    generate(dir, "skip", SPRITE, skip_body);
+    generate(dir, "jump", SPRITE, jump_body);
+    generate(dir, "call", SPRITE, call_body);
+    generate(dir, "timer", SPRITE, timer_body);
+    generate(dir, "rand", SPRITE, rand_body);
+    generate(dir, "bcd", SCRATCH, bcd_body);
+    generate(dir, "regmem", SCRATCH, regmem_body);
+    generate(dir, "index", SPRITE, index_body);
+    generate(dir, "draw", SPRITE, draw_body);
+    generate(dir, "cls", SPRITE, cls_body);
+    generate(dir, "mix", SPRITE, mix_body);
+    return 0;
+}
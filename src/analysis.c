@@ -0,0 +1,745 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "analysis.h"
+#include "disasm.h"
+#include "error.h"
+#include "idle.h"
+#include "romdb.h"
+
+#define ANALYSIS_HEADER_SIZE 60
+#define BLOCK_RECORD_SIZE 12
+#define MAX_JUMP_TABLE 128          // Entries followed after a Bnnn
+#define NO_INDEX 0xFFFFFFFFu
+
+_Static_assert(ADDRESS_IDLE == IDLE_HINT, "idle.c looks for ADDRESS_IDLE");
+
+static void put_le(uint8_t* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t get_le(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static uint16_t read_word(const CPU* cpu, uint32_t address) {
+    return cpu->memory[address & cpu->memory_mask] << 8 | cpu->memory[(address + 1) & cpu->memory_mask];
+}
+
+static int instruction_length(const DecodedOp* d) {
+    return d->op == OP_LD_I_LONG ? 4 : 2;
+}
+
+static int is_skip(uint8_t op) {
+    return op == OP_SE_VX_NN || op == OP_SNE_VX_NN || op == OP_SE_VX_VY || op == OP_SNE_VX_VY
+        || op == OP_SKP || op == OP_SKNP;
+}
+
+// Instructions after which control doesn't simply fall through
+static int ends_block(uint8_t op) {
+    return op == OP_JP || op == OP_CALL || op == OP_RET || op == OP_EXIT || op == OP_JP_V0 || is_skip(op);
+}
+
+// Instructions an idle loop may consist of: they only read the timer or keys, or compare
+static int waits_only(uint8_t op) {
+    return op == OP_JP || op == OP_LD_VX_DT || op == OP_LD_VX_K || op == OP_LD_VX_NN || is_skip(op);
+}
+
+// Addresses still to explore, each is pushed at most once
+typedef struct {
+    uint16_t* items;
+    uint32_t count;
+} Worklist;
+
+static void push_target(Analysis* analysis, Worklist* work, uint8_t* queued, uint32_t address) {
+    uint32_t end = START_PROGRAM_MEM + analysis->rom_size;
+    if (address < START_PROGRAM_MEM || address >= end) {
+        return;
+    }
+    analysis->address_flags[address] |= ADDRESS_BLOCK;
+    if (!queued[address]) {
+        queued[address] = 1;
+        work->items[work->count++] = (uint16_t)address;
+    }
+}
+
+// Recursive descent from 0x200, marks every instruction reachable through the control flow
+static void find_code(Analysis* analysis, const CPU* cpu, uint8_t* queued, Worklist* work) {
+    uint8_t* flags = analysis->address_flags;
+    uint32_t end = START_PROGRAM_MEM + analysis->rom_size;
+
+    push_target(analysis, work, queued, START_PROGRAM_MEM);
+    while (work->count > 0) {
+        uint32_t pc = work->items[--work->count];
+
+        while (pc + 1 < end && !(flags[pc] & (ADDRESS_INSTRUCTION | ADDRESS_OPERAND))) {
+            DecodedOp d = decode(read_word(cpu, pc), cpu->machine);
+            int length = instruction_length(&d);
+            if (pc + length > end) {
+                break;
+            }
+
+            flags[pc] |= ADDRESS_INSTRUCTION;
+            for (int i = 1; i < length; i++) {
+                flags[pc + i] |= ADDRESS_OPERAND;
+            }
+            analysis->instructions++;
+            uint32_t next = pc + length;
+
+            if (d.op == OP_JP) {
+                push_target(analysis, work, queued, d.nnn);
+                break;
+            }
+            if (d.op == OP_RET || d.op == OP_EXIT) {
+                break;
+            }
+            if (d.op == OP_CALL) {
+                push_target(analysis, work, queued, d.nnn);
+                if (d.nnn >= START_PROGRAM_MEM && d.nnn < end) {
+                    flags[d.nnn] |= ADDRESS_FUNCTION;
+                }
+                push_target(analysis, work, queued, next);
+                break;
+            }
+            if (is_skip(d.op)) {
+                push_target(analysis, work, queued, next);
+                push_target(analysis, work, queued, next + skip_size(cpu, (uint16_t)next));
+                break;
+            }
+            if (d.op == OP_JP_V0) {
+                // Only a table of jumps or calls is followed, anything else could be data
+                for (uint32_t entry = d.nnn; entry < d.nnn + 2u * MAX_JUMP_TABLE && entry + 1 < end; entry += 2) {
+                    uint8_t op = decode(read_word(cpu, entry), cpu->machine).op;
+                    if (op != OP_JP && op != OP_CALL) {
+                        break;
+                    }
+                    push_target(analysis, work, queued, entry);
+                }
+                break;
+            }
+            pc = next;
+        }
+    }
+}
+
+// Splits the code into basic blocks, `block_at` gets each block's index by start address
+static int find_blocks(Analysis* analysis, const CPU* cpu, uint32_t* block_at) {
+    uint8_t* flags = analysis->address_flags;
+    uint32_t end = START_PROGRAM_MEM + analysis->rom_size;
+
+    // The instruction after one that ends a block starts a block, if it is code
+    for (uint32_t pc = START_PROGRAM_MEM; pc < end; pc++) {
+        if (flags[pc] & ADDRESS_INSTRUCTION) {
+            DecodedOp d = decode(read_word(cpu, pc), cpu->machine);
+            uint32_t next = pc + instruction_length(&d);
+            if (ends_block(d.op) && next < end && (flags[next] & ADDRESS_INSTRUCTION)) {
+                flags[next] |= ADDRESS_BLOCK;
+            }
+        }
+    }
+
+    uint32_t count = 0;
+    for (uint32_t pc = START_PROGRAM_MEM; pc < end; pc++) {
+        count += (flags[pc] & (ADDRESS_BLOCK | ADDRESS_INSTRUCTION)) == (ADDRESS_BLOCK | ADDRESS_INSTRUCTION);
+    }
+    analysis->blocks = calloc(count ? count : 1, sizeof(BasicBlock));
+    if (analysis->blocks == NULL) {
+        return -1;
+    }
+
+    for (uint32_t pc = START_PROGRAM_MEM; pc < end; pc++) {
+        if ((flags[pc] & (ADDRESS_BLOCK | ADDRESS_INSTRUCTION)) != (ADDRESS_BLOCK | ADDRESS_INSTRUCTION)) {
+            continue;
+        }
+
+        BasicBlock* block = &analysis->blocks[analysis->block_count];
+        block_at[pc] = analysis->block_count++;
+        block->start = (uint16_t)pc;
+
+        uint32_t at = pc;
+        while (1) {
+            DecodedOp d = decode(read_word(cpu, at), cpu->machine);
+            uint32_t next = at + instruction_length(&d);
+            int falls_through = !ends_block(d.op);
+
+            if (d.op == OP_JP) {
+                block->successors[block->successor_count++] = d.nnn;
+            } else if (d.op == OP_CALL) {
+                block->call = d.nnn;
+                falls_through = 1;
+            } else if (is_skip(d.op)) {
+                block->successors[block->successor_count++] = (uint16_t)next;
+                block->successors[block->successor_count++] = (uint16_t)(next + skip_size(cpu, (uint16_t)next));
+            } else if (d.op == OP_JP_V0) {
+                block->flags |= BLOCK_INDIRECT;
+            }
+
+            int continues = falls_through && next < end && (flags[next] & ADDRESS_INSTRUCTION);
+            if (!continues || (flags[next] & ADDRESS_BLOCK) || ends_block(d.op)) {
+                if (continues) {
+                    block->successors[block->successor_count++] = (uint16_t)next;
+                }
+                block->end = (uint16_t)next;
+                break;
+            }
+            at = next;
+        }
+        pc = block->end - 1;
+    }
+
+    return 0;
+}
+
+static void mark_data(Analysis* analysis, uint32_t address, uint32_t length, uint8_t kind) {
+    for (uint32_t i = 0; i < length; i++) {
+        analysis->address_flags[(address + i) & (analysis->memory_size - 1)] |= kind;
+    }
+}
+
+// A store of `length` bytes at `address` from `site`, recorded if it lands on code
+static int mark_store(Analysis* analysis, uint32_t site, uint32_t address, uint32_t length) {
+    int hits_code = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        uint32_t target = (address + i) & (analysis->memory_size - 1);
+        analysis->address_flags[target] |= ADDRESS_WRITTEN;
+        if (analysis->address_flags[target] & (ADDRESS_INSTRUCTION | ADDRESS_OPERAND)) {
+            CodeWrite* grown = realloc(analysis->code_writes, (analysis->code_write_count + 1) * sizeof(CodeWrite));
+            if (grown != NULL) {
+                analysis->code_writes = grown;
+                analysis->code_writes[analysis->code_write_count++] = (CodeWrite){ (uint16_t)site, (uint16_t)target };
+            }
+            hits_code = 1;
+        }
+    }
+    return hits_code;
+}
+
+// Follows I through each block to find sprites, tables and the stores that land on code
+static void find_data(Analysis* analysis, const CPU* cpu) {
+    for (uint32_t b = 0; b < analysis->block_count; b++) {
+        BasicBlock* block = &analysis->blocks[b];
+        int known = 0;
+        uint32_t i = 0;
+
+        for (uint32_t pc = block->start; pc < block->end;) {
+            DecodedOp d = decode(read_word(cpu, pc), cpu->machine);
+            uint32_t span = (d.x > d.y ? d.x - d.y : d.y - d.x) + 1;
+
+            switch (d.op) {
+                case OP_LD_I:
+                    i = d.nnn;
+                    known = 1;
+                    break;
+                case OP_LD_I_LONG:
+                    i = read_word(cpu, pc + 2);
+                    known = 1;
+                    break;
+                case OP_ADD_I_VX:
+                case OP_LD_F_VX:
+                case OP_LD_HF_VX:
+                    known = 0;
+                    break;
+                case OP_DRW:
+                    if (known) {
+                        mark_data(analysis, i, d.n ? d.n : 32, ADDRESS_SPRITE);
+                    }
+                    break;
+                case OP_LD_VX_I:
+                case OP_LOAD_VX_VY:
+                    if (known) {
+                        mark_data(analysis, i, d.op == OP_LD_VX_I ? d.x + 1u : span, ADDRESS_READ);
+                    }
+                    // Where Fx65 leaves I depends on the quirks
+                    known = known && d.op == OP_LOAD_VX_VY;
+                    break;
+                case OP_LD_B_VX:
+                case OP_LD_I_VX:
+                case OP_SAVE_VX_VY:
+                    if (known) {
+                        uint32_t length = d.op == OP_LD_B_VX ? 3 : d.op == OP_LD_I_VX ? d.x + 1u : span;
+                        if (mark_store(analysis, pc, i, length)) {
+                            block->flags |= BLOCK_SELF_MODIFYING;
+                        }
+                    } else {
+                        analysis->unknown_writes++;
+                    }
+                    known = known && d.op != OP_LD_I_VX;
+                    break;
+            }
+            pc += instruction_length(&d);
+        }
+    }
+}
+
+static uint32_t block_index(const Analysis* analysis, const uint32_t* block_at, uint32_t address) {
+    return address < analysis->memory_size ? block_at[address] : NO_INDEX;
+}
+
+// Every block reachable from a root, calls not followed
+static uint32_t reachable(const Analysis* analysis, const uint32_t* block_at, uint32_t root, uint32_t* stack, uint8_t* seen) {
+    uint32_t count = 0;
+    uint32_t top = 0;
+    memset(seen, 0, analysis->block_count);
+    stack[top++] = root;
+    seen[root] = 1;
+
+    while (top > 0) {
+        uint32_t b = stack[--top];
+        stack[analysis->block_count + count++] = b;
+        const BasicBlock* block = &analysis->blocks[b];
+        for (int s = 0; s < block->successor_count; s++) {
+            uint32_t next = block_index(analysis, block_at, block->successors[s]);
+            if (next != NO_INDEX && !seen[next]) {
+                seen[next] = 1;
+                stack[top++] = next;
+            }
+        }
+    }
+    return count;
+}
+
+static void add_call(Analysis* analysis, uint16_t caller, uint16_t callee) {
+    for (uint32_t i = 0; i < analysis->call_count; i++) {
+        if (analysis->calls[i].caller == caller && analysis->calls[i].callee == callee) {
+            return;
+        }
+    }
+    CallEdge* grown = realloc(analysis->calls, (analysis->call_count + 1) * sizeof(CallEdge));
+    if (grown != NULL) {
+        analysis->calls = grown;
+        analysis->calls[analysis->call_count++] = (CallEdge){ caller, callee };
+    }
+}
+
+/*
+ * Finds loops as back edges of a depth-first search from every root, and
+ * marks the loops whose whole body only waits as idle.
+ */
+static int find_loops(Analysis* analysis, const CPU* cpu, const uint32_t* block_at) {
+    uint32_t n = analysis->block_count;
+    uint8_t* state = calloc(n ? n : 1, 1);                  // 0 new, 1 on the stack, 2 done
+    uint32_t* stack = malloc(2 * (n + 1) * sizeof(uint32_t));
+    uint8_t* seen = malloc(n ? n : 1);
+    if (state == NULL || stack == NULL || seen == NULL) {
+        free(state);
+        free(stack);
+        free(seen);
+        return -1;
+    }
+
+    // Depth-first from each block that nothing falls into: the entry, functions, jump table entries
+    uint32_t* next_successor = (uint32_t*)stack + n + 1;
+    for (uint32_t root = 0; root < n; root++) {
+        if (state[root] != 0) {
+            continue;
+        }
+        uint32_t top = 0;
+        stack[top] = root;
+        next_successor[top++] = 0;
+        state[root] = 1;
+
+        while (top > 0) {
+            uint32_t b = stack[top - 1];
+            BasicBlock* block = &analysis->blocks[b];
+            if (next_successor[top - 1] == block->successor_count) {
+                state[b] = 2;
+                top--;
+                continue;
+            }
+
+            uint32_t next = block_index(analysis, block_at, block->successors[next_successor[top - 1]++]);
+            if (next == NO_INDEX) {
+                continue;
+            }
+            if (state[next] == 1) {
+                // Back edge: `next` heads a loop ending in `b`
+                BasicBlock* head = &analysis->blocks[next];
+                if (!(head->flags & BLOCK_LOOP_HEAD)) {
+                    head->flags |= BLOCK_LOOP_HEAD;
+                    analysis->loops++;
+                }
+
+                // Idle if the straight run of blocks from the head to `b` only waits and is short
+                int idle = head->start <= block->start;
+                uint32_t instructions = 0;
+                for (uint32_t pc = head->start; idle && pc < block->end;) {
+                    DecodedOp d = decode(read_word(cpu, pc), cpu->machine);
+                    idle = waits_only(d.op) && ++instructions <= IDLE_MAX_LOOP
+                        && (analysis->address_flags[pc] & ADDRESS_INSTRUCTION);
+                    pc += instruction_length(&d);
+                }
+                if (idle) {
+                    for (uint32_t i = next; i <= b; i++) {
+                        BasicBlock* member = &analysis->blocks[i];
+                        if (!(member->flags & BLOCK_IDLE) && i == next) {
+                            analysis->idle_loops++;
+                        }
+                        member->flags |= BLOCK_IDLE;
+                        mark_data(analysis, member->start, member->end - member->start, ADDRESS_IDLE);
+                    }
+                }
+            } else if (state[next] == 0) {
+                state[next] = 1;
+                stack[top] = next;
+                next_successor[top++] = 0;
+            }
+        }
+    }
+
+    // Call graph: what each function (and the main program) reaches before returning
+    for (uint32_t b = 0; b < n; b++) {
+        uint16_t entry = analysis->blocks[b].start;
+        if (entry != START_PROGRAM_MEM && !(analysis->address_flags[entry] & ADDRESS_FUNCTION)) {
+            continue;
+        }
+        analysis->functions += entry != START_PROGRAM_MEM;
+
+        uint32_t count = reachable(analysis, block_at, b, stack, seen);
+        for (uint32_t i = 0; i < count; i++) {
+            const BasicBlock* block = &analysis->blocks[stack[n + i]];
+            if (block->call != 0) {
+                add_call(analysis, entry, block->call);
+            }
+        }
+    }
+
+    free(state);
+    free(stack);
+    free(seen);
+    return 0;
+}
+
+int analyze_rom(Analysis* analysis, const CPU* cpu, uint32_t size) {
+    memset(analysis, 0, sizeof(*analysis));
+    analysis->memory_size = memory_size(cpu);
+    analysis->machine = cpu->machine;
+    analysis->rom_size = size;
+    analysis->hash = hash_rom(&cpu->memory[START_PROGRAM_MEM], size);
+
+    analysis->address_flags = calloc(analysis->memory_size, 1);
+    uint8_t* queued = calloc(analysis->memory_size, 1);
+    Worklist work = { malloc(analysis->memory_size * sizeof(uint16_t)), 0 };
+    uint32_t* block_at = malloc(analysis->memory_size * sizeof(uint32_t));
+    int status = -1;
+
+    if (analysis->address_flags != NULL && queued != NULL && work.items != NULL && block_at != NULL) {
+        memset(block_at, 0xFF, analysis->memory_size * sizeof(uint32_t));
+        find_code(analysis, cpu, queued, &work);
+        if (find_blocks(analysis, cpu, block_at) == 0) {
+            find_data(analysis, cpu);
+            status = find_loops(analysis, cpu, block_at);
+        }
+    }
+
+    free(queued);
+    free(work.items);
+    free(block_at);
+    if (status < 0) {
+        print_error(ERROR_MEMORY, "Could not allocate the ROM analysis");
+        cleanup_analysis(analysis);
+        return -1;
+    }
+
+    for (uint32_t pc = START_PROGRAM_MEM; pc < START_PROGRAM_MEM + size; pc++) {
+        analysis->data_bytes += !(analysis->address_flags[pc] & (ADDRESS_INSTRUCTION | ADDRESS_OPERAND));
+    }
+    return 0;
+}
+
+static void cache_path(char* path, size_t size, const char* directory, uint64_t hash, const char* extension) {
+    snprintf(path, size, "%s/%016llx.%s", directory, (unsigned long long)hash, extension);
+}
+
+static int write_analysis(const Analysis* analysis, const char* path) {
+    size_t size = ANALYSIS_HEADER_SIZE + analysis->memory_size + analysis->block_count * BLOCK_RECORD_SIZE
+                + 4 * (analysis->call_count + analysis->code_write_count);
+    uint8_t* data = malloc(size);
+    if (data == NULL) {
+        return -1;
+    }
+
+    uint8_t* p = data;
+    memcpy(p, ANALYSIS_MAGIC, 4);
+    put_le(p + 4, ANALYSIS_VERSION, 2);
+    p[6] = analysis->machine;
+    p[7] = 0;
+    put_le(p + 8, analysis->hash, 8);
+    put_le(p + 16, analysis->rom_size, 4);
+    put_le(p + 20, analysis->memory_size, 4);
+    put_le(p + 24, analysis->block_count, 4);
+    put_le(p + 28, analysis->call_count, 4);
+    put_le(p + 32, analysis->code_write_count, 4);
+    put_le(p + 36, analysis->instructions, 4);
+    put_le(p + 40, analysis->functions, 4);
+    put_le(p + 44, analysis->loops, 4);
+    put_le(p + 48, analysis->idle_loops, 4);
+    put_le(p + 52, analysis->data_bytes, 4);
+    put_le(p + 56, analysis->unknown_writes, 4);
+    p += ANALYSIS_HEADER_SIZE;
+
+    memcpy(p, analysis->address_flags, analysis->memory_size);
+    p += analysis->memory_size;
+    for (uint32_t i = 0; i < analysis->block_count; i++, p += BLOCK_RECORD_SIZE) {
+        const BasicBlock* block = &analysis->blocks[i];
+        put_le(p, block->start, 2);
+        put_le(p + 2, block->end, 2);
+        put_le(p + 4, block->successors[0], 2);
+        put_le(p + 6, block->successors[1], 2);
+        p[8] = block->successor_count;
+        p[9] = block->flags;
+        put_le(p + 10, block->call, 2);
+    }
+    for (uint32_t i = 0; i < analysis->call_count; i++, p += 4) {
+        put_le(p, analysis->calls[i].caller, 2);
+        put_le(p + 2, analysis->calls[i].callee, 2);
+    }
+    for (uint32_t i = 0; i < analysis->code_write_count; i++, p += 4) {
+        put_le(p, analysis->code_writes[i].site, 2);
+        put_le(p + 2, analysis->code_writes[i].target, 2);
+    }
+
+    FILE* file = fopen(path, "wb");
+    int status = file != NULL && fwrite(data, 1, size, file) == size ? 0 : -1;
+    if (file != NULL && fclose(file) != 0) {
+        status = -1;
+    }
+    free(data);
+    return status;
+}
+
+// Returns 0 if `path` holds the analysis of this very ROM on this machine, -1 otherwise
+static int read_analysis(Analysis* analysis, const char* path, const CPU* cpu, uint32_t size, uint64_t hash) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    uint8_t header[ANALYSIS_HEADER_SIZE];
+    memset(analysis, 0, sizeof(*analysis));
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)
+        || memcmp(header, ANALYSIS_MAGIC, 4) != 0 || get_le(header + 4, 2) != ANALYSIS_VERSION
+        || header[6] != cpu->machine || get_le(header + 8, 8) != hash
+        || get_le(header + 16, 4) != size || get_le(header + 20, 4) != memory_size(cpu)) {
+        fclose(file);
+        return -1;
+    }
+
+    analysis->machine = header[6];
+    analysis->hash = hash;
+    analysis->rom_size = size;
+    analysis->memory_size = memory_size(cpu);
+    analysis->block_count = (uint32_t)get_le(header + 24, 4);
+    analysis->call_count = (uint32_t)get_le(header + 28, 4);
+    analysis->code_write_count = (uint32_t)get_le(header + 32, 4);
+    analysis->instructions = (uint32_t)get_le(header + 36, 4);
+    analysis->functions = (uint32_t)get_le(header + 40, 4);
+    analysis->loops = (uint32_t)get_le(header + 44, 4);
+    analysis->idle_loops = (uint32_t)get_le(header + 48, 4);
+    analysis->data_bytes = (uint32_t)get_le(header + 52, 4);
+    analysis->unknown_writes = (uint32_t)get_le(header + 56, 4);
+
+    // Every count is bounded by the memory size, a bigger one means a damaged file
+    size_t rest = analysis->memory_size + (size_t)analysis->block_count * BLOCK_RECORD_SIZE
+                + 4 * ((size_t)analysis->call_count + analysis->code_write_count);
+    uint8_t* data = NULL;
+    int ok = analysis->block_count <= analysis->memory_size && analysis->call_count <= analysis->memory_size
+          && analysis->code_write_count <= analysis->memory_size
+          && (data = malloc(rest)) != NULL && fread(data, 1, rest, file) == rest;
+    fclose(file);
+
+    analysis->address_flags = malloc(analysis->memory_size);
+    analysis->blocks = calloc(analysis->block_count + 1, sizeof(BasicBlock));
+    analysis->calls = calloc(analysis->call_count + 1, sizeof(CallEdge));
+    analysis->code_writes = calloc(analysis->code_write_count + 1, sizeof(CodeWrite));
+    if (!ok || analysis->address_flags == NULL || analysis->blocks == NULL
+        || analysis->calls == NULL || analysis->code_writes == NULL) {
+        free(data);
+        cleanup_analysis(analysis);
+        return -1;
+    }
+
+    const uint8_t* p = data;
+    memcpy(analysis->address_flags, p, analysis->memory_size);
+    p += analysis->memory_size;
+    for (uint32_t i = 0; i < analysis->block_count; i++, p += BLOCK_RECORD_SIZE) {
+        BasicBlock* block = &analysis->blocks[i];
+        block->start = (uint16_t)get_le(p, 2);
+        block->end = (uint16_t)get_le(p + 2, 2);
+        block->successors[0] = (uint16_t)get_le(p + 4, 2);
+        block->successors[1] = (uint16_t)get_le(p + 6, 2);
+        block->successor_count = p[8] <= 2 ? p[8] : 2;
+        block->flags = p[9];
+        block->call = (uint16_t)get_le(p + 10, 2);
+    }
+    for (uint32_t i = 0; i < analysis->call_count; i++, p += 4) {
+        analysis->calls[i] = (CallEdge){ (uint16_t)get_le(p, 2), (uint16_t)get_le(p + 2, 2) };
+    }
+    for (uint32_t i = 0; i < analysis->code_write_count; i++, p += 4) {
+        analysis->code_writes[i] = (CodeWrite){ (uint16_t)get_le(p, 2), (uint16_t)get_le(p + 2, 2) };
+    }
+
+    free(data);
+    return 0;
+}
+
+int load_analysis(Analysis* analysis, const char* directory, const CPU* cpu, uint32_t size) {
+    uint64_t hash = hash_rom(&cpu->memory[START_PROGRAM_MEM], size);
+    char path[4096];
+    cache_path(path, sizeof(path), directory, hash, "cfg");
+    if (read_analysis(analysis, path, cpu, size, hash) == 0) {
+        return 1;
+    }
+
+    if (analyze_rom(analysis, cpu, size) < 0) {
+        return -1;
+    }
+
+    // A cache that can't be written only costs the next run the analysis again
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+        print_error(ERROR_ANALYSIS, "Could not create the analysis cache directory");
+        return 0;
+    }
+    if (write_analysis(analysis, path) < 0) {
+        print_error(ERROR_ANALYSIS, "Could not write the analysis to the cache");
+        return 0;
+    }
+
+    cache_path(path, sizeof(path), directory, hash, "lst");
+    FILE* listing = fopen(path, "w");
+    if (listing == NULL) {
+        print_error(ERROR_ANALYSIS, "Could not write the disassembly listing");
+        return 0;
+    }
+    write_listing(analysis, cpu, listing);
+    fclose(listing);
+    return 0;
+}
+
+static const BasicBlock* find_block(const Analysis* analysis, uint32_t start) {
+    uint32_t low = 0, high = analysis->block_count;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (analysis->blocks[middle].start < start) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < analysis->block_count && analysis->blocks[low].start == start ? &analysis->blocks[low] : NULL;
+}
+
+static const char* data_kind(uint8_t flags) {
+    if (flags & ADDRESS_WRITTEN) {
+        return "written";
+    }
+    if (flags & ADDRESS_SPRITE) {
+        return "sprite";
+    }
+    if (flags & ADDRESS_READ) {
+        return "table";
+    }
+    return "unreached";
+}
+
+void write_listing(const Analysis* analysis, const CPU* cpu, FILE* out) {
+    const uint8_t* flags = analysis->address_flags;
+    uint32_t end = START_PROGRAM_MEM + analysis->rom_size;
+
+    fprintf(out, "; ROM %016llx, %u bytes\n", (unsigned long long)analysis->hash, analysis->rom_size);
+    fprintf(out, "; ");
+    analysis_report(analysis, out);
+    for (uint32_t i = 0; i < analysis->call_count; i++) {
+        fprintf(out, "; call %03X -> %03X\n", analysis->calls[i].caller, analysis->calls[i].callee);
+    }
+
+    for (uint32_t pc = START_PROGRAM_MEM; pc < end;) {
+        if (flags[pc] & ADDRESS_INSTRUCTION) {
+            const BasicBlock* block = (flags[pc] & ADDRESS_BLOCK) ? find_block(analysis, pc) : NULL;
+            if (block != NULL) {
+                fprintf(out, "\n%s_%03X:%s%s%s\n", (flags[pc] & ADDRESS_FUNCTION) ? "sub" : "L", pc,
+                        (block->flags & BLOCK_LOOP_HEAD) ? " ; loop" : "",
+                        (block->flags & BLOCK_IDLE) ? " ; idle" : "",
+                        (block->flags & BLOCK_SELF_MODIFYING) ? " ; self-modifying" : "");
+            }
+
+            char text[DISASM_MAX_TEXT];
+            int length = disassemble(cpu, (uint16_t)pc, text, sizeof(text));
+            fprintf(out, "%04X  %02X%02X  %s", pc, cpu->memory[pc], cpu->memory[pc + 1], text);
+            int padding = 18 - (int)strlen(text);
+            for (uint32_t i = 0; i < analysis->code_write_count; i++) {
+                const CodeWrite* write = &analysis->code_writes[i];
+                if (write->site == pc) {
+                    fprintf(out, "%*s ; writes code at %03X", padding, "", write->target);
+                    padding = 0;
+                } else if (write->target >= pc && write->target < pc + length) {
+                    fprintf(out, "%*s ; modified by %03X", padding, "", write->site);
+                    padding = 0;
+                }
+            }
+            fputc('\n', out);
+            pc += length;
+            continue;
+        }
+
+        // Data bytes of the same kind, eight to a line
+        uint8_t kind = flags[pc] & (ADDRESS_SPRITE | ADDRESS_READ | ADDRESS_WRITTEN);
+        uint32_t count = 0;
+        fprintf(out, "%04X  DB   ", pc);
+        while (pc < end && count < 8 && !(flags[pc] & ADDRESS_INSTRUCTION)
+               && (flags[pc] & (ADDRESS_SPRITE | ADDRESS_READ | ADDRESS_WRITTEN)) == kind) {
+            fprintf(out, "%s0x%02X", count ? ", " : "", cpu->memory[pc]);
+            pc++;
+            count++;
+        }
+        fprintf(out, "%*s ; %s\n", (int)(8 - count) * 6, "", data_kind(kind));
+    }
+}
+
+void prewarm_caches(const Analysis* analysis, CPU* cpu, Backend* backend) {
+    uint32_t end = START_PROGRAM_MEM + analysis->rom_size;
+
+    for (uint32_t pc = START_PROGRAM_MEM; pc < end && pc < DECODE_CACHE_SIZE; pc += 2) {
+        if (analysis->address_flags[pc] & ADDRESS_INSTRUCTION) {
+            cpu->decode_cache[pc >> 1] = decode(read_word(cpu, pc), cpu->machine);
+        }
+    }
+
+    if (backend == NULL || backend->type != BACKEND_THREADED) {
+        return;
+    }
+
+    // Threaded blocks also end at draws and stores, so one basic block can take several
+    for (uint32_t i = 0; i < analysis->block_count; i++) {
+        const BasicBlock* block = &analysis->blocks[i];
+        uint32_t pc = block->start;
+        while (pc < block->end && !(pc & 1)) {
+            int next = prewarm_threaded_block(cpu, backend->cache, (uint16_t)pc);
+            if (next < 0) {
+                return;
+            }
+            pc = (uint32_t)next;
+        }
+    }
+}
+
+void analysis_report(const Analysis* analysis, FILE* out) {
+    fprintf(out, "analysis: %u instructions in %u blocks, %u functions, %u loops (%u idle), "
+                 "%u data bytes, %u code writes, %u stores to unknown addresses\n",
+            analysis->instructions, analysis->block_count, analysis->functions, analysis->loops,
+            analysis->idle_loops, analysis->data_bytes, analysis->code_write_count, analysis->unknown_writes);
+}
+
+void cleanup_analysis(Analysis* analysis) {
+    free(analysis->address_flags);
+    free(analysis->blocks);
+    free(analysis->calls);
+    free(analysis->code_writes);
+    memset(analysis, 0, sizeof(*analysis));
+}
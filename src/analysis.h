@@ -0,0 +1,100 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+#include "backend.h"
+
+#define ANALYSIS_MAGIC "C8AN"
+#define ANALYSIS_VERSION 2
+
+// What is known about each byte of memory
+#define ADDRESS_INSTRUCTION 0x01    // An instruction starts here
+#define ADDRESS_OPERAND 0x02        // Rest of an instruction
+#define ADDRESS_BLOCK 0x04          // A basic block starts here
+#define ADDRESS_FUNCTION 0x08       // 2nnn target
+#define ADDRESS_SPRITE 0x10         // Drawn by Dxyn
+#define ADDRESS_READ 0x20           // Loaded by Fx65 / 5xy3
+#define ADDRESS_WRITTEN 0x40        // Stored to by Fx33 / Fx55 / 5xy2
+#define ADDRESS_IDLE 0x80           // Inside a loop that can only wait for the timer or a key
+
+// Basic block flags
+#define BLOCK_LOOP_HEAD 0x01        // Target of a back edge
+#define BLOCK_IDLE 0x02             // In an idle loop
+#define BLOCK_INDIRECT 0x04         // Ends in Bnnn, successors guessed from a jump table
+#define BLOCK_SELF_MODIFYING 0x08   // Writes into code
+
+typedef struct {
+    uint16_t start;
+    uint16_t end;                   // First address after the block
+    uint16_t successors[2];         // Where control goes next, not counting calls and returns
+    uint8_t successor_count;
+    uint8_t flags;
+    uint16_t call;                  // Function called at the end, 0 if none
+} BasicBlock;
+
+typedef struct {
+    uint16_t caller;                // Entry of the calling function (0x200 for the main program)
+    uint16_t callee;
+} CallEdge;
+
+// Fx33 / Fx55 / 5xy2 at `site` may write to `target`, which holds code
+typedef struct {
+    uint16_t site;
+    uint16_t target;
+} CodeWrite;
+
+/*
+ * The result of a static pass over a loaded ROM. Code is found by recursive
+ * descent from 0x200 through jumps, calls and both sides of skips; I is
+ * followed within a block to tell sprite and table data from code and to
+ * find stores that land on code. Bnnn is followed into jump tables of
+ * 1nnn/2nnn instructions and is otherwise a dead end.
+ *
+ * Everything here is a hint: the emulator never depends on it being right.
+ */
+typedef struct {
+    uint64_t hash;                  // hash_rom() of the ROM
+    uint32_t rom_size;
+    uint8_t machine;
+    uint32_t memory_size;
+    uint8_t* address_flags;         // ADDRESS_* per byte of memory
+
+    BasicBlock* blocks;             // By address
+    uint32_t block_count;
+    CallEdge* calls;
+    uint32_t call_count;
+    CodeWrite* code_writes;
+    uint32_t code_write_count;
+
+    // Summary
+    uint32_t instructions;
+    uint32_t functions;
+    uint32_t loops;
+    uint32_t idle_loops;
+    uint32_t data_bytes;            // ROM bytes that are not code
+    uint32_t unknown_writes;        // Stores through an I that isn't known statically
+} Analysis;
+
+// Analyzes the ROM of `size` bytes loaded at 0x200 in `cpu`
+int analyze_rom(Analysis* analysis, const CPU* cpu, uint32_t size);
+
+/*
+ * Loads the analysis of the ROM from `directory` (HASH.cfg), or runs it
+ * and stores it there together with a disassembly listing (HASH.lst).
+ * Returns 1 if it came from the cache, 0 if it was run, -1 on failure.
+ */
+int load_analysis(Analysis* analysis, const char* directory, const CPU* cpu, uint32_t size);
+
+// Writes the listing: labels, disassembly, data bytes and what was found about them
+void write_listing(const Analysis* analysis, const CPU* cpu, FILE* out);
+
+// Decodes every instruction found into the decode cache and translates the blocks the backend (may be NULL) will run
+void prewarm_caches(const Analysis* analysis, CPU* cpu, Backend* backend);
+
+void analysis_report(const Analysis* analysis, FILE* out);
+
+void cleanup_analysis(Analysis* analysis);
+
+#endif
@@ -1,32 +1,149 @@
 #define AMPLITUDE 28000
 #define FREQUENCY 440.0
+#define RAMP_STEP (AMPLITUDE / 44)      // About a millisecond from silence to full volume
+#define PATTERN_RATE 4000.0             // Pattern samples per second at DEFAULT_PITCH
 
 #include <math.h>
+#include <string.h>
 #include "audio.h"
+#include "error.h"
 
-void audio_callback(void* userdata, Uint8* stream, int len) {
-    (void)userdata;
-    static double phase = 0;
-    int16_t* stream16 = (int16_t*)stream;
-    int samples = len / 2; // 16-bit samples
-
-    for (int i = 0; i < samples; i++) {
-        stream16[i] = (int16_t)(AMPLITUDE * sin(phase));
-        phase += 2.0 *M_PI * FREQUENCY / 44100.0;
-        if (phase > 2.0 * M_PI) {
-            phase -= 2.0 * M_PI;
+// One period of a sine at full scale, indexed by the top 8 bits of the phase
+static int16_t sine_table[256];
+
+// Phase increment per output sample for each Fx3A pitch, 128 pattern bits per period
+static uint32_t pattern_increments[256];
+
+static const uint32_t tone_increment = (uint32_t)(FREQUENCY * 4294967296.0 / AUDIO_SAMPLE_RATE);
+
+static void initialize_tables(void) {
+    static int ready = 0;
+    if (ready) {
+        return;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        sine_table[i] = (int16_t)lrint(32767.0 * sin(2.0 * M_PI * i / 256.0));
+    }
+    for (int pitch = 0; pitch < 256; pitch++) {
+        double rate = PATTERN_RATE * pow(2.0, (pitch - DEFAULT_PITCH) / 48.0);
+        pattern_increments[pitch] = (uint32_t)(rate / (PATTERN_SIZE * 8) * 4294967296.0 / AUDIO_SAMPLE_RATE);
+    }
+    ready = 1;
+}
+
+void render_synth(Synth* synth, int16_t* out, uint32_t count) {
+    const SoundEvent* sound = &synth->sound;
+    int32_t target = sound->on ? AMPLITUDE : 0;
+
+    // Nothing playing and nothing fading out
+    if (target == 0 && synth->gain == 0) {
+        memset(out, 0, count * sizeof(*out));
+        return;
+    }
+
+    uint32_t increment = sound->pattern_set ? pattern_increments[sound->pitch] : tone_increment;
+    for (uint32_t i = 0; i < count; i++) {
+        if (synth->gain < target) {
+            synth->gain = synth->gain + RAMP_STEP < target ? synth->gain + RAMP_STEP : target;
+        } else if (synth->gain > target) {
+            synth->gain = synth->gain - RAMP_STEP > target ? synth->gain - RAMP_STEP : target;
+        }
+
+        int32_t wave;
+        if (sound->pattern_set) {
+            uint32_t bit = synth->phase >> 25;
+            wave = (sound->pattern[bit >> 3] >> (7 - (bit & 7))) & 1 ? 32767 : -32767;
+        } else {
+            wave = sine_table[synth->phase >> 24];
         }
+        out[i] = (int16_t)((wave * synth->gain) >> 15);
+        synth->phase += increment;
     }
 }
 
-int initialize_audio(Audio* audio) {
+// Events that sound the same, whatever their frame
+static int same_sound(const SoundEvent* a, const SoundEvent* b) {
+    return a->on == b->on && a->pitch == b->pitch && a->pattern_set == b->pattern_set
+        && memcmp(a->pattern, b->pattern, PATTERN_SIZE) == 0;
+}
+
+void sound_event(const CPU* cpu, uint64_t frame, SoundEvent* event) {
+    event->frame = frame;
+    event->on = cpu->sound_timer > 0;
+    event->pitch = cpu->pitch;
+    event->pattern_set = cpu->pattern_set;
+    memcpy(event->pattern, cpu->pattern, PATTERN_SIZE);
+}
+
+// Runs on the audio thread: plays every queued event at its frame's sample
+static void audio_callback(void* userdata, Uint8* stream, int len) {
+    Audio* audio = userdata;
+    SoundRing* ring = &audio->ring;
+    int16_t* out = (int16_t*)stream;
+    uint32_t remaining = len / 2; // 16-bit samples
+
+    while (remaining > 0) {
+        uint32_t count = remaining;
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        if (tail != atomic_load_explicit(&ring->head, memory_order_acquire)) {
+            const SoundEvent* event = &ring->events[tail % SOUND_RING_SIZE];
+            int64_t at = audio->frame_start + (int64_t)event->frame * AUDIO_FRAME_SAMPLES;
+            int64_t now = (int64_t)audio->samples;
+
+            // Frames map to samples at a fixed offset, taken again when the
+            // emulation drifted more than a frame from the device clock
+            if (audio->frame_start < 0 || at < now - AUDIO_FRAME_SAMPLES
+                    || at > now + audio->latency + 4 * AUDIO_FRAME_SAMPLES) {
+                audio->frame_start = now + audio->latency - (int64_t)event->frame * AUDIO_FRAME_SAMPLES;
+                at = now + audio->latency;
+            }
+
+            if (at <= now) {
+                audio->synth.sound = *event;
+                atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+                continue;
+            }
+            if (at - now < count) {
+                count = (uint32_t)(at - now);
+            }
+        }
+
+        render_synth(&audio->synth, out, count);
+        out += count;
+        remaining -= count;
+        audio->samples += count;
+    }
+}
+
+static void initialize_common(Audio* audio, AudioSink sink) {
+    initialize_tables();
+    memset(audio, 0, sizeof(*audio));
+    audio->sink = sink;
+    atomic_init(&audio->ring.head, 0);
+    atomic_init(&audio->ring.tail, 0);
+    audio->synth.sound.pitch = DEFAULT_PITCH;
+    audio->frame_start = -1;
+}
+
+int initialize_audio(Audio* audio, uint32_t latency_ms) {
+    initialize_common(audio, AUDIO_SINK_DEVICE);
+
+    // The device buffer is the latency, rounded up to a power of two
+    uint32_t samples = 64;
+    while (samples < 8192 && samples * 1000 < latency_ms * AUDIO_SAMPLE_RATE) {
+        samples *= 2;
+    }
+
     SDL_AudioSpec want, have;
     SDL_zero(want);
-    want.freq = 44100;
-    want.format = AUDIO_S16;
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
     want.channels = 1;
-    want.samples = 2048;
+    want.samples = samples;
     want.callback = audio_callback;
+    want.userdata = audio;
 
     audio->audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
     if (audio->audioDevice == 0) {
@@ -34,20 +151,99 @@ int initialize_audio(Audio* audio) {
         return -1;
     }
 
-    audio->beeping = 0;
+    audio->latency = have.samples;
+    SDL_PauseAudioDevice(audio->audioDevice, 0);
+    return 0;
+}
+
+void initialize_null_audio(Audio* audio) {
+    initialize_common(audio, AUDIO_SINK_NULL);
+}
+
+static void put_le(uint8_t* p, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+// Canonical 44-byte header of a 16-bit mono PCM file with `samples` samples
+static int write_wav_header(FILE* file, uint64_t samples) {
+    uint32_t data_size = (uint32_t)(samples * 2);
+    uint8_t header[44];
+
+    memcpy(header, "RIFF", 4);
+    put_le(header + 4, 36 + data_size, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le(header + 16, 16, 4);                         // Format chunk size
+    put_le(header + 20, 1, 2);                          // PCM
+    put_le(header + 22, 1, 2);                          // Channels
+    put_le(header + 24, AUDIO_SAMPLE_RATE, 4);
+    put_le(header + 28, AUDIO_SAMPLE_RATE * 2, 4);      // Bytes per second
+    put_le(header + 32, 2, 2);                          // Bytes per sample
+    put_le(header + 34, 16, 2);                         // Bits per sample
+    memcpy(header + 36, "data", 4);
+    put_le(header + 40, data_size, 4);
+
+    return fseek(file, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), file) == sizeof(header) ? 0 : -1;
+}
+
+int initialize_wav_audio(Audio* audio, const char* path) {
+    initialize_common(audio, AUDIO_SINK_WAV);
+
+    audio->wav = fopen(path, "wb");
+    if (audio->wav == NULL || write_wav_header(audio->wav, 0) < 0) {
+        print_error(ERROR_AUDIO, "Could not create the WAV file");
+        if (audio->wav != NULL) {
+            fclose(audio->wav);
+        }
+        return -1;
+    }
     return 0;
 }
 
-void toggle_beep(Audio* audio, int on) {
-    if (on && !audio->beeping) {
-        SDL_PauseAudioDevice(audio->audioDevice, 0);
-        audio->beeping = 1;
-    } else if (!on && audio->beeping) {
-        SDL_PauseAudioDevice(audio->audioDevice, 1);
-        audio->beeping = 0;
+void queue_sound(Audio* audio, const SoundEvent* event) {
+    switch (audio->sink) {
+        case AUDIO_SINK_NULL:
+            break;
+
+        case AUDIO_SINK_WAV: {
+            // No device clock to follow, every frame is exactly its samples
+            int16_t samples[AUDIO_FRAME_SAMPLES];
+            audio->synth.sound = *event;
+            render_synth(&audio->synth, samples, AUDIO_FRAME_SAMPLES);
+            audio->wav_samples += fwrite(samples, sizeof(samples[0]), AUDIO_FRAME_SAMPLES, audio->wav);
+            break;
+        }
+
+        case AUDIO_SINK_DEVICE: {
+            if (audio->have_queued && same_sound(&audio->queued, event)) {
+                break;
+            }
+
+            SoundRing* ring = &audio->ring;
+            unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == SOUND_RING_SIZE) {
+                // Tried again next frame, the edge is late instead of lost
+                audio->dropped++;
+                break;
+            }
+
+            ring->events[head % SOUND_RING_SIZE] = *event;
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+            audio->queued = *event;
+            audio->have_queued = 1;
+            break;
+        }
     }
 }
 
 void cleanup_audio(Audio* audio) {
-    SDL_CloseAudioDevice(audio->audioDevice);
+    if (audio->sink == AUDIO_SINK_DEVICE) {
+        SDL_CloseAudioDevice(audio->audioDevice);
+    } else if (audio->sink == AUDIO_SINK_WAV) {
+        if (write_wav_header(audio->wav, audio->wav_samples) < 0) {
+            print_error(ERROR_AUDIO, "Could not finish the WAV file");
+        }
+        fclose(audio->wav);
+    }
 }
@@ -1,15 +1,93 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <SDL2/SDL.h>
+#include "cpu.h"
+
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_FRAME_SAMPLES (AUDIO_SAMPLE_RATE / 60)   // Samples per 60 Hz tick, exactly 735
+#define AUDIO_DEFAULT_LATENCY 12                        // Milliseconds of device buffer
+#define SOUND_RING_SIZE 64                              // Power of two
+
+// What the buzzer does during one frame, taken from the CPU at each 60 Hz tick
+typedef struct {
+    uint64_t frame;                 // Timestamp, in frames since the start
+    uint8_t on;                     // Sound timer running
+    uint8_t pitch;                  // Fx3A
+    uint8_t pattern_set;            // Play the pattern instead of the tone
+    uint8_t pattern[PATTERN_SIZE];  // F002
+} SoundEvent;
+
+/*
+ * Lock-free single producer, single consumer queue of sound changes from
+ * the emulation thread to the audio callback. Only edges are queued, a
+ * frame that sounds like the one before costs nothing.
+ */
+typedef struct {
+    SoundEvent events[SOUND_RING_SIZE];
+    atomic_uint head;               // Next slot the producer writes
+    atomic_uint tail;               // Next slot the consumer reads
+} SoundRing;
+
+/*
+ * Wavetable oscillator: a sine tone for CHIP-8's buzzer, or XO-CHIP's 1-bit
+ * pattern at its pitch. The gain ramps over a millisecond when the sound
+ * starts or stops instead of clicking.
+ */
+typedef struct {
+    SoundEvent sound;               // What is playing now
+    uint32_t phase;                 // 32-bit phase accumulator over one period
+    int32_t gain;
+} Synth;
+
+typedef enum {
+    AUDIO_SINK_NULL,                // Sound is discarded
+    AUDIO_SINK_DEVICE,              // SDL audio device, fed through the ring
+    AUDIO_SINK_WAV                  // Rendered frame by frame into a WAV file
+} AudioSink;
 
 typedef struct {
+    AudioSink sink;
     SDL_AudioDeviceID audioDevice;
-    int beeping;
+    FILE* wav;
+    uint64_t wav_samples;
+
+    SoundRing ring;
+    SoundEvent queued;              // Last event queued, producer side
+    int have_queued;
+    uint32_t dropped;               // Events lost to a full ring
+
+    // Consumer side
+    Synth synth;
+    uint64_t samples;               // Samples rendered so far
+    int64_t frame_start;            // Sample at which frame 0 plays, -1 until the first event
+    uint32_t latency;               // Samples between queueing a frame and hearing it
 } Audio;
 
-int initialize_audio(Audio* audio);
+/*
+ * Opens the default audio device with a buffer of about `latency_ms`
+ * milliseconds. The device plays silence between beeps, it is never paused.
+ */
+int initialize_audio(Audio* audio, uint32_t latency_ms);
+
+// Discards all sound, for headless runs
+void initialize_null_audio(Audio* audio);
+
+// Writes 16-bit mono samples to a WAV file, AUDIO_FRAME_SAMPLES per queued frame
+int initialize_wav_audio(Audio* audio, const char* path);
+
 void cleanup_audio(Audio* audio);
-void toggle_beep(Audio* audio, int on);
+
+// The sound the CPU makes in the frame that just ran, before tick_timers()
+void sound_event(const CPU* cpu, uint64_t frame, SoundEvent* event);
+
+// Queues the sound of frame `event->frame`. Call once per frame in frame order.
+void queue_sound(Audio* audio, const SoundEvent* event);
+
+// Fills `count` samples from the oscillator
+void render_synth(Synth* synth, int16_t* out, uint32_t count);
 
 #endif
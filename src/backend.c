@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "backend.h"
+#include "error.h"
+
+int parse_backend(const char* name, BackendType* type) {
+    if (strcmp(name, "interpreter") == 0) {
+        *type = BACKEND_INTERPRETER;
+        return 0;
+    }
+
+    if (strcmp(name, "threaded") == 0) {
+        *type = BACKEND_THREADED;
+        return 0;
+    }
+
+    return -1;
+}
+
+int initialize_backend(Backend* backend, BackendType type, int lockstep, const CPU* cpu) {
+    backend->type = type;
+    backend->cache = NULL;
+    backend->reference = NULL;
+    backend->checked_blocks = 0;
+
+    if (type == BACKEND_THREADED) {
+        backend->cache = create_threaded_cache(memory_size(cpu));
+        if (backend->cache == NULL) {
+            print_error(ERROR_MEMORY, "Could not allocate the threaded code cache");
+            return -1;
+        }
+    }
+
+    if (lockstep) {
+        backend->reference = malloc(sizeof(CPU));
+        if (backend->reference == NULL) {
+            print_error(ERROR_MEMORY, "Could not allocate the lockstep reference CPU");
+            cleanup_backend(backend);
+            return -1;
+        }
+        *backend->reference = *cpu;
+    }
+
+    return 0;
+}
+
+static uint32_t run_one_block(Backend* backend, CPU* cpu, uint32_t max) {
+    if (backend->type == BACKEND_THREADED) {
+        return run_block(cpu, backend->cache, max);
+    }
+
+    step(cpu);
+    return 1;
+}
+
+static int run_lockstep(Backend* backend, CPU* cpu, uint32_t count) {
+    CPU* reference = backend->reference;
+
+    // Keys and timers are driven by the frame loop between batches, mirror them
+    memcpy(reference->keypad, cpu->keypad, sizeof(cpu->keypad));
+    reference->delay_timer = cpu->delay_timer;
+    reference->sound_timer = cpu->sound_timer;
+    reference->vblank = cpu->vblank;
+
+    while (count > 0) {
+        uint16_t block_pc = cpu->PC;
+
+        // Both sides carry their own copy of the Cxnn generator state
+        uint32_t executed = run_one_block(backend, cpu, count);
+
+        for (uint32_t i = 0; i < executed; i++) {
+            execute(reference, fetch(reference));
+        }
+
+        backend->checked_blocks++;
+        if (cpu_diff(cpu, reference, NULL) != 0) {
+            fprintf(stderr, "Lockstep divergence in the block at 0x%03X (%u instructions, block #%llu):\n",
+                    block_pc, executed, (unsigned long long)backend->checked_blocks);
+            fprintf(stderr, " backend != reference\n");
+            cpu_diff(cpu, reference, stderr);
+            return -1;
+        }
+
+        count -= executed;
+    }
+
+    return 0;
+}
+
+int run_backend(Backend* backend, CPU* cpu, uint32_t count) {
+    if (backend->reference != NULL) {
+        return run_lockstep(backend, cpu, count);
+    }
+
+    if (backend->type == BACKEND_THREADED) {
+        run_threaded(cpu, backend->cache, count);
+    } else {
+        run_instructions(cpu, count);
+    }
+
+    return 0;
+}
+
+void cleanup_backend(Backend* backend) {
+    destroy_threaded_cache(backend->cache);
+    free(backend->reference);
+    backend->cache = NULL;
+    backend->reference = NULL;
+}
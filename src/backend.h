@@ -0,0 +1,40 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "threaded.h"
+
+typedef enum {
+    BACKEND_INTERPRETER,    // step() with the decode cache
+    BACKEND_THREADED        // Translated blocks of threaded code
+} BackendType;
+
+typedef struct {
+    BackendType type;
+    ThreadedCache* cache;
+
+    // Lockstep differential mode: a second CPU run by the reference interpreter
+    // (plain fetch/execute) and compared with the real one after every block
+    CPU* reference;
+    uint64_t checked_blocks;
+} Backend;
+
+// Returns 0 and sets `type` if `name` is "interpreter" or "threaded"
+int parse_backend(const char* name, BackendType* type);
+
+/*
+ * Sets up the selected backend for `cpu`, which must already have its ROM loaded.
+ * In lockstep mode a copy of `cpu` is made to serve as the reference.
+ */
+int initialize_backend(Backend* backend, BackendType type, int lockstep, const CPU* cpu);
+
+/*
+ * Runs exactly `count` instructions on `cpu` with the selected backend.
+ * Returns -1 if lockstep mode found a divergence, 0 otherwise.
+ */
+int run_backend(Backend* backend, CPU* cpu, uint32_t count);
+
+void cleanup_backend(Backend* backend);
+
+#endif
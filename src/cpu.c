@@ -1,19 +1,108 @@
-#include <SDL2/SDL.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include "cpu.h"
 #include "font.h"
 #include "error.h"
+#include "profile.h"
 
-int initialize_cpu(CPU* cpu) {
-    // Set a seed so we get random numbers each time
-    srand(time(NULL));
+void seed_cpu(CPU* cpu, uint64_t seed) {
+    // splitmix64 spreads small seeds over the whole state
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+
+    // xorshift gets stuck at zero
+    cpu->rng_state = z != 0 ? z : 1;
+}
+
+static void invalidate_range(CPU* cpu, uint32_t address, uint32_t end);
+
+void set_machine(CPU* cpu, Machine machine) {
+    // The XO-CHIP opcodes only decode on XO-CHIP, forget what was decoded for another machine
+    if (cpu->machine != machine) {
+        invalidate_range(cpu, 0, MEM_SIZE);
+    }
+    cpu->machine = machine;
+    cpu->memory_mask = machine == MACHINE_XOCHIP ? MEM_SIZE - 1 : CHIP8_MEM_SIZE - 1;
+}
+
+int parse_machine(const char* name, Machine* machine) {
+    if (strcmp(name, "chip8") == 0) {
+        *machine = MACHINE_CHIP8;
+    } else if (strcmp(name, "schip") == 0) {
+        *machine = MACHINE_SCHIP;
+    } else if (strcmp(name, "xochip") == 0) {
+        *machine = MACHINE_XOCHIP;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+#define QUIRK_VALUES(id, name, description, ...) [id] = { __VA_ARGS__ },
+const Quirks quirk_profiles[QUIRKS_COUNT] = {
+    QUIRK_PROFILES(QUIRK_VALUES)
+};
+#undef QUIRK_VALUES
+
+#define QUIRK_NAME(id, name, ...) [id] = #name,
+static const char* const quirk_names[QUIRKS_COUNT] = {
+    QUIRK_PROFILES(QUIRK_NAME)
+};
+#undef QUIRK_NAME
+
+#define QUIRK_DESCRIPTION(id, name, description, ...) [id] = description,
+static const char* const quirk_descriptions[QUIRKS_COUNT] = {
+    QUIRK_PROFILES(QUIRK_DESCRIPTION)
+};
+#undef QUIRK_DESCRIPTION
+
+void set_quirks(CPU* cpu, QuirkProfile quirks) {
+    cpu->quirks = quirks;
+}
+
+int parse_quirks(const char* name, QuirkProfile* quirks) {
+    for (int i = 0; i < QUIRKS_COUNT; i++) {
+        if (strcmp(name, quirk_names[i]) == 0) {
+            *quirks = (QuirkProfile)i;
+            return 0;
+        }
+    }
+    return -1;
+}
 
+const char* quirks_name(QuirkProfile quirks) {
+    return quirk_names[quirks];
+}
+
+const char* quirks_description(QuirkProfile quirks) {
+    return quirk_descriptions[quirks];
+}
+
+QuirkProfile default_quirks(Machine machine) {
+    return machine == MACHINE_XOCHIP ? QUIRKS_XOCHIP : QUIRKS_SCHIP;
+}
+
+static uint8_t random_byte(CPU* cpu) {
+    uint64_t x = cpu->rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    cpu->rng_state = x;
+    return (x * 0x2545F4914F6CDD1Dull) >> 56;
+}
+
+int initialize_cpu(CPU* cpu) {
     // Check for null pointers
     if (cpu == NULL) {
         return -1;
     }
 
+    // Set a seed so we get random numbers each time
+    seed_cpu(cpu, (uint64_t)time(NULL));
+
     // Clear memory
     if (memset(cpu->memory, 0, MEM_SIZE) == NULL) {
         return -1;
@@ -22,21 +111,30 @@ int initialize_cpu(CPU* cpu) {
     // Originally, 512 bytes were used to store its own code
     // Therefore, we need to leave those 512 bytes empty (except for the fonts).
     // According to the guide I was reading: "For some reason, it’s become popular to put it at 050–09F"
-    for (int i = START_FONT_MEM; i <= END_FONT_MEM; i++) {
-        cpu->memory[i] = fontset[i - START_FONT_MEM];
-    }
+    memcpy(&cpu->memory[START_FONT_MEM], fontset, sizeof(fontset));
+    memcpy(&cpu->memory[START_BIG_FONT_MEM], big_fontset, sizeof(big_fontset));
 
     cpu->PC = START_PROGRAM_MEM;  // Initialize it to address 0x200 for retro-compatibility
     cpu->SP = -1;
     cpu->I = 0;
     cpu->delay_timer = 0;
     cpu->sound_timer = 0;
-    cpu->original_mode = 0;
+    set_machine(cpu, MACHINE_CHIP8);
+    set_quirks(cpu, default_quirks(MACHINE_CHIP8));
+    cpu->vblank = 0;
 
     // Clear framebuffer
-    if (memset(cpu->framebuffer, 0, FRAMEBUFFER_SIZE) == NULL) {
+    if (memset(cpu->framebuffer, 0, sizeof(cpu->framebuffer)) == NULL) {
         return -1;
     }
+    cpu->dirty_rows = ~0ull;
+    cpu->effects = 0;
+    cpu->hires = 0;
+    cpu->planes = 1;
+    memset(cpu->flags, 0, sizeof(cpu->flags));
+    memset(cpu->pattern, 0, sizeof(cpu->pattern));
+    cpu->pitch = DEFAULT_PITCH;
+    cpu->pattern_set = 0;
 
     // Clear stack
     if (memset(cpu->stack, 0, sizeof(cpu->stack)) == NULL) {
@@ -48,27 +146,18 @@ int initialize_cpu(CPU* cpu) {
         return -1;
     }
 
-    return 0;
-}
+    // Release all keys
+    memset(cpu->keypad, 0, sizeof(cpu->keypad));
 
-void print_keypad(CPU* cpu) {
-    printf("\n");
-    printf("1: %d | 2: %d | 3: %d | C: %d\n", cpu->keypad[0], cpu->keypad[1], cpu->keypad[2], cpu->keypad[3]);
-    printf("4: %d | 5: %d | 6: %d | D: %d\n", cpu->keypad[4], cpu->keypad[5], cpu->keypad[6], cpu->keypad[7]);
-    printf("7: %d | 8: %d | 9: %d | E: %d\n", cpu->keypad[8], cpu->keypad[9], cpu->keypad[10], cpu->keypad[11]);
-    printf("A: %d | 0: %d | B: %d | F: %d\n", cpu->keypad[12], cpu->keypad[13], cpu->keypad[14], cpu->keypad[15]);
-}
+    // Nothing has been decoded yet
+    memset(cpu->decode_cache, 0, sizeof(cpu->decode_cache));
+    memset(cpu->page_generation, 0, sizeof(cpu->page_generation));
 
-void handle_input(CPU* cpu, SDL_KeyboardEvent key) {
-    for (int i = 0; i < NUM_KEYS; i++) {
-        if (key.keysym.scancode == keymap[i]) {
-            cpu->keypad[i] = (key.type == SDL_KEYDOWN) ? 1 : 0;
-            break;
-        }
-    }
+#ifdef CHIP8_PROFILE
+    cpu->profile = NULL;
+#endif
 
-    // Only for debugging
-    /*print_keypad(cpu);*/
+    return 0;
 }
 
 uint16_t fetch(CPU* cpu) {
@@ -78,7 +167,7 @@ uint16_t fetch(CPU* cpu) {
     */
 
     uint8_t first_half = cpu->memory[cpu->PC];
-    uint8_t second_half = cpu->memory[cpu->PC + 1];
+    uint8_t second_half = cpu->memory[(uint16_t)(cpu->PC + 1)];
 
     // Increment to get the next two bytes
     cpu->PC += 2;
@@ -91,288 +180,706 @@ uint16_t fetch(CPU* cpu) {
     return opcode;
 }
 
-void execute(CPU* cpu, uint16_t opcode) {
-    // There are like 35 instructions to consider
+DecodedOp decode(uint16_t opcode, Machine machine) {
+    DecodedOp d;
+    int xochip = machine == MACHINE_XOCHIP;
 
     uint8_t first = (opcode & 0xF000) >> 12;    // first nibble
-    uint8_t x = (opcode & 0x0F00) >> 8;         // second nibble
-    uint8_t y = (opcode & 0x00F0) >> 4;         // third nibble
-    uint8_t n = (opcode & 0x000F);              // fourth nibble
-    uint8_t nn = (opcode & 0x00FF);             // second byte
-    uint16_t nnn = (opcode & 0x0FFF);           // second, third, and fourth nibbles
-
-    switch(first) {
+    d.x = (opcode & 0x0F00) >> 8;               // second nibble
+    d.y = (opcode & 0x00F0) >> 4;               // third nibble
+    d.n = (opcode & 0x000F);                    // fourth nibble
+    d.nn = (opcode & 0x00FF);                   // second byte
+    d.nnn = (opcode & 0x0FFF);                  // second, third, and fourth nibbles
+    d.op = OP_NOP;
+
+    switch (first) {
         case 0x0:
-            switch(nn) {
-                case 0xE0:
-                    // clear screen
-                    memset(cpu->framebuffer, 0, FRAMEBUFFER_SIZE);
-                    break;
-                case 0xEE:
-                    // return
-                    cpu->PC = cpu->stack[cpu->SP]; // program pointer points to the return address
-                    cpu->SP--; // decrement the stack pointer
-                    break;
-            }
-            break;
-        case 0x1:
-            // There is only one instruction whose first nibble is 1
-            // jump
-            cpu->PC = nnn; // set the program counter to nnn mem address
-            break;
-        case 0x2:
-            // There is only one instruction whose first nibble is 2
-            // call (subroutine)
-            cpu->SP++;
-            cpu->stack[cpu->SP] = cpu->PC;
-            cpu->PC = nnn;
-            break;
-        case 0x3:
-            // There is only one instruction whose first nibble is 3
-            // skip if Vx == nn
-            if (cpu->v[x] == nn) {
-                // skip one instruction
-                cpu->PC += 2;
-            }
-            break;
-        case 0x4:
-            // There is only one instruction whose first nibble is 4
-            // skip if Vx != nn
-            if (cpu->v[x] != nn) {
-                // skip one instruction
-                cpu->PC += 2;
-            }
+            if (d.nn == 0xE0) d.op = OP_CLS;
+            else if (d.nn == 0xEE) d.op = OP_RET;
+            else if (d.nnn >= 0x0C0 && d.nnn <= 0x0CF) d.op = OP_SCD;
+            else if (xochip && d.nnn >= 0x0D0 && d.nnn <= 0x0DF) d.op = OP_SCU;
+            else if (d.nnn == 0x0FB) d.op = OP_SCR;
+            else if (d.nnn == 0x0FC) d.op = OP_SCL;
+            else if (d.nnn == 0x0FD) d.op = OP_EXIT;
+            else if (d.nnn == 0x0FE) d.op = OP_LOW;
+            else if (d.nnn == 0x0FF) d.op = OP_HIGH;
             break;
+        case 0x1: d.op = OP_JP; break;
+        case 0x2: d.op = OP_CALL; break;
+        case 0x3: d.op = OP_SE_VX_NN; break;
+        case 0x4: d.op = OP_SNE_VX_NN; break;
         case 0x5:
-            // There is only one instruction whose first nibble is 5
-            // skip if Vx == Vy
-            if (cpu->v[x] == cpu->v[y]) {
-                // skip one instruction
-                cpu->PC += 2;
-            }
-            break;
-        case 0x6:
-            // There is only one instruction whose first nibble is 6
-            // set vx to nn
-            cpu->v[x] = nn;
-            break;
-        case 0x7:
-            // There is only one instruction whose first nibble is 7
-            // add nn to vx
-            cpu->v[x] += nn;
+            if (xochip && d.n == 0x2) d.op = OP_SAVE_VX_VY;
+            else if (xochip && d.n == 0x3) d.op = OP_LOAD_VX_VY;
+            else d.op = OP_SE_VX_VY;
             break;
+        case 0x6: d.op = OP_LD_VX_NN; break;
+        case 0x7: d.op = OP_ADD_VX_NN; break;
         case 0x8:
             // This set of instructions is decided based on the last nibble of the opcode
-            switch (n) {
-                case 0x0:
-                    // set vx to vy
-                    cpu->v[x] = cpu->v[y];
-                    break;
-                case 0x1:
-                    // binary OR
-                    cpu->v[x] = cpu->v[x] | cpu->v[y];
-                    break;
-                case 0x2:
-                    // binary AND
-                    cpu->v[x] = cpu->v[x] & cpu->v[y];
-                    break;
-                case 0x3:
-                    // binary XOR
-                    cpu->v[x] = cpu->v[x] ^ cpu->v[y];
-                    break;
-                case 0x4: {
-                    // Add
-                    int16_t tmp = cpu->v[x] + cpu->v[y];    // Check for overflow
-                    cpu->v[0xF] = (tmp > 255) ? 1 : 0;      // Assign the carry flag
-                    cpu->v[x] = tmp & 0xFF;                 // Assign the lower 8 bits of tmp
-                    break;
-                }
-                case 0x5:
-                    // Subtract vx - vy
-                    cpu->v[0xF] = cpu->v[x] > cpu->v[y] ? 1 : 0;    // Check for underflow
-                    cpu->v[x] = cpu->v[x] - cpu->v[y];              // Check for overflow
-                    break;
-                case 0x6:
-                    if (cpu->original_mode == 1) {
-                        cpu->v[x] = cpu->v[y];
-
-                    }
-                    // shift one bit to the right
-                    cpu->v[0xF] = cpu->v[x] & 0b1;
-                    cpu->v[x] = cpu->v[x] >> 1;
-                    break;
-                case 0x7:
-                    // Subtract vy - vx
-                    cpu->v[0xF] = cpu->v[y] > cpu->v[x] ? 1 : 0;    // Check for underflow
-                    cpu->v[x] = cpu->v[y] - cpu->v[x];              // Check for overflow
-                    break;
-                case 0xE:
-                    if (cpu->original_mode == 1) {
-                        cpu->v[x] = cpu->v[y];
-                    }
-                    // shift one bit to the left
-                    cpu->v[0xF] = (cpu->v[x] >> 7) & 0b1;
-                    cpu->v[x] = cpu->v[x] << 1;
-                    break;
+            switch (d.n) {
+                case 0x0: d.op = OP_LD_VX_VY; break;
+                case 0x1: d.op = OP_OR; break;
+                case 0x2: d.op = OP_AND; break;
+                case 0x3: d.op = OP_XOR; break;
+                case 0x4: d.op = OP_ADD_VX_VY; break;
+                case 0x5: d.op = OP_SUB; break;
+                case 0x6: d.op = OP_SHR; break;
+                case 0x7: d.op = OP_SUBN; break;
+                case 0xE: d.op = OP_SHL; break;
             }
             break;
-        case 0x9:
-            // There is only one instruction whose first nibble is 9
-            // skip if Vx != Vy
-            if (cpu->v[x] != cpu->v[y]) {
-                // skip one instruction
-                cpu->PC += 2;
-            }
+        case 0x9: d.op = OP_SNE_VX_VY; break;
+        case 0xA: d.op = OP_LD_I; break;
+        case 0xB: d.op = OP_JP_V0; break;
+        case 0xC: d.op = OP_RND; break;
+        case 0xD: d.op = OP_DRW; break;
+        case 0xE:
+            if (d.nn == 0x9E) d.op = OP_SKP;
+            else if (d.nn == 0xA1) d.op = OP_SKNP;
             break;
-        case 0xA:
-            // There is only one instruction whose first nibble is A
-            // Set the index register to the value nnn
-            cpu->I = nnn;
+        case 0xF:
+            switch (d.nn) {
+                case 0x00: if (xochip && d.x == 0) d.op = OP_LD_I_LONG; break;
+                case 0x01: if (xochip) d.op = OP_PLANE; break;
+                case 0x02: if (xochip && d.x == 0) d.op = OP_AUDIO; break;
+                case 0x07: d.op = OP_LD_VX_DT; break;
+                case 0x0A: d.op = OP_LD_VX_K; break;
+                case 0x15: d.op = OP_LD_DT_VX; break;
+                case 0x18: d.op = OP_LD_ST_VX; break;
+                case 0x1E: d.op = OP_ADD_I_VX; break;
+                case 0x29: d.op = OP_LD_F_VX; break;
+                case 0x33: d.op = OP_LD_B_VX; break;
+                case 0x55: d.op = OP_LD_I_VX; break;
+                case 0x65: d.op = OP_LD_VX_I; break;
+                case 0x30: d.op = OP_LD_HF_VX; break;
+                case 0x75: d.op = OP_LD_R_VX; break;
+                case 0x85: d.op = OP_LD_VX_R; break;
+                case 0x3A: if (xochip) d.op = OP_PITCH; break;
+            }
             break;
-        case 0xB:
-            // There is only one instruction whose first nibble is B
-            // But it's ambiguous :/
-            if (cpu->original_mode == 1) {
-                cpu->PC = cpu->v[0] + nnn;
+    }
 
-            } else {
-                cpu->PC = cpu->v[x] + nnn;
+    return d;
+}
 
-            }
-            break;
-        case 0xC: {
-            // There is only one instruction whose first nibble is C
-            // generate a random number and binary ANDs it with nn
-            uint8_t random = rand() % 256;
-            random = random & nn;
-            // put the result in vx
-            cpu->v[x] = random;
-            break;
+static void invalidate_range(CPU* cpu, uint32_t address, uint32_t end) {
+    // Every byte belongs to exactly one even-aligned cache slot
+    for (uint32_t a = address; a < end && a < DECODE_CACHE_SIZE; a++) {
+        cpu->decode_cache[a >> 1].op = OP_UNDECODED;
+    }
+
+    for (uint32_t page = address / CODE_PAGE_SIZE; page * CODE_PAGE_SIZE < end; page++) {
+        cpu->page_generation[page]++;
+    }
+}
+
+void invalidate_decode_cache(CPU* cpu, uint16_t address, uint16_t length) {
+    // Writes wrap around the end of memory like the addresses they went to
+    uint32_t size = memory_size(cpu);
+    uint32_t start = address & cpu->memory_mask;
+    uint32_t end = start + length;
+    if (end > size) {
+        invalidate_range(cpu, 0, end - size < size ? end - size : size);
+        end = size;
+    }
+    invalidate_range(cpu, start, end);
+    cpu->effects++;
+}
+
+// Address `offset` bytes past I
+static inline uint16_t i_address(const CPU* cpu, uint32_t offset) {
+    return (cpu->I + offset) & cpu->memory_mask;
+}
+
+static inline void skip_next(CPU* cpu) {
+    cpu->PC += skip_size(cpu, cpu->PC);
+}
+
+static void op_nop(CPU* cpu, const DecodedOp* d) {
+    (void)cpu;
+    (void)d;
+    // Don't do anything
+}
+
+static void clear_planes(CPU* cpu, uint8_t planes) {
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (planes & (1 << plane)) {
+            memset(cpu->framebuffer[plane], 0, sizeof(cpu->framebuffer[plane]));
         }
-        case 0xD: {
-            // There is only one instruction whose first nibble is D,
-            // and it's the most convoluted to write
-            uint8_t x_start = cpu->v[x] % 64;
-            uint8_t y_start = cpu->v[y] % 32;
-            cpu->v[0xF] = 0;
-
-            // Iterate over the rows
-            for (size_t row = 0; row < n; row++) {
-                if (y_start + row >= 32) {
-                    break;
-                }
+    }
+    cpu->dirty_rows = ~0ull;
+    cpu->effects++;
+}
 
-                // Get the nth byte of sprite data
-                uint8_t nth = cpu->memory[cpu->I + row];
+static void op_cls(CPU* cpu, const DecodedOp* d) {
+    (void)d;
+    // clear screen, only the selected planes on XO-CHIP
+    clear_planes(cpu, cpu->planes);
+}
 
-                // Iterate over the columns
-                for (size_t col = 0; col < 8; col++) {
-                    if (x_start + col >= 64) {
-                        break;
-                    }
+static void op_ret(CPU* cpu, const DecodedOp* d) {
+    (void)d;
+    // return
+    cpu->PC = cpu->stack[cpu->SP]; // program pointer points to the return address
+    cpu->SP--; // decrement the stack pointer
+}
 
-                    uint8_t nth_pixel = (nth & (0x80 >> col)) ? 1 : 0;
-                    uint16_t pixel_index = x_start + col + ((y_start + row) * 64);
+static void op_jp(CPU* cpu, const DecodedOp* d) {
+    // jump
+    cpu->PC = d->nnn; // set the program counter to nnn mem address
+}
 
-                    // Check collision
-                    uint8_t current_pixel = cpu->framebuffer[pixel_index];
-                    if (nth_pixel & current_pixel) {
-                        cpu->v[0xF] = 1;
-                    }
+static void op_call(CPU* cpu, const DecodedOp* d) {
+    // call (subroutine)
+    cpu->SP++;
+    cpu->stack[cpu->SP] = cpu->PC;
+    cpu->PC = d->nnn;
+}
 
-                    cpu->framebuffer[pixel_index] ^= nth_pixel;
-                }
+static void op_se_vx_nn(CPU* cpu, const DecodedOp* d) {
+    // skip if Vx == nn
+    if (cpu->v[d->x] == d->nn) {
+        // skip one instruction
+        skip_next(cpu);
+    }
+}
+
+static void op_sne_vx_nn(CPU* cpu, const DecodedOp* d) {
+    // skip if Vx != nn
+    if (cpu->v[d->x] != d->nn) {
+        // skip one instruction
+        skip_next(cpu);
+    }
+}
+
+static void op_se_vx_vy(CPU* cpu, const DecodedOp* d) {
+    // skip if Vx == Vy
+    if (cpu->v[d->x] == cpu->v[d->y]) {
+        // skip one instruction
+        skip_next(cpu);
+    }
+}
+
+static void op_ld_vx_nn(CPU* cpu, const DecodedOp* d) {
+    // set vx to nn
+    cpu->v[d->x] = d->nn;
+}
+
+static void op_add_vx_nn(CPU* cpu, const DecodedOp* d) {
+    // add nn to vx
+    cpu->v[d->x] += d->nn;
+}
+
+static void op_ld_vx_vy(CPU* cpu, const DecodedOp* d) {
+    // set vx to vy
+    cpu->v[d->x] = cpu->v[d->y];
+}
+
+static void op_add_vx_vy(CPU* cpu, const DecodedOp* d) {
+    // Add
+    int16_t tmp = cpu->v[d->x] + cpu->v[d->y];  // Check for overflow
+    cpu->v[0xF] = (tmp > 255) ? 1 : 0;          // Assign the carry flag
+    cpu->v[d->x] = tmp & 0xFF;                  // Assign the lower 8 bits of tmp
+}
+
+static void op_sub(CPU* cpu, const DecodedOp* d) {
+    // Subtract vx - vy
+    cpu->v[0xF] = cpu->v[d->x] > cpu->v[d->y] ? 1 : 0;  // Check for underflow
+    cpu->v[d->x] = cpu->v[d->x] - cpu->v[d->y];         // Check for overflow
+}
+
+static void op_subn(CPU* cpu, const DecodedOp* d) {
+    // Subtract vy - vx
+    cpu->v[0xF] = cpu->v[d->y] > cpu->v[d->x] ? 1 : 0;  // Check for underflow
+    cpu->v[d->x] = cpu->v[d->y] - cpu->v[d->x];         // Check for overflow
+}
+
+static void op_sne_vx_vy(CPU* cpu, const DecodedOp* d) {
+    // skip if Vx != Vy
+    if (cpu->v[d->x] != cpu->v[d->y]) {
+        // skip one instruction
+        skip_next(cpu);
+    }
+}
+
+static void op_ld_i(CPU* cpu, const DecodedOp* d) {
+    // Set the index register to the value nnn
+    cpu->I = d->nnn;
+}
+
+static void op_rnd(CPU* cpu, const DecodedOp* d) {
+    // generate a random number and binary ANDs it with nn
+    uint8_t random = random_byte(cpu);
+    random = random & d->nn;
+    // put the result in vx
+    cpu->v[d->x] = random;
+}
+
+// Row `row` of a sprite `width` (8 or 16) pixels wide starting at I + offset
+static inline uint32_t sprite_row(const CPU* cpu, uint32_t offset, uint32_t row, uint32_t width) {
+    if (width == 16) {
+        return (uint32_t)cpu->memory[i_address(cpu, offset + row * 2)] << 8
+             | cpu->memory[i_address(cpu, offset + row * 2 + 1)];
+    }
+    return cpu->memory[i_address(cpu, offset + row)];
+}
+
+// Draws one plane's sprite, returns 1 if it erased a pixel
+static inline uint8_t draw_plane(CPU* cpu, int plane, uint32_t offset, uint32_t x, uint32_t y, uint32_t rows, uint32_t width, int wrap) {
+    uint64_t (*lines)[FRAMEBUFFER_WORDS] = cpu->framebuffer[plane];
+    uint32_t height_mask = screen_height(cpu) - 1;
+    uint64_t collision = 0;
+    uint64_t drawn = 0;
+
+    if (!cpu->hires) {
+        // One word per row. Pixels past column 63 are clipped, or rotated
+        // back to the left edge when sprites wrap
+        for (uint32_t row = 0; row < rows; row++) {
+            uint64_t nth = width == 8
+                ? cpu->memory[i_address(cpu, offset + row)]
+                : sprite_row(cpu, offset, row, width);
+            uint64_t aligned = nth << (64 - width);
+            uint64_t bits = aligned >> x;
+            if (wrap && x != 0) {
+                bits |= aligned << (64 - x);
             }
-            break;
+
+            uint32_t line = (y + row) & height_mask;
+            collision |= lines[line][0] & bits;
+            lines[line][0] ^= bits;
+            drawn |= (uint64_t)(bits != 0) << line;
         }
-        case 0xE:
-            switch (nn) {
-                case 0x9E:
-                    // Skip if the key in register x is pressed
-                    if (cpu->keypad[cpu->v[x]] == 1) {
-                        cpu->PC += 2;
-                    }
-                    break;
-                case 0xA1:
-                    // Skip if the key in register x is not pressed
-                    if (cpu->keypad[cpu->v[x]] == 0) {
-                        cpu->PC += 2;
-                    }
-                    break;
+    } else {
+        // The sprite straddles the two words of a row when it starts within
+        // `width` pixels of column 64
+        for (uint32_t row = 0; row < rows; row++) {
+            uint64_t aligned = (uint64_t)sprite_row(cpu, offset, row, width) << (64 - width);
+            uint64_t left = x < 64 ? aligned >> x : 0;
+            uint64_t right = x == 0 ? 0 : x < 64 ? aligned << (64 - x) : aligned >> (x - 64);
+            if (wrap && x > 64) {
+                left |= aligned << (128 - x);
             }
-            break;
-        case 0xF:
-            switch (nn) {
-                case 0x07:
-                    cpu->v[x] = cpu->delay_timer;
-                    break;
-                case 0x0A: {
-                    // wait for any key press
-                    int key_pressed = -1;
-                    for (uint8_t i = 0; i < NUM_KEYS; i++) {
-                        if (cpu->keypad[i] == 1) {
-                            cpu->v[x] = i;
-                            key_pressed = 1;
-                            break;
-                        }
-                    }
-
-                    if (key_pressed == -1) {
-                        cpu->PC -= 2;
-                    }
-                    break;
-                }
-                case 0x15:
-                    cpu->delay_timer = cpu->v[x];
-                    break;
-                case 0x18:
-                    cpu->sound_timer = cpu->v[x];
-                    break;
-                case 0x1E: {
-                    uint16_t tmp = cpu->I + cpu->v[x];
-                    if (tmp > 0xFFF) {
-                        cpu->v[0xF] = 1;
-
-                    }
-                    cpu->I += cpu->v[x];
-                    break;
-                }
-                case 0x29: {
-                    uint8_t hex_char = (cpu->v[x] & 0x0F); // Hex character stored in vx
-                    cpu->I = START_FONT_MEM + (hex_char * 5);
-                    break;
-                }
-                case 0x33: {
-                    // Binary coded decimal conversion
-                    uint8_t num = cpu->v[x];
 
-                    for (int8_t i = 2; i >= 0; i--) {
-                        cpu->memory[cpu->I + i] = num % 10;
-                        num /= 10;
-                    }
+            uint32_t line = (y + row) & height_mask;
+            collision |= (lines[line][0] & left) | (lines[line][1] & right);
+            lines[line][0] ^= left;
+            lines[line][1] ^= right;
+            drawn |= (uint64_t)((left | right) != 0) << line;
+        }
+    }
+
+    cpu->dirty_rows |= drawn;
+    return collision != 0;
+}
 
-                    break;
-                }
-                case 0x55:
-                    // Ambiguous instruction but according to the guide it didn't matter much
-                    for (uint8_t i = 0; i <= x; i++) {
-                        cpu->memory[cpu->I + i] = cpu->v[i];
-                    }
-                    break;
-                case 0x65:
-                    // Ambiguous instruction but according to the guide it didn't matter much
-                    for (uint8_t i = 0; i <= x; i++) {
-                        cpu->v[i] = cpu->memory[cpu->I + i];
-                    }
-                    break;
+/*
+ * Dxyn for both edge behaviours. Each framebuffer row is one or two
+ * 64-bit words, so a sprite row is shifted into place and XORed in one go.
+ */
+static inline void draw_sprite(CPU* cpu, const DecodedOp* d, int wrap) {
+    uint32_t height = screen_height(cpu);
+    uint32_t x_start = cpu->v[d->x] & (screen_width(cpu) - 1);
+    uint32_t y_start = cpu->v[d->y] & (height - 1);
+    cpu->v[0xF] = 0;
+
+    // Dxy0 draws a 16x16 sprite, two bytes per row
+    uint32_t sprite_width = d->n == 0 ? 16 : 8;
+    uint32_t sprite_rows = d->n == 0 ? 16 : d->n;
+
+    // Unless they wrap, sprites are clipped at the bottom edge
+    uint32_t rows = sprite_rows;
+    if (!wrap && y_start + rows > height) {
+        rows = height - y_start;
+    }
+
+    // XO-CHIP: the sprite for each selected plane follows the previous one
+    uint32_t offset = 0;
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (cpu->planes & (1 << plane)) {
+            cpu->v[0xF] |= draw_plane(cpu, plane, offset, x_start, y_start, rows, sprite_width, wrap);
+            offset += sprite_rows * (sprite_width / 8);
+        }
+    }
+    cpu->effects++;
+}
+
+static void op_skp(CPU* cpu, const DecodedOp* d) {
+    // Skip if the key in register x is pressed
+    if (cpu->keypad[cpu->v[d->x]] == 1) {
+        skip_next(cpu);
+    }
+}
+
+static void op_sknp(CPU* cpu, const DecodedOp* d) {
+    // Skip if the key in register x is not pressed
+    if (cpu->keypad[cpu->v[d->x]] == 0) {
+        skip_next(cpu);
+    }
+}
+
+static void op_ld_vx_dt(CPU* cpu, const DecodedOp* d) {
+    cpu->v[d->x] = cpu->delay_timer;
+}
+
+static void op_ld_vx_k(CPU* cpu, const DecodedOp* d) {
+    // wait for any key press
+    for (uint8_t i = 0; i < NUM_KEYS; i++) {
+        if (cpu->keypad[i] == 1) {
+            cpu->v[d->x] = i;
+            return;
+        }
+    }
+
+    // No key pressed, execute this instruction again
+    cpu->PC -= 2;
+}
+
+static void op_ld_dt_vx(CPU* cpu, const DecodedOp* d) {
+    cpu->delay_timer = cpu->v[d->x];
+}
+
+static void op_ld_st_vx(CPU* cpu, const DecodedOp* d) {
+    cpu->sound_timer = cpu->v[d->x];
+}
+
+static void op_add_i_vx(CPU* cpu, const DecodedOp* d) {
+    uint16_t tmp = cpu->I + cpu->v[d->x];
+    if (tmp > 0xFFF) {
+        cpu->v[0xF] = 1;
+    }
+    cpu->I += cpu->v[d->x];
+}
+
+static void op_ld_f_vx(CPU* cpu, const DecodedOp* d) {
+    uint8_t hex_char = (cpu->v[d->x] & 0x0F); // Hex character stored in vx
+    cpu->I = START_FONT_MEM + (hex_char * 5);
+}
+
+static void op_ld_b_vx(CPU* cpu, const DecodedOp* d) {
+    // Binary coded decimal conversion
+    uint8_t num = cpu->v[d->x];
+
+    for (int8_t i = 2; i >= 0; i--) {
+        cpu->memory[i_address(cpu, i)] = num % 10;
+        num /= 10;
+    }
+
+    // We might have just overwritten code
+    invalidate_decode_cache(cpu, cpu->I, 3);
+}
+
+// Moves the selected planes `n` rows down, or up when n is negative
+static void scroll_rows(CPU* cpu, int n) {
+    uint32_t height = screen_height(cpu);
+    uint32_t count = (uint32_t)(n < 0 ? -n : n);
+    if (count > height) {
+        count = height;
+    }
+
+    size_t row_size = sizeof(cpu->framebuffer[0][0]);
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (!(cpu->planes & (1 << plane))) {
+            continue;
+        }
+
+        uint64_t (*rows)[FRAMEBUFFER_WORDS] = cpu->framebuffer[plane];
+        if (n > 0) {
+            memmove(rows[count], rows[0], (height - count) * row_size);
+            memset(rows[0], 0, count * row_size);
+        } else {
+            memmove(rows[0], rows[count], (height - count) * row_size);
+            memset(rows[height - count], 0, count * row_size);
+        }
+    }
+
+    cpu->dirty_rows = ~0ull;
+    cpu->effects++;
+}
+
+// Moves the selected planes `pixels` (4 or 2) right, or left, shifting whole rows at a time
+static void scroll_columns(CPU* cpu, int right, uint32_t pixels) {
+    uint32_t height = screen_height(cpu);
+
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (!(cpu->planes & (1 << plane))) {
+            continue;
+        }
+
+        for (uint32_t y = 0; y < height; y++) {
+            uint64_t* line = cpu->framebuffer[plane][y];
+            if (!cpu->hires) {
+                // Pixels shifted past column 63 are off screen and dropped
+                line[0] = right ? line[0] >> pixels : line[0] << pixels;
+            } else if (right) {
+                line[1] = (line[1] >> pixels) | (line[0] << (64 - pixels));
+                line[0] >>= pixels;
+            } else {
+                line[0] = (line[0] << pixels) | (line[1] >> (64 - pixels));
+                line[1] <<= pixels;
             }
-            break;
-        default:
-            // Don't do anything
-            break;
+        }
+    }
+
+    cpu->dirty_rows = ~0ull;
+    cpu->effects++;
+}
+
+static void op_exit(CPU* cpu, const DecodedOp* d) {
+    (void)d;
+    // There is no interpreter to return to, so stay on this instruction
+    cpu->PC -= 2;
+}
+
+static void op_low(CPU* cpu, const DecodedOp* d) {
+    (void)d;
+    // Switching resolution clears the screen
+    cpu->hires = 0;
+    clear_planes(cpu, (1 << NUM_PLANES) - 1);
+}
+
+static void op_high(CPU* cpu, const DecodedOp* d) {
+    (void)d;
+    cpu->hires = 1;
+    clear_planes(cpu, (1 << NUM_PLANES) - 1);
+}
+
+static void op_save_vx_vy(CPU* cpu, const DecodedOp* d) {
+    // Registers x to y in either order, I is left alone
+    int step = d->x <= d->y ? 1 : -1;
+    uint32_t count = (uint32_t)((d->x - d->y) * -step) + 1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        cpu->memory[i_address(cpu, i)] = cpu->v[d->x + step * (int)i];
+    }
+
+    // We might have just overwritten code
+    invalidate_decode_cache(cpu, cpu->I, count);
+}
+
+static void op_load_vx_vy(CPU* cpu, const DecodedOp* d) {
+    int step = d->x <= d->y ? 1 : -1;
+    uint32_t count = (uint32_t)((d->x - d->y) * -step) + 1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        cpu->v[d->x + step * (int)i] = cpu->memory[i_address(cpu, i)];
+    }
+}
+
+static void op_ld_i_long(CPU* cpu, const DecodedOp* d) {
+    (void)d;
+    // The address is the next two bytes, which are skipped over
+    cpu->I = (uint16_t)(cpu->memory[cpu->PC] << 8) | cpu->memory[(uint16_t)(cpu->PC + 1)];
+    cpu->PC += 2;
+}
+
+static void op_plane(CPU* cpu, const DecodedOp* d) {
+    // Bit-planes drawn to, cleared and scrolled from now on
+    cpu->planes = d->x;
+}
+
+static void op_ld_hf_vx(CPU* cpu, const DecodedOp* d) {
+    uint8_t hex_char = (cpu->v[d->x] & 0x0F);
+    cpu->I = START_BIG_FONT_MEM + (hex_char * 10);
+}
+
+static void op_ld_r_vx(CPU* cpu, const DecodedOp* d) {
+    for (uint8_t i = 0; i <= d->x; i++) {
+        cpu->flags[i] = cpu->v[i];
     }
 }
 
+static void op_ld_vx_r(CPU* cpu, const DecodedOp* d) {
+    for (uint8_t i = 0; i <= d->x; i++) {
+        cpu->v[i] = cpu->flags[i];
+    }
+}
+
+static void op_audio(CPU* cpu, const DecodedOp* d) {
+    (void)d;
+    // 16 bytes from I become the waveform, one bit per sample, most significant first
+    for (uint32_t i = 0; i < PATTERN_SIZE; i++) {
+        cpu->pattern[i] = cpu->memory[i_address(cpu, i)];
+    }
+    cpu->pattern_set = 1;
+}
+
+static void op_pitch(CPU* cpu, const DecodedOp* d) {
+    cpu->pitch = cpu->v[d->x];
+}
+
+// Quirk-dependent handlers, one copy per profile
+#define QUIRKED_NAME(name, profile) name##_##profile
+#define QUIRKED_EXPAND(name, profile) QUIRKED_NAME(name, profile)
+#define QUIRKED(name) QUIRKED_EXPAND(name, QUIRKS_NAME)
+
+#define QUIRK_CONSTANTS(id, name, description, ...) static const Quirks quirks_##name = { __VA_ARGS__ };
+QUIRK_PROFILES(QUIRK_CONSTANTS)
+#undef QUIRK_CONSTANTS
+
+#define QUIRKS_NAME vip
+#include "ops.inc"
+#define QUIRKS_NAME chip48
+#include "ops.inc"
+#define QUIRKS_NAME schip
+#include "ops.inc"
+#define QUIRKS_NAME xochip
+#include "ops.inc"
+
+// Indexed by Operation
+#define HANDLER_TABLE(profile) { \
+    [OP_UNDECODED]  = op_nop, \
+    [OP_NOP]        = op_nop, \
+    [OP_CLS]        = op_cls, \
+    [OP_RET]        = op_ret, \
+    [OP_JP]         = op_jp, \
+    [OP_CALL]       = op_call, \
+    [OP_SE_VX_NN]   = op_se_vx_nn, \
+    [OP_SNE_VX_NN]  = op_sne_vx_nn, \
+    [OP_SE_VX_VY]   = op_se_vx_vy, \
+    [OP_LD_VX_NN]   = op_ld_vx_nn, \
+    [OP_ADD_VX_NN]  = op_add_vx_nn, \
+    [OP_LD_VX_VY]   = op_ld_vx_vy, \
+    [OP_OR]         = op_or_##profile, \
+    [OP_AND]        = op_and_##profile, \
+    [OP_XOR]        = op_xor_##profile, \
+    [OP_ADD_VX_VY]  = op_add_vx_vy, \
+    [OP_SUB]        = op_sub, \
+    [OP_SHR]        = op_shr_##profile, \
+    [OP_SUBN]       = op_subn, \
+    [OP_SHL]        = op_shl_##profile, \
+    [OP_SNE_VX_VY]  = op_sne_vx_vy, \
+    [OP_LD_I]       = op_ld_i, \
+    [OP_JP_V0]      = op_jp_v0_##profile, \
+    [OP_RND]        = op_rnd, \
+    [OP_DRW]        = op_drw_##profile, \
+    [OP_SKP]        = op_skp, \
+    [OP_SKNP]       = op_sknp, \
+    [OP_LD_VX_DT]   = op_ld_vx_dt, \
+    [OP_LD_VX_K]    = op_ld_vx_k, \
+    [OP_LD_DT_VX]   = op_ld_dt_vx, \
+    [OP_LD_ST_VX]   = op_ld_st_vx, \
+    [OP_ADD_I_VX]   = op_add_i_vx, \
+    [OP_LD_F_VX]    = op_ld_f_vx, \
+    [OP_LD_B_VX]    = op_ld_b_vx, \
+    [OP_LD_I_VX]    = op_ld_i_vx_##profile, \
+    [OP_LD_VX_I]    = op_ld_vx_i_##profile, \
+    [OP_SCD]        = op_scd_##profile, \
+    [OP_SCU]        = op_scu_##profile, \
+    [OP_SCR]        = op_scr_##profile, \
+    [OP_SCL]        = op_scl_##profile, \
+    [OP_EXIT]       = op_exit, \
+    [OP_LOW]        = op_low, \
+    [OP_HIGH]       = op_high, \
+    [OP_SAVE_VX_VY] = op_save_vx_vy, \
+    [OP_LOAD_VX_VY] = op_load_vx_vy, \
+    [OP_LD_I_LONG]  = op_ld_i_long, \
+    [OP_PLANE]      = op_plane, \
+    [OP_LD_HF_VX]   = op_ld_hf_vx, \
+    [OP_LD_R_VX]    = op_ld_r_vx, \
+    [OP_LD_VX_R]    = op_ld_vx_r, \
+    [OP_AUDIO]      = op_audio, \
+    [OP_PITCH]      = op_pitch, \
+}
+
+#define QUIRK_HANDLERS(id, name, ...) [id] = HANDLER_TABLE(name),
+const OpHandler op_handlers[QUIRKS_COUNT][OP_COUNT] = {
+    QUIRK_PROFILES(QUIRK_HANDLERS)
+};
+#undef QUIRK_HANDLERS
+#undef HANDLER_TABLE
+
+void execute(CPU* cpu, uint16_t opcode) {
+    DecodedOp d = decode(opcode, cpu->machine);
+    op_handlers[cpu->quirks][d.op](cpu, &d);
+}
+
+static inline void step_with(CPU* cpu, const OpHandler* handlers) {
+    uint16_t pc = cpu->PC;
+
+    // Odd addresses (e.g. after Bnnn) and code past the cached range take the slow path
+    if ((pc & 1) || pc >= DECODE_CACHE_SIZE) {
+        DecodedOp d = decode(fetch(cpu), cpu->machine);
+        PROFILE_OP(cpu, &d, pc);
+        handlers[d.op](cpu, &d);
+        return;
+    }
+
+    DecodedOp* slot = &cpu->decode_cache[pc >> 1];
+    if (slot->op == OP_UNDECODED) {
+        *slot = decode((cpu->memory[pc] << 8) | cpu->memory[pc + 1], cpu->machine);
+    }
+
+    // Copy it, the handler may invalidate its own slot (self-modifying code)
+    DecodedOp d = *slot;
+    PROFILE_OP(cpu, &d, pc);
+    cpu->PC += 2;
+    handlers[d.op](cpu, &d);
+}
+
+void step(CPU* cpu) {
+    step_with(cpu, op_handlers[cpu->quirks]);
+}
+
+// An interpreter loop per profile, each with its handler table as a constant
+#define QUIRK_INTERPRETER(id, name, ...) \
+    static void run_##name(CPU* cpu, uint32_t count) { \
+        for (uint32_t i = 0; i < count; i++) { \
+            step_with(cpu, op_handlers[id]); \
+        } \
+    }
+QUIRK_PROFILES(QUIRK_INTERPRETER)
+#undef QUIRK_INTERPRETER
+
+#define QUIRK_RUN(id, name, ...) [id] = run_##name,
+static void (*const interpreters[QUIRKS_COUNT])(CPU* cpu, uint32_t count) = {
+    QUIRK_PROFILES(QUIRK_RUN)
+};
+#undef QUIRK_RUN
+
+void tick_timers(CPU* cpu) {
+    // Start of a frame, the display wait quirk lets the next Dxyn through
+    cpu->vblank = 1;
+
+    if (cpu->delay_timer > 0) {
+        cpu->delay_timer--;
+    }
+
+    if (cpu->sound_timer > 0) {
+        cpu->sound_timer--;
+    }
+}
+
+void run_instructions(CPU* cpu, uint32_t count) {
+    // The profile is picked once per batch, not per instruction
+    interpreters[cpu->quirks](cpu, count);
+}
+
+// The same loops with a bitmap test in front of every instruction
+#define QUIRK_TRAPPING_INTERPRETER(id, name, ...) \
+    static uint32_t run_##name##_until_trap(CPU* cpu, uint32_t count, const uint8_t* traps) { \
+        for (uint32_t i = 0; i < count; i++) { \
+            uint16_t pc = cpu->PC; \
+            if (traps[pc >> 3] & (1 << (pc & 7))) { \
+                return i; \
+            } \
+            step_with(cpu, op_handlers[id]); \
+        } \
+        return count; \
+    }
+QUIRK_PROFILES(QUIRK_TRAPPING_INTERPRETER)
+#undef QUIRK_TRAPPING_INTERPRETER
+
+#define QUIRK_RUN_UNTIL_TRAP(id, name, ...) [id] = run_##name##_until_trap,
+static uint32_t (*const trapping_interpreters[QUIRKS_COUNT])(CPU* cpu, uint32_t count, const uint8_t* traps) = {
+    QUIRK_PROFILES(QUIRK_RUN_UNTIL_TRAP)
+};
+#undef QUIRK_RUN_UNTIL_TRAP
+
+uint32_t run_until_trap(CPU* cpu, uint32_t count, const uint8_t* traps) {
+    return trapping_interpreters[cpu->quirks](cpu, count, traps);
+}
+
 int load_rom(CPU* cpu, const char* filename) {
     FILE* rom = fopen(filename, "rb");
     if (rom == NULL) {
@@ -386,7 +893,7 @@ int load_rom(CPU* cpu, const char* filename) {
     rewind(rom);
 
     // Make sure the rom fits in the memory
-    if (rom_size > MEM_SIZE - START_PROGRAM_MEM) {
+    if (rom_size > memory_size(cpu) - START_PROGRAM_MEM) {
         print_error(ERROR_ROM_SIZE, "ROM file too large");
         return -1;
     }
@@ -400,5 +907,92 @@ int load_rom(CPU* cpu, const char* filename) {
     }
 
     fclose(rom);
+
+    // Drop anything decoded from the previous contents
+    invalidate_decode_cache(cpu, START_PROGRAM_MEM, rom_size);
     return 0;
 }
+
+int load_rom_data(CPU* cpu, const uint8_t* data, size_t size) {
+    if (size > memory_size(cpu) - START_PROGRAM_MEM) {
+        print_error(ERROR_ROM_SIZE, "ROM file too large");
+        return -1;
+    }
+
+    memcpy(&cpu->memory[START_PROGRAM_MEM], data, size);
+    invalidate_decode_cache(cpu, START_PROGRAM_MEM, size);
+    return 0;
+}
+
+int cpu_diff(const CPU* a, const CPU* b, FILE* out) {
+    int differences = 0;
+
+#define DIFF_FIELD(field) \
+    if (a->field != b->field) { \
+        if (out) fprintf(out, "  %s: 0x%X != 0x%X\n", #field, a->field, b->field); \
+        differences++; \
+    }
+
+#define DIFF_ARRAY(array, count) \
+    if (memcmp(a->array, b->array, sizeof(a->array)) != 0) { \
+        for (int i = 0; i < (int)(count); i++) { \
+            if (a->array[i] != b->array[i]) { \
+                if (out) fprintf(out, "  %s[0x%X]: 0x%X != 0x%X\n", #array, i, a->array[i], b->array[i]); \
+                differences++; \
+            } \
+        } \
+    }
+
+    DIFF_FIELD(PC);
+    DIFF_FIELD(I);
+    DIFF_FIELD(SP);
+    DIFF_FIELD(delay_timer);
+    DIFF_FIELD(sound_timer);
+    DIFF_FIELD(quirks);
+    DIFF_FIELD(vblank);
+    DIFF_FIELD(machine);
+    DIFF_FIELD(hires);
+    DIFF_FIELD(planes);
+    DIFF_FIELD(pitch);
+    DIFF_FIELD(pattern_set);
+    DIFF_ARRAY(v, NUM_REGS);
+    DIFF_ARRAY(stack, STACK_DEPTH);
+    DIFF_ARRAY(keypad, NUM_KEYS);
+    DIFF_ARRAY(flags, NUM_FLAGS);
+    DIFF_ARRAY(pattern, PATTERN_SIZE);
+
+    // Only the part of memory the machine can address
+    uint32_t size = memory_size(a) < memory_size(b) ? memory_size(a) : memory_size(b);
+    if (memcmp(a->memory, b->memory, size) != 0) {
+        for (uint32_t i = 0; i < size; i++) {
+            if (a->memory[i] != b->memory[i]) {
+                if (out) fprintf(out, "  memory[0x%X]: 0x%X != 0x%X\n", i, a->memory[i], b->memory[i]);
+                differences++;
+            }
+        }
+    }
+
+#undef DIFF_FIELD
+#undef DIFF_ARRAY
+
+    if (a->rng_state != b->rng_state) {
+        if (out) fprintf(out, "  rng_state: %016llX != %016llX\n",
+                         (unsigned long long)a->rng_state, (unsigned long long)b->rng_state);
+        differences++;
+    }
+
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        for (int row = 0; row < FRAMEBUFFER_HEIGHT; row++) {
+            for (int w = 0; w < FRAMEBUFFER_WORDS; w++) {
+                if (a->framebuffer[plane][row][w] != b->framebuffer[plane][row][w]) {
+                    if (out) fprintf(out, "  framebuffer[%d][%d][%d]: %016llX != %016llX\n", plane, row, w,
+                                     (unsigned long long)a->framebuffer[plane][row][w],
+                                     (unsigned long long)b->framebuffer[plane][row][w]);
+                    differences++;
+                }
+            }
+        }
+    }
+
+    return differences;
+}
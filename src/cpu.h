@@ -2,17 +2,147 @@
 #define CPU_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
-#include <SDL2/SDL.h>
 
-#define MEM_SIZE 4096
+#define MEM_SIZE 0x10000                // XO-CHIP address space, the largest of all machines
+#define CHIP8_MEM_SIZE 0x1000           // CHIP-8 and SUPER-CHIP, addresses wrap around at 4 KB
 #define STACK_DEPTH 16
 #define NUM_REGS 16
-#define FRAMEBUFFER_SIZE 64*32
+#define FRAMEBUFFER_WIDTH 128           // High resolution, low resolution uses the top-left 64x32
+#define FRAMEBUFFER_HEIGHT 64
+#define FRAMEBUFFER_WORDS (FRAMEBUFFER_WIDTH / 64)
+#define LORES_WIDTH 64
+#define LORES_HEIGHT 32
+#define NUM_PLANES 4                    // XO-CHIP bit-planes, CHIP-8 and SUPER-CHIP only draw on the first
 #define START_FONT_MEM 0x50
-#define END_FONT_MEM 0xF9
+#define END_FONT_MEM 0x9F
+#define START_BIG_FONT_MEM 0xA0         // SUPER-CHIP 8x10 digits
+#define END_BIG_FONT_MEM 0x13F
 #define START_PROGRAM_MEM 0x200
 #define NUM_KEYS 16
+#define NUM_FLAGS 16                    // SUPER-CHIP "RPL user flags" (8 on the HP48, 16 on XO-CHIP)
+#define PATTERN_SIZE 16                 // XO-CHIP audio pattern, 128 one-bit samples
+#define DEFAULT_PITCH 64                // Fx3A value playing the pattern at 4000 samples per second
+#define CODE_PAGE_SIZE 64
+#define NUM_CODE_PAGES (MEM_SIZE / CODE_PAGE_SIZE)
+#define DECODE_CACHE_SIZE 0x1000        // Bytes of memory covered by the decode cache, code above runs uncached
+
+// The machine being emulated, decides the memory size
+typedef enum {
+    MACHINE_CHIP8,
+    MACHINE_SCHIP,
+    MACHINE_XOCHIP
+} Machine;
+
+// Every instruction the interpreter knows, the result of decoding an opcode
+typedef enum {
+    OP_UNDECODED = 0,   // Empty decode cache slot
+    OP_NOP,             // Unknown opcodes are ignored
+    OP_CLS,             // 00E0
+    OP_RET,             // 00EE
+    OP_JP,              // 1nnn
+    OP_CALL,            // 2nnn
+    OP_SE_VX_NN,        // 3xnn
+    OP_SNE_VX_NN,       // 4xnn
+    OP_SE_VX_VY,        // 5xy0
+    OP_LD_VX_NN,        // 6xnn
+    OP_ADD_VX_NN,       // 7xnn
+    OP_LD_VX_VY,        // 8xy0
+    OP_OR,              // 8xy1
+    OP_AND,             // 8xy2
+    OP_XOR,             // 8xy3
+    OP_ADD_VX_VY,       // 8xy4
+    OP_SUB,             // 8xy5
+    OP_SHR,             // 8xy6
+    OP_SUBN,            // 8xy7
+    OP_SHL,             // 8xyE
+    OP_SNE_VX_VY,       // 9xy0
+    OP_LD_I,            // Annn
+    OP_JP_V0,           // Bnnn
+    OP_RND,             // Cxnn
+    OP_DRW,             // Dxyn
+    OP_SKP,             // Ex9E
+    OP_SKNP,            // ExA1
+    OP_LD_VX_DT,        // Fx07
+    OP_LD_VX_K,         // Fx0A
+    OP_LD_DT_VX,        // Fx15
+    OP_LD_ST_VX,        // Fx18
+    OP_ADD_I_VX,        // Fx1E
+    OP_LD_F_VX,         // Fx29
+    OP_LD_B_VX,         // Fx33
+    OP_LD_I_VX,         // Fx55
+    OP_LD_VX_I,         // Fx65
+    OP_SCD,             // 00Cn, SUPER-CHIP
+    OP_SCU,             // 00Dn, XO-CHIP
+    OP_SCR,             // 00FB, SUPER-CHIP
+    OP_SCL,             // 00FC, SUPER-CHIP
+    OP_EXIT,            // 00FD, SUPER-CHIP
+    OP_LOW,             // 00FE, SUPER-CHIP
+    OP_HIGH,            // 00FF, SUPER-CHIP
+    OP_SAVE_VX_VY,      // 5xy2, XO-CHIP
+    OP_LOAD_VX_VY,      // 5xy3, XO-CHIP
+    OP_LD_I_LONG,       // F000 nnnn, XO-CHIP
+    OP_PLANE,           // Fn01, XO-CHIP
+    OP_LD_HF_VX,        // Fx30, SUPER-CHIP
+    OP_LD_R_VX,         // Fx75, SUPER-CHIP
+    OP_LD_VX_R,         // Fx85, SUPER-CHIP
+    OP_AUDIO,           // F002, XO-CHIP
+    OP_PITCH,           // Fx3A, XO-CHIP
+    OP_COUNT
+} Operation;
+
+// Where Fx55 / Fx65 leave I
+typedef enum {
+    MEMORY_UNCHANGED,   // SUPER-CHIP 1.1
+    MEMORY_PLUS_X,      // CHIP-48
+    MEMORY_PLUS_X_1     // COSMAC VIP, XO-CHIP
+} MemoryQuirk;
+
+// Behaviours that differ between interpreters of the same instructions
+typedef struct {
+    uint8_t vf_reset;       // 8xy1 / 8xy2 / 8xy3 clear VF
+    uint8_t memory;         // MemoryQuirk
+    uint8_t display_wait;   // Dxyn waits for the next 60 Hz tick, at most one sprite per frame
+    uint8_t wrap;           // Sprites wrap around the screen edges instead of being clipped
+    uint8_t shift_vy;       // 8xy6 / 8xyE shift Vy into Vx instead of shifting Vx
+    uint8_t jump_v0;        // Bnnn jumps to nnn + V0 instead of xnn + Vx
+    uint8_t scroll_half;    // Scrolling moves high resolution pixels even in low resolution
+} Quirks;
+
+/*
+ * Named quirk profiles. Each one gets its own copy of the quirk-dependent
+ * handlers (src/ops.inc) with the quirks compiled in.
+ * X(id, name, description, vf_reset, memory, display_wait, wrap, shift_vy, jump_v0, scroll_half)
+ */
+#define QUIRK_PROFILES(X) \
+    X(QUIRKS_VIP,    vip,    "COSMAC VIP",      1, MEMORY_PLUS_X_1,  1, 0, 1, 1, 0) \
+    X(QUIRKS_CHIP48, chip48, "CHIP-48",         0, MEMORY_PLUS_X,    0, 0, 0, 0, 0) \
+    X(QUIRKS_SCHIP,  schip,  "SUPER-CHIP 1.1",  0, MEMORY_UNCHANGED, 0, 0, 0, 0, 1) \
+    X(QUIRKS_XOCHIP, xochip, "XO-CHIP",         0, MEMORY_PLUS_X_1,  0, 1, 1, 1, 0)
+
+typedef enum {
+#define QUIRK_ID(id, ...) id,
+    QUIRK_PROFILES(QUIRK_ID)
+#undef QUIRK_ID
+    QUIRKS_COUNT
+} QuirkProfile;
+
+extern const Quirks quirk_profiles[QUIRKS_COUNT];
+
+#ifdef CHIP8_PROFILE
+struct Profile;
+#endif
+
+// An opcode with its operands already extracted (8 bytes)
+typedef struct {
+    uint8_t op;     // Operation
+    uint8_t x;      // second nibble
+    uint8_t y;      // third nibble
+    uint8_t n;      // fourth nibble
+    uint8_t nn;     // second byte
+    uint16_t nnn;   // second, third, and fourth nibbles
+} DecodedOp;
 
 typedef struct {
     uint8_t memory[MEM_SIZE];               // Create 4Kb or 4096 bytes of RAM
@@ -23,20 +153,99 @@ typedef struct {
     uint8_t v[NUM_REGS];                    // 16 one byte general purpose registers (V0 - VF)
     uint8_t delay_timer;                    // 60 Hz
     uint8_t sound_timer;                    // Something something sound
-    uint8_t framebuffer[FRAMEBUFFER_SIZE];  // 64 * 32 pixels display
+    // One bit per pixel, each row is FRAMEBUFFER_WORDS words with bit 63 of the first word at x = 0
+    uint64_t framebuffer[NUM_PLANES][FRAMEBUFFER_HEIGHT][FRAMEBUFFER_WORDS];
+    uint64_t dirty_rows;                    // Bit per framebuffer row changed since the display last drew it
+    uint8_t hires;                          // 128x64 instead of 64x32 (00FF / 00FE)
+    uint8_t planes;                         // Bit-planes drawn to and cleared (Fn01), 1 unless XO-CHIP changes it
+    uint8_t flags[NUM_FLAGS];               // Fx75 / Fx85 storage
+    uint8_t pattern[PATTERN_SIZE];          // F002 audio pattern, played while the sound timer runs
+    uint8_t pitch;                          // Fx3A playback rate of the pattern
+    uint8_t pattern_set;                    // F002 ran, the buzzer plays the pattern instead of a tone
+    uint32_t effects;                       // Bumped by every memory write and draw
     uint8_t keypad[NUM_KEYS];               // Array to represent the 16 keys available
-    uint8_t original_mode;                  // Flag to determine whether we use a CHIP-8 or SUPER-CHIP
+    uint8_t quirks;                         // QuirkProfile, set with set_quirks()
+    uint8_t vblank;                         // Set by tick_timers(), Dxyn waits for it with the display wait quirk
+    uint8_t machine;                        // Machine, set with set_machine()
+    uint16_t memory_mask;                   // Memory size - 1, addresses built from I wrap around
+    uint64_t rng_state;                     // xorshift64* state for Cxnn, never zero
+    DecodedOp decode_cache[DECODE_CACHE_SIZE / 2]; // One pre-decoded instruction per even address
+    uint32_t page_generation[NUM_CODE_PAGES]; // Bumped whenever a page of memory is written
+#ifdef CHIP8_PROFILE
+    struct Profile* profile;                // Instrumentation (see profile.h), NULL when off
+#endif
 } CPU;
 
-static const uint8_t keymap[NUM_KEYS] = {
-    SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4,
-    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_R,
-    SDL_SCANCODE_A, SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_F,
-    SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_C, SDL_SCANCODE_V
-};
+// Returns 1 if the pixel at (x, y) is on in the first plane
+static inline uint8_t get_pixel(const CPU* cpu, int x, int y) {
+    return (cpu->framebuffer[0][y][x >> 6] >> (63 - (x & 63))) & 1;
+}
+
+// Size of the active display, 64x32 or 128x64
+static inline uint32_t screen_width(const CPU* cpu) {
+    return LORES_WIDTH << cpu->hires;
+}
+
+static inline uint32_t screen_height(const CPU* cpu) {
+    return LORES_HEIGHT << cpu->hires;
+}
+
+// The keypad as one bit per key, key 0 in bit 0
+static inline uint16_t keypad_mask(const CPU* cpu) {
+    uint16_t mask = 0;
+    for (int i = 0; i < NUM_KEYS; i++) {
+        mask |= (cpu->keypad[i] ? 1 : 0) << i;
+    }
+    return mask;
+}
+
+static inline void set_keypad_mask(CPU* cpu, uint16_t mask) {
+    for (int i = 0; i < NUM_KEYS; i++) {
+        cpu->keypad[i] = (mask >> i) & 1;
+    }
+}
+
+static inline uint32_t memory_size(const CPU* cpu) {
+    return (uint32_t)cpu->memory_mask + 1;
+}
+
+/*
+ * Bytes a skip instruction jumps over when the next instruction is at `pc`.
+ * On XO-CHIP, F000 nnnn is four bytes long and is always skipped as a whole.
+ */
+static inline uint16_t skip_size(const CPU* cpu, uint16_t pc) {
+    return cpu->machine == MACHINE_XOCHIP && cpu->memory[pc] == 0xF0
+        && cpu->memory[(uint16_t)(pc + 1)] == 0x00 ? 4 : 2;
+}
+
+typedef void (*OpHandler)(CPU* cpu, const DecodedOp* op);
+
+// Handler for each Operation per quirk profile, used by step() and the other backends
+extern const OpHandler op_handlers[QUIRKS_COUNT][OP_COUNT];
 
 int initialize_cpu(CPU* cpu);
-void handle_input(CPU* cpu, SDL_KeyboardEvent event);
+
+// Selects the machine to emulate, call before load_rom(). Drops the decoded instructions if it changes.
+void set_machine(CPU* cpu, Machine machine);
+
+// Returns 0 and sets `machine` if `name` is "chip8", "schip" or "xochip"
+int parse_machine(const char* name, Machine* machine);
+
+// Selects the quirk profile, from then on the CPU runs that profile's handlers
+void set_quirks(CPU* cpu, QuirkProfile quirks);
+
+// Returns 0 and sets `quirks` if `name` is "vip", "chip48", "schip" or "xochip"
+int parse_quirks(const char* name, QuirkProfile* quirks);
+
+// Short name ("vip") and description ("COSMAC VIP") of a profile
+const char* quirks_name(QuirkProfile quirks);
+const char* quirks_description(QuirkProfile quirks);
+
+// Profile used when none is given: SUPER-CHIP 1.1 for CHIP-8 and SUPER-CHIP, XO-CHIP for XO-CHIP
+QuirkProfile default_quirks(Machine machine);
+
+// Seeds the random number generator used by Cxnn, the same seed gives the same numbers
+void seed_cpu(CPU* cpu, uint64_t seed);
 
 /*
  * Returns a 16-bit opcode combining two consecutive bytes from memory.
@@ -47,16 +256,66 @@ uint16_t fetch(CPU* cpu);
 
 
 /*
- * Decodes and executes the given opcode.
+ * Splits an opcode into its operation and operands.
  * Extracts:
  * X (second nibble),
  * Y (third nibble),
  * N (fourth nibble),
  * NN (third and fourth nibbles),
  * and NNN (second, third, and fourth nibbles)
+ * The XO-CHIP instructions (00Dn, 5xy2, 5xy3, F000, Fn01, F002, Fx3A)
+ * only exist on MACHINE_XOCHIP, elsewhere 5xyN is 5xy0 and the rest do nothing.
+ */
+DecodedOp decode(uint16_t opcode, Machine machine);
+
+/*
+ * Decodes and executes the given opcode.
  */
 void execute(CPU* cpu, uint16_t opcode);
 
+/*
+ * Runs the instruction at PC, like execute(fetch(cpu)), but reuses the
+ * decoded instruction from decode_cache when it is still valid.
+ */
+void step(CPU* cpu);
+
+/*
+ * Forgets the decoded instructions covering [address, address + length)
+ * and bumps the generation of the code pages involved.
+ * Anything that writes to memory must call this, otherwise step()
+ * and translated blocks keep running the old code.
+ */
+void invalidate_decode_cache(CPU* cpu, uint16_t address, uint16_t length);
+
+/*
+ * Decrements the delay and sound timers.
+ * Must be called at 60 Hz (once per frame).
+ */
+void tick_timers(CPU* cpu);
+
+/*
+ * Runs a batch of `count` instructions back to back.
+ * The caller decides how often to call it, so this works
+ * with or without SDL.
+ */
+void run_instructions(CPU* cpu, uint32_t count);
+
+/*
+ * run_instructions() that stops in front of the first instruction whose
+ * address has its bit set in `traps` (MEM_SIZE / 8 bytes, bit address & 7
+ * of byte address >> 3). Returns the number of instructions run.
+ */
+uint32_t run_until_trap(CPU* cpu, uint32_t count, const uint8_t* traps);
+
 int load_rom(CPU* cpu, const char* filename);
 
+// load_rom() from a buffer
+int load_rom_data(CPU* cpu, const uint8_t* data, size_t size);
+
+/*
+ * Compares the architectural state of two CPUs (everything except caches).
+ * Prints each difference to `out` if it is not NULL and returns how many were found.
+ */
+int cpu_diff(const CPU* a, const CPU* b, FILE* out);
+
 #endif
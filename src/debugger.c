@@ -0,0 +1,773 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "debugger.h"
+#include "analysis.h"
+#include "disasm.h"
+#include "scheduler.h"
+
+#define DISASSEMBLY_BEFORE 4        // Instructions shown above PC
+#define DISASSEMBLY_AFTER 6         // and below it
+#define LIST_LENGTH 16              // Instructions printed by "list"
+#define DUMP_LENGTH 64              // Bytes printed by "x"
+#define MAX_COMMAND 256
+
+static const struct {
+    const char* text;
+    Comparison comparison;
+} comparisons[] = {
+    // Two-character operators first, "<" is a prefix of "<="
+    {"==", COMPARE_EQ}, {"!=", COMPARE_NE}, {"<=", COMPARE_LE},
+    {">=", COMPARE_GE}, {"<", COMPARE_LT}, {">", COMPARE_GT},
+};
+
+static inline int test_bit(const uint8_t* bits, uint32_t address) {
+    return bits[address >> 3] >> (address & 7) & 1;
+}
+
+static inline void set_bit(uint8_t* bits, uint32_t address, int value) {
+    if (value) {
+        bits[address >> 3] |= 1 << (address & 7);
+    } else {
+        bits[address >> 3] &= ~(1 << (address & 7));
+    }
+}
+
+static inline uint16_t opcode_at(const CPU* cpu, uint32_t address) {
+    return cpu->memory[address & cpu->memory_mask] << 8 | cpu->memory[(address + 1) & cpu->memory_mask];
+}
+
+// Recomputes the trap bits of addresses first to last
+static void update_traps(Debugger* debugger, uint32_t first, uint32_t last) {
+    for (uint32_t byte = first >> 3; byte <= last >> 3; byte++) {
+        uint8_t bits = debugger->breakpoint_bits[byte];
+        if (debugger->watchpoint_count > 0) {
+            bits |= debugger->store_bits[byte];
+        }
+        if (debugger->step_target >= 0 && (uint32_t)debugger->step_target >> 3 == byte) {
+            bits |= 1 << (debugger->step_target & 7);
+        }
+        debugger->traps[byte] = bits;
+    }
+}
+
+// Bytes written by the instruction at `address`, starting at I: 0 if it isn't a store
+static uint16_t store_length(const CPU* cpu, uint32_t address) {
+    DecodedOp d = decode(opcode_at(cpu, address), cpu->machine);
+    switch (d.op) {
+        case OP_LD_B_VX:
+            return 3;
+        case OP_LD_I_VX:
+            return d.x + 1;
+        case OP_SAVE_VX_VY:
+            return (d.x <= d.y ? d.y - d.x : d.x - d.y) + 1;
+        default:
+            return 0;
+    }
+}
+
+// Marks the stores among the instructions starting at `count` addresses from `address`
+static void find_stores(Debugger* debugger, const CPU* cpu, uint32_t address, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t a = (address + i) & cpu->memory_mask;
+        set_bit(debugger->store_bits, a, store_length(cpu, a) > 0);
+        update_traps(debugger, a, a);
+    }
+}
+
+static void clear_step(Debugger* debugger) {
+    int32_t target = debugger->step_target;
+    if (target >= 0) {
+        debugger->step_target = -1;
+        update_traps(debugger, target, target);
+    }
+}
+
+static void set_step(Debugger* debugger, uint16_t target, int8_t depth) {
+    clear_step(debugger);
+    debugger->step_target = target;
+    debugger->step_depth = depth;
+    update_traps(debugger, target, target);
+}
+
+void initialize_debugger(Debugger* debugger, const uint8_t* address_flags) {
+    memset(debugger, 0, sizeof(*debugger));
+    debugger->step_target = -1;
+    debugger->address_flags = address_flags;
+}
+
+static Breakpoint* find_breakpoint(Debugger* debugger, uint16_t address) {
+    for (uint32_t i = 0; i < debugger->breakpoint_count; i++) {
+        if (debugger->breakpoints[i].address == address) {
+            return &debugger->breakpoints[i];
+        }
+    }
+    return NULL;
+}
+
+static int parse_operand(const char* name, size_t length, uint8_t* operand) {
+    if (length == 2 && toupper((unsigned char)name[0]) == 'V' && isxdigit((unsigned char)name[1])) {
+        char digit[2] = { name[1], '\0' };
+        *operand = (uint8_t)strtoul(digit, NULL, 16);
+    } else if (length == 1 && toupper((unsigned char)name[0]) == 'I') {
+        *operand = OPERAND_I;
+    } else if (length == 2 && strncasecmp(name, "DT", 2) == 0) {
+        *operand = OPERAND_DT;
+    } else if (length == 2 && strncasecmp(name, "ST", 2) == 0) {
+        *operand = OPERAND_ST;
+    } else if (length == 2 && strncasecmp(name, "SP", 2) == 0) {
+        *operand = OPERAND_SP;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// "V3 == 5", "I >= 0x300", "SP>1"
+static int parse_condition(const char* text, Breakpoint* breakpoint) {
+    const char* p = text;
+    while (isspace((unsigned char)*p)) p++;
+    size_t length = 0;
+    while (isalnum((unsigned char)p[length])) length++;
+    if (parse_operand(p, length, &breakpoint->operand) < 0) {
+        return -1;
+    }
+    p += length;
+    while (isspace((unsigned char)*p)) p++;
+
+    size_t i = 0;
+    while (i < sizeof(comparisons) / sizeof(comparisons[0])
+           && strncmp(p, comparisons[i].text, strlen(comparisons[i].text)) != 0) {
+        i++;
+    }
+    if (i == sizeof(comparisons) / sizeof(comparisons[0])) {
+        return -1;
+    }
+    breakpoint->comparison = comparisons[i].comparison;
+    p += strlen(comparisons[i].text);
+
+    char* end;
+    breakpoint->value = (int32_t)strtol(p, &end, 0);
+    if (end == p) {
+        return -1;
+    }
+    while (isspace((unsigned char)*end)) end++;
+    return *end == '\0' ? 0 : -1;
+}
+
+static int32_t operand_value(const CPU* cpu, uint8_t operand) {
+    switch (operand) {
+        case OPERAND_I:
+            return cpu->I;
+        case OPERAND_DT:
+            return cpu->delay_timer;
+        case OPERAND_ST:
+            return cpu->sound_timer;
+        case OPERAND_SP:
+            return cpu->SP;
+        default:
+            return cpu->v[operand];
+    }
+}
+
+static int condition_holds(const Breakpoint* breakpoint, const CPU* cpu) {
+    int32_t value = operand_value(cpu, breakpoint->operand);
+    switch (breakpoint->comparison) {
+        case COMPARE_EQ: return value == breakpoint->value;
+        case COMPARE_NE: return value != breakpoint->value;
+        case COMPARE_LT: return value < breakpoint->value;
+        case COMPARE_LE: return value <= breakpoint->value;
+        case COMPARE_GT: return value > breakpoint->value;
+        default:         return value >= breakpoint->value;
+    }
+}
+
+int add_breakpoint(Debugger* debugger, uint16_t address, const char* condition) {
+    Breakpoint breakpoint = { .address = address };
+    if (condition != NULL) {
+        if (parse_condition(condition, &breakpoint) < 0) {
+            return -1;
+        }
+        breakpoint.conditional = 1;
+    }
+
+    Breakpoint* existing = find_breakpoint(debugger, address);
+    if (existing != NULL) {
+        *existing = breakpoint;
+        return 0;
+    }
+    if (debugger->breakpoint_count == MAX_BREAKPOINTS) {
+        return -1;
+    }
+
+    debugger->breakpoints[debugger->breakpoint_count++] = breakpoint;
+    set_bit(debugger->breakpoint_bits, address, 1);
+    update_traps(debugger, address, address);
+    return 0;
+}
+
+int remove_breakpoint(Debugger* debugger, uint16_t address) {
+    Breakpoint* breakpoint = find_breakpoint(debugger, address);
+    if (breakpoint == NULL) {
+        return -1;
+    }
+
+    *breakpoint = debugger->breakpoints[--debugger->breakpoint_count];
+    set_bit(debugger->breakpoint_bits, address, 0);
+    update_traps(debugger, address, address);
+    return 0;
+}
+
+int add_watchpoint(Debugger* debugger, const CPU* cpu, uint16_t address, uint16_t length) {
+    if (length == 0 || length > memory_size(cpu) || debugger->watchpoint_count == MAX_WATCHPOINTS) {
+        return -1;
+    }
+
+    // Stores aren't tracked while nothing is watched, memory may have changed since
+    if (debugger->watchpoint_count == 0) {
+        find_stores(debugger, cpu, 0, memory_size(cpu));
+    }
+
+    address &= cpu->memory_mask;
+    debugger->watchpoints[debugger->watchpoint_count++] = (Watchpoint){ address, length, 0 };
+    for (uint32_t i = 0; i < length; i++) {
+        set_bit(debugger->watched, (address + i) & cpu->memory_mask, 1);
+    }
+    update_traps(debugger, 0, MEM_SIZE - 1);
+    return 0;
+}
+
+int remove_watchpoint(Debugger* debugger, const CPU* cpu, uint16_t address) {
+    uint32_t i = 0;
+    while (i < debugger->watchpoint_count && debugger->watchpoints[i].address != address) {
+        i++;
+    }
+    if (i == debugger->watchpoint_count) {
+        return -1;
+    }
+    debugger->watchpoints[i] = debugger->watchpoints[--debugger->watchpoint_count];
+
+    // Overlapping watchpoints share bytes, so the rest are marked again
+    memset(debugger->watched, 0, sizeof(debugger->watched));
+    for (uint32_t w = 0; w < debugger->watchpoint_count; w++) {
+        const Watchpoint* watchpoint = &debugger->watchpoints[w];
+        for (uint32_t b = 0; b < watchpoint->length; b++) {
+            set_bit(debugger->watched, (watchpoint->address + b) & cpu->memory_mask, 1);
+        }
+    }
+    update_traps(debugger, 0, MEM_SIZE - 1);
+    return 0;
+}
+
+int debug_step_over(Debugger* debugger, const CPU* cpu) {
+    if (decode(opcode_at(cpu, cpu->PC), cpu->machine).op != OP_CALL) {
+        return 0;
+    }
+    set_step(debugger, cpu->PC + 2, cpu->SP);
+    return 1;
+}
+
+int debug_step_out(Debugger* debugger, const CPU* cpu) {
+    if (cpu->SP < 0) {
+        return -1;
+    }
+    set_step(debugger, cpu->stack[cpu->SP], cpu->SP - 1);
+    return 0;
+}
+
+// Decides whether to stop in front of the trapped instruction at PC
+static int should_stop(Debugger* debugger, const CPU* cpu) {
+    uint16_t pc = cpu->PC;
+    if (debugger->step_target == pc && cpu->SP == debugger->step_depth) {
+        debugger->stop = STOP_STEP;
+        debugger->stop_address = pc;
+        return 1;
+    }
+
+    if (test_bit(debugger->breakpoint_bits, pc)) {
+        Breakpoint* breakpoint = find_breakpoint(debugger, pc);
+        if (breakpoint != NULL && (!breakpoint->conditional || condition_holds(breakpoint, cpu))) {
+            breakpoint->hits++;
+            debugger->stop = STOP_BREAKPOINT;
+            debugger->stop_address = pc;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Runs the instruction at PC on its own and checks what it wrote against the watchpoints
+static void single_step(Debugger* debugger, CPU* cpu) {
+    uint16_t pc = cpu->PC;
+    uint16_t start = cpu->I & cpu->memory_mask;
+    uint16_t length = debugger->watchpoint_count > 0 ? store_length(cpu, pc) : 0;
+    for (uint32_t i = 0; i < length; i++) {
+        debugger->written_before[i] = cpu->memory[(start + i) & cpu->memory_mask];
+    }
+
+    step(cpu);
+    if (length == 0) {
+        return;
+    }
+
+    // The store may have turned something into a store, or one into something else
+    find_stores(debugger, cpu, (start - 1) & cpu->memory_mask, length + 1);
+
+    int watched = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        watched |= test_bit(debugger->watched, (start + i) & cpu->memory_mask);
+    }
+    if (!watched) {
+        return;
+    }
+
+    debugger->stop = STOP_WATCHPOINT;
+    debugger->stop_address = pc;
+    debugger->written_address = start;
+    debugger->written_length = length;
+    for (uint32_t w = 0; w < debugger->watchpoint_count; w++) {
+        Watchpoint* watchpoint = &debugger->watchpoints[w];
+        for (uint32_t i = 0; i < length; i++) {
+            if (((start + i - watchpoint->address) & cpu->memory_mask) < watchpoint->length) {
+                watchpoint->hits++;
+                break;
+            }
+        }
+    }
+}
+
+uint32_t debug_run(Debugger* debugger, CPU* cpu, uint32_t count, int resume) {
+    uint32_t ran = 0;
+    debugger->stop = STOP_NONE;
+
+    while (ran < count) {
+        if (!resume) {
+            ran += run_until_trap(cpu, count - ran, debugger->traps);
+            if (ran == count || should_stop(debugger, cpu)) {
+                break;
+            }
+        }
+        resume = 0;
+
+        single_step(debugger, cpu);
+        ran++;
+        if (debugger->stop != STOP_NONE) {
+            break;
+        }
+    }
+
+    // Hitting anything ends a step over / out, like in gdb
+    if (debugger->stop != STOP_NONE) {
+        clear_step(debugger);
+    }
+    return ran;
+}
+
+static const char* operand_name(uint8_t operand) {
+    static const char* const names[] = { "I", "DT", "ST", "SP" };
+    static const char* const registers[NUM_REGS] = {
+        "V0", "V1", "V2", "V3", "V4", "V5", "V6", "V7",
+        "V8", "V9", "VA", "VB", "VC", "VD", "VE", "VF"
+    };
+    return operand < NUM_REGS ? registers[operand] : names[operand - OPERAND_I];
+}
+
+static const char* comparison_text(uint8_t comparison) {
+    for (size_t i = 0; i < sizeof(comparisons) / sizeof(comparisons[0]); i++) {
+        if (comparisons[i].comparison == comparison) {
+            return comparisons[i].text;
+        }
+    }
+    return "?";
+}
+
+// Prints `count` instructions from `address` and returns the address after them
+static uint16_t print_disassembly(const Debugger* debugger, const CPU* cpu, uint16_t address, int count, FILE* out) {
+    for (int i = 0; i < count; i++) {
+        uint16_t masked = address & cpu->memory_mask;
+        if (debugger->address_flags != NULL && (debugger->address_flags[masked] & ADDRESS_FUNCTION)) {
+            fprintf(out, "sub_%03X:\n", masked);
+        }
+
+        char text[DISASM_MAX_TEXT];
+        int length = disassemble(cpu, address, text, sizeof(text));
+        fprintf(out, "%s%c %04X  %04X  %s\n", address == cpu->PC ? "=>" : "  ",
+                test_bit(debugger->breakpoint_bits, address) ? '*' : ' ',
+                address, opcode_at(cpu, address), text);
+        address += length;
+    }
+    return address;
+}
+
+static void print_memory(const CPU* cpu, uint16_t address, uint32_t length, FILE* out) {
+    for (uint32_t line = 0; line < length; line += 16) {
+        fprintf(out, "%04X ", (address + line) & cpu->memory_mask);
+        for (uint32_t i = line; i < length && i < line + 16; i++) {
+            fprintf(out, " %02X", cpu->memory[(address + i) & cpu->memory_mask]);
+        }
+        fputc('\n', out);
+    }
+}
+
+void debugger_show(const Debugger* debugger, const CPU* cpu, FILE* out) {
+    fprintf(out, "PC %04X  I %04X  SP %d  DT %02X  ST %02X  keys", cpu->PC, cpu->I, cpu->SP,
+            cpu->delay_timer, cpu->sound_timer);
+    uint16_t keys = keypad_mask(cpu);
+    for (int key = 0; key < NUM_KEYS; key++) {
+        if (keys >> key & 1) {
+            fprintf(out, " %X", key);
+        }
+    }
+    fprintf(out, "%s\n", keys ? "" : " -");
+
+    for (int i = 0; i < NUM_REGS; i++) {
+        fprintf(out, "V%X %02X%s", i, cpu->v[i], i % 8 == 7 ? "\n" : "  ");
+    }
+
+    fprintf(out, "stack");
+    for (int i = 0; i <= cpu->SP; i++) {
+        fprintf(out, " %04X", cpu->stack[i]);
+    }
+    fprintf(out, "%s\n", cpu->SP < 0 ? " -" : "");
+
+    uint16_t start = cpu->PC >= 2 * DISASSEMBLY_BEFORE ? cpu->PC - 2 * DISASSEMBLY_BEFORE : cpu->PC & 1;
+    print_disassembly(debugger, cpu, start, (cpu->PC - start) / 2 + DISASSEMBLY_AFTER + 1, out);
+
+    fprintf(out, "[I]\n");
+    print_memory(cpu, cpu->I, 16, out);
+}
+
+// The debugger's view of the frame loop
+typedef struct {
+    Debugger* debugger;
+    CPU* cpu;
+    Scheduler scheduler;
+    uint32_t budget;                // Of the current frame
+    uint32_t left;                  // Instructions the current frame still has to run
+    int in_frame;
+    DebuggerFrameHook hook;
+    void* context;
+    volatile sig_atomic_t* interrupted;
+    FILE* out;
+    uint16_t list_next;             // Where a repeated "list" continues
+} Session;
+
+/*
+ * Runs at most `instructions` instructions and `frames` frames (0 for no
+ * limit), until the debugger stops or SIGINT comes. Frames end exactly
+ * like in the normal loop, so a debugged run matches a plain one.
+ */
+static void advance(Session* session, uint64_t instructions, uint64_t frames) {
+    int resume = 1;
+    *session->interrupted = 0;
+    session->debugger->stop = STOP_NONE;
+
+    while (instructions > 0 && !*session->interrupted) {
+        if (!session->in_frame) {
+            session->budget = session->left = scheduler_frame_budget(&session->scheduler);
+            session->in_frame = 1;
+        }
+
+        if (session->left > 0) {
+            uint32_t chunk = session->left < instructions ? session->left : (uint32_t)instructions;
+            uint32_t ran = debug_run(session->debugger, session->cpu, chunk, resume);
+            resume = 0;
+            session->left -= ran;
+            instructions -= ran;
+            if (session->debugger->stop != STOP_NONE) {
+                break;
+            }
+        }
+
+        if (session->left == 0) {
+            tick_timers(session->cpu);
+            scheduler_frame_done(&session->scheduler, session->budget);
+            session->in_frame = 0;
+            if (session->hook != NULL) {
+                session->hook(session->context, session->cpu, session->scheduler.frames);
+            }
+            if (frames > 0 && --frames == 0) {
+                break;
+            }
+        }
+    }
+}
+
+// Why the CPU stopped, then where it is
+static void report_stop(Session* session) {
+    const Debugger* debugger = session->debugger;
+    const CPU* cpu = session->cpu;
+    FILE* out = session->out;
+
+    if (debugger->stop == STOP_BREAKPOINT) {
+        const Breakpoint* breakpoint = find_breakpoint(session->debugger, debugger->stop_address);
+        fprintf(out, "breakpoint %04X, hits %llu\n", debugger->stop_address,
+                (unsigned long long)(breakpoint != NULL ? breakpoint->hits : 0));
+    } else if (debugger->stop == STOP_WATCHPOINT) {
+        fprintf(out, "watchpoint: %04X wrote", debugger->stop_address);
+        for (uint32_t i = 0; i < debugger->written_length; i++) {
+            uint16_t address = (debugger->written_address + i) & cpu->memory_mask;
+            if (test_bit(debugger->watched, address)) {
+                fprintf(out, " %04X: %02X -> %02X", address, debugger->written_before[i], cpu->memory[address]);
+            }
+        }
+        fputc('\n', out);
+    } else if (*session->interrupted) {
+        fprintf(out, "interrupted\n");
+        *session->interrupted = 0;
+    }
+
+    fprintf(out, "frame %llu, instruction %u of %u\n", (unsigned long long)session->scheduler.frames,
+            session->in_frame ? session->budget - session->left : 0,
+            session->in_frame ? session->budget : frame_budget(session->scheduler.clock_speed, session->scheduler.frames));
+    debugger_show(debugger, cpu, out);
+    session->list_next = cpu->PC;
+}
+
+static void print_breakpoints(const Debugger* debugger, FILE* out) {
+    for (uint32_t i = 0; i < debugger->breakpoint_count; i++) {
+        const Breakpoint* breakpoint = &debugger->breakpoints[i];
+        fprintf(out, "breakpoint %04X", breakpoint->address);
+        if (breakpoint->conditional) {
+            fprintf(out, " if %s %s %d", operand_name(breakpoint->operand),
+                    comparison_text(breakpoint->comparison), breakpoint->value);
+        }
+        fprintf(out, ", hits %llu\n", (unsigned long long)breakpoint->hits);
+    }
+    for (uint32_t i = 0; i < debugger->watchpoint_count; i++) {
+        const Watchpoint* watchpoint = &debugger->watchpoints[i];
+        fprintf(out, "watchpoint %04X, %u bytes, hits %llu\n", watchpoint->address, watchpoint->length,
+                (unsigned long long)watchpoint->hits);
+    }
+    if (debugger->breakpoint_count == 0 && debugger->watchpoint_count == 0) {
+        fprintf(out, "no breakpoints or watchpoints\n");
+    }
+}
+
+static void print_screen(const CPU* cpu, FILE* out) {
+    for (uint32_t y = 0; y < screen_height(cpu); y++) {
+        for (uint32_t x = 0; x < screen_width(cpu); x++) {
+            int on = 0;
+            for (int plane = 0; plane < NUM_PLANES; plane++) {
+                on |= cpu->framebuffer[plane][y][x >> 6] >> (63 - (x & 63)) & 1;
+            }
+            fputc(on ? '#' : '.', out);
+        }
+        fputc('\n', out);
+    }
+}
+
+static void print_help(FILE* out) {
+    fprintf(out,
+            "step, s [N]            run N instructions (default 1)\n"
+            "next, n                step over a call\n"
+            "out, o                 run until the current subroutine returns\n"
+            "continue, c [FRAMES]   run until something stops it or FRAMES frames end\n"
+            "break, b ADDR [if COND]  break at ADDR, COND is like V3 == 5 (V0-VF, I, DT, ST, SP)\n"
+            "watch, w ADDR [LENGTH] stop after a write to LENGTH bytes from ADDR (default 1)\n"
+            "delete, d [ADDR]       remove the breakpoint and watchpoint at ADDR, or all of them\n"
+            "info, i                list breakpoints and watchpoints\n"
+            "regs, r                show registers, code around PC and memory at I\n"
+            "list, l [ADDR]         disassemble from ADDR (default PC), again to continue\n"
+            "x ADDR [LENGTH]        show memory (default 64 bytes)\n"
+            "key, k KEY [0|1]       press or release a key (toggles without a value)\n"
+            "screen                 print the display\n"
+            "quit, q                exit\n"
+            "Addresses and keys are hex, other numbers decimal unless they start with 0x.\n"
+            "An empty line repeats the last command.\n");
+}
+
+// Splits off the next word of `*cursor`, NULL at the end of the line
+static char* next_word(char** cursor) {
+    char* p = *cursor;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0') {
+        *cursor = p;
+        return NULL;
+    }
+    char* word = p;
+    while (*p != '\0' && !isspace((unsigned char)*p)) p++;
+    if (*p != '\0') {
+        *p++ = '\0';
+    }
+    *cursor = p;
+    return word;
+}
+
+static int parse_hex(const char* text, uint32_t max, uint32_t* value) {
+    char* end;
+    unsigned long parsed = strtoul(text, &end, 16);
+    if (end == text || *end != '\0' || parsed > max) {
+        return -1;
+    }
+    *value = (uint32_t)parsed;
+    return 0;
+}
+
+static int parse_count(const char* text, uint64_t* value) {
+    char* end;
+    *value = strtoull(text, &end, 0);
+    return end != text && *end == '\0' ? 0 : -1;
+}
+
+static int is_command(const char* word, const char* name, const char* alias) {
+    return strcmp(word, name) == 0 || (alias != NULL && strcmp(word, alias) == 0);
+}
+
+// Runs one command line, returns 1 to quit
+static int run_command(Session* session, char* line) {
+    Debugger* debugger = session->debugger;
+    CPU* cpu = session->cpu;
+    FILE* out = session->out;
+
+    char* cursor = line;
+    char* command = next_word(&cursor);
+    char* argument = next_word(&cursor);
+    uint32_t address, value;
+    uint64_t count;
+
+    if (command == NULL) {
+        return 0;
+    } else if (is_command(command, "quit", "q")) {
+        return 1;
+    } else if (is_command(command, "help", "h")) {
+        print_help(out);
+    } else if (is_command(command, "step", "s")) {
+        count = 1;
+        if (argument != NULL && (parse_count(argument, &count) < 0 || count == 0)) {
+            fprintf(out, "Usage: step [N]\n");
+            return 0;
+        }
+        advance(session, count, 0);
+        report_stop(session);
+    } else if (is_command(command, "next", "n")) {
+        advance(session, debug_step_over(debugger, cpu) ? UINT64_MAX : 1, 0);
+        report_stop(session);
+    } else if (is_command(command, "out", "o")) {
+        if (debug_step_out(debugger, cpu) < 0) {
+            fprintf(out, "Not in a subroutine\n");
+            return 0;
+        }
+        advance(session, UINT64_MAX, 0);
+        report_stop(session);
+    } else if (is_command(command, "continue", "c")) {
+        count = 0;
+        if (argument != NULL && parse_count(argument, &count) < 0) {
+            fprintf(out, "Usage: continue [FRAMES]\n");
+            return 0;
+        }
+        advance(session, UINT64_MAX, count);
+        report_stop(session);
+    } else if (is_command(command, "break", "b")) {
+        char* keyword = next_word(&cursor);
+        if (argument == NULL || parse_hex(argument, 0xFFFF, &address) < 0
+            || (keyword != NULL && strcmp(keyword, "if") != 0)
+            || add_breakpoint(debugger, (uint16_t)address, keyword != NULL ? cursor : NULL) < 0) {
+            fprintf(out, "Usage: break ADDR [if V0-VF|I|DT|ST|SP ==|!=|<|<=|>|>= VALUE], at most %d\n",
+                    MAX_BREAKPOINTS);
+        }
+    } else if (is_command(command, "watch", "w")) {
+        char* length = next_word(&cursor);
+        count = 1;
+        if (argument == NULL || parse_hex(argument, 0xFFFF, &address) < 0
+            || (length != NULL && (parse_count(length, &count) < 0 || count > 0xFFFF))
+            || add_watchpoint(debugger, cpu, (uint16_t)address, (uint16_t)count) < 0) {
+            fprintf(out, "Usage: watch ADDR [LENGTH], at most %d\n", MAX_WATCHPOINTS);
+        }
+    } else if (is_command(command, "delete", "d")) {
+        if (argument == NULL) {
+            while (debugger->breakpoint_count > 0) {
+                remove_breakpoint(debugger, debugger->breakpoints[0].address);
+            }
+            while (debugger->watchpoint_count > 0) {
+                remove_watchpoint(debugger, cpu, debugger->watchpoints[0].address);
+            }
+            return 0;
+        }
+        if (parse_hex(argument, 0xFFFF, &address) < 0) {
+            fprintf(out, "Usage: delete [ADDR]\n");
+            return 0;
+        }
+        int breakpoint = remove_breakpoint(debugger, (uint16_t)address) == 0;
+        int watchpoint = remove_watchpoint(debugger, cpu, (uint16_t)address) == 0;
+        if (!breakpoint && !watchpoint) {
+            fprintf(out, "Nothing to delete at %04X\n", address);
+        }
+    } else if (is_command(command, "info", "i")) {
+        print_breakpoints(debugger, out);
+    } else if (is_command(command, "regs", "r")) {
+        debugger_show(debugger, cpu, out);
+    } else if (is_command(command, "list", "l")) {
+        if (argument != NULL && parse_hex(argument, 0xFFFF, &address) < 0) {
+            fprintf(out, "Usage: list [ADDR]\n");
+            return 0;
+        }
+        session->list_next = print_disassembly(debugger, cpu, argument != NULL ? (uint16_t)address : session->list_next,
+                                               LIST_LENGTH, out);
+    } else if (is_command(command, "x", NULL)) {
+        char* length = next_word(&cursor);
+        count = DUMP_LENGTH;
+        if (argument == NULL || parse_hex(argument, 0xFFFF, &address) < 0
+            || (length != NULL && (parse_count(length, &count) < 0 || count > memory_size(cpu)))) {
+            fprintf(out, "Usage: x ADDR [LENGTH]\n");
+            return 0;
+        }
+        print_memory(cpu, (uint16_t)address, (uint32_t)count, out);
+    } else if (is_command(command, "key", "k")) {
+        char* state = next_word(&cursor);
+        if (argument == NULL || parse_hex(argument, NUM_KEYS - 1, &value) < 0
+            || (state != NULL && strcmp(state, "0") != 0 && strcmp(state, "1") != 0)) {
+            fprintf(out, "Usage: key KEY [0|1]\n");
+            return 0;
+        }
+        cpu->keypad[value] = state != NULL ? state[0] == '1' : !cpu->keypad[value];
+        fprintf(out, "key %X %s\n", value, cpu->keypad[value] ? "down" : "up");
+    } else if (is_command(command, "screen", NULL)) {
+        print_screen(cpu, out);
+    } else {
+        fprintf(out, "Unknown command '%s', try help\n", command);
+    }
+    return 0;
+}
+
+int run_debugger(Debugger* debugger, CPU* cpu, uint32_t clock_speed, DebuggerFrameHook hook, void* context,
+                 volatile sig_atomic_t* interrupted, FILE* in, FILE* out) {
+    Session session = {
+        .debugger = debugger,
+        .cpu = cpu,
+        .hook = hook,
+        .context = context,
+        .interrupted = interrupted,
+        .out = out,
+    };
+    scheduler_init(&session.scheduler, clock_speed);
+    report_stop(&session);
+
+    char line[MAX_COMMAND];
+    char last[MAX_COMMAND] = "";
+    for (;;) {
+        fprintf(out, "(chip8) ");
+        fflush(out);
+        if (fgets(line, sizeof(line), in) == NULL) {
+            fputc('\n', out);
+            return ferror(in) ? -1 : 0;
+        }
+
+        // An empty line repeats the last command
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[strspn(line, " \t")] == '\0') {
+            strcpy(line, last);
+        } else {
+            strcpy(last, line);
+            // Repeating "list ADDR" goes on from where it stopped
+            if (strncmp(last, "l ", 2) == 0 || strncmp(last, "list ", 5) == 0) {
+                last[strcspn(last, " ")] = '\0';
+            }
+        }
+
+        if (run_command(&session, line)) {
+            return 0;
+        }
+    }
+}
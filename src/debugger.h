@@ -0,0 +1,129 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+
+#define MAX_BREAKPOINTS 64
+#define MAX_WATCHPOINTS 64
+#define TRAP_BYTES (MEM_SIZE / 8)       // One bit per address
+#define MAX_STORE 16                    // Most bytes one instruction writes (Fx55 / 5xy2)
+
+// What a conditional breakpoint compares, besides V0-VF (0-15)
+#define OPERAND_I 16
+#define OPERAND_DT 17
+#define OPERAND_ST 18
+#define OPERAND_SP 19
+
+typedef enum {
+    COMPARE_EQ,
+    COMPARE_NE,
+    COMPARE_LT,
+    COMPARE_LE,
+    COMPARE_GT,
+    COMPARE_GE
+} Comparison;
+
+typedef struct {
+    uint16_t address;
+    uint8_t conditional;            // Only stops when `operand comparison value` holds
+    uint8_t operand;
+    uint8_t comparison;             // Comparison
+    int32_t value;
+    uint64_t hits;                  // Times it stopped the CPU
+} Breakpoint;
+
+// Stops after an Fx33 / Fx55 / 5xy2 writes to any of `length` bytes from `address`
+typedef struct {
+    uint16_t address;
+    uint16_t length;
+    uint64_t hits;
+} Watchpoint;
+
+typedef enum {
+    STOP_NONE,                      // Ran everything it was asked to
+    STOP_BREAKPOINT,                // In front of stop_address
+    STOP_WATCHPOINT,                // The store at stop_address wrote to a watched byte
+    STOP_STEP                       // A step over / out got back to its caller
+} StopReason;
+
+/*
+ * Breakpoints cost nothing until they are hit: run_until_trap() tests one
+ * bit per instruction and only the addresses with a bit set come back here
+ * to have their conditions evaluated. While there are watchpoints, every
+ * instruction that writes through I is trapped too (and kept up to date
+ * when code is overwritten), so watched memory is checked only around
+ * actual stores.
+ */
+typedef struct {
+    uint8_t traps[TRAP_BYTES];              // breakpoint_bits | store_bits | the step target
+    uint8_t breakpoint_bits[TRAP_BYTES];
+    uint8_t store_bits[TRAP_BYTES];         // Fx33 / Fx55 / 5xy2, only used while watching
+    uint8_t watched[TRAP_BYTES];            // Bytes of memory covered by a watchpoint
+
+    Breakpoint breakpoints[MAX_BREAKPOINTS];
+    uint32_t breakpoint_count;
+    Watchpoint watchpoints[MAX_WATCHPOINTS];
+    uint32_t watchpoint_count;
+
+    // Step over / out: stop at step_target once SP is back to step_depth
+    int32_t step_target;                    // -1 when not stepping
+    int8_t step_depth;
+
+    // Why the last debug_run() stopped
+    StopReason stop;
+    uint16_t stop_address;
+    uint16_t written_address;               // STOP_WATCHPOINT: the bytes the store wrote
+    uint16_t written_length;
+    uint8_t written_before[MAX_STORE];
+
+    const uint8_t* address_flags;           // From --analyze (analysis.h) for labels, may be NULL
+} Debugger;
+
+// Called at the end of every frame, after the timers ticked
+typedef void (*DebuggerFrameHook)(void* context, const CPU* cpu, uint64_t frame);
+
+// `address_flags` may be NULL
+void initialize_debugger(Debugger* debugger, const uint8_t* address_flags);
+
+/*
+ * Breakpoint at `address`, replacing any that is already there.
+ * `condition` is NULL or looks like "V3 == 5" (V0-VF, I, DT, ST or SP and
+ * ==, !=, <, <=, > or >=). Returns -1 if it can't be parsed or there are too many.
+ */
+int add_breakpoint(Debugger* debugger, uint16_t address, const char* condition);
+int remove_breakpoint(Debugger* debugger, uint16_t address);
+int add_watchpoint(Debugger* debugger, const CPU* cpu, uint16_t address, uint16_t length);
+int remove_watchpoint(Debugger* debugger, const CPU* cpu, uint16_t address);
+
+/*
+ * Arm a step over the call at PC or out of the current subroutine, which
+ * the next debug_run() stops at. debug_step_over() returns 0 if PC isn't
+ * a call (a single step does it), debug_step_out() -1 outside a subroutine.
+ */
+int debug_step_over(Debugger* debugger, const CPU* cpu);
+int debug_step_out(Debugger* debugger, const CPU* cpu);
+
+/*
+ * Runs up to `count` instructions and returns how many ran. Stops early,
+ * with debugger->stop saying why, at a breakpoint whose condition holds,
+ * after a write to watched memory or when a step over / out is done. With
+ * `resume` the first instruction runs even if there is a breakpoint on it.
+ */
+uint32_t debug_run(Debugger* debugger, CPU* cpu, uint32_t count, int resume);
+
+// Registers, the disassembly around PC and the memory at I
+void debugger_show(const Debugger* debugger, const CPU* cpu, FILE* out);
+
+/*
+ * The text UI: reads commands from `in` until "quit" or the end of input
+ * and runs the CPU in frames of clock_speed / 60 instructions, ticking the
+ * timers between them. `interrupted` (set by SIGINT) stops a running
+ * command and is cleared again. Returns 0, or -1 if the input failed.
+ */
+int run_debugger(Debugger* debugger, CPU* cpu, uint32_t clock_speed, DebuggerFrameHook hook, void* context,
+                 volatile sig_atomic_t* interrupted, FILE* in, FILE* out);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include "disasm.h"
+
+int disassemble(const CPU* cpu, uint16_t address, char* out, size_t out_size) {
+    uint16_t mask = cpu->memory_mask;
+    uint16_t opcode = cpu->memory[address & mask] << 8 | cpu->memory[(address + 1) & mask];
+    DecodedOp d = decode(opcode, cpu->machine);
+    int x = d.x, y = d.y;
+
+    switch (d.op) {
+        case OP_CLS:        snprintf(out, out_size, "CLS"); break;
+        case OP_RET:        snprintf(out, out_size, "RET"); break;
+        case OP_JP:         snprintf(out, out_size, "JP 0x%03X", d.nnn); break;
+        case OP_CALL:       snprintf(out, out_size, "CALL 0x%03X", d.nnn); break;
+        case OP_SE_VX_NN:   snprintf(out, out_size, "SE V%X, 0x%02X", x, d.nn); break;
+        case OP_SNE_VX_NN:  snprintf(out, out_size, "SNE V%X, 0x%02X", x, d.nn); break;
+        case OP_SE_VX_VY:   snprintf(out, out_size, "SE V%X, V%X", x, y); break;
+        case OP_LD_VX_NN:   snprintf(out, out_size, "LD V%X, 0x%02X", x, d.nn); break;
+        case OP_ADD_VX_NN:  snprintf(out, out_size, "ADD V%X, 0x%02X", x, d.nn); break;
+        case OP_LD_VX_VY:   snprintf(out, out_size, "LD V%X, V%X", x, y); break;
+        case OP_OR:         snprintf(out, out_size, "OR V%X, V%X", x, y); break;
+        case OP_AND:        snprintf(out, out_size, "AND V%X, V%X", x, y); break;
+        case OP_XOR:        snprintf(out, out_size, "XOR V%X, V%X", x, y); break;
+        case OP_ADD_VX_VY:  snprintf(out, out_size, "ADD V%X, V%X", x, y); break;
+        case OP_SUB:        snprintf(out, out_size, "SUB V%X, V%X", x, y); break;
+        case OP_SHR:        snprintf(out, out_size, "SHR V%X, V%X", x, y); break;
+        case OP_SUBN:       snprintf(out, out_size, "SUBN V%X, V%X", x, y); break;
+        case OP_SHL:        snprintf(out, out_size, "SHL V%X, V%X", x, y); break;
+        case OP_SNE_VX_VY:  snprintf(out, out_size, "SNE V%X, V%X", x, y); break;
+        case OP_LD_I:       snprintf(out, out_size, "LD I, 0x%03X", d.nnn); break;
+        case OP_JP_V0:      snprintf(out, out_size, "JP V0, 0x%03X", d.nnn); break;
+        case OP_RND:        snprintf(out, out_size, "RND V%X, 0x%02X", x, d.nn); break;
+        case OP_DRW:        snprintf(out, out_size, "DRW V%X, V%X, %d", x, y, d.n); break;
+        case OP_SKP:        snprintf(out, out_size, "SKP V%X", x); break;
+        case OP_SKNP:       snprintf(out, out_size, "SKNP V%X", x); break;
+        case OP_LD_VX_DT:   snprintf(out, out_size, "LD V%X, DT", x); break;
+        case OP_LD_VX_K:    snprintf(out, out_size, "LD V%X, K", x); break;
+        case OP_LD_DT_VX:   snprintf(out, out_size, "LD DT, V%X", x); break;
+        case OP_LD_ST_VX:   snprintf(out, out_size, "LD ST, V%X", x); break;
+        case OP_ADD_I_VX:   snprintf(out, out_size, "ADD I, V%X", x); break;
+        case OP_LD_F_VX:    snprintf(out, out_size, "LD F, V%X", x); break;
+        case OP_LD_B_VX:    snprintf(out, out_size, "LD B, V%X", x); break;
+        case OP_LD_I_VX:    snprintf(out, out_size, "LD [I], V%X", x); break;
+        case OP_LD_VX_I:    snprintf(out, out_size, "LD V%X, [I]", x); break;
+        case OP_SCD:        snprintf(out, out_size, "SCD %d", d.n); break;
+        case OP_SCU:        snprintf(out, out_size, "SCU %d", d.n); break;
+        case OP_SCR:        snprintf(out, out_size, "SCR"); break;
+        case OP_SCL:        snprintf(out, out_size, "SCL"); break;
+        case OP_EXIT:       snprintf(out, out_size, "EXIT"); break;
+        case OP_LOW:        snprintf(out, out_size, "LOW"); break;
+        case OP_HIGH:       snprintf(out, out_size, "HIGH"); break;
+        case OP_SAVE_VX_VY: snprintf(out, out_size, "SAVE V%X - V%X", x, y); break;
+        case OP_LOAD_VX_VY: snprintf(out, out_size, "LOAD V%X - V%X", x, y); break;
+        case OP_PLANE:      snprintf(out, out_size, "PLANE %d", x); break;
+        case OP_AUDIO:      snprintf(out, out_size, "AUDIO"); break;
+        case OP_PITCH:      snprintf(out, out_size, "PITCH V%X", x); break;
+        case OP_LD_HF_VX:   snprintf(out, out_size, "LD HF, V%X", x); break;
+        case OP_LD_R_VX:    snprintf(out, out_size, "LD R, V%X", x); break;
+        case OP_LD_VX_R:    snprintf(out, out_size, "LD V%X, R", x); break;
+
+        case OP_LD_I_LONG: {
+            uint16_t value = cpu->memory[(address + 2) & mask] << 8 | cpu->memory[(address + 3) & mask];
+            snprintf(out, out_size, "LD I, 0x%04X", value);
+            return 4;
+        }
+
+        default:
+            snprintf(out, out_size, "DW 0x%04X", opcode);
+            break;
+    }
+
+    return 2;
+}
@@ -0,0 +1,18 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define DISASM_MAX_TEXT 24      // Longest text disassemble() writes, with the terminator
+
+/*
+ * Writes the instruction at `address` in `cpu`'s memory as text ("LD V0, 0x1F",
+ * "DRW V1, V2, 5") to `out` and returns its length in bytes: 4 for F000 nnnn
+ * on XO-CHIP, 2 otherwise. Opcodes that aren't instructions on the CPU's
+ * machine come out as "DW 0x1234". Addresses wrap around like the CPU's.
+ */
+int disassemble(const CPU* cpu, uint16_t address, char* out, size_t out_size);
+
+#endif
@@ -1,6 +1,14 @@
 #include "display.h"
 #include "cpu.h"
 
+// Colors for the XO-CHIP plane combinations past the first two
+static const uint32_t default_plane_colors[1 << NUM_PLANES] = {
+    0x000000FF, 0xFFFFFFFF, 0xAAAAAAFF, 0x555555FF,
+    0xFF0000FF, 0x00FF00FF, 0x0000FFFF, 0xFFFF00FF,
+    0x880000FF, 0x008800FF, 0x000088FF, 0x888800FF,
+    0xFF00FFFF, 0x00FFFFFF, 0x880088FF, 0x008888FF
+};
+
 int initialize_display(Display *display) {
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
@@ -20,41 +28,125 @@ int initialize_display(Display *display) {
         return -1;
     }
 
-    display->texture = SDL_CreateTexture(display->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+    display->texture = SDL_CreateTexture(display->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
 
     if (display->texture == NULL) {
         printf("Texture could not be created! SDL_Error: %s\n", SDL_GetError());
         return -1;
     }
 
-    display->pixels = (uint32_t*)calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(uint32_t));
+    display->kernel = select_expand_kernel(NULL);
+    memcpy(display->colors, default_plane_colors, sizeof(display->colors));
+    set_palette(display, (Palette){ DEFAULT_PALETTE_ON, DEFAULT_PALETTE_OFF });
+    display->phosphor_decay = 0;
+    memset(display->intensity, 0, sizeof(display->intensity));
+    display->fading_rows = 0;
+    display->hires = 0;
+    display->needs_redraw = 1;
 
-    if (display->pixels == NULL) {
-        printf("Pixels could not be initialized! Error\n");
-        return -1;
+    return 0;
+}
+
+// Converts row y of the framebuffer, `words` 64-pixel words wide
+static void convert_row(Display *display, const Frame *frame, int y, int words, uint32_t* out) {
+    uint64_t other_planes = 0;
+    for (int plane = 1; plane < NUM_PLANES; plane++) {
+        for (int w = 0; w < words; w++) {
+            other_planes |= frame->framebuffer[plane][y][w];
+        }
     }
 
-    return 0;
+    // A row keeps fading while any of its words does
+    int fading = 0;
+    for (int w = 0; w < words; w++) {
+        uint64_t bits = frame->framebuffer[0][y][w];
+        uint32_t* pixels = out + w * 64;
+
+        if (other_planes) {
+            uint64_t planes[NUM_PLANES];
+            for (int plane = 0; plane < NUM_PLANES; plane++) {
+                planes[plane] = frame->framebuffer[plane][y][w];
+            }
+            expand_row_planes(planes, NUM_PLANES, pixels, display->colors);
+        } else if (display->phosphor_decay) {
+            fading |= expand_row_phosphor(bits, &display->intensity[y][w * 64], pixels,
+                                          display->phosphor_ramp, display->phosphor_decay);
+        } else {
+            display->kernel->expand_row(bits, pixels, display->palette.on, display->palette.off);
+        }
+    }
+
+    // Plane colors don't fade, so a row drawn with them is done too
+    display->fading_rows = fading ? display->fading_rows | (1ull << y) : display->fading_rows & ~(1ull << y);
 }
 
-void update_display(Display *display, CPU *cpu) {
+void update_display(Display *display, const Frame *frame, uint64_t dirty_rows) {
+    uint64_t rows = dirty_rows | display->fading_rows;
 
-    // Convert our 1-bit framebuffer to 32-bit pixels
-    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
-        display->pixels[i] = cpu->framebuffer[i] ? 0xFFFFFFFF : 0x000000FF;
+    // Switching resolution shows a different part of the texture
+    if (frame->hires != display->hires) {
+        display->hires = frame->hires;
+        display->fading_rows = 0;
+        display->needs_redraw = 1;
     }
 
-    // Update texture with pixel data
-    SDL_UpdateTexture(display->texture, NULL, display->pixels, SCREEN_WIDTH * sizeof(uint32_t));
+    // Most frames of menus and puzzles don't draw anything, skip the upload and present
+    if (rows == 0 && !display->needs_redraw) {
+        return;
+    }
+
+    int width = LORES_WIDTH << frame->hires;
+    int height = LORES_HEIGHT << frame->hires;
+    uint64_t visible = height == 64 ? ~0ull : (1ull << height) - 1;
+
+    // The palette changed or the window was exposed, convert everything again
+    if (display->needs_redraw) {
+        rows = visible;
+    }
+    rows &= visible;
+
+    if (rows != 0) {
+        // Lock the band between the first and last rows that need converting
+        int first = __builtin_ctzll(rows);
+        int last = 63 - __builtin_clzll(rows);
+        SDL_Rect rect = { 0, first, width, last - first + 1 };
+
+        void* locked;
+        int pitch;
+        if (SDL_LockTexture(display->texture, &rect, &locked, &pitch) < 0) {
+            printf("Texture could not be locked! SDL_Error: %s\n", SDL_GetError());
+            return;
+        }
+
+        // Convert our 1-bit framebuffer to 32-bit pixels, every locked row must be written
+        for (int y = first; y <= last; y++) {
+            uint32_t* out = (uint32_t*)((uint8_t*)locked + (y - first) * pitch);
+            convert_row(display, frame, y, width / 64, out);
+        }
+
+        SDL_UnlockTexture(display->texture);
+    }
 
     // Clear renderer
     SDL_RenderClear(display->renderer);
 
-    // Copy texture to renderer
-    SDL_RenderCopy(display->renderer, display->texture, NULL, NULL);
+    // Copy the part of the texture in use to the renderer
+    SDL_Rect source = { 0, 0, width, height };
+    SDL_RenderCopy(display->renderer, display->texture, &source, NULL);
 
     // Update screen
     SDL_RenderPresent(display->renderer);
+    display->needs_redraw = 0;
+}
+
+void set_palette(Display *display, Palette palette) {
+    display->palette = palette;
+    display->colors[0] = palette.off;
+    display->colors[1] = palette.on;
+    build_phosphor_ramp(&palette, display->phosphor_ramp);
+
+    // Everything on screen has the old colors
+    display->needs_redraw = 1;
 }
 
 // NOTE: Do not confuse this function with clean_display
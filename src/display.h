@@ -9,16 +9,35 @@
 #include <SDL2/SDL.h>
 
 #include "cpu.h"
+#include "frames.h"
+#include "pixels.h"
 
 typedef struct {
     SDL_Window* window;
     SDL_Renderer* renderer;
     SDL_Texture* texture;
-    uint32_t* pixels;
+    const ExpandKernel* kernel;     // Framebuffer to RGBA conversion, picked at runtime
+    Palette palette;
+    uint32_t colors[1 << NUM_PLANES]; // XO-CHIP colors by plane bits, the first two are the palette
+    uint8_t phosphor_decay;         // Fraction of brightness (/256) kept each frame, 0 disables it
+    uint32_t phosphor_ramp[256];    // Palette colors by intensity
+    uint8_t intensity[FRAMEBUFFER_HEIGHT][FRAMEBUFFER_WIDTH];
+    uint64_t fading_rows;           // Rows with pixels still fading out
+    uint8_t hires;                  // Resolution of what is on screen
+    int needs_redraw;               // Redraw everything even if the framebuffer did not change
 } Display;
 
 int initialize_display(Display *display);
-void update_display(Display *display, CPU *cpu);
+/*
+ * Converts the rows of the frame marked in `dirty_rows` straight into the
+ * locked band of the streaming texture and presents it. Does nothing if no
+ * row changed (or is fading) since the last call.
+ * The texture is 128x64 and only the part the current resolution uses is
+ * stretched over the window. Rows with nothing on the XO-CHIP planes other
+ * than the first go through the fast 1-bit kernel.
+ */
+void update_display(Display *display, const Frame *frame, uint64_t dirty_rows);
+void set_palette(Display *display, Palette palette);
 void cleanup_display(Display *display);
 
 #endif
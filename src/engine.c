@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "engine.h"
+#include "error.h"
+#include "scheduler.h"
+
+static int run_instructions_runner(void* context, CPU* cpu, uint32_t count) {
+    (void)context;
+    run_instructions(cpu, count);
+    return 0;
+}
+
+static uint64_t run_instance(Worker* worker, uint32_t index) {
+    Engine* engine = worker->engine;
+    CPU* cpu = &engine->cpus[index];
+    uint64_t instructions = 0;
+
+    if (engine->keys != NULL) {
+        set_keypad_mask(cpu, engine->keys[index]);
+    }
+
+    for (uint32_t f = 0; f < engine->batch_frames; f++) {
+        uint32_t budget = frame_budget(engine->clock_speed, engine->frames[index]++);
+        if (engine->idle_skip) {
+            run_skipping_idle(cpu, budget, run_instructions_runner, NULL, &worker->idle);
+        } else {
+            run_instructions(cpu, budget);
+        }
+        tick_timers(cpu);
+        instructions += budget;
+    }
+
+    if (engine->observe != NULL) {
+        engine->observe(engine->observe_context, index, cpu);
+    }
+    return instructions;
+}
+
+// Claims the next chunk of `victim`'s range, returns 0 if there is none left
+static int claim_chunk(Worker* victim, uint32_t* first, uint32_t* last) {
+    uint32_t start = atomic_fetch_add_explicit(&victim->next, ENGINE_CHUNK, memory_order_relaxed);
+    if (start >= victim->end) {
+        return 0;
+    }
+
+    *first = start;
+    *last = start + ENGINE_CHUNK < victim->end ? start + ENGINE_CHUNK : victim->end;
+    return 1;
+}
+
+static void run_batch(Worker* worker) {
+    Engine* engine = worker->engine;
+    uint32_t first, last;
+    worker->instructions = 0;
+
+    // Own share first
+    while (claim_chunk(worker, &first, &last)) {
+        for (uint32_t i = first; i < last; i++) {
+            worker->instructions += run_instance(worker, i);
+        }
+    }
+
+    // Then help whoever still has work, starting with the next worker
+    for (uint32_t offset = 1; offset < engine->num_workers; offset++) {
+        Worker* victim = &engine->workers[(worker->id + offset) % engine->num_workers];
+        while (claim_chunk(victim, &first, &last)) {
+            worker->stolen++;
+            for (uint32_t i = first; i < last; i++) {
+                worker->instructions += run_instance(worker, i);
+            }
+        }
+    }
+}
+
+static void* worker_main(void* arg) {
+    Worker* worker = arg;
+    Engine* engine = worker->engine;
+
+    // The barriers are sized after all threads started, wait for them
+    pthread_mutex_lock(&engine->lock);
+    while (!engine->ready) {
+        pthread_cond_wait(&engine->ready_cond, &engine->lock);
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    while (1) {
+        pthread_barrier_wait(&engine->start);
+        if (engine->stopping) {
+            break;
+        }
+
+        run_batch(worker);
+        pthread_barrier_wait(&engine->done);
+    }
+
+    return NULL;
+}
+
+Engine* create_engine(const CPU* template, uint32_t count, uint64_t seed, uint32_t num_workers, uint32_t clock_speed) {
+    if (num_workers == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = online > 0 ? (uint32_t)online : 1;
+    }
+
+    Engine* engine = calloc(1, sizeof(Engine));
+    if (engine == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the engine");
+        return NULL;
+    }
+
+    engine->cpus = malloc((size_t)count * sizeof(CPU));
+    engine->frames = calloc(count, sizeof(uint64_t));
+    engine->workers = calloc(num_workers, sizeof(Worker));
+    if (engine->cpus == NULL || engine->frames == NULL || engine->workers == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the instance pool");
+        free(engine->cpus);
+        free(engine->frames);
+        free(engine->workers);
+        free(engine);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        engine->cpus[i] = *template;
+        seed_cpu(&engine->cpus[i], seed + i);
+    }
+
+    engine->count = count;
+    engine->clock_speed = clock_speed;
+    engine->idle_skip = 1;
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->ready_cond, NULL);
+
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < num_workers; i++) {
+        Worker* worker = &engine->workers[i];
+        worker->engine = engine;
+        worker->id = i;
+        atomic_init(&worker->next, 0);
+        worker->end = 0;
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    if (started == 0) {
+        print_error(ERROR_MEMORY, "Could not start any worker thread");
+        pthread_cond_destroy(&engine->ready_cond);
+        pthread_mutex_destroy(&engine->lock);
+        free(engine->workers);
+        free(engine->frames);
+        free(engine->cpus);
+        free(engine);
+        return NULL;
+    }
+
+    // Carry on with fewer workers if the system ran out of threads
+    engine->num_workers = started;
+
+    // Every worker plus the calling thread meet at both barriers
+    pthread_barrier_init(&engine->start, NULL, started + 1);
+    pthread_barrier_init(&engine->done, NULL, started + 1);
+
+    pthread_mutex_lock(&engine->lock);
+    engine->ready = 1;
+    pthread_cond_broadcast(&engine->ready_cond);
+    pthread_mutex_unlock(&engine->lock);
+
+    return engine;
+}
+
+uint64_t run_engine_frames(Engine* engine, uint32_t frames) {
+    engine->batch_frames = frames;
+
+    // Hand every worker an equal contiguous share of the pool
+    for (uint32_t i = 0; i < engine->num_workers; i++) {
+        Worker* worker = &engine->workers[i];
+        uint32_t first = (uint32_t)((uint64_t)engine->count * i / engine->num_workers);
+        worker->end = (uint32_t)((uint64_t)engine->count * (i + 1) / engine->num_workers);
+        atomic_store_explicit(&worker->next, first, memory_order_relaxed);
+    }
+
+    pthread_barrier_wait(&engine->start);
+    pthread_barrier_wait(&engine->done);
+
+    uint64_t instructions = 0;
+    for (uint32_t i = 0; i < engine->num_workers; i++) {
+        instructions += engine->workers[i].instructions;
+    }
+
+    engine->frame += frames;
+    engine->instructions += instructions;
+    return instructions;
+}
+
+void restart_engine(Engine* engine, uint32_t count) {
+    engine->count = count;
+    engine->frame = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        engine->frames[i] = 0;
+    }
+}
+
+IdleStats engine_idle_stats(const Engine* engine) {
+    IdleStats total = {0};
+    for (uint32_t i = 0; i < engine->num_workers; i++) {
+        const IdleStats* idle = &engine->workers[i].idle;
+        total.probes += idle->probes;
+        total.loops_found += idle->loops_found;
+        total.skipped_instructions += idle->skipped_instructions;
+    }
+    return total;
+}
+
+void destroy_engine(Engine* engine) {
+    if (engine == NULL) {
+        return;
+    }
+
+    engine->stopping = 1;
+
+    pthread_barrier_wait(&engine->start);
+    for (uint32_t i = 0; i < engine->num_workers; i++) {
+        pthread_join(engine->workers[i].thread, NULL);
+    }
+
+    pthread_barrier_destroy(&engine->start);
+    pthread_barrier_destroy(&engine->done);
+    pthread_cond_destroy(&engine->ready_cond);
+    pthread_mutex_destroy(&engine->lock);
+    free(engine->workers);
+    free(engine->frames);
+    free(engine->cpus);
+    free(engine);
+}
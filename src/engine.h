@@ -0,0 +1,88 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "idle.h"
+
+// Instances claimed at a time by a worker, small enough to balance, large enough to amortize the atomics
+#define ENGINE_CHUNK 8
+
+struct Engine;
+
+// Called on every instance after its batch, from the worker thread that ran it
+typedef void (*EngineObserver)(void* context, uint32_t index, const CPU* cpu);
+
+typedef struct {
+    struct Engine* engine;
+    pthread_t thread;
+    uint32_t id;
+
+    // This worker's share of the pool for the current batch. Other workers
+    // steal from it by advancing `next` once their own share is done.
+    _Atomic uint32_t next;
+    uint32_t end;
+
+    uint64_t instructions;  // Executed by this worker in the current batch
+    uint64_t stolen;        // Chunks taken from other workers, over the engine's lifetime
+    IdleStats idle;         // Idle loops skipped by this worker, over the engine's lifetime
+} Worker;
+
+/*
+ * Runs many CPU instances in parallel on a pool of worker threads.
+ * Instances live in one contiguous array and all run at the same
+ * clock speed; each call to run_engine_frames() steps every instance
+ * by the same number of 60 Hz frames.
+ */
+typedef struct Engine {
+    CPU* cpus;
+    uint32_t count;
+    uint32_t clock_speed;
+    int idle_skip;              // Skip idle loops (see idle.h), on by default
+    uint64_t frame;             // Frames run so far by the pool
+    uint64_t* frames;           // Frames run by each instance since it was last reset, paces its budget
+    const uint16_t* keys;       // Keypad mask per instance, set before each batch, NULL leaves the keypads alone
+    EngineObserver observe;     // NULL when nobody looks at the results
+    void* observe_context;
+
+    Worker* workers;
+    uint32_t num_workers;
+    pthread_mutex_t lock;       // Guards `ready` while the workers start up
+    pthread_cond_t ready_cond;
+    int ready;                  // Set once the barriers exist
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    uint32_t batch_frames;      // Frames to run in the current batch
+    int stopping;
+
+    uint64_t instructions;      // Total over all instances
+} Engine;
+
+/*
+ * Creates `count` instances, each a copy of `template` (which should already
+ * have its ROM loaded) seeded with seed + i, and `num_workers` threads
+ * (0 means one per online CPU). Returns NULL on failure.
+ */
+Engine* create_engine(const CPU* template, uint32_t count, uint64_t seed, uint32_t num_workers, uint32_t clock_speed);
+
+/*
+ * Steps every instance by `frames` frames and returns once all are done.
+ * Returns the number of instructions executed over all instances.
+ */
+uint64_t run_engine_frames(Engine* engine, uint32_t frames);
+
+/*
+ * Starts over from frame 0 with the first `count` instances (at most the
+ * number the engine was created with), after the caller has reloaded them.
+ * A single reloaded instance only needs its `frames` entry zeroed.
+ */
+void restart_engine(Engine* engine, uint32_t count);
+
+// Idle loop statistics summed over all workers
+IdleStats engine_idle_stats(const Engine* engine);
+
+void destroy_engine(Engine* engine);
+
+#endif
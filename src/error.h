@@ -11,7 +11,16 @@ typedef enum {
     ERROR_ROM_SIZE,
     ERROR_ROM_READ,
     ERROR_SDL_INIT,
-    ERROR_MEMORY
+    ERROR_MEMORY,
+    ERROR_SNAPSHOT,
+    ERROR_MOVIE,
+    ERROR_PROFILE,
+    ERROR_ROM_DB,
+    ERROR_LIBRARY,
+    ERROR_AUDIO,
+    ERROR_SHM,
+    ERROR_VIDEO,
+    ERROR_ANALYSIS
 } ErrorCode;
 
 void print_error(ErrorCode code, const char* message);
@@ -3,5 +3,6 @@
 #include <stdint.h>
 
 extern const uint8_t fontset[80];
+extern const uint8_t big_fontset[160];
 
 #endif
@@ -0,0 +1,46 @@
+#include <string.h>
+#include "frames.h"
+
+void initialize_triple_buffer(TripleBuffer* buffer) {
+    memset(buffer->slots, 0, sizeof(buffer->slots));
+    buffer->back = 0;
+    atomic_init(&buffer->middle, 1);
+    buffer->front = 2;
+
+    // Nothing has been shown yet, the first frame is drawn in full
+    for (int slot = 0; slot < 3; slot++) {
+        buffer->changed[slot] = ~0ull;
+    }
+}
+
+void publish_frame(TripleBuffer* buffer, CPU* cpu, uint64_t number) {
+    Frame* frame = &buffer->slots[buffer->back];
+    memcpy(frame->framebuffer, cpu->framebuffer, sizeof(frame->framebuffer));
+    frame->hires = cpu->hires;
+    frame->number = number;
+
+    for (int slot = 0; slot < 3; slot++) {
+        buffer->changed[slot] |= cpu->dirty_rows;
+        frame->changed[slot] = buffer->changed[slot];
+    }
+    buffer->changed[buffer->back] = 0;
+    cpu->dirty_rows = 0;
+
+    unsigned previous = atomic_exchange_explicit(&buffer->middle, buffer->back | FRAME_FRESH, memory_order_acq_rel);
+    buffer->back = previous & ~FRAME_FRESH;
+}
+
+const Frame* acquire_frame(TripleBuffer* buffer, uint64_t* dirty_rows) {
+    if (!(atomic_load_explicit(&buffer->middle, memory_order_relaxed) & FRAME_FRESH)) {
+        *dirty_rows = 0;
+        return NULL;
+    }
+
+    unsigned shown = buffer->front;
+    unsigned previous = atomic_exchange_explicit(&buffer->middle, shown, memory_order_acq_rel);
+    buffer->front = previous & ~FRAME_FRESH;
+
+    const Frame* frame = &buffer->slots[buffer->front];
+    *dirty_rows = frame->changed[shown];
+    return frame;
+}
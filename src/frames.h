@@ -0,0 +1,54 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define FRAME_FRESH 4   // Set in TripleBuffer.middle until the consumer takes that slot
+
+// What the display needs of a finished frame
+typedef struct {
+    uint64_t framebuffer[NUM_PLANES][FRAMEBUFFER_HEIGHT][FRAMEBUFFER_WORDS];
+    uint8_t hires;
+    uint64_t number;        // Frames run when it was published
+    uint64_t changed[3];    // Rows that differ from what each other slot held when it was published
+} Frame;
+
+/*
+ * Lock-free triple buffer handing finished frames from the emulation
+ * thread to the render thread. The producer fills its back slot and swaps
+ * it with the middle one, the consumer swaps its front slot with the middle
+ * one when that holds a newer frame. Neither side ever waits; frames the
+ * renderer is too slow for are overwritten in the middle slot.
+ *
+ * Each published frame records which rows changed since every other slot
+ * was published, so the consumer knows exactly which rows differ from the
+ * frame it showed before, however many frames it skipped.
+ */
+typedef struct {
+    Frame slots[3];
+    atomic_uint middle;             // Slot index, | FRAME_FRESH when not taken yet
+    uint64_t changed[3];            // Producer side: rows changed since each slot was published
+    unsigned back;                  // Producer's slot
+    unsigned front;                 // Consumer's slot
+} TripleBuffer;
+
+void initialize_triple_buffer(TripleBuffer* buffer);
+
+// Copies the CPU's framebuffer into the back slot and publishes it, clears cpu->dirty_rows
+void publish_frame(TripleBuffer* buffer, CPU* cpu, uint64_t number);
+
+/*
+ * Takes the newest published frame, or returns NULL if there is none since
+ * the last call. `*dirty_rows` gets the rows that differ from the frame
+ * taken before.
+ */
+const Frame* acquire_frame(TripleBuffer* buffer, uint64_t* dirty_rows);
+
+// The frame taken last, still owned by the consumer
+static inline const Frame* front_frame(const TripleBuffer* buffer) {
+    return &buffer->slots[buffer->front];
+}
+
+#endif
@@ -0,0 +1,147 @@
+#include <string.h>
+#include "idle.h"
+
+// Everything an instruction can change without bumping cpu->effects, including Fx75 and Fn01
+typedef struct {
+    uint16_t PC;
+    uint16_t I;
+    int8_t SP;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t v[NUM_REGS];
+    uint16_t stack[STACK_DEPTH];
+    uint8_t flags[NUM_FLAGS];
+    uint8_t planes;
+    uint64_t rng_state;
+    uint32_t effects;
+    uint8_t pitch;
+    uint8_t pattern_set;
+    uint8_t pattern[PATTERN_SIZE];
+} IdleState;
+
+static void capture(IdleState* state, const CPU* cpu) {
+    memset(state, 0, sizeof(*state));
+    state->PC = cpu->PC;
+    state->I = cpu->I;
+    state->SP = cpu->SP;
+    state->delay_timer = cpu->delay_timer;
+    state->sound_timer = cpu->sound_timer;
+    memcpy(state->v, cpu->v, sizeof(state->v));
+    memcpy(state->stack, cpu->stack, sizeof(state->stack));
+    memcpy(state->flags, cpu->flags, sizeof(state->flags));
+    state->planes = cpu->planes;
+    state->rng_state = cpu->rng_state;
+    state->effects = cpu->effects;
+    state->pitch = cpu->pitch;
+    state->pattern_set = cpu->pattern_set;
+    memcpy(state->pattern, cpu->pattern, sizeof(state->pattern));
+}
+
+/*
+ * Single-steps until PC comes back to where it started. Returns the loop
+ * length, 0 if it did not come back within `limit` instructions, or -1 if
+ * the runner failed. `*steps` is the number of instructions run.
+ */
+static int find_loop(CPU* cpu, uint32_t limit, IdleRunner run, void* context, uint32_t* steps) {
+    uint16_t start = cpu->PC;
+
+    for (uint32_t i = 1; i <= limit; i++) {
+        if (run(context, cpu, 1) < 0) {
+            return -1;
+        }
+        (*steps)++;
+        if (cpu->PC == start) {
+            return (int)i;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Looks for an idle loop starting at the current PC. Returns its length
+ * (0 if there is none) and adds the instructions it ran to `*steps`.
+ */
+static int probe(CPU* cpu, uint32_t remaining, IdleRunner run, void* context, uint32_t* steps) {
+    IdleState before, after;
+
+    // The first pass can still change something (e.g. Fx07 loading the
+    // timer into a register that held an older value), so a loop only
+    // counts as idle if a second pass leaves everything as it was
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t limit = remaining - *steps < IDLE_MAX_LOOP ? remaining - *steps : IDLE_MAX_LOOP;
+        capture(&before, cpu);
+        int length = find_loop(cpu, limit, run, context, steps);
+        if (length <= 0) {
+            return length;
+        }
+
+        capture(&after, cpu);
+        if (memcmp(&before, &after, sizeof(before)) == 0) {
+            return length;
+        }
+    }
+
+    return 0;
+}
+
+int run_skipping_idle(CPU* cpu, uint32_t count, IdleRunner run, void* context, IdleStats* stats) {
+    uint32_t interval = IDLE_PROBE_INTERVAL;
+    uint32_t until_probe = 0;
+    const uint8_t* hints = stats->hints;
+    int armed = 0;
+
+    while (count > 0) {
+        // Besides the backed off schedule, probe as soon as the CPU enters a loop the analysis found.
+        // Once probed, a hinted loop isn't probed again until the CPU has left it
+        int hinted = hints != NULL && (hints[cpu->PC & cpu->memory_mask] & IDLE_HINT);
+        if (!hinted) {
+            armed = 1;
+        }
+        if (until_probe == 0 || (hinted && armed)) {
+            uint32_t steps = 0;
+            stats->probes++;
+            int length = probe(cpu, count, run, context, &steps);
+            if (length < 0) {
+                return -1;
+            }
+            count -= steps;
+
+            if (length > 0) {
+                // Every further iteration would end in the same state, so only
+                // the part of an iteration that doesn't fit needs to run
+                uint32_t skipped = count - count % (uint32_t)length;
+                stats->loops_found++;
+                stats->skipped_instructions += skipped;
+                return run(context, cpu, count - skipped);
+            }
+
+            if (hinted) {
+                armed = 0;
+            }
+            until_probe = interval;
+            if (interval < IDLE_MAX_INTERVAL) {
+                interval *= 2;
+            }
+        }
+
+        uint32_t chunk = count < until_probe ? count : until_probe;
+        if (hints != NULL && chunk > IDLE_HINT_INTERVAL) {
+            chunk = IDLE_HINT_INTERVAL;
+        }
+        if (run(context, cpu, chunk) < 0) {
+            return -1;
+        }
+        count -= chunk;
+        until_probe -= chunk;
+    }
+
+    return 0;
+}
+
+void idle_report(const IdleStats* stats, uint64_t instructions, FILE* out) {
+    double share = instructions > 0 ? 100.0 * (double)stats->skipped_instructions / (double)instructions : 0.0;
+    fprintf(out, "idle instructions skipped: %llu (%.1f%%, %llu loops in %llu probes)\n",
+        (unsigned long long)stats->skipped_instructions, share,
+        (unsigned long long)stats->loops_found, (unsigned long long)stats->probes);
+}
@@ -0,0 +1,38 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+
+#define IDLE_MAX_LOOP 16            // Longest loop (in instructions) that is recognized
+#define IDLE_PROBE_INTERVAL 64      // Instructions run between probes at the start of a frame
+#define IDLE_MAX_INTERVAL 4096      // The interval doubles after every failed probe up to this
+#define IDLE_HINT_INTERVAL 64       // Instructions between looks at the hints, when there are any
+#define IDLE_HINT 0x80              // Set in IdleStats.hints for addresses in statically found idle loops
+
+// Runs exactly `count` instructions on `cpu`, returns -1 on failure
+typedef int (*IdleRunner)(void* context, CPU* cpu, uint32_t count);
+
+typedef struct {
+    const uint8_t* hints;           // Optional flags per address of memory, see analysis.h
+    uint64_t probes;
+    uint64_t loops_found;
+    uint64_t skipped_instructions;
+} IdleStats;
+
+/*
+ * Runs `count` instructions like `run` would, but skips the ones spent
+ * spinning in an idle loop. Every so often the CPU is single-stepped for up
+ * to IDLE_MAX_LOOP instructions; if it comes back to the same PC with the
+ * same registers, RPL flags, stack and RNG state and without having drawn
+ * or written memory, nothing it does can change before the next timer tick or key
+ * event, so the rest of the frame is skipped in whole loop iterations.
+ * This covers "wait for the delay timer", Fx0A and "wait for a key" loops.
+ * The result is identical to running every instruction.
+ */
+int run_skipping_idle(CPU* cpu, uint32_t count, IdleRunner run, void* context, IdleStats* stats);
+
+void idle_report(const IdleStats* stats, uint64_t instructions, FILE* out);
+
+#endif
@@ -0,0 +1,14 @@
+#include "input.h"
+
+void handle_input(atomic_uint* keys, SDL_KeyboardEvent key) {
+    for (int i = 0; i < NUM_KEYS; i++) {
+        if (key.keysym.scancode == keymap[i]) {
+            if (key.type == SDL_KEYDOWN) {
+                atomic_fetch_or_explicit(keys, 1u << i, memory_order_relaxed);
+            } else {
+                atomic_fetch_and_explicit(keys, ~(1u << i), memory_order_relaxed);
+            }
+            break;
+        }
+    }
+}
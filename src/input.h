@@ -0,0 +1,19 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
+
+#include "cpu.h"
+
+static const uint8_t keymap[NUM_KEYS] = {
+    SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4,
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_R,
+    SDL_SCANCODE_A, SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_F,
+    SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_C, SDL_SCANCODE_V
+};
+
+// Sets or clears the key's bit in `keys`, a keypad mask read by the emulation thread
+void handle_input(atomic_uint* keys, SDL_KeyboardEvent event);
+
+#endif
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include "libchip8.h"
+#include "cpu.h"
+#include "engine.h"
+#include "error.h"
+#include "idle.h"
+#include "scheduler.h"
+
+// The public constants are the internal ones under other names
+_Static_assert(CHIP8_MACHINE_CHIP8 == (int)MACHINE_CHIP8 && CHIP8_MACHINE_SCHIP == (int)MACHINE_SCHIP
+               && CHIP8_MACHINE_XOCHIP == (int)MACHINE_XOCHIP, "machine numbers differ");
+_Static_assert(CHIP8_QUIRKS_VIP == (int)QUIRKS_VIP && CHIP8_QUIRKS_CHIP48 == (int)QUIRKS_CHIP48
+               && CHIP8_QUIRKS_SCHIP == (int)QUIRKS_SCHIP && CHIP8_QUIRKS_XOCHIP == (int)QUIRKS_XOCHIP,
+               "quirk profile numbers differ");
+
+#define PLANE_BYTES (FRAMEBUFFER_HEIGHT * FRAMEBUFFER_WORDS * 8)
+
+struct Chip8 {
+    CPU cpu;
+    CPU power_on;           // Restored by chip8_reset()
+    Chip8Config config;
+    uint64_t frame;
+    IdleStats idle;
+};
+
+struct Chip8Batch {
+    Engine* engine;
+    CPU* power_on;
+    uint64_t seed;          // Machine i uses seed + i
+    int format;             // Of the chip8_step_many() call in progress
+    uint8_t* observations;
+};
+
+void chip8_default_config(Chip8Config* config) {
+    config->machine = CHIP8_MACHINE_CHIP8;
+    config->quirks = CHIP8_QUIRKS_DEFAULT;
+    config->clock_speed = 700;
+    config->seed = 1;
+    config->idle_skip = 1;
+}
+
+size_t chip8_observation_size(int format) {
+    switch (format) {
+        case CHIP8_OBSERVE_BITS:
+            return PLANE_BYTES;
+        case CHIP8_OBSERVE_PLANES:
+            return NUM_PLANES * PLANE_BYTES;
+        case CHIP8_OBSERVE_PIXELS:
+            return FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT;
+        default:
+            return 0;
+    }
+}
+
+// Checks `config` and fills in its defaults
+static int check_config(const Chip8Config* config, Chip8Config* out) {
+    if (config == NULL) {
+        chip8_default_config(out);
+        return 0;
+    }
+
+    *out = *config;
+    if (out->clock_speed == 0) {
+        out->clock_speed = 700;
+    }
+    if (out->machine < CHIP8_MACHINE_CHIP8 || out->machine > CHIP8_MACHINE_XOCHIP
+            || out->quirks < CHIP8_QUIRKS_DEFAULT || out->quirks >= (int)QUIRKS_COUNT) {
+        print_error(ERROR_MISSING_ARGS, "Unknown machine or quirk profile");
+        return -1;
+    }
+    return 0;
+}
+
+// Power-on state with `rom` loaded, as main() sets it up
+static int power_on(CPU* cpu, const Chip8Config* config, const void* rom, size_t size) {
+    if (initialize_cpu(cpu) < 0) {
+        return -1;
+    }
+    set_machine(cpu, (Machine)config->machine);
+    set_quirks(cpu, config->quirks < 0 ? default_quirks((Machine)config->machine) : (QuirkProfile)config->quirks);
+    seed_cpu(cpu, config->seed);
+    return rom != NULL ? load_rom_data(cpu, rom, size) : 0;
+}
+
+static void observe_cpu(const CPU* cpu, int format, uint8_t* out) {
+    switch (format) {
+        case CHIP8_OBSERVE_BITS:
+            memcpy(out, cpu->framebuffer[0], PLANE_BYTES);
+            break;
+
+        case CHIP8_OBSERVE_PLANES:
+            memcpy(out, cpu->framebuffer, NUM_PLANES * PLANE_BYTES);
+            break;
+
+        case CHIP8_OBSERVE_PIXELS: {
+            // Low resolution reads the top-left quarter, every pixel twice in both directions
+            int shift = cpu->hires ? 0 : 1;
+            int width = FRAMEBUFFER_WIDTH >> shift;
+            for (int y = 0; y < FRAMEBUFFER_HEIGHT >> shift; y++) {
+                uint8_t row[FRAMEBUFFER_WIDTH];
+                memset(row, 0, width);
+
+                // Only the pixels that are on cost anything
+                for (int plane = 0; plane < NUM_PLANES; plane++) {
+                    for (int w = 0; w < width / 64; w++) {
+                        uint64_t bits = cpu->framebuffer[plane][y][w];
+                        while (bits != 0) {
+                            int x = __builtin_clzll(bits);
+                            row[w * 64 + x] |= 1 << plane;
+                            bits &= ~(1ull << (63 - x));
+                        }
+                    }
+                }
+
+                if (shift) {
+                    for (int x = 0; x < width; x++) {
+                        out[2 * x] = out[2 * x + 1] = row[x];
+                    }
+                    memcpy(out + FRAMEBUFFER_WIDTH, out, FRAMEBUFFER_WIDTH);
+                    out += 2 * FRAMEBUFFER_WIDTH;
+                } else {
+                    memcpy(out, row, FRAMEBUFFER_WIDTH);
+                    out += FRAMEBUFFER_WIDTH;
+                }
+            }
+            break;
+        }
+    }
+}
+
+Chip8* chip8_create(const Chip8Config* config) {
+    Chip8* chip8 = malloc(sizeof(Chip8));
+    if (chip8 == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the machine");
+        return NULL;
+    }
+
+    if (check_config(config, &chip8->config) < 0 || power_on(&chip8->cpu, &chip8->config, NULL, 0) < 0) {
+        free(chip8);
+        return NULL;
+    }
+    chip8->power_on = chip8->cpu;
+    chip8->frame = 0;
+    memset(&chip8->idle, 0, sizeof(chip8->idle));
+    return chip8;
+}
+
+void chip8_destroy(Chip8* chip8) {
+    free(chip8);
+}
+
+int chip8_load_rom(Chip8* chip8, const void* rom, size_t size) {
+    if (power_on(&chip8->cpu, &chip8->config, rom, size) < 0) {
+        return -1;
+    }
+    chip8->power_on = chip8->cpu;
+    chip8->frame = 0;
+    return 0;
+}
+
+void chip8_reset(Chip8* chip8) {
+    chip8->cpu = chip8->power_on;
+    chip8->frame = 0;
+}
+
+void chip8_set_keys(Chip8* chip8, uint16_t keys) {
+    set_keypad_mask(&chip8->cpu, keys);
+}
+
+static int run_instructions_runner(void* context, CPU* cpu, uint32_t count) {
+    (void)context;
+    run_instructions(cpu, count);
+    return 0;
+}
+
+uint64_t chip8_run_frames(Chip8* chip8, uint32_t frames) {
+    uint64_t instructions = 0;
+
+    for (uint32_t f = 0; f < frames; f++) {
+        uint32_t budget = frame_budget(chip8->config.clock_speed, chip8->frame++);
+        if (chip8->config.idle_skip) {
+            run_skipping_idle(&chip8->cpu, budget, run_instructions_runner, NULL, &chip8->idle);
+        } else {
+            run_instructions(&chip8->cpu, budget);
+        }
+        tick_timers(&chip8->cpu);
+        instructions += budget;
+    }
+
+    return instructions;
+}
+
+const uint64_t* chip8_framebuffer(const Chip8* chip8) {
+    return &chip8->cpu.framebuffer[0][0][0];
+}
+
+void chip8_screen_size(const Chip8* chip8, uint32_t* width, uint32_t* height) {
+    *width = screen_width(&chip8->cpu);
+    *height = screen_height(&chip8->cpu);
+}
+
+void chip8_observe(const Chip8* chip8, int format, void* out) {
+    observe_cpu(&chip8->cpu, format, out);
+}
+
+const uint8_t* chip8_memory(const Chip8* chip8, size_t* size) {
+    *size = memory_size(&chip8->cpu);
+    return chip8->cpu.memory;
+}
+
+int chip8_sound_on(const Chip8* chip8) {
+    return chip8->cpu.sound_timer > 0;
+}
+
+// Runs on the engine's workers, each machine writes only its own slot
+static void observe_instance(void* context, uint32_t index, const CPU* cpu) {
+    Chip8Batch* batch = context;
+    observe_cpu(cpu, batch->format, batch->observations + index * chip8_observation_size(batch->format));
+}
+
+Chip8Batch* chip8_batch_create(const Chip8Config* config, const void* rom, size_t size,
+                               uint32_t count, uint32_t threads) {
+    Chip8Config checked;
+    if (check_config(config, &checked) < 0) {
+        return NULL;
+    }
+
+    Chip8Batch* batch = calloc(1, sizeof(Chip8Batch));
+    CPU* template = malloc(sizeof(CPU));
+    if (batch == NULL || template == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the batch");
+        free(batch);
+        free(template);
+        return NULL;
+    }
+
+    if (power_on(template, &checked, rom, size) < 0
+            || (batch->engine = create_engine(template, count, checked.seed, threads, checked.clock_speed)) == NULL) {
+        free(template);
+        free(batch);
+        return NULL;
+    }
+
+    batch->engine->idle_skip = checked.idle_skip;
+    batch->engine->observe_context = batch;
+    batch->power_on = template;
+    batch->seed = checked.seed;
+    return batch;
+}
+
+void chip8_batch_destroy(Chip8Batch* batch) {
+    if (batch == NULL) {
+        return;
+    }
+    destroy_engine(batch->engine);
+    free(batch->power_on);
+    free(batch);
+}
+
+uint32_t chip8_batch_count(const Chip8Batch* batch) {
+    return batch->engine->count;
+}
+
+void chip8_batch_reset(Chip8Batch* batch, uint32_t index) {
+    batch->engine->cpus[index] = *batch->power_on;
+    seed_cpu(&batch->engine->cpus[index], batch->seed + index);
+    batch->engine->frames[index] = 0;
+}
+
+uint64_t chip8_step_many(Chip8Batch* batch, const uint16_t* actions, uint32_t frames,
+                         int format, void* observations) {
+    int observing = observations != NULL && chip8_observation_size(format) > 0;
+    batch->engine->keys = actions;
+    batch->engine->observe = observing ? observe_instance : NULL;
+    batch->format = format;
+    batch->observations = observations;
+    return run_engine_frames(batch->engine, frames);
+}
+
+const uint8_t* chip8_batch_memory(const Chip8Batch* batch, uint32_t index, size_t* size) {
+    const CPU* cpu = &batch->engine->cpus[index];
+    *size = memory_size(cpu);
+    return cpu->memory;
+}
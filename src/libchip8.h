@@ -0,0 +1,117 @@
+#ifndef LIBCHIP8_H
+#define LIBCHIP8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libchip8: the emulator core without SDL, as a static (libchip8.a) or
+ * shared (libchip8.so) library. Built with `make lib`; only the functions
+ * below are exported from the shared library.
+ *
+ * A Chip8 is one machine. A Chip8Batch is many copies of one ROM stepped
+ * together on a pool of worker threads, each writing its observation
+ * straight into a buffer the caller owns.
+ */
+
+#if defined(__GNUC__)
+#define CHIP8_API __attribute__((visibility("default")))
+#else
+#define CHIP8_API
+#endif
+
+typedef struct Chip8 Chip8;
+typedef struct Chip8Batch Chip8Batch;
+
+enum {
+    CHIP8_MACHINE_CHIP8,
+    CHIP8_MACHINE_SCHIP,
+    CHIP8_MACHINE_XOCHIP
+};
+
+enum {
+    CHIP8_QUIRKS_DEFAULT = -1,  // The machine's usual profile
+    CHIP8_QUIRKS_VIP,
+    CHIP8_QUIRKS_CHIP48,
+    CHIP8_QUIRKS_SCHIP,
+    CHIP8_QUIRKS_XOCHIP
+};
+
+// What chip8_observe() and chip8_step_many() write for each machine
+enum {
+    CHIP8_OBSERVE_NONE,         // Nothing
+    CHIP8_OBSERVE_BITS,         // First plane, 64 rows of two native-endian uint64_t, bit 63 of the first is x = 0
+    CHIP8_OBSERVE_PLANES,       // All four planes in that layout, one after the other
+    CHIP8_OBSERVE_PIXELS        // 128x64 bytes holding each pixel's plane bits, low resolution pixels doubled
+};
+
+typedef struct {
+    int machine;                // CHIP8_MACHINE_*
+    int quirks;                 // CHIP8_QUIRKS_*
+    uint32_t clock_speed;       // Instructions per second, 0 for the default 700
+    uint64_t seed;              // Cxnn random numbers
+    int idle_skip;              // Skip idle loops, same results as running them (see idle.h)
+} Chip8Config;
+
+// Defaults: CHIP-8, its usual quirks, 700 instructions per second, seed 1, idle skipping on
+CHIP8_API void chip8_default_config(Chip8Config* config);
+
+// Bytes one observation of `format` takes
+CHIP8_API size_t chip8_observation_size(int format);
+
+// Returns NULL if `config` is invalid or memory runs out. `config` may be NULL for the defaults.
+CHIP8_API Chip8* chip8_create(const Chip8Config* config);
+CHIP8_API void chip8_destroy(Chip8* chip8);
+
+/*
+ * Powers the machine on with `rom` at 0x200. The state right after this
+ * is what chip8_reset() goes back to. Returns -1 if the ROM doesn't fit.
+ */
+CHIP8_API int chip8_load_rom(Chip8* chip8, const void* rom, size_t size);
+CHIP8_API void chip8_reset(Chip8* chip8);
+
+// Keypad as one bit per key, key 0 in bit 0
+CHIP8_API void chip8_set_keys(Chip8* chip8, uint16_t keys);
+
+// Runs `frames` 60 Hz frames and returns the instructions executed
+CHIP8_API uint64_t chip8_run_frames(Chip8* chip8, uint32_t frames);
+
+// The live framebuffer in the CHIP8_OBSERVE_PLANES layout, valid until chip8_destroy()
+CHIP8_API const uint64_t* chip8_framebuffer(const Chip8* chip8);
+CHIP8_API void chip8_screen_size(const Chip8* chip8, uint32_t* width, uint32_t* height);
+
+// Writes chip8_observation_size(format) bytes to `out`
+CHIP8_API void chip8_observe(const Chip8* chip8, int format, void* out);
+
+// The machine's memory (4 KB, or 64 KB for XO-CHIP), valid until chip8_destroy()
+CHIP8_API const uint8_t* chip8_memory(const Chip8* chip8, size_t* size);
+
+// 1 while the sound timer runs
+CHIP8_API int chip8_sound_on(const Chip8* chip8);
+
+/*
+ * `count` machines, each powered on with `rom`, run on `threads` worker
+ * threads (0: one per CPU). Machine i is seeded with config->seed + i.
+ * Returns NULL on failure.
+ */
+CHIP8_API Chip8Batch* chip8_batch_create(const Chip8Config* config, const void* rom, size_t size,
+                                         uint32_t count, uint32_t threads);
+CHIP8_API void chip8_batch_destroy(Chip8Batch* batch);
+CHIP8_API uint32_t chip8_batch_count(const Chip8Batch* batch);
+
+// Puts machine `index` back to power-on, its seed and frame 0, e.g. at the end of an episode
+CHIP8_API void chip8_batch_reset(Chip8Batch* batch, uint32_t index);
+
+/*
+ * Sets machine i's keypad to actions[i] (actions may be NULL to keep the
+ * keys), runs every machine for `frames` frames and writes machine i's
+ * observation at observations + i * chip8_observation_size(format).
+ * Returns the instructions executed over all machines.
+ */
+CHIP8_API uint64_t chip8_step_many(Chip8Batch* batch, const uint16_t* actions, uint32_t frames,
+                                   int format, void* observations);
+
+// Machine `index`'s memory, as chip8_memory()
+CHIP8_API const uint8_t* chip8_batch_memory(const Chip8Batch* batch, uint32_t index, size_t* size);
+
+#endif
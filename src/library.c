@@ -0,0 +1,469 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "library.h"
+#include "error.h"
+
+// A ROM found while building, before it is written out
+typedef struct {
+    LibraryEntry entry;
+    const uint8_t* data;    // Mapped source file
+} PendingRom;
+
+static void put_le(uint8_t* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static int compare_hashes(const void* a, const void* b) {
+    uint64_t x = ((const LibraryEntry*)a)->hash;
+    uint64_t y = ((const LibraryEntry*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+Machine detect_machine(const uint8_t* rom, size_t size) {
+    if (size > CHIP8_MEM_SIZE - START_PROGRAM_MEM) {
+        return MACHINE_XOCHIP;
+    }
+
+    // Follow the code from the entry point so sprite data isn't mistaken
+    // for instructions. Bnnn and returns end a path.
+    uint8_t* visited = calloc(size + 1, 1);
+    // Every instruction is visited once and pushes at most 3 successors
+    uint32_t* pending = malloc((size * 3 + 1) * sizeof(uint32_t));
+    if (visited == NULL || pending == NULL) {
+        free(visited);
+        free(pending);
+        return MACHINE_CHIP8;
+    }
+
+    Machine machine = MACHINE_CHIP8;
+    uint32_t count = 0;
+    pending[count++] = 0;
+    while (count > 0 && machine != MACHINE_XOCHIP) {
+        uint32_t at = pending[--count];
+        if (at + 1 >= size || visited[at]) {
+            continue;
+        }
+        visited[at] = 1;
+
+        // Decoded as XO-CHIP so its instructions are recognized, the first one found ends the scan
+        DecodedOp d = decode((rom[at] << 8) | rom[at + 1], MACHINE_XOCHIP);
+        switch (d.op) {
+            case OP_LD_I_LONG:
+            case OP_SCU:
+            case OP_SAVE_VX_VY:
+            case OP_LOAD_VX_VY:
+            case OP_AUDIO:
+            case OP_PITCH:
+                machine = MACHINE_XOCHIP;
+                break;
+            case OP_PLANE:
+                if (d.x != 1) {
+                    machine = MACHINE_XOCHIP;
+                }
+                break;
+            case OP_HIGH:
+            case OP_LOW:
+            case OP_SCD:
+            case OP_SCR:
+            case OP_SCL:
+            case OP_EXIT:
+            case OP_LD_HF_VX:
+            case OP_LD_R_VX:
+            case OP_LD_VX_R:
+                machine = MACHINE_SCHIP;
+                break;
+            case OP_DRW:
+                if (d.n == 0) {
+                    machine = MACHINE_SCHIP;
+                }
+                break;
+        }
+
+        // Successors, as offsets into the ROM
+        uint32_t next = at + (d.op == OP_LD_I_LONG ? 4 : 2);
+        switch (d.op) {
+            case OP_JP:
+                if (d.nnn >= START_PROGRAM_MEM) {
+                    pending[count++] = d.nnn - START_PROGRAM_MEM;
+                }
+                break;
+            case OP_CALL:
+                if (d.nnn >= START_PROGRAM_MEM) {
+                    pending[count++] = d.nnn - START_PROGRAM_MEM;
+                }
+                pending[count++] = next;
+                break;
+            case OP_SE_VX_NN:
+            case OP_SNE_VX_NN:
+            case OP_SE_VX_VY:
+            case OP_SNE_VX_VY:
+            case OP_SKP:
+            case OP_SKNP:
+                pending[count++] = next;
+                pending[count++] = next + 2;
+                // Skips only jump over 4 bytes on XO-CHIP, and only when the next word is F000 nnnn
+                if (next + 1 < size && rom[next] == 0xF0 && rom[next + 1] == 0x00) {
+                    pending[count++] = next + 4;
+                }
+                break;
+            case OP_RET:
+            case OP_JP_V0:
+            case OP_EXIT:
+                break;
+            default:
+                pending[count++] = next;
+                break;
+        }
+    }
+
+    free(visited);
+    free(pending);
+    return machine;
+}
+
+// Maps `path` read-only, returns NULL for empty or unreadable files
+static const uint8_t* map_file(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return data;
+}
+
+static int write_library(const char* out_path, const PendingRom* roms, uint32_t count, uint32_t files) {
+    // Write next to the destination and rename, readers never see half a library
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", out_path);
+    FILE* out = fopen(temp_path, "wb");
+    if (out == NULL) {
+        print_error(ERROR_LIBRARY, "Could not create the library file");
+        return -1;
+    }
+
+    uint8_t header[LIBRARY_HEADER_SIZE] = {0};
+    memcpy(header, LIBRARY_MAGIC, 4);
+    put_le(header + 4, LIBRARY_VERSION, 2);
+    put_le(header + 8, count, 4);
+    put_le(header + 12, files, 4);
+    int failed = fwrite(header, 1, sizeof(header), out) != sizeof(header);
+
+    for (uint32_t i = 0; i < count && !failed; i++) {
+        const LibraryEntry* entry = &roms[i].entry;
+        uint8_t record[LIBRARY_ENTRY_SIZE] = {0};
+        put_le(record, entry->hash, 8);
+        put_le(record + 8, entry->offset, 4);
+        put_le(record + 12, entry->size, 4);
+        record[16] = entry->machine;
+        record[17] = entry->quirks;
+        failed = fwrite(record, 1, sizeof(record), out) != sizeof(record);
+    }
+
+    for (uint32_t i = 0; i < count && !failed; i++) {
+        failed = fwrite(roms[i].data, 1, roms[i].entry.size, out) != roms[i].entry.size;
+    }
+
+    if (fclose(out) != 0 || failed || rename(temp_path, out_path) != 0) {
+        print_error(ERROR_LIBRARY, "Could not write the library file");
+        remove(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_pending(const void* a, const void* b) {
+    return compare_hashes(&((const PendingRom*)a)->entry, &((const PendingRom*)b)->entry);
+}
+
+// Calls `visit` with the path of every regular file in `dir` except the library itself
+static int for_each_rom_file(const char* dir, int (*visit)(void* context, const char* path), void* context) {
+    DIR* directory = opendir(dir);
+    if (directory == NULL) {
+        print_error(ERROR_LIBRARY, "Could not open the ROM directory");
+        return -1;
+    }
+
+    char path[4096];
+    struct dirent* item;
+    int status = 0;
+    while (status == 0 && (item = readdir(directory)) != NULL) {
+        if (item->d_name[0] == '.' || strcmp(item->d_name, LIBRARY_FILE) == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, item->d_name);
+        status = visit(context, path);
+    }
+
+    closedir(directory);
+    return status;
+}
+
+typedef struct {
+    PendingRom* roms;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t files;
+    const RomDatabase* db;
+} BuildState;
+
+static int add_rom_file(void* context, const char* path) {
+    BuildState* state = context;
+
+    size_t size;
+    const uint8_t* data = map_file(path, &size);
+    if (data == NULL) {
+        return 0;
+    }
+    if (size > MEM_SIZE - START_PROGRAM_MEM) {
+        munmap((void*)data, size);
+        return 0;
+    }
+
+    if (state->count == state->capacity) {
+        state->capacity = state->capacity ? state->capacity * 2 : 256;
+        PendingRom* grown = realloc(state->roms, state->capacity * sizeof(PendingRom));
+        if (grown == NULL) {
+            print_error(ERROR_MEMORY, "Could not allocate the library index");
+            munmap((void*)data, size);
+            return -1;
+        }
+        state->roms = grown;
+    }
+
+    LibraryEntry* entry = &state->roms[state->count].entry;
+    entry->hash = hash_rom(data, size);
+    entry->size = (uint32_t)size;
+    entry->machine = detect_machine(data, size);
+
+    QuirkProfile quirks = default_quirks((Machine)entry->machine);
+    Machine machine = (Machine)entry->machine;
+    if (state->db != NULL && find_rom(state->db, entry->hash, &quirks, &machine)) {
+        entry->machine = machine;
+    }
+    entry->quirks = quirks;
+
+    state->roms[state->count].data = data;
+    state->count++;
+    state->files++;
+    printf("%016llx %s\n", (unsigned long long)entry->hash, path);
+    return 0;
+}
+
+int build_library(const char* dir, const char* out_path, const RomDatabase* db) {
+    BuildState state = { .db = db };
+    int status = for_each_rom_file(dir, add_rom_file, &state);
+
+    if (status == 0) {
+        // Sort by hash and drop duplicates
+        qsort(state.roms, state.count, sizeof(PendingRom), compare_pending);
+        uint32_t unique = 0;
+        for (uint32_t i = 0; i < state.count; i++) {
+            if (unique > 0 && state.roms[unique - 1].entry.hash == state.roms[i].entry.hash) {
+                munmap((void*)state.roms[i].data, state.roms[i].entry.size);
+                continue;
+            }
+            state.roms[unique++] = state.roms[i];
+        }
+        state.count = unique;
+
+        uint64_t offset = LIBRARY_HEADER_SIZE + (uint64_t)unique * LIBRARY_ENTRY_SIZE;
+        for (uint32_t i = 0; i < unique; i++) {
+            state.roms[i].entry.offset = (uint32_t)offset;
+            offset += state.roms[i].entry.size;
+        }
+
+        if (offset > UINT32_MAX) {
+            print_error(ERROR_LIBRARY, "Too many ROMs for one library file");
+            status = -1;
+        } else {
+            status = write_library(out_path, state.roms, unique, state.files);
+        }
+    }
+
+    for (uint32_t i = 0; i < state.count; i++) {
+        munmap((void*)state.roms[i].data, state.roms[i].entry.size);
+    }
+    free(state.roms);
+    return status;
+}
+
+// Counts the ROM files in a directory and whether any is newer than `since`
+typedef struct {
+    uint32_t files;
+    struct timespec since;
+    int newer;
+} FreshnessState;
+
+static int check_rom_file(void* context, const char* path) {
+    FreshnessState* state = context;
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > MEM_SIZE - START_PROGRAM_MEM) {
+        return 0;
+    }
+
+    state->files++;
+    if (st.st_mtim.tv_sec > state->since.tv_sec
+        || (st.st_mtim.tv_sec == state->since.tv_sec && st.st_mtim.tv_nsec > state->since.tv_nsec)) {
+        state->newer = 1;
+    }
+    return 0;
+}
+
+static int map_library(RomLibrary* library, const char* path) {
+    library->data = map_file(path, &library->size);
+    if (library->data == NULL) {
+        print_error(ERROR_LIBRARY, "Could not open the library file");
+        return -1;
+    }
+
+    const uint8_t* data = library->data;
+    uint32_t count = library->size >= LIBRARY_HEADER_SIZE ? (uint32_t)get_le(data + 8, 4) : 0;
+    if (library->size < LIBRARY_HEADER_SIZE || memcmp(data, LIBRARY_MAGIC, 4) != 0
+        || get_le(data + 4, 2) != LIBRARY_VERSION
+        || library->size < LIBRARY_HEADER_SIZE + (uint64_t)count * LIBRARY_ENTRY_SIZE) {
+        print_error(ERROR_LIBRARY, "Not a library file of a supported version");
+        close_library(library);
+        return -1;
+    }
+
+    library->entries = malloc((count ? count : 1) * sizeof(LibraryEntry));
+    if (library->entries == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the library index");
+        close_library(library);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* record = data + LIBRARY_HEADER_SIZE + (size_t)i * LIBRARY_ENTRY_SIZE;
+        LibraryEntry* entry = &library->entries[i];
+        entry->hash = get_le(record, 8);
+        entry->offset = (uint32_t)get_le(record + 8, 4);
+        entry->size = (uint32_t)get_le(record + 12, 4);
+        entry->machine = record[16];
+        entry->quirks = record[17];
+
+        if ((uint64_t)entry->offset + entry->size > library->size || entry->machine > MACHINE_XOCHIP
+            || entry->quirks >= QUIRKS_COUNT || (i > 0 && entry->hash <= library->entries[i - 1].hash)) {
+            print_error(ERROR_LIBRARY, "Corrupt library index");
+            close_library(library);
+            return -1;
+        }
+    }
+    library->count = count;
+    return 0;
+}
+
+// The database wins over what the index recorded, which may predate it or have been built without one
+static void apply_rom_db(RomLibrary* library, const RomDatabase* db) {
+    for (uint32_t i = 0; db != NULL && i < library->count; i++) {
+        LibraryEntry* entry = &library->entries[i];
+        QuirkProfile quirks = (QuirkProfile)entry->quirks;
+        Machine machine = (Machine)entry->machine;
+        if (find_rom(db, entry->hash, &quirks, &machine)) {
+            entry->quirks = quirks;
+            entry->machine = machine;
+        }
+    }
+}
+
+static int map_library_with_db(RomLibrary* library, const char* path, const RomDatabase* db) {
+    if (map_library(library, path) < 0) {
+        return -1;
+    }
+    apply_rom_db(library, db);
+    return 0;
+}
+
+int open_library(RomLibrary* library, const char* path, const RomDatabase* db) {
+    library->data = NULL;
+    library->size = 0;
+    library->entries = NULL;
+    library->count = 0;
+
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        print_error(ERROR_LIBRARY, "Could not find the library");
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return map_library_with_db(library, path, db);
+    }
+
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s/%s", path, LIBRARY_FILE);
+
+    // Up to date when no ROM was added, removed or modified since it was built
+    struct stat index_st;
+    int fresh = 0;
+    if (stat(index_path, &index_st) == 0) {
+        FreshnessState state = { .files = 0, .since = index_st.st_mtim, .newer = 0 };
+        if (for_each_rom_file(path, check_rom_file, &state) < 0) {
+            return -1;
+        }
+        if (map_library(library, index_path) == 0) {
+            fresh = !state.newer && get_le(library->data + 12, 4) == state.files;
+            if (!fresh) {
+                close_library(library);
+            }
+        }
+    }
+
+    if (!fresh) {
+        if (build_library(path, index_path, db) < 0) {
+            return -1;
+        }
+        return map_library_with_db(library, index_path, db);
+    }
+    apply_rom_db(library, db);
+    return 0;
+}
+
+void close_library(RomLibrary* library) {
+    if (library->data != NULL) {
+        munmap((void*)library->data, library->size);
+    }
+    free(library->entries);
+    library->data = NULL;
+    library->size = 0;
+    library->entries = NULL;
+    library->count = 0;
+}
+
+int32_t find_library_rom(const RomLibrary* library, uint64_t hash) {
+    LibraryEntry key = { .hash = hash };
+    const LibraryEntry* entry = bsearch(&key, library->entries, library->count, sizeof(LibraryEntry), compare_hashes);
+    return entry != NULL ? (int32_t)(entry - library->entries) : -1;
+}
+
+int load_library_rom(CPU* cpu, const RomLibrary* library, uint32_t index) {
+    const LibraryEntry* entry = &library->entries[index];
+    return load_rom_data(cpu, library->data + entry->offset, entry->size);
+}
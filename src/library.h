@@ -0,0 +1,69 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "romdb.h"
+
+/*
+ * ROM library: many ROMs packed into one file that is mmap'ed, with an index
+ * sorted by content hash (hash_rom()). Each entry holds the ROM's size, the
+ * machine it was detected as and its quirk profile, so loading a ROM into a
+ * CPU is a lookup and a single memcpy.
+ *
+ * Layout, little-endian: a 16-byte header ("C8RL", version, ROM count,
+ * source file count), LIBRARY_ENTRY_SIZE bytes per ROM in hash order, then
+ * the ROM contents. Identical ROMs are stored once.
+ */
+#define LIBRARY_MAGIC "C8RL"
+#define LIBRARY_VERSION 1
+#define LIBRARY_HEADER_SIZE 16
+#define LIBRARY_ENTRY_SIZE 20       // Hash, offset, size, machine, quirk profile, padding
+#define LIBRARY_FILE "library.c8l"  // Index kept inside a ROM directory
+
+typedef struct {
+    uint64_t hash;
+    uint32_t offset;        // Of the ROM contents from the start of the file
+    uint32_t size;
+    uint8_t machine;        // Machine
+    uint8_t quirks;         // QuirkProfile
+} LibraryEntry;
+
+typedef struct {
+    const uint8_t* data;    // The whole file, mapped read-only
+    size_t size;
+    LibraryEntry* entries;  // Sorted by hash
+    uint32_t count;
+} RomLibrary;
+
+/*
+ * Packs every regular file in `dir` that fits in memory into the library
+ * file `out_path`. Each ROM's machine is guessed from the instructions it
+ * uses; its quirk profile comes from `db` when listed there (db may be NULL),
+ * otherwise from the machine. Prints "hash path" for each ROM.
+ */
+int build_library(const char* dir, const char* out_path, const RomDatabase* db);
+
+/*
+ * Opens a library file, or a directory of ROMs: then its LIBRARY_FILE is
+ * used, and (re)built first if it is missing or older than any ROM.
+ * ROMs listed in `db` (may be NULL) get its quirks and machine, whatever
+ * the index was built with.
+ */
+int open_library(RomLibrary* library, const char* path, const RomDatabase* db);
+void close_library(RomLibrary* library);
+
+// Index of the ROM with this hash, -1 if the library doesn't have it
+int32_t find_library_rom(const RomLibrary* library, uint64_t hash);
+
+/*
+ * Copies ROM `index` into memory, like load_rom(). Call set_machine() and
+ * set_quirks() first, usually with the entry's machine and quirks.
+ */
+int load_library_rom(CPU* cpu, const RomLibrary* library, uint32_t index);
+
+// Best guess of the machine a ROM was written for, from the instructions it contains
+Machine detect_machine(const uint8_t* rom, size_t size);
+
+#endif
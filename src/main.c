@@ -1,41 +1,1104 @@
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include "cpu.h"
 #include "display.h"
+#include "frames.h"
 #include "error.h"
 #include "audio.h"
+#include "input.h"
+#include "scheduler.h"
+#include "backend.h"
+#include "engine.h"
+#include "soa.h"
+#include "snapshot.h"
+#include "rewind.h"
+#include "movie.h"
+#include "profile.h"
+#include "idle.h"
+#include "romdb.h"
+#include "library.h"
+#include "shmring.h"
+#include "video.h"
+#include "analysis.h"
+#include "debugger.h"
 
-const uint32_t REFRESH_RATE = 1000 / 60; // 60 Hz
-uint32_t CLOCK_SPEED = 1000 / 700; // 700 instructions per second
+// Everything that can be set from the command line
+typedef struct {
+    const char* rom_path;
+    uint32_t clock_speed;
+    int quirks;                 // QuirkProfile, -1: from the ROM database or the machine
+    Machine machine;
+    int machine_set;
+    const char* rom_db_path;
+    const char* library_path;
+    int headless;
+    int uncapped;
+    int show_stats;
+    uint64_t max_frames;
+    BackendType backend_type;
+    int lockstep;
+    Palette palette;
+    uint8_t phosphor_decay;
+    const char* kernel_name;
+    uint32_t instances;
+    uint32_t threads;
+    int soa;
+    int verify;
+    const char* state_path;
+    const char* load_state_path;
+    int rewind_mb;              // -1: default (on in the window, off headless)
+    const char* record_path;
+    const char* play_path;
+    uint64_t seed;
+    int seed_set;
+    const char* profile_prefix;
+    int idle_skip;
+    uint32_t audio_latency;     // Milliseconds
+    const char* wav_path;
+    const char* shm_name;
+    const char* video_path;
+    const char* analysis_dir;
+    const uint8_t* idle_hints;  // From the --analyze pass, NULL without it
+    int debug;
+} Options;
+
+// Where finished frames go besides the window, each NULL unless asked for
+typedef struct {
+    ShmRing* shm;
+    VideoRecorder* video;
+} FrameSinks;
+
+static volatile sig_atomic_t quit_requested = 0;
+
+// Hands frame `number` (frames run so far) to the shared memory ring and the video recorder
+static void finish_frame(const FrameSinks* sinks, const CPU* cpu, uint64_t number) {
+    if (sinks->shm != NULL) {
+        publish_shm_frame(sinks->shm, cpu, number);
+    }
+    if (sinks->video != NULL) {
+        record_video_frame(sinks->video, cpu);
+    }
+}
+
+static void handle_signal(int sig) {
+    (void)sig;
+    quit_requested = 1;
+}
+
+static int run_backend_runner(void* context, CPU* cpu, uint32_t count) {
+    return run_backend(context, cpu, count);
+}
+
+// Runs one frame's budget, skipping idle loops unless `idle` is NULL
+static int run_frame(CPU* cpu, Backend* backend, uint32_t budget, IdleStats* idle) {
+    if (idle == NULL) {
+        return run_backend(backend, cpu, budget);
+    }
+    return run_skipping_idle(cpu, budget, run_backend_runner, backend, idle);
+}
+
+/*
+ * Runs the CPU without a window or audio device, the sound goes to a WAV
+ * file with --wav and the frames to --shm and --video.
+ * Each 60 Hz tick executes a batch of clock_speed / 60 instructions
+ * and then updates the timers. When uncapped, ticks are run back to back
+ * instead of being paced to real time.
+ */
+static int run_headless(CPU* cpu, Backend* backend, Movie* movie, const FrameSinks* sinks, const Options* options) {
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    uint64_t max_frames = options->max_frames;
+
+    // Recording only, to measure the cost and size of the history
+    Rewind rewind;
+    int recording = options->rewind_mb > 0;
+    if (recording && initialize_rewind(&rewind, (size_t)options->rewind_mb << 20, REWIND_KEYFRAME_INTERVAL) < 0) {
+        return 1;
+    }
+
+    Audio audio;
+    if (options->wav_path == NULL) {
+        initialize_null_audio(&audio);
+    } else if (initialize_wav_audio(&audio, options->wav_path) < 0) {
+        if (recording) {
+            cleanup_rewind(&rewind);
+        }
+        return 1;
+    }
+
+    IdleStats idle_stats = { .hints = options->idle_hints };
+    IdleStats* idle = options->idle_skip ? &idle_stats : NULL;
+
+    Scheduler scheduler;
+    scheduler_init(&scheduler, options->clock_speed);
+    int status = 0;
+    int movie_ended = 0;
+    SoundEvent sound;
+
+    while (!quit_requested && !movie_ended && status == 0 && (max_frames == 0 || scheduler.frames < max_frames)) {
+        uint32_t due = options->uncapped ? 1 : scheduler_wait(&scheduler);
+
+        for (uint32_t i = 0; i < due && (max_frames == 0 || scheduler.frames < max_frames); i++) {
+            if (movie != NULL && movie_frame(movie, cpu, scheduler.frames)) {
+                movie_ended = 1;
+                break;
+            }
+
+            uint32_t budget = scheduler_frame_budget(&scheduler);
+            if (run_frame(cpu, backend, budget, idle) < 0) {
+                status = 1;
+                break;
+            }
+            sound_event(cpu, scheduler.frames, &sound);
+            queue_sound(&audio, &sound);
+            tick_timers(cpu);
+            if (recording) {
+                record_rewind_frame(&rewind, cpu);
+            }
+            scheduler_frame_done(&scheduler, budget);
+            finish_frame(sinks, cpu, scheduler.frames);
+        }
+
+        if (options->show_stats) {
+            scheduler_report_periodic(&scheduler, stderr);
+        }
+    }
+
+    scheduler_report(&scheduler, stdout);
+    if (idle != NULL) {
+        idle_report(idle, scheduler.instructions, stdout);
+    }
+    if (backend->reference != NULL) {
+        printf("lockstep blocks checked: %llu\n", (unsigned long long)backend->checked_blocks);
+    }
+    if (recording) {
+        rewind_report(&rewind, stdout);
+        cleanup_rewind(&rewind);
+    }
+    cleanup_audio(&audio);
+    if (movie != NULL && finish_movie(movie, cpu, scheduler.frames) < 0) {
+        status = 1;
+    } else if (movie != NULL && movie->mode == MOVIE_PLAYBACK) {
+        printf("movie: reproduced %llu frames exactly\n", (unsigned long long)scheduler.frames);
+    }
+    return status;
+}
+
+static void debugger_frame_done(void* context, const CPU* cpu, uint64_t frame) {
+    finish_frame(context, cpu, frame);
+}
+
+/*
+ * Runs the ROM under the debugger, driven from the terminal (see debugger.h).
+ * There is no window or audio, frames still go to --shm and --video.
+ */
+static int run_debugging(CPU* cpu, const FrameSinks* sinks, const uint8_t* address_flags, const Options* options) {
+    // Ctrl-C stops the running command instead of quitting
+    signal(SIGINT, handle_signal);
+
+    Debugger* debugger = malloc(sizeof(Debugger));
+    if (debugger == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the debugger");
+        return 1;
+    }
+    initialize_debugger(debugger, address_flags);
+
+    int status = run_debugger(debugger, cpu, options->clock_speed, debugger_frame_done, (void*)sinks,
+                              &quit_requested, stdin, stdout) < 0 ? 1 : 0;
+    free(debugger);
+    return status;
+}
+
+// Frames per engine dispatch when uncapped, amortizes the barrier between batches
+#define ENGINE_BATCH_FRAMES 60
+
+/*
+ * Runs many copies of the loaded ROM in parallel without a window, copy i
+ * seeded with seed + i. Reports aggregate instructions/sec over all instances.
+ */
+static int run_instances(const CPU* cpu, const Options* options) {
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    Engine* engine = create_engine(cpu, options->instances, options->seed, options->threads, options->clock_speed);
+    if (engine == NULL) {
+        return 1;
+    }
+    engine->idle_skip = options->idle_skip;
+
+    uint64_t max_frames = options->max_frames;
+
+    Scheduler scheduler;
+    scheduler_init(&scheduler, options->clock_speed);
+
+    while (!quit_requested && (max_frames == 0 || scheduler.frames < max_frames)) {
+        uint32_t frames = options->uncapped ? ENGINE_BATCH_FRAMES : scheduler_wait(&scheduler);
+        if (max_frames != 0 && scheduler.frames + frames > max_frames) {
+            frames = max_frames - scheduler.frames;
+        }
+
+        uint64_t instructions = run_engine_frames(engine, frames);
+        scheduler_frames_done(&scheduler, frames, instructions);
+
+        if (options->show_stats) {
+            scheduler_report_periodic(&scheduler, stderr);
+        }
+    }
+
+    scheduler_report(&scheduler, stdout);
+    printf("instances: %u\n", engine->count);
+    printf("worker threads: %u\n", engine->num_workers);
+    if (engine->idle_skip) {
+        IdleStats idle = engine_idle_stats(engine);
+        idle_report(&idle, scheduler.instructions, stdout);
+    }
+
+    destroy_engine(engine);
+    return 0;
+}
+
+// Keys --verify holds on lane `lane` in frame `frame`, different on every lane so they diverge
+static uint16_t verify_keys(uint32_t lane, uint64_t frame) {
+    uint64_t z = ((uint64_t)lane << 32 | (frame / 8)) * 0x9E3779B97F4A7C15ull;
+    return (uint16_t)(z >> 48);
+}
+
+/*
+ * Runs the instances on the SoA executor on this thread. Instance i is
+ * seeded with seed + i. With --verify, a scalar CPU per lane runs alongside
+ * and every lane is compared against it after each frame, while each lane
+ * gets its own key presses so the instances take different paths.
+ */
+static int run_soa_instances(const CPU* cpu, const Options* options) {
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    uint32_t count = options->instances;
+    SoaPool* pool = create_soa_pool(cpu, count, options->seed);
+    if (pool == NULL) {
+        return 1;
+    }
+
+    CPU* reference = NULL;
+    CPU* lane = NULL;
+    if (options->verify) {
+        reference = malloc((size_t)count * sizeof(CPU));
+        lane = malloc(sizeof(CPU));
+        if (reference == NULL || lane == NULL) {
+            print_error(ERROR_MEMORY, "Could not allocate the reference CPUs");
+            free(reference);
+            free(lane);
+            destroy_soa_pool(pool);
+            return 1;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            reference[i] = *cpu;
+            seed_cpu(&reference[i], options->seed + i);
+        }
+    }
+
+    uint64_t max_frames = options->max_frames;
+
+    Scheduler scheduler;
+    scheduler_init(&scheduler, options->clock_speed);
+    int status = 0;
+
+    while (!quit_requested && status == 0 && (max_frames == 0 || scheduler.frames < max_frames)) {
+        uint32_t due = options->uncapped ? 1 : scheduler_wait(&scheduler);
+
+        for (uint32_t f = 0; f < due && status == 0 && (max_frames == 0 || scheduler.frames < max_frames); f++) {
+            uint32_t budget = frame_budget(options->clock_speed, scheduler.frames);
+            if (reference != NULL) {
+                for (uint32_t i = 0; i < count; i++) {
+                    set_keypad_mask(&reference[i], verify_keys(i, scheduler.frames));
+                    set_soa_keypad(pool, i, reference[i].keypad);
+                }
+            }
+            run_soa(pool, budget);
+            tick_soa_timers(pool);
+
+            if (reference != NULL) {
+                for (uint32_t i = 0; i < count; i++) {
+                    run_instructions(&reference[i], budget);
+                    tick_timers(&reference[i]);
+                    export_soa_lane(pool, i, lane);
+                    if (cpu_diff(&reference[i], lane, stderr) != 0) {
+                        fprintf(stderr, "SoA lane %u diverged in frame %llu\n", i, (unsigned long long)scheduler.frames);
+                        status = 1;
+                        break;
+                    }
+                }
+            }
+
+            scheduler_frames_done(&scheduler, 1, (uint64_t)budget * count);
+        }
+
+        if (options->show_stats) {
+            scheduler_report_periodic(&scheduler, stderr);
+        }
+    }
+
+    scheduler_report(&scheduler, stdout);
+    printf("instances: %u\n", count);
+    printf("SoA steps: %llu (uniform %llu, vector groups %llu, scalar lane ops %llu)\n",
+           (unsigned long long)pool->steps, (unsigned long long)pool->uniform_steps,
+           (unsigned long long)pool->vector_groups, (unsigned long long)pool->scalar_ops);
+    if (reference != NULL && status == 0) {
+        printf("verified against scalar: %u lanes, %llu frames\n", count, (unsigned long long)scheduler.frames);
+    }
+
+    free(reference);
+    free(lane);
+    destroy_soa_pool(pool);
+    return status;
+}
+
+// ROMs run at the same time by --library without --instances
+#define LIBRARY_BATCH 256
+
+/*
+ * Runs every ROM in the library for --frames frames on the engine, a batch
+ * of --instances ROMs at a time, and prints each ROM's final state hash.
+ */
+static int run_library(const CPU* cpu, const RomLibrary* library, const Options* options) {
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    uint32_t batch = options->instances > 0 ? options->instances : LIBRARY_BATCH;
+    if (batch > library->count) {
+        batch = library->count;
+    }
+    if (batch == 0) {
+        printf("roms: 0\n");
+        return 0;
+    }
+
+    Engine* engine = create_engine(cpu, batch, options->seed, options->threads, options->clock_speed);
+    Snapshot* snapshot = malloc(sizeof(Snapshot));
+    if (engine == NULL || snapshot == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the library run");
+        destroy_engine(engine);
+        free(snapshot);
+        return 1;
+    }
+    engine->idle_skip = options->idle_skip;
+
+    uint64_t start = scheduler_now_ns();
+    uint64_t instructions = 0;
+    uint32_t done = 0;
+    int status = 0;
+
+    for (uint32_t first = 0; first < library->count && !quit_requested && status == 0; first += batch) {
+        uint32_t count = library->count - first < batch ? library->count - first : batch;
+
+        // Every instance starts from power-on with its own ROM
+        for (uint32_t i = 0; i < count && status == 0; i++) {
+            const LibraryEntry* entry = &library->entries[first + i];
+            engine->cpus[i] = *cpu;
+            set_machine(&engine->cpus[i], (Machine)entry->machine);
+            set_quirks(&engine->cpus[i], (QuirkProfile)entry->quirks);
+            status = load_library_rom(&engine->cpus[i], library, first + i) < 0;
+        }
+        if (status != 0) {
+            break;
+        }
+
+        restart_engine(engine, count);
+        for (uint64_t frame = 0; frame < options->max_frames && !quit_requested; frame += ENGINE_BATCH_FRAMES) {
+            uint64_t frames = options->max_frames - frame < ENGINE_BATCH_FRAMES ? options->max_frames - frame : ENGINE_BATCH_FRAMES;
+            instructions += run_engine_frames(engine, (uint32_t)frames);
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            const LibraryEntry* entry = &library->entries[first + i];
+            save_snapshot(&engine->cpus[i], snapshot);
+            printf("rom %016llx %s state %08x\n", (unsigned long long)entry->hash,
+                   quirks_name((QuirkProfile)entry->quirks), hash_snapshot(snapshot));
+        }
+        done += count;
+    }
+
+    double seconds = (scheduler_now_ns() - start) / 1e9;
+    printf("roms: %u\n", done);
+    printf("frames per rom: %llu\n", (unsigned long long)options->max_frames);
+    printf("instructions: %llu\n", (unsigned long long)instructions);
+    printf("instructions/sec: %.0f\n", seconds > 0 ? instructions / seconds : 0.0);
+    printf("worker threads: %u\n", engine->num_workers);
+
+    free(snapshot);
+    destroy_engine(engine);
+    return status;
+}
+
+// Save state and rewind hotkeys
+#define KEY_SAVE_STATE SDL_SCANCODE_F5
+#define KEY_LOAD_STATE SDL_SCANCODE_F9
+#define KEY_REWIND SDL_SCANCODE_BACKSPACE
+#define KEY_DUMP_PROFILE SDL_SCANCODE_F7
+
+// Hotkey requests from the render thread, carried out by the emulation thread between frames
+#define COMMAND_SAVE_STATE 0x1u
+#define COMMAND_LOAD_STATE 0x2u
+#define COMMAND_DUMP_PROFILE 0x4u
+
+// Keeps the lockstep reference in sync after the state was replaced
+static void sync_reference(CPU* cpu, Backend* backend) {
+    if (backend->reference != NULL) {
+        *backend->reference = *cpu;
+    }
+}
+
+/*
+ * State shared by the render thread (the main thread, which owns SDL) and
+ * the emulation thread. The CPU belongs to the emulation thread alone:
+ * frames go out through the triple buffer, keys and hotkeys come in
+ * through the atomics.
+ */
+typedef struct {
+    CPU* cpu;
+    Backend* backend;
+    Movie* movie;
+    const Options* options;
+    Audio* audio;
+    const FrameSinks* sinks;
+
+    TripleBuffer frames;
+    Uint32 wake_event;          // SDL event type telling the render thread a frame is ready
+    atomic_int wake_pending;    // A wake event is queued and not handled yet
+    atomic_uint keys;           // Keypad mask, from handle_input()
+    atomic_uint commands;       // COMMAND_* bits
+    atomic_int rewinding;       // Rewind key held
+    atomic_int quit;            // The window was closed
+    atomic_int finished;        // The emulation thread is done
+    int status;
+} Session;
+
+static void wake_renderer(Session* session) {
+    if (!atomic_exchange_explicit(&session->wake_pending, 1, memory_order_acq_rel)) {
+        SDL_Event event;
+        SDL_zero(event);
+        event.type = session->wake_event;
+        SDL_PushEvent(&event);
+    }
+}
+
+// Carries out the hotkeys pressed since the last frame
+static void run_commands(Session* session, Snapshot* slot) {
+    CPU* cpu = session->cpu;
+    const Options* options = session->options;
+    unsigned commands = atomic_exchange_explicit(&session->commands, 0, memory_order_acquire);
+
+    if (commands & COMMAND_SAVE_STATE) {
+        save_snapshot(cpu, slot);
+        if (write_snapshot_file(slot, options->state_path) == 0) {
+            printf("State saved to %s\n", options->state_path);
+        }
+    }
+    if (commands & COMMAND_LOAD_STATE) {
+        if (slot->size == 0 && read_snapshot_file(slot, options->state_path) < 0) {
+            slot->size = 0;
+        } else if (load_snapshot(cpu, slot, NULL) == 0) {
+            sync_reference(cpu, session->backend);
+        }
+    }
+#ifdef CHIP8_PROFILE
+    if ((commands & COMMAND_DUMP_PROFILE) && cpu->profile != NULL) {
+        if (dump_profile(cpu->profile, cpu, options->profile_prefix) == 0) {
+            printf("Profile written to %s.txt and %s.folded\n",
+                   options->profile_prefix, options->profile_prefix);
+        }
+    }
+#endif
+}
+
+/*
+ * The emulation thread: runs frames on the scheduler's real-time clock,
+ * queues their sound and publishes their framebuffer. A slow present on
+ * the render thread no longer delays the CPU or the timers.
+ */
+static void* emulation_thread(void* arg) {
+    Session* session = arg;
+    CPU* cpu = session->cpu;
+    Backend* backend = session->backend;
+    Movie* movie = session->movie;
+    const Options* options = session->options;
+
+    // Held rewind key steps back one recorded frame per frame
+    // Rewinding or loading a state would break a movie
+    Rewind rewind;
+    int rewind_enabled = options->rewind_mb != 0 && movie == NULL;
+    size_t rewind_budget = options->rewind_mb > 0 ? (size_t)options->rewind_mb << 20 : REWIND_DEFAULT_BUDGET;
+    if (rewind_enabled && initialize_rewind(&rewind, rewind_budget, REWIND_KEYFRAME_INTERVAL) < 0) {
+        session->status = 1;
+        atomic_store(&session->finished, 1);
+        wake_renderer(session);
+        return NULL;
+    }
+
+    // A skipped idle loop leaves the rest of the frame to sleep
+    IdleStats idle_stats = { .hints = options->idle_hints };
+    IdleStats* idle = options->idle_skip ? &idle_stats : NULL;
+
+    Scheduler scheduler;
+    scheduler_init(&scheduler, options->clock_speed);
+
+    // F5 keeps a copy in memory and writes it to disk, F9 restores it
+    Snapshot slot;
+    slot.size = 0;
+
+    SoundEvent sound;
+    int quit = 0;
+
+    while (!quit && !atomic_load_explicit(&session->quit, memory_order_relaxed)) {
+        // Sleep until the next frame is due
+        uint32_t due = scheduler_wait(&scheduler);
+
+        run_commands(session, &slot);
+        int rewinding = rewind_enabled && atomic_load_explicit(&session->rewinding, memory_order_relaxed);
+
+        // Run every frame that is due, normally one, more after a stall
+        for (uint32_t i = 0; i < due; i++) {
+            if (rewinding) {
+                // Stays on the oldest frame once the history runs out
+                if (rewind_frame(&rewind, cpu) == 0) {
+                    sync_reference(cpu, backend);
+                }
+                sound_event(cpu, scheduler.frames, &sound);
+                sound.on = 0;
+                queue_sound(session->audio, &sound);
+                scheduler_frame_done(&scheduler, 0);
+                finish_frame(session->sinks, cpu, scheduler.frames);
+                continue;
+            }
+
+            // The keypad as the render thread last saw it, a movie may replace it
+            set_keypad_mask(cpu, (uint16_t)atomic_load_explicit(&session->keys, memory_order_relaxed));
+            if (movie != NULL && movie_frame(movie, cpu, scheduler.frames)) {
+                quit = 1;
+                break;
+            }
+
+            uint32_t budget = scheduler_frame_budget(&scheduler);
+            if (run_frame(cpu, backend, budget, idle) < 0) {
+                quit = 1;
+                session->status = 1;
+                break;
+            }
+
+            // The buzzer follows the sound timer, timestamped with the frame
+            sound_event(cpu, scheduler.frames, &sound);
+            queue_sound(session->audio, &sound);
+            tick_timers(cpu);
+
+            if (rewind_enabled) {
+                record_rewind_frame(&rewind, cpu);
+            }
+
+            scheduler_frame_done(&scheduler, budget);
+            finish_frame(session->sinks, cpu, scheduler.frames);
+        }
+
+        publish_frame(&session->frames, cpu, scheduler.frames);
+        wake_renderer(session);
+
+        if (options->show_stats) {
+            scheduler_report_periodic(&scheduler, stdout);
+        }
+    }
+
+    if (options->show_stats) {
+        scheduler_report(&scheduler, stdout);
+        if (idle != NULL) {
+            idle_report(idle, scheduler.instructions, stdout);
+        }
+        if (rewind_enabled) {
+            rewind_report(&rewind, stdout);
+        }
+    }
+
+    if (movie != NULL && finish_movie(movie, cpu, scheduler.frames) < 0) {
+        session->status = 1;
+    }
+
+    if (rewind_enabled) {
+        cleanup_rewind(&rewind);
+    }
+
+    atomic_store(&session->finished, 1);
+    wake_renderer(session);
+    return NULL;
+}
+
+// Window events and hotkeys, on the render thread
+static void handle_event(Session* session, Display* display, const SDL_Event* event) {
+    const SDL_KeyboardEvent* key = &event->key;
+
+    switch (event->type) {
+        case SDL_QUIT:
+            atomic_store(&session->quit, 1);
+            break;
+        case SDL_WINDOWEVENT:
+            // The window contents may have been lost, draw again even if nothing changed
+            display->needs_redraw = 1;
+            break;
+        case SDL_KEYDOWN:
+            if (key->keysym.scancode == KEY_SAVE_STATE && !key->repeat) {
+                atomic_fetch_or(&session->commands, COMMAND_SAVE_STATE);
+            } else if (key->keysym.scancode == KEY_LOAD_STATE && !key->repeat && session->movie == NULL) {
+                atomic_fetch_or(&session->commands, COMMAND_LOAD_STATE);
+            } else if (key->keysym.scancode == KEY_REWIND) {
+                atomic_store(&session->rewinding, 1);
+            } else if (key->keysym.scancode == KEY_DUMP_PROFILE) {
+                atomic_fetch_or(&session->commands, COMMAND_DUMP_PROFILE);
+            } else {
+                handle_input(&session->keys, *key);
+            }
+            break;
+        case SDL_KEYUP:
+            if (key->keysym.scancode == KEY_REWIND) {
+                atomic_store(&session->rewinding, 0);
+            }
+            handle_input(&session->keys, *key);
+            break;
+    }
+}
+
+static int run_windowed(CPU* cpu, Backend* backend, Movie* movie, const FrameSinks* sinks, const Options* options) {
+    Display display;
+    if (initialize_display(&display) < 0) {
+        print_error(ERROR_DISPLAY_INIT, "Display could not be initialized");
+        return 1;
+    }
+
+    set_palette(&display, options->palette);
+    display.phosphor_decay = options->phosphor_decay;
+    if (options->kernel_name != NULL) {
+        display.kernel = select_expand_kernel(options->kernel_name);
+        if (display.kernel == NULL) {
+            print_error(ERROR_DISPLAY_INIT, "Unknown or unsupported pixel kernel");
+            cleanup_display(&display);
+            return 1;
+        }
+    }
+
+    Audio audio;
+
+    if (initialize_audio(&audio, options->audio_latency) < 0) {
+        return 1;
+    }
+
+    Session shared;
+    Session* session = &shared;
+    session->cpu = cpu;
+    session->backend = backend;
+    session->movie = movie;
+    session->options = options;
+    session->audio = &audio;
+    session->sinks = sinks;
+    session->status = 0;
+    initialize_triple_buffer(&session->frames);
+    session->wake_event = SDL_RegisterEvents(1);
+    atomic_init(&session->wake_pending, 0);
+    atomic_init(&session->keys, keypad_mask(cpu));
+    atomic_init(&session->commands, 0);
+    atomic_init(&session->rewinding, 0);
+    atomic_init(&session->quit, 0);
+    atomic_init(&session->finished, 0);
+
+    pthread_t thread;
+    if (session->wake_event == (Uint32)-1 || pthread_create(&thread, NULL, emulation_thread, session) != 0) {
+        print_error(ERROR_CPU_INIT, "Could not start the emulation thread");
+        cleanup_audio(&audio);
+        cleanup_display(&display);
+        return 1;
+    }
+
+    // Render loop: sleeps until the emulation thread publishes a frame or the user does something
+    SDL_Event event;
+    while (!atomic_load(&session->finished)) {
+        if (!SDL_WaitEvent(&event)) {
+            continue;
+        }
+        do {
+            if (event.type == session->wake_event) {
+                atomic_store_explicit(&session->wake_pending, 0, memory_order_release);
+            } else {
+                handle_event(session, &display, &event);
+            }
+        } while (SDL_PollEvent(&event));
+
+        uint64_t dirty_rows;
+        const Frame* frame = acquire_frame(&session->frames, &dirty_rows);
+        update_display(&display, frame != NULL ? frame : front_frame(&session->frames), dirty_rows);
+    }
+
+    pthread_join(thread, NULL);
+
+    // Cleanup
+    cleanup_display(&display);
+    cleanup_audio(&audio);
+
+    return session->status;
+}
+
+static void print_usage(const char* program) {
+    printf("Usage: %s -r rom_path [-c clock_speed] [-o] [-m chip8|schip|xochip] [-q vip|chip48|schip|xochip] [--rom-db PATH] [--library PATH] [-s] [-b interpreter|threaded] [--lockstep]\n"
+           "       [--palette RRGGBB,RRGGBB] [--phosphor DECAY] [--kernel avx2|sse2|scalar]\n"
+           "       [--headless [--frames N] [--uncapped] [--instances N [--threads N | --soa [--verify]]]]\n"
+           "       [--state PATH] [--load-state PATH] [--rewind MB]\n"
+           "       [--seed N] [--record MOVIE | --play MOVIE] [--profile PREFIX] [--no-idle-skip]\n"
+           "       [--audio-latency MS] [--wav PATH] [--shm NAME] [--video PATH] [--analyze DIR] [--debug]\n", program);
+}
+
+// Parses "RRGGBB,RRGGBB" (on color, off color)
+static int parse_palette(const char* text, Palette* palette) {
+    unsigned int on, off;
+    if (sscanf(text, "%6x,%6x", &on, &off) != 2) {
+        return -1;
+    }
+
+    palette->on = (on << 8) | 0xFF;
+    palette->off = (off << 8) | 0xFF;
+    return 0;
+}
 
 int main(int argc, char** argv) {
-    char* rom_path = NULL;
-    uint32_t clock_speed = 700;
-    int original_mode = 0;
+    Options options = {
+        .rom_path = NULL,
+        .clock_speed = 700,
+        .quirks = -1,
+        .machine = MACHINE_CHIP8,
+        .machine_set = 0,
+        .rom_db_path = NULL,
+        .library_path = NULL,
+        .headless = 0,
+        .uncapped = 0,
+        .show_stats = 0,
+        .max_frames = 0,
+        .backend_type = BACKEND_INTERPRETER,
+        .lockstep = 0,
+        .palette = { DEFAULT_PALETTE_ON, DEFAULT_PALETTE_OFF },
+        .phosphor_decay = 0,
+        .kernel_name = NULL,
+        .instances = 0,
+        .threads = 0,
+        .soa = 0,
+        .verify = 0,
+        .state_path = NULL,
+        .load_state_path = NULL,
+        .rewind_mb = -1,
+        .record_path = NULL,
+        .play_path = NULL,
+        .seed = 0,
+        .seed_set = 0,
+        .profile_prefix = NULL,
+        .idle_skip = 1,
+        .audio_latency = AUDIO_DEFAULT_LATENCY,
+        .wav_path = NULL,
+        .shm_name = NULL,
+        .video_path = NULL,
+        .analysis_dir = NULL,
+        .idle_hints = NULL,
+        .debug = 0,
+    };
+
+    static const struct option long_options[] = {
+        {"rom",      required_argument, NULL, 'r'},
+        {"clock",    required_argument, NULL, 'c'},
+        {"original", no_argument,       NULL, 'o'},
+        {"machine",  required_argument, NULL, 'm'},
+        {"quirks",   required_argument, NULL, 'q'},
+        {"rom-db",   required_argument, NULL, 'B'},
+        {"library",  required_argument, NULL, 'G'},
+        {"headless", no_argument,       NULL, 'H'},
+        {"frames",   required_argument, NULL, 'f'},
+        {"uncapped", no_argument,       NULL, 'u'},
+        {"stats",    no_argument,       NULL, 's'},
+        {"backend",  required_argument, NULL, 'b'},
+        {"lockstep", no_argument,       NULL, 'l'},
+        {"palette",  required_argument, NULL, 'P'},
+        {"phosphor", required_argument, NULL, 'D'},
+        {"kernel",   required_argument, NULL, 'K'},
+        {"instances", required_argument, NULL, 'N'},
+        {"threads",  required_argument, NULL, 'T'},
+        {"soa",      no_argument,       NULL, 'S'},
+        {"verify",   no_argument,       NULL, 'V'},
+        {"state",    required_argument, NULL, 'A'},
+        {"load-state", required_argument, NULL, 'L'},
+        {"rewind",   required_argument, NULL, 'W'},
+        {"seed",     required_argument, NULL, 'E'},
+        {"record",   required_argument, NULL, 'R'},
+        {"play",     required_argument, NULL, 'Y'},
+        {"profile",  required_argument, NULL, 'F'},
+        {"no-idle-skip", no_argument,   NULL, 'I'},
+        {"audio-latency", required_argument, NULL, 'M'},
+        {"wav",      required_argument, NULL, 'O'},
+        {"shm",      required_argument, NULL, 'Z'},
+        {"video",    required_argument, NULL, 'X'},
+        {"analyze",  required_argument, NULL, 'J'},
+        {"debug",    no_argument,       NULL, 'Q'},
+        {NULL, 0, NULL, 0}
+    };
 
     int opt;
-    while ((opt = getopt(argc, argv, "r:c:o")) != -1) {
+    while ((opt = getopt_long(argc, argv, "r:c:om:q:Hf:usb:l", long_options, NULL)) != -1) {
         switch(opt) {
             case 'r':
-                rom_path = optarg;
+                options.rom_path = optarg;
                 break;
             case 'c':
-                clock_speed = atoi(optarg);
+                options.clock_speed = atoi(optarg);
                 break;
             case 'o':
-                original_mode = 1;
+                // The original CHIP-8 is the COSMAC VIP interpreter
+                options.quirks = QUIRKS_VIP;
+                break;
+            case 'm':
+                if (parse_machine(optarg, &options.machine) < 0) {
+                    print_error(ERROR_MISSING_ARGS, "Machine must be 'chip8', 'schip' or 'xochip'");
+                    return 1;
+                }
+                options.machine_set = 1;
+                break;
+            case 'q': {
+                QuirkProfile quirks;
+                if (parse_quirks(optarg, &quirks) < 0) {
+                    print_error(ERROR_MISSING_ARGS, "Quirks must be 'vip', 'chip48', 'schip' or 'xochip'");
+                    return 1;
+                }
+                options.quirks = quirks;
+                break;
+            }
+            case 'B':
+                options.rom_db_path = optarg;
+                break;
+            case 'G':
+                options.library_path = optarg;
+                break;
+            case 'H':
+                options.headless = 1;
+                break;
+            case 'f':
+                options.max_frames = strtoull(optarg, NULL, 10);
+                break;
+            case 'u':
+                options.uncapped = 1;
+                break;
+            case 's':
+                options.show_stats = 1;
+                break;
+            case 'b':
+                if (parse_backend(optarg, &options.backend_type) < 0) {
+                    print_error(ERROR_MISSING_ARGS, "Backend must be 'interpreter' or 'threaded'");
+                    return 1;
+                }
+                break;
+            case 'l':
+                options.lockstep = 1;
+                break;
+            case 'P':
+                if (parse_palette(optarg, &options.palette) < 0) {
+                    print_error(ERROR_MISSING_ARGS, "Palette must look like FFFFFF,000000");
+                    return 1;
+                }
+                break;
+            case 'D':
+                options.phosphor_decay = atoi(optarg);
+                break;
+            case 'K':
+                options.kernel_name = optarg;
+                break;
+            case 'N':
+                options.instances = atoi(optarg);
+                break;
+            case 'T':
+                options.threads = atoi(optarg);
+                break;
+            case 'S':
+                options.soa = 1;
+                break;
+            case 'V':
+                options.verify = 1;
+                break;
+            case 'A':
+                options.state_path = optarg;
+                break;
+            case 'L':
+                options.load_state_path = optarg;
+                break;
+            case 'W':
+                options.rewind_mb = atoi(optarg);
+                break;
+            case 'E':
+                options.seed = strtoull(optarg, NULL, 0);
+                options.seed_set = 1;
+                break;
+            case 'R':
+                options.record_path = optarg;
+                break;
+            case 'Y':
+                options.play_path = optarg;
+                break;
+            case 'F':
+#ifdef CHIP8_PROFILE
+                options.profile_prefix = optarg;
+                break;
+#else
+                print_error(ERROR_MISSING_ARGS, "--profile needs a build with profiling (make PROFILE=1)");
+                return 1;
+#endif
+            case 'I':
+                options.idle_skip = 0;
+                break;
+            case 'M':
+                options.audio_latency = atoi(optarg);
+                break;
+            case 'O':
+                options.wav_path = optarg;
+                break;
+            case 'Z':
+                options.shm_name = optarg;
+                break;
+            case 'X':
+                options.video_path = optarg;
+                break;
+            case 'J':
+                options.analysis_dir = optarg;
+                break;
+            case 'Q':
+                options.debug = 1;
                 break;
             default:
-                printf("Usage: %s -r rom_path [-c clock_speed] [-o]\n", argv[0]);
+                print_usage(argv[0]);
                 return 1;
         }
     }
 
-    if (rom_path == NULL) {
+    if (options.rom_path == NULL && options.library_path == NULL) {
         print_error(ERROR_MISSING_ARGS, "Rom path is required");
         return 1;
     }
 
-    CLOCK_SPEED = 1000 / clock_speed;
+    if (options.clock_speed == 0) {
+        print_error(ERROR_MISSING_ARGS, "Clock speed must be greater than zero");
+        return 1;
+    }
+
+    if (options.debug && (options.instances > 0 || options.record_path != NULL || options.play_path != NULL
+                          || options.lockstep)) {
+        print_error(ERROR_MISSING_ARGS, "--debug can't be combined with --instances, --record, --play or --lockstep");
+        return 1;
+    }
+
+    RomDatabase db = { NULL, 0 };
+    if (options.rom_db_path != NULL && load_rom_db(&db, options.rom_db_path) < 0) {
+        return 1;
+    }
+
+    // With a library, -r is the hash of one of its ROMs, without one every ROM is run
+    RomLibrary library;
+    int32_t library_index = -1;
+    if (options.library_path != NULL) {
+        int opened = open_library(&library, options.library_path, options.rom_db_path != NULL ? &db : NULL);
+        cleanup_rom_db(&db);
+        if (opened < 0) {
+            return 1;
+        }
+
+        if (options.rom_path == NULL) {
+            int status = 1;
+            if (!options.headless || options.max_frames == 0) {
+                print_error(ERROR_MISSING_ARGS, "Running a whole library needs --headless and --frames");
+            } else {
+                CPU* template = malloc(sizeof(CPU));
+                if (template != NULL && initialize_cpu(template) == 0) {
+                    seed_cpu(template, options.seed_set ? options.seed : (uint64_t)time(NULL));
+                    status = run_library(template, &library, &options);
+                }
+                free(template);
+            }
+            close_library(&library);
+            return status;
+        }
+
+        char* end;
+        library_index = find_library_rom(&library, strtoull(options.rom_path, &end, 16));
+        if (*end != '\0' || library_index < 0) {
+            print_error(ERROR_LIBRARY, "-r must be the hash of a ROM in the library");
+            close_library(&library);
+            return 1;
+        }
+
+        const LibraryEntry* entry = &library.entries[library_index];
+        if (options.quirks < 0) {
+            options.quirks = entry->quirks;
+        }
+        if (!options.machine_set) {
+            options.machine = (Machine)entry->machine;
+        }
+    }
+
+    // Known ROMs get their profile and machine from the database, unless they were given
+    // (open_library() already applied it to the library's entries)
+    if (options.rom_db_path != NULL && options.library_path == NULL) {
+        uint64_t hash;
+        if (hash_rom_file(options.rom_path, &hash) < 0) {
+            cleanup_rom_db(&db);
+            return 1;
+        }
+
+        QuirkProfile quirks;
+        Machine machine = options.machine;
+        if (find_rom(&db, hash, &quirks, &machine)) {
+            if (options.quirks < 0) {
+                options.quirks = quirks;
+            }
+            if (!options.machine_set) {
+                options.machine = machine;
+            }
+        } else {
+            printf("ROM %016llx is not in the database\n", (unsigned long long)hash);
+        }
+        cleanup_rom_db(&db);
+    }
+
+    // A movie starts from power-on with the settings it was recorded with
+    Movie movie;
+    Movie* active_movie = NULL;
+    if (options.record_path != NULL || options.play_path != NULL) {
+        if ((options.record_path != NULL && options.play_path != NULL)
+            || options.instances > 0 || options.load_state_path != NULL) {
+            print_error(ERROR_MISSING_ARGS, "--record/--play can't be combined with each other, --instances or --load-state");
+            return 1;
+        }
+
+        if (options.play_path != NULL) {
+            if (start_playback(&movie, options.play_path) < 0) {
+                return 1;
+            }
+            options.clock_speed = movie.clock_speed;
+            options.quirks = movie.quirks;
+            options.machine = (Machine)movie.machine;
+            options.machine_set = 1;
+            options.seed = movie.seed;
+            options.seed_set = 1;
+        }
+        active_movie = &movie;
+    }
+
+    if (!options.seed_set) {
+        options.seed = (uint64_t)time(NULL);
+    }
+
+    if (options.quirks < 0) {
+        options.quirks = default_quirks(options.machine);
+    }
 
     CPU cpu;
     if (initialize_cpu(&cpu) < 0) {
@@ -43,79 +1106,165 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    cpu.original_mode = original_mode;
+    set_machine(&cpu, options.machine);
+    set_quirks(&cpu, (QuirkProfile)options.quirks);
 
-    Display display;
-    if (initialize_display(&display) < 0) {
-        print_error(ERROR_DISPLAY_INIT, "Display could not be initialized");
+    int loaded;
+    uint32_t rom_size = 0;
+    if (library_index >= 0) {
+        loaded = load_library_rom(&cpu, &library, library_index);
+        rom_size = library.entries[library_index].size;
+        close_library(&library);
+    } else {
+        loaded = load_rom(&cpu, options.rom_path);
+        struct stat rom_stat;
+        rom_size = stat(options.rom_path, &rom_stat) == 0 ? (uint32_t)rom_stat.st_size : 0;
+    }
+    if (loaded < 0) {
+        print_error(ERROR_ROM_LOAD, "ROM could not be loaded");
         return 1;
     }
 
-    Audio audio;
+    // Static analysis of the ROM as loaded, cached by its hash
+    Analysis analysis;
+    int analyzed = 0;
+    if (options.analysis_dir != NULL) {
+        int cached = load_analysis(&analysis, options.analysis_dir, &cpu, rom_size);
+        if (cached < 0) {
+            return 1;
+        }
+        printf("%s", cached ? "(cached) " : "");
+        analysis_report(&analysis, stdout);
+        analyzed = 1;
+    }
+
+    seed_cpu(&cpu, options.seed);
 
-    if (initialize_audio(&audio) < 0) {
+    if (options.play_path != NULL && check_movie_memory(&movie, &cpu) < 0) {
         return 1;
     }
-
-    if (load_rom(&cpu, rom_path) < 0) {
-        print_error(ERROR_ROM_LOAD, "ROM could not be loaded");
+    if (options.record_path != NULL
+        && start_recording(&movie, options.record_path, &cpu, options.seed, options.clock_speed) < 0) {
         return 1;
     }
 
-    SDL_Event event;
-    int quit = 0;
-    uint32_t last_updated_time = SDL_GetTicks();
+    if (options.load_state_path != NULL) {
+        Snapshot* snapshot = malloc(sizeof(Snapshot));
+        if (snapshot == NULL) {
+            print_error(ERROR_MEMORY, "Could not allocate the snapshot");
+            return 1;
+        }
 
-    uint32_t last_cpu_cycle = SDL_GetTicks();
+        int loaded = read_snapshot_file(snapshot, options.load_state_path) == 0
+                  && load_snapshot(&cpu, snapshot, NULL) == 0;
+        free(snapshot);
+        if (!loaded) {
+            return 1;
+        }
+    }
 
-    // Main loop
-    while (!quit) {
-        // Handle events
-        while (SDL_PollEvent(&event)) {
-            switch (event.type) {
-                case SDL_QUIT:
-                    quit = 1;
-                    break;
-                case SDL_KEYDOWN:
-                    handle_input(&cpu, event.key);
-                    break;
-                case SDL_KEYUP:
-                    handle_input(&cpu, event.key);
-                    break;
-            }
+    // Default save state file sits next to the ROM
+    char default_state_path[4096];
+    if (options.state_path == NULL) {
+        snprintf(default_state_path, sizeof(default_state_path), "%s.state", options.rom_path);
+        options.state_path = default_state_path;
+    }
+
+    if (options.instances > 0) {
+        if (!options.headless || options.shm_name != NULL || options.video_path != NULL) {
+            print_error(ERROR_MISSING_ARGS, "--instances requires --headless and can't be combined with --shm or --video");
+            return 1;
+        }
+        // Every instance starts with the template's decode cache
+        if (analyzed) {
+            prewarm_caches(&analysis, &cpu, NULL);
         }
+        return options.soa ? run_soa_instances(&cpu, &options) : run_instances(&cpu, &options);
+    }
 
-        uint32_t current_time = SDL_GetTicks();
-        if (current_time - last_updated_time >= REFRESH_RATE) {
-            last_updated_time = SDL_GetTicks();
+    if (options.soa || options.verify) {
+        print_error(ERROR_MISSING_ARGS, "--soa and --verify require --instances");
+        return 1;
+    }
 
-            // Update timers
-            if (cpu.delay_timer > 0) {
-                cpu.delay_timer--;
-            }
+    Backend backend;
+    if (initialize_backend(&backend, options.backend_type, options.lockstep, &cpu) < 0) {
+        return 1;
+    }
 
-            if (cpu.sound_timer > 0) {
-                cpu.sound_timer--;
-                toggle_beep(&audio, 1);
-            } else {
-                toggle_beep(&audio, 0);
-            }
+#ifdef CHIP8_PROFILE
+    // Only the main machine, the lockstep reference is not profiled.
+    // Idle loops are run in full so they show up in the profile
+    if (options.profile_prefix != NULL) {
+        options.idle_skip = 0;
+        cpu.profile = create_profile();
+        if (cpu.profile == NULL) {
+            cleanup_backend(&backend);
+            return 1;
+        }
+    }
+#endif
 
-            update_display(&display, &cpu);
+    if (analyzed) {
+        prewarm_caches(&analysis, &cpu, &backend);
+        options.idle_hints = analysis.address_flags;
+    }
+
+    // External readers map the ring, see shmring.h
+    FrameSinks sinks = { NULL, NULL };
+    ShmRing shm;
+    if (options.shm_name != NULL) {
+        if (initialize_shm_ring(&shm, options.shm_name) < 0) {
+            cleanup_backend(&backend);
+            return 1;
         }
+        sinks.shm = &shm;
+    }
 
-        if (current_time - last_cpu_cycle >= CLOCK_SPEED) {
-            last_cpu_cycle = SDL_GetTicks();
+    VideoRecorder video;
+    if (options.video_path != NULL) {
+        if (initialize_video(&video, options.video_path, &cpu) < 0) {
+            if (sinks.shm != NULL) {
+                cleanup_shm_ring(sinks.shm);
+            }
+            cleanup_backend(&backend);
+            return 1;
+        }
+        sinks.video = &video;
+    }
 
-            // Placeholder functions
-            uint16_t opcode = fetch(&cpu);
-            execute(&cpu, opcode);
+    int status;
+    if (options.debug) {
+        status = run_debugging(&cpu, &sinks, analyzed ? analysis.address_flags : NULL, &options);
+    } else if (options.headless) {
+        status = run_headless(&cpu, &backend, active_movie, &sinks, &options);
+    } else {
+        status = run_windowed(&cpu, &backend, active_movie, &sinks, &options);
+    }
+
+    if (sinks.shm != NULL) {
+        cleanup_shm_ring(sinks.shm);
+    }
+    if (sinks.video != NULL) {
+        if (cleanup_video(sinks.video) < 0) {
+            status = 1;
+        } else {
+            video_report(sinks.video, stdout);
         }
     }
 
-    // Cleanup
-    cleanup_display(&display);
-    cleanup_audio(&audio);
+#ifdef CHIP8_PROFILE
+    if (cpu.profile != NULL) {
+        if (dump_profile(cpu.profile, &cpu, options.profile_prefix) == 0) {
+            printf("Profile written to %s.txt and %s.folded\n", options.profile_prefix, options.profile_prefix);
+        }
+        destroy_profile(cpu.profile);
+    }
+#endif
 
-    return 0;
+    if (analyzed) {
+        cleanup_analysis(&analysis);
+    }
+    cleanup_backend(&backend);
+    return status;
 }
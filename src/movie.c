@@ -0,0 +1,221 @@
+#include "movie.h"
+#include "error.h"
+#include "snapshot.h"
+
+#define MOVIE_HEADER_SIZE 28
+#define MOVIE_EVENT_SIZE 7
+
+static void put_le(uint8_t* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t get_le(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+// FNV-1a over the machine's memory, catches playback against a different ROM
+static uint32_t hash_memory(const CPU* cpu) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < memory_size(cpu); i++) {
+        hash = (hash ^ cpu->memory[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hash_state(const CPU* cpu) {
+    Snapshot snapshot;
+    save_snapshot(cpu, &snapshot);
+    return hash_snapshot(&snapshot);
+}
+
+// Once a write failed the events after it would not line up, so nothing more is written
+static int write_event(Movie* movie, uint32_t frame, uint8_t type, uint32_t value) {
+    if (movie->failed) {
+        return -1;
+    }
+
+    uint8_t event[MOVIE_EVENT_SIZE];
+    put_le(event, frame, 4);
+    event[4] = type;
+    put_le(event + 5, value, 2);
+
+    if (fwrite(event, 1, sizeof(event), movie->file) != sizeof(event)) {
+        print_error(ERROR_MOVIE, "Could not write to the movie file");
+        movie->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int read_event(Movie* movie) {
+    uint8_t event[MOVIE_EVENT_SIZE];
+    if (fread(event, 1, sizeof(event), movie->file) != sizeof(event)) {
+        print_error(ERROR_MOVIE, "Movie file ends without an end marker");
+        return -1;
+    }
+
+    movie->next_frame = get_le(event, 4);
+    movie->next_type = event[4];
+    movie->next_keys = get_le(event + 5, 2);
+
+    if (movie->next_type == MOVIE_EVENT_END) {
+        uint8_t hash[4];
+        if (fread(hash, 1, sizeof(hash), movie->file) != sizeof(hash)) {
+            print_error(ERROR_MOVIE, "Movie file is truncated");
+            return -1;
+        }
+        movie->final_hash = get_le(hash, 4);
+    } else if (movie->next_type != MOVIE_EVENT_KEYS) {
+        print_error(ERROR_MOVIE, "Unknown movie event");
+        return -1;
+    }
+    return 0;
+}
+
+int start_recording(Movie* movie, const char* path, const CPU* cpu, uint64_t seed, uint32_t clock_speed) {
+    movie->mode = MOVIE_RECORD;
+    movie->seed = seed;
+    movie->clock_speed = clock_speed;
+    movie->quirks = cpu->quirks;
+    movie->machine = cpu->machine;
+    movie->memory_hash = hash_memory(cpu);
+    movie->keys = keypad_mask(cpu);
+    movie->failed = 0;
+
+    movie->file = fopen(path, "wb");
+    if (movie->file == NULL) {
+        print_error(ERROR_MOVIE, "Could not create the movie file");
+        return -1;
+    }
+
+    uint8_t header[MOVIE_HEADER_SIZE] = {0};
+    memcpy(header, MOVIE_MAGIC, 4);
+    put_le(header + 4, MOVIE_VERSION, 2);
+    put_le(header + 8, seed, 8);
+    put_le(header + 16, clock_speed, 4);
+    header[20] = movie->quirks;
+    header[21] = movie->machine;
+    put_le(header + 24, movie->memory_hash, 4);
+
+    if (fwrite(header, 1, sizeof(header), movie->file) != sizeof(header)) {
+        print_error(ERROR_MOVIE, "Could not write to the movie file");
+        fclose(movie->file);
+        movie->file = NULL;
+        return -1;
+    }
+
+    // The keys held when recording starts
+    if (movie->keys != 0) {
+        return write_event(movie, 0, MOVIE_EVENT_KEYS, movie->keys);
+    }
+    return 0;
+}
+
+int start_playback(Movie* movie, const char* path) {
+    movie->mode = MOVIE_PLAYBACK;
+    movie->keys = 0;
+    movie->failed = 0;
+
+    movie->file = fopen(path, "rb");
+    if (movie->file == NULL) {
+        print_error(ERROR_MOVIE, "Could not open the movie file");
+        return -1;
+    }
+
+    uint8_t header[MOVIE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), movie->file) != sizeof(header)
+        || memcmp(header, MOVIE_MAGIC, 4) != 0 || get_le(header + 4, 2) != MOVIE_VERSION) {
+        print_error(ERROR_MOVIE, "Not a movie file of a supported version");
+        fclose(movie->file);
+        movie->file = NULL;
+        return -1;
+    }
+
+    movie->seed = get_le(header + 8, 8);
+    movie->clock_speed = get_le(header + 16, 4);
+    movie->quirks = header[20];
+    movie->machine = header[21];
+    if (movie->machine > MACHINE_XOCHIP || movie->quirks >= QUIRKS_COUNT) {
+        print_error(ERROR_MOVIE, "Movie of an unknown machine or quirk profile");
+        fclose(movie->file);
+        movie->file = NULL;
+        return -1;
+    }
+    movie->memory_hash = get_le(header + 24, 4);
+
+    if (read_event(movie) < 0) {
+        fclose(movie->file);
+        movie->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int check_movie_memory(const Movie* movie, const CPU* cpu) {
+    if (hash_memory(cpu) != movie->memory_hash) {
+        print_error(ERROR_MOVIE, "The movie was recorded with a different ROM");
+        return -1;
+    }
+    return 0;
+}
+
+int movie_frame(Movie* movie, CPU* cpu, uint64_t frame) {
+    if (movie->mode == MOVIE_RECORD) {
+        uint16_t keys = keypad_mask(cpu);
+        if (keys != movie->keys) {
+            movie->keys = keys;
+            write_event(movie, (uint32_t)frame, MOVIE_EVENT_KEYS, keys);
+        }
+        return 0;
+    }
+
+    // Playback: whatever the keyboard did, the keypad is what was recorded
+    while (movie->next_type == MOVIE_EVENT_KEYS && movie->next_frame <= frame) {
+        movie->keys = movie->next_keys;
+        if (read_event(movie) < 0) {
+            movie->next_type = MOVIE_EVENT_END;
+            movie->next_frame = (uint32_t)frame;
+        }
+    }
+    set_keypad_mask(cpu, movie->keys);
+
+    return movie->next_type == MOVIE_EVENT_END && frame >= movie->next_frame;
+}
+
+int finish_movie(Movie* movie, const CPU* cpu, uint64_t frames) {
+    int status = 0;
+
+    if (movie->mode == MOVIE_RECORD) {
+        uint8_t hash[4];
+        put_le(hash, hash_state(cpu), 4);
+        if (movie->failed) {
+            print_error(ERROR_MOVIE, "The movie is incomplete, a keypad change could not be written");
+            status = -1;
+        } else if (write_event(movie, (uint32_t)frames, MOVIE_EVENT_END, 0) < 0
+            || fwrite(hash, 1, sizeof(hash), movie->file) != sizeof(hash)) {
+            status = -1;
+        }
+        if (fclose(movie->file) != 0) {
+            print_error(ERROR_MOVIE, "Could not write to the movie file");
+            status = -1;
+        }
+    } else {
+        if (movie->next_type != MOVIE_EVENT_END || frames != movie->next_frame) {
+            print_error(ERROR_MOVIE, "Playback stopped before the end of the movie");
+            status = -1;
+        } else if (hash_state(cpu) != movie->final_hash) {
+            print_error(ERROR_MOVIE, "Playback diverged from the recording");
+            status = -1;
+        }
+        fclose(movie->file);
+    }
+
+    movie->file = NULL;
+    return status;
+}
@@ -0,0 +1,71 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+
+/*
+ * Input movies. A movie stores the Cxnn seed, clock speed, quirk profile and
+ * machine a run started with, a hash of the loaded memory, and every keypad change
+ * keyed by the frame it was applied in. Playing it back from a fresh
+ * machine reproduces the run exactly; the final state's hash is stored at
+ * the end and checked when playback finishes.
+ *
+ * All fields are stored little-endian after a "C8MV" magic and a version.
+ */
+#define MOVIE_MAGIC "C8MV"
+#define MOVIE_VERSION 4    // 2: machine, final hash of a version 3 snapshot, 3: quirk profile, version 4 snapshot, 4: version 5 snapshot
+
+#define MOVIE_EVENT_KEYS 0     // Keypad bitmask from this frame on
+#define MOVIE_EVENT_END 1      // Last frame, followed by the final state hash
+
+typedef enum {
+    MOVIE_RECORD,
+    MOVIE_PLAYBACK
+} MovieMode;
+
+typedef struct {
+    MovieMode mode;
+    FILE* file;
+
+    uint64_t seed;
+    uint32_t clock_speed;
+    uint8_t quirks;
+    uint8_t machine;
+    uint32_t memory_hash;
+
+    uint16_t keys;              // Keypad bitmask currently applied
+    int failed;                 // Recording: set once a write failed, the movie is incomplete from there on
+
+    // Playback: the next event not yet applied
+    uint32_t next_frame;
+    uint8_t next_type;
+    uint16_t next_keys;         // Final state hash for MOVIE_EVENT_END
+    uint32_t final_hash;
+} Movie;
+
+// Starts recording a run of `cpu`, which has its ROM loaded and has been seeded with `seed`
+int start_recording(Movie* movie, const char* path, const CPU* cpu, uint64_t seed, uint32_t clock_speed);
+
+// Opens a movie and reads its header. The caller sets up the CPU from its seed, clock, quirk profile and machine.
+int start_playback(Movie* movie, const char* path);
+
+// Checks that `cpu` has the same memory the movie was recorded with
+int check_movie_memory(const Movie* movie, const CPU* cpu);
+
+/*
+ * Call at the start of every frame, before running it. Records keypad
+ * changes, or applies the recorded ones during playback.
+ * Returns 1 once playback has reached the last recorded frame.
+ */
+int movie_frame(Movie* movie, CPU* cpu, uint64_t frame);
+
+/*
+ * Recording: writes the end marker and final state hash, -1 if any write
+ * of the recording failed.
+ * Playback: compares the final state with the recorded one, -1 on mismatch.
+ */
+int finish_movie(Movie* movie, const CPU* cpu, uint64_t frames);
+
+#endif
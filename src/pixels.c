@@ -0,0 +1,144 @@
+#include <stddef.h>
+#include <string.h>
+#include "pixels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+void expand_row_scalar(uint64_t bits, uint32_t* out, uint32_t on, uint32_t off) {
+    for (int x = 0; x < 64; x++) {
+        out[x] = (bits >> (63 - x)) & 1 ? on : off;
+    }
+}
+
+void expand_row_planes(const uint64_t* bits, int planes, uint32_t* out, const uint32_t* colors) {
+    for (int x = 0; x < 64; x++) {
+        uint32_t index = 0;
+        for (int p = 0; p < planes; p++) {
+            index |= ((bits[p] >> (63 - x)) & 1) << p;
+        }
+        out[x] = colors[index];
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// 4 pixels per iteration: broadcast a nibble and test one bit per lane
+__attribute__((target("sse2")))
+static void expand_row_sse2(uint64_t bits, uint32_t* out, uint32_t on, uint32_t off) {
+    const __m128i select = _mm_set_epi32(1, 2, 4, 8);
+    const __m128i on_v = _mm_set1_epi32((int)on);
+    const __m128i off_v = _mm_set1_epi32((int)off);
+
+    for (int x = 0; x < 64; x += 4) {
+        __m128i nibble = _mm_set1_epi32((int)((bits >> (60 - x)) & 0xF));
+        __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(nibble, select), select);
+        __m128i pixels = _mm_or_si128(_mm_and_si128(mask, on_v), _mm_andnot_si128(mask, off_v));
+        _mm_storeu_si128((__m128i*)&out[x], pixels);
+    }
+}
+
+// 8 pixels per iteration: broadcast a byte and test one bit per lane
+__attribute__((target("avx2")))
+static void expand_row_avx2(uint64_t bits, uint32_t* out, uint32_t on, uint32_t off) {
+    const __m256i select = _mm256_set_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256i on_v = _mm256_set1_epi32((int)on);
+    const __m256i off_v = _mm256_set1_epi32((int)off);
+
+    for (int x = 0; x < 64; x += 8) {
+        __m256i byte = _mm256_set1_epi32((int)((bits >> (56 - x)) & 0xFF));
+        __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(byte, select), select);
+        __m256i pixels = _mm256_blendv_epi8(off_v, on_v, mask);
+        _mm256_storeu_si256((__m256i*)&out[x], pixels);
+    }
+}
+
+#endif
+
+static const ExpandKernel all_kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", expand_row_avx2 },
+    { "sse2", expand_row_sse2 },
+#endif
+    { "scalar", expand_row_scalar },
+    { NULL, NULL }
+};
+
+static int kernel_supported(const ExpandKernel* kernel) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (kernel->expand_row == expand_row_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (kernel->expand_row == expand_row_sse2) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return kernel->expand_row == expand_row_scalar;
+}
+
+const ExpandKernel* supported_expand_kernels(void) {
+    static ExpandKernel supported[sizeof(all_kernels) / sizeof(all_kernels[0])];
+
+    if (supported[0].name == NULL) {
+        size_t count = 0;
+        for (size_t i = 0; all_kernels[i].name != NULL; i++) {
+            if (kernel_supported(&all_kernels[i])) {
+                supported[count++] = all_kernels[i];
+            }
+        }
+    }
+
+    return supported;
+}
+
+const ExpandKernel* select_expand_kernel(const char* name) {
+    const ExpandKernel* kernels = supported_expand_kernels();
+
+    // Kernels are ordered fastest first
+    if (name == NULL) {
+        return &kernels[0];
+    }
+
+    for (size_t i = 0; kernels[i].name != NULL; i++) {
+        if (strcmp(kernels[i].name, name) == 0) {
+            return &kernels[i];
+        }
+    }
+
+    return NULL;
+}
+
+void build_phosphor_ramp(const Palette* palette, uint32_t ramp[256]) {
+    for (int intensity = 0; intensity < 256; intensity++) {
+        uint32_t color = 0;
+
+        // Interpolate each channel separately
+        for (int shift = 0; shift < 32; shift += 8) {
+            int from = (palette->off >> shift) & 0xFF;
+            int to = (palette->on >> shift) & 0xFF;
+            color |= (uint32_t)(from + (to - from) * intensity / 255) << shift;
+        }
+
+        ramp[intensity] = color;
+    }
+}
+
+int expand_row_phosphor(uint64_t bits, uint8_t* intensity, uint32_t* out, const uint32_t ramp[256], uint8_t decay) {
+    int fading = 0;
+
+    for (int x = 0; x < 64; x++) {
+        if ((bits >> (63 - x)) & 1) {
+            intensity[x] = 255;
+        } else {
+            intensity[x] = (intensity[x] * decay) >> 8;
+            fading |= intensity[x] != 0;
+        }
+
+        out[x] = ramp[intensity[x]];
+    }
+
+    return fading;
+}
@@ -0,0 +1,55 @@
+#ifndef PIXELS_H
+#define PIXELS_H
+
+#include <stdint.h>
+
+// Colors are in the texture's RGBA8888 format, 0xRRGGBBAA
+typedef struct {
+    uint32_t on;
+    uint32_t off;
+} Palette;
+
+#define DEFAULT_PALETTE_ON 0xFFFFFFFF
+#define DEFAULT_PALETTE_OFF 0x000000FF
+
+/*
+ * Expands one 64-pixel framebuffer row (bit 63 is the leftmost pixel)
+ * into 64 32-bit pixels.
+ */
+typedef void (*ExpandRow)(uint64_t bits, uint32_t* out, uint32_t on, uint32_t off);
+
+typedef struct {
+    const char* name;
+    ExpandRow expand_row;
+} ExpandKernel;
+
+void expand_row_scalar(uint64_t bits, uint32_t* out, uint32_t on, uint32_t off);
+
+/*
+ * Returns the fastest kernel the CPU supports (AVX2, SSE2 or scalar),
+ * or the kernel called `name` if it is not NULL. Returns NULL if the
+ * named kernel does not exist or is not supported.
+ */
+const ExpandKernel* select_expand_kernel(const char* name);
+
+// All kernels supported on this CPU, terminated by an entry with a NULL name
+const ExpandKernel* supported_expand_kernels(void);
+
+/*
+ * Expands one 64-pixel row of `planes` bit-planes, where bits[p] is the
+ * row of plane p, into 64 pixels colored colors[bit of plane 0 | bit of plane 1 << 1 | ...].
+ */
+void expand_row_planes(const uint64_t* bits, int planes, uint32_t* out, const uint32_t* colors);
+
+// Fills `ramp` with the 256 colors between palette->off (0) and palette->on (255)
+void build_phosphor_ramp(const Palette* palette, uint32_t ramp[256]);
+
+/*
+ * Phosphor decay: lit pixels jump to full intensity and unlit ones fade by
+ * `decay` / 256 every frame. `intensity` holds one byte per pixel of state
+ * and `ramp` comes from build_phosphor_ramp().
+ * Returns 1 while some pixel in the row is still fading.
+ */
+int expand_row_phosphor(uint64_t bits, uint8_t* intensity, uint32_t* out, const uint32_t ramp[256], uint8_t decay);
+
+#endif
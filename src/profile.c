@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include "profile.h"
+#include "error.h"
+
+static const char* const op_names[OP_COUNT] = {
+    [OP_UNDECODED]  = "????",
+    [OP_NOP]        = "NOP",
+    [OP_CLS]        = "00E0 CLS",
+    [OP_RET]        = "00EE RET",
+    [OP_JP]         = "1nnn JP",
+    [OP_CALL]       = "2nnn CALL",
+    [OP_SE_VX_NN]   = "3xnn SE",
+    [OP_SNE_VX_NN]  = "4xnn SNE",
+    [OP_SE_VX_VY]   = "5xy0 SE",
+    [OP_LD_VX_NN]   = "6xnn LD",
+    [OP_ADD_VX_NN]  = "7xnn ADD",
+    [OP_LD_VX_VY]   = "8xy0 LD",
+    [OP_OR]         = "8xy1 OR",
+    [OP_AND]        = "8xy2 AND",
+    [OP_XOR]        = "8xy3 XOR",
+    [OP_ADD_VX_VY]  = "8xy4 ADD",
+    [OP_SUB]        = "8xy5 SUB",
+    [OP_SHR]        = "8xy6 SHR",
+    [OP_SUBN]       = "8xy7 SUBN",
+    [OP_SHL]        = "8xyE SHL",
+    [OP_SNE_VX_VY]  = "9xy0 SNE",
+    [OP_LD_I]       = "Annn LD I",
+    [OP_JP_V0]      = "Bnnn JP V0",
+    [OP_RND]        = "Cxnn RND",
+    [OP_DRW]        = "Dxyn DRW",
+    [OP_SKP]        = "Ex9E SKP",
+    [OP_SKNP]       = "ExA1 SKNP",
+    [OP_LD_VX_DT]   = "Fx07 LD DT",
+    [OP_LD_VX_K]    = "Fx0A LD K",
+    [OP_LD_DT_VX]   = "Fx15 LD DT",
+    [OP_LD_ST_VX]   = "Fx18 LD ST",
+    [OP_ADD_I_VX]   = "Fx1E ADD I",
+    [OP_LD_F_VX]    = "Fx29 LD F",
+    [OP_LD_B_VX]    = "Fx33 LD B",
+    [OP_LD_I_VX]    = "Fx55 LD [I]",
+    [OP_LD_VX_I]    = "Fx65 LD [I]",
+    [OP_SCD]        = "00Cn SCD",
+    [OP_SCU]        = "00Dn SCU",
+    [OP_SCR]        = "00FB SCR",
+    [OP_SCL]        = "00FC SCL",
+    [OP_EXIT]       = "00FD EXIT",
+    [OP_LOW]        = "00FE LOW",
+    [OP_HIGH]       = "00FF HIGH",
+    [OP_SAVE_VX_VY] = "5xy2 SAVE",
+    [OP_LOAD_VX_VY] = "5xy3 LOAD",
+    [OP_LD_I_LONG]  = "F000 LD I",
+    [OP_PLANE]      = "Fn01 PLANE",
+    [OP_LD_HF_VX]   = "Fx30 LD HF",
+    [OP_LD_R_VX]    = "Fx75 LD R",
+    [OP_LD_VX_R]    = "Fx85 LD R",
+    [OP_AUDIO]      = "F002 AUDIO",
+    [OP_PITCH]      = "Fx3A PITCH",
+};
+
+// Finds or adds the table entry for the current shadow stack
+static int32_t find_stack(Profile* profile) {
+    uint32_t hash = 2166136261u ^ profile->depth;
+    for (int i = 0; i < profile->depth; i++) {
+        hash = (hash ^ profile->frames[i]) * 16777619u;
+    }
+
+    for (uint32_t probe = 0; probe < PROFILE_STACKS; probe++) {
+        uint32_t index = (hash + probe) % PROFILE_STACKS;
+        ProfileStack* entry = &profile->stacks[index];
+
+        if (!entry->used) {
+            entry->used = 1;
+            entry->depth = profile->depth;
+            memcpy(entry->frames, profile->frames, profile->depth * sizeof(uint16_t));
+            return index;
+        }
+
+        if (entry->depth == profile->depth
+            && memcmp(entry->frames, profile->frames, profile->depth * sizeof(uint16_t)) == 0) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+Profile* create_profile(void) {
+    Profile* profile = calloc(1, sizeof(Profile));
+    if (profile == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the profile");
+        return NULL;
+    }
+
+    profile->current = find_stack(profile);
+    return profile;
+}
+
+void destroy_profile(Profile* profile) {
+    free(profile);
+}
+
+void profile_op(Profile* profile, const CPU* cpu, const DecodedOp* d, uint16_t pc) {
+    profile->instructions++;
+    profile->op_counts[d->op]++;
+    profile->pc_counts[pc & (MEM_SIZE - 1)]++;
+
+    if (profile->current >= 0) {
+        profile->stacks[profile->current].samples++;
+    } else {
+        profile->lost_samples++;
+    }
+
+    switch (d->op) {
+        case OP_CALL:
+            // A real overflow crashes the CPU anyway, keep the deepest frames we have
+            if (profile->depth < STACK_DEPTH) {
+                profile->frames[profile->depth++] = d->nnn;
+                profile->current = find_stack(profile);
+            }
+            break;
+        case OP_RET:
+            if (profile->depth > 0) {
+                profile->depth--;
+                profile->current = find_stack(profile);
+            }
+            break;
+        case OP_LD_VX_K: {
+            // Same test as the handler: no key down means it runs again
+            int pressed = 0;
+            for (int i = 0; i < NUM_KEYS; i++) {
+                pressed |= cpu->keypad[i] == 1;
+            }
+            profile->key_wait_cycles += !pressed;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static const Profile* sort_profile;
+
+// Hottest address first
+static int compare_pcs(const void* a, const void* b) {
+    uint64_t ca = sort_profile->pc_counts[*(const uint16_t*)a];
+    uint64_t cb = sort_profile->pc_counts[*(const uint16_t*)b];
+    return (ca < cb) - (ca > cb);
+}
+
+void write_flat_profile(const Profile* profile, const CPU* cpu, FILE* out) {
+    double total = profile->instructions ? (double)profile->instructions : 1.0;
+
+    fprintf(out, "instructions: %llu\n", (unsigned long long)profile->instructions);
+    fprintf(out, "Fx0A key wait cycles: %llu (%.2f%%)\n",
+            (unsigned long long)profile->key_wait_cycles, profile->key_wait_cycles * 100.0 / total);
+
+    fprintf(out, "\n%-14s %14s %8s\n", "operation", "count", "percent");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (profile->op_counts[op] == 0) {
+            continue;
+        }
+        fprintf(out, "%-14s %14llu %7.2f%%\n", op_names[op],
+                (unsigned long long)profile->op_counts[op], profile->op_counts[op] * 100.0 / total);
+    }
+
+    static uint16_t order[MEM_SIZE];
+    for (int pc = 0; pc < MEM_SIZE; pc++) {
+        order[pc] = pc;
+    }
+    sort_profile = profile;
+    qsort(order, MEM_SIZE, sizeof(order[0]), compare_pcs);
+
+    fprintf(out, "\n%-7s %-6s %14s %8s\n", "address", "opcode", "count", "percent");
+    for (int i = 0; i < PROFILE_HOT_PCS && profile->pc_counts[order[i]] > 0; i++) {
+        uint16_t pc = order[i];
+        uint16_t opcode = (cpu->memory[pc] << 8) | cpu->memory[(pc + 1) & (MEM_SIZE - 1)];
+        fprintf(out, "0x%03X   %04X   %14llu %7.2f%%\n", pc, opcode,
+                (unsigned long long)profile->pc_counts[pc], profile->pc_counts[pc] * 100.0 / total);
+    }
+}
+
+void write_folded_stacks(const Profile* profile, FILE* out) {
+    for (int i = 0; i < PROFILE_STACKS; i++) {
+        const ProfileStack* entry = &profile->stacks[i];
+        if (!entry->used || entry->samples == 0) {
+            continue;
+        }
+
+        fprintf(out, "main");
+        for (int f = 0; f < entry->depth; f++) {
+            fprintf(out, ";sub_%03X", entry->frames[f]);
+        }
+        fprintf(out, " %llu\n", (unsigned long long)entry->samples);
+    }
+
+    if (profile->lost_samples > 0) {
+        fprintf(out, "main;[too many stacks] %llu\n", (unsigned long long)profile->lost_samples);
+    }
+}
+
+int dump_profile(const Profile* profile, const CPU* cpu, const char* prefix) {
+    char path[4096];
+    int status = 0;
+
+    snprintf(path, sizeof(path), "%s.txt", prefix);
+    FILE* flat = fopen(path, "w");
+    if (flat != NULL) {
+        write_flat_profile(profile, cpu, flat);
+        fclose(flat);
+    } else {
+        status = -1;
+    }
+
+    snprintf(path, sizeof(path), "%s.folded", prefix);
+    FILE* folded = fopen(path, "w");
+    if (folded != NULL) {
+        write_folded_stacks(profile, folded);
+        fclose(folded);
+    } else {
+        status = -1;
+    }
+
+    if (status < 0) {
+        print_error(ERROR_PROFILE, "Could not write the profile");
+    }
+    return status;
+}
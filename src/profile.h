@@ -0,0 +1,69 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+
+/*
+ * Optional instrumentation, compiled in with -DCHIP8_PROFILE (make
+ * PROFILE=1). Without it PROFILE_OP expands to nothing and the CPU has no
+ * profile pointer, so a normal build pays nothing.
+ *
+ * Counts instructions per operation and per address, Fx0A executions that
+ * found no key pressed, and samples per call stack (a shadow of 2nnn/00EE)
+ * for flamegraph-style folded output.
+ */
+#define PROFILE_STACKS 1024     // Distinct call stacks tracked
+#define PROFILE_HOT_PCS 20      // Addresses listed in the flat profile
+
+typedef struct {
+    uint16_t frames[STACK_DEPTH];
+    uint8_t depth;
+    uint8_t used;
+    uint64_t samples;
+} ProfileStack;
+
+struct Profile {
+    uint64_t instructions;
+    uint64_t op_counts[OP_COUNT];
+    uint64_t pc_counts[MEM_SIZE];
+    uint64_t key_wait_cycles;       // Fx0A executed with no key down, i.e. spinning
+
+    // Shadow call stack, and the table entry its samples go to (-1: table full)
+    uint16_t frames[STACK_DEPTH];
+    uint8_t depth;
+    int32_t current;
+    uint64_t lost_samples;
+    ProfileStack stacks[PROFILE_STACKS];
+};
+
+typedef struct Profile Profile;
+
+Profile* create_profile(void);
+void destroy_profile(Profile* profile);
+
+// Records one instruction at `pc`, before it runs
+void profile_op(Profile* profile, const CPU* cpu, const DecodedOp* d, uint16_t pc);
+
+// Per-operation counts, Fx0A spinning and the hottest addresses
+void write_flat_profile(const Profile* profile, const CPU* cpu, FILE* out);
+
+// One "main;sub_0ABC;sub_0DEF count" line per call stack
+void write_folded_stacks(const Profile* profile, FILE* out);
+
+// Writes PREFIX.txt and PREFIX.folded
+int dump_profile(const Profile* profile, const CPU* cpu, const char* prefix);
+
+#ifdef CHIP8_PROFILE
+#define PROFILE_OP(cpu, d, pc) \
+    do { \
+        if ((cpu)->profile != NULL) { \
+            profile_op((cpu)->profile, (cpu), (d), (pc)); \
+        } \
+    } while (0)
+#else
+#define PROFILE_OP(cpu, d, pc) ((void)0)
+#endif
+
+#endif
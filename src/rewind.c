@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include "rewind.h"
+#include "error.h"
+#include "scheduler.h"
+
+// Largest snapshot image, an XO-CHIP machine with all of its memory
+#define IMAGE_SIZE SNAPSHOT_FULL_SIZE(MEM_SIZE)
+
+// Longest zero run or literal a token can hold
+#define MAX_RUN 0xFFFF
+
+// Zero runs shorter than this stay inside the surrounding literal
+#define MIN_ZERO_RUN 4
+
+// Worst case: a token header for every MIN_ZERO_RUN + 1 input bytes
+#define MAX_ENCODED_SIZE (IMAGE_SIZE + (IMAGE_SIZE / (MIN_ZERO_RUN + 1) + 1) * 4)
+
+/*
+ * Encodes `image` XOR `previous` (or just `image` when previous is NULL)
+ * as tokens of [u16 zero run][u16 literal length][literal bytes], the
+ * literals being the XORed bytes. Longer runs take several tokens.
+ * Returns the encoded size.
+ */
+static size_t encode_xor_rle(const uint8_t* image, const uint8_t* previous, size_t size, uint8_t* out) {
+    uint8_t* p = out;
+    size_t i = 0;
+
+    while (i < size) {
+        // Zero run, skipped a word at a time
+        size_t start = i;
+        if (previous != NULL) {
+            while (i + 8 <= size && i + 8 - start <= MAX_RUN) {
+                uint64_t a, b;
+                memcpy(&a, image + i, 8);
+                memcpy(&b, previous + i, 8);
+                if (a != b) {
+                    break;
+                }
+                i += 8;
+            }
+            while (i < size && i - start < MAX_RUN && image[i] == previous[i]) {
+                i++;
+            }
+        } else {
+            while (i < size && i - start < MAX_RUN && image[i] == 0) {
+                i++;
+            }
+        }
+        size_t zeros = i - start;
+
+        if (i == size) {
+            break;
+        }
+
+        // Literal, until a zero run long enough to be worth a token
+        uint8_t* header = p;
+        p += 4;
+        size_t literal = 0;
+        size_t trailing = 0;
+        while (i < size && literal < MAX_RUN) {
+            uint8_t byte = previous != NULL ? image[i] ^ previous[i] : image[i];
+            trailing = byte == 0 ? trailing + 1 : 0;
+            if (trailing == MIN_ZERO_RUN) {
+                break;
+            }
+            p[literal++] = byte;
+            i++;
+        }
+
+        // Zeros at the end of the literal belong to the next zero run
+        size_t back = trailing == MIN_ZERO_RUN ? MIN_ZERO_RUN - 1 : trailing;
+        literal -= back;
+        i -= back;
+        p += literal;
+
+        header[0] = zeros & 0xFF;
+        header[1] = zeros >> 8;
+        header[2] = literal & 0xFF;
+        header[3] = literal >> 8;
+    }
+
+    return p - out;
+}
+
+// XORs an encoded record into `image`
+static void apply_xor_rle(uint8_t* image, const uint8_t* data, size_t size) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    size_t i = 0;
+
+    while (p < end) {
+        size_t zeros = p[0] | p[1] << 8;
+        size_t literal = p[2] | p[3] << 8;
+        p += 4;
+
+        i += zeros;
+        for (size_t k = 0; k < literal; k++) {
+            image[i + k] ^= p[k];
+        }
+        i += literal;
+        p += literal;
+    }
+}
+
+int initialize_rewind(Rewind* rewind, size_t budget, uint32_t keyframe_interval) {
+    memset(rewind, 0, sizeof(Rewind));
+
+    // At least two keyframe groups' worth of worst-case records
+    if (budget < 4 * MAX_ENCODED_SIZE) {
+        budget = 4 * MAX_ENCODED_SIZE;
+    }
+    if (budget > UINT32_MAX) {
+        budget = UINT32_MAX;
+    }
+
+    rewind->capacity = budget;
+    rewind->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    rewind->max_records = budget / 16;
+    rewind->arena = malloc(budget);
+    rewind->records = malloc(rewind->max_records * sizeof(RewindRecord));
+    rewind->encoded = malloc(MAX_ENCODED_SIZE);
+
+    if (rewind->arena == NULL || rewind->records == NULL || rewind->encoded == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the rewind buffer");
+        cleanup_rewind(rewind);
+        return -1;
+    }
+    return 0;
+}
+
+void cleanup_rewind(Rewind* rewind) {
+    free(rewind->arena);
+    free(rewind->records);
+    free(rewind->encoded);
+    rewind->arena = NULL;
+    rewind->records = NULL;
+    rewind->encoded = NULL;
+}
+
+static void clear_rewind(Rewind* rewind) {
+    rewind->first = 0;
+    rewind->count = 0;
+    rewind->write_pos = 0;
+    rewind->used = 0;
+    rewind->since_keyframe = 0;
+}
+
+static RewindRecord* record_at(Rewind* rewind, uint32_t index) {
+    return &rewind->records[(rewind->first + index) % rewind->max_records];
+}
+
+// Drops the oldest keyframe together with the deltas that depend on it
+static void evict_oldest_group(Rewind* rewind) {
+    do {
+        rewind->used -= record_at(rewind, 0)->size;
+        rewind->first = (rewind->first + 1) % rewind->max_records;
+        rewind->count--;
+        rewind->evicted_frames++;
+    } while (rewind->count > 0 && !record_at(rewind, 0)->keyframe);
+
+    if (rewind->count == 0) {
+        clear_rewind(rewind);
+    }
+}
+
+static int overlaps(const RewindRecord* record, size_t offset, size_t size) {
+    return record->offset < offset + size && offset < record->offset + record->size;
+}
+
+// Finds room for `size` bytes at the write position, evicting as needed
+static size_t reserve(Rewind* rewind, size_t size) {
+    if (rewind->write_pos + size > rewind->capacity) {
+        // Records behind the write position are the oldest ones, they go first
+        while (rewind->count > 0 && record_at(rewind, 0)->offset >= rewind->write_pos) {
+            evict_oldest_group(rewind);
+        }
+        rewind->write_pos = 0;
+    }
+
+    while (rewind->count > 0 && (rewind->count == rewind->max_records
+                                 || overlaps(record_at(rewind, 0), rewind->write_pos, size))) {
+        evict_oldest_group(rewind);
+    }
+
+    size_t offset = rewind->write_pos;
+    rewind->write_pos += size;
+    return offset;
+}
+
+void record_rewind_frame(Rewind* rewind, const CPU* cpu) {
+    uint64_t start = scheduler_now_ns();
+
+    save_snapshot(cpu, &rewind->current);
+
+    // A different machine (e.g. after loading a state) has differently sized
+    // snapshots, which can't be XORed with the old ones
+    if (rewind->current.size != rewind->image_size) {
+        clear_rewind(rewind);
+        rewind->image_size = rewind->current.size;
+    }
+
+    int keyframe = rewind->count == 0 || rewind->since_keyframe + 1 >= rewind->keyframe_interval;
+    size_t size = encode_xor_rle(rewind->current.data, keyframe ? NULL : rewind->latest.data, rewind->image_size, rewind->encoded);
+
+    // Evicting can empty the history, and the next record then has to be a keyframe
+    size_t offset = reserve(rewind, size);
+    if (rewind->count == 0 && !keyframe) {
+        keyframe = 1;
+        size = encode_xor_rle(rewind->current.data, NULL, rewind->image_size, rewind->encoded);
+        rewind->write_pos = offset + size;
+    }
+
+    memcpy(rewind->arena + offset, rewind->encoded, size);
+    RewindRecord* record = &rewind->records[(rewind->first + rewind->count) % rewind->max_records];
+    record->offset = offset;
+    record->size = size;
+    record->keyframe = keyframe;
+    rewind->count++;
+    rewind->used += size;
+    rewind->since_keyframe = keyframe ? 0 : rewind->since_keyframe + 1;
+
+    memcpy(rewind->latest.data, rewind->current.data, rewind->image_size);
+    rewind->latest.size = rewind->image_size;
+
+    rewind->recorded_frames++;
+    rewind->record_ns += scheduler_now_ns() - start;
+}
+
+int rewind_frame(Rewind* rewind, CPU* cpu) {
+    if (rewind->count < 2) {
+        return -1;
+    }
+
+    uint32_t newest = rewind->count - 1;
+    RewindRecord* record = record_at(rewind, newest);
+
+    if (!record->keyframe) {
+        // XOR is its own inverse, undoing the newest delta gives the frame before it
+        apply_xor_rle(rewind->latest.data, rewind->arena + record->offset, record->size);
+    } else {
+        // Rebuild the previous frame from the keyframe before it
+        uint32_t k = newest - 1;
+        while (!record_at(rewind, k)->keyframe) {
+            k--;
+        }
+
+        memset(rewind->latest.data, 0, rewind->image_size);
+        for (uint32_t i = k; i < newest; i++) {
+            RewindRecord* r = record_at(rewind, i);
+            apply_xor_rle(rewind->latest.data, rewind->arena + r->offset, r->size);
+        }
+    }
+
+    // Drop the newest record, recording continues from the restored frame
+    rewind->count--;
+    rewind->used -= record->size;
+    rewind->write_pos = record->offset;
+
+    rewind->since_keyframe = 0;
+    for (uint32_t i = rewind->count - 1; !record_at(rewind, i)->keyframe; i--) {
+        rewind->since_keyframe++;
+    }
+
+    rewind->rewound_frames++;
+    return load_snapshot(cpu, &rewind->latest, NULL);
+}
+
+void rewind_report(const Rewind* rewind, FILE* out) {
+    double seconds = (double)rewind->count / TIMER_HZ;
+
+    fprintf(out, "rewind history: %.1f s in %.2f MB of %.2f MB (%.0f bytes/s)\n",
+            seconds,
+            rewind->used / 1048576.0,
+            rewind->capacity / 1048576.0,
+            seconds > 0 ? rewind->used / seconds : 0.0);
+    fprintf(out, "rewind record time: %.2f us/frame\n",
+            rewind->recorded_frames ? rewind->record_ns / 1e3 / rewind->recorded_frames : 0.0);
+}
@@ -0,0 +1,65 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+#include "snapshot.h"
+
+#define REWIND_DEFAULT_BUDGET (8u << 20)     // Bytes of history
+#define REWIND_KEYFRAME_INTERVAL 60          // One full state per second
+
+// One recorded frame inside the arena
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint8_t keyframe;
+} RewindRecord;
+
+/*
+ * History for "hold to rewind". Every frame the machine is serialized as
+ * a full snapshot, XORed with the previous frame's and run-length encoded
+ * into a preallocated arena; every REWIND_KEYFRAME_INTERVAL frames the
+ * snapshot is stored on its own instead. When the arena is full the oldest
+ * keyframe and its deltas are dropped together. Nothing is allocated after
+ * initialize_rewind().
+ */
+typedef struct {
+    uint8_t* arena;
+    size_t capacity;
+    size_t write_pos;
+    size_t used;                // Bytes held by live records
+
+    RewindRecord* records;      // Ring of records, oldest at `first`
+    uint32_t max_records;
+    uint32_t first;
+    uint32_t count;
+    uint32_t keyframe_interval;
+    uint32_t since_keyframe;
+    size_t image_size;          // Size of every recorded snapshot
+
+    Snapshot latest;            // State of the newest record
+    Snapshot current;           // Scratch for the frame being recorded
+    uint8_t* encoded;           // Scratch for one encoded record
+
+    // Statistics
+    uint64_t recorded_frames;
+    uint64_t evicted_frames;
+    uint64_t rewound_frames;
+    uint64_t record_ns;
+} Rewind;
+
+int initialize_rewind(Rewind* rewind, size_t budget, uint32_t keyframe_interval);
+void cleanup_rewind(Rewind* rewind);
+
+// Appends the state at the end of a frame
+void record_rewind_frame(Rewind* rewind, const CPU* cpu);
+
+// Goes back one frame and restores it into `cpu`. Returns -1 when there is no older frame.
+int rewind_frame(Rewind* rewind, CPU* cpu);
+
+// Seconds of gameplay held, bytes used and bytes per second of history
+void rewind_report(const Rewind* rewind, FILE* out);
+
+#endif
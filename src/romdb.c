@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "romdb.h"
+#include "error.h"
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t hash_rom(const uint8_t* data, size_t size) {
+    return fnv1a(FNV_OFFSET, data, size);
+}
+
+int hash_rom_file(const char* path, uint64_t* hash) {
+    FILE* rom = fopen(path, "rb");
+    if (rom == NULL) {
+        print_error(ERROR_ROM_OPEN, "Could not open ROM file");
+        return -1;
+    }
+
+    uint64_t h = FNV_OFFSET;
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), rom)) > 0) {
+        h = fnv1a(h, buffer, n);
+    }
+
+    int failed = ferror(rom);
+    fclose(rom);
+    if (failed) {
+        print_error(ERROR_ROM_READ, "Could not read ROM file");
+        return -1;
+    }
+
+    *hash = h;
+    return 0;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    uint64_t x = ((const RomDbEntry*)a)->hash;
+    uint64_t y = ((const RomDbEntry*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+int load_rom_db(RomDatabase* db, const char* path) {
+    db->entries = NULL;
+    db->count = 0;
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        print_error(ERROR_ROM_DB, "Could not open the ROM database");
+        return -1;
+    }
+
+    uint32_t capacity = 0;
+    char line[256];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+
+        // Comments and blank lines
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char hash_text[32], profile[32], machine_name[32];
+        int fields = sscanf(line, "%31s %31s %31s", hash_text, profile, machine_name);
+        if (fields <= 0) {
+            continue;
+        }
+
+        char* end;
+        RomDbEntry entry;
+        QuirkProfile quirks;
+        Machine machine = MACHINE_CHIP8;
+        entry.hash = strtoull(hash_text, &end, 16);
+        if (fields < 2 || *end != '\0' || parse_quirks(profile, &quirks) < 0
+            || (fields == 3 && parse_machine(machine_name, &machine) < 0)) {
+            char message[64];
+            snprintf(message, sizeof(message), "Bad entry on line %d of the ROM database", line_number);
+            print_error(ERROR_ROM_DB, message);
+            fclose(file);
+            cleanup_rom_db(db);
+            return -1;
+        }
+        entry.quirks = quirks;
+        entry.machine = fields == 3 ? machine : ROMDB_ANY_MACHINE;
+
+        if (db->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            RomDbEntry* grown = realloc(db->entries, capacity * sizeof(RomDbEntry));
+            if (grown == NULL) {
+                print_error(ERROR_MEMORY, "Could not allocate the ROM database");
+                fclose(file);
+                cleanup_rom_db(db);
+                return -1;
+            }
+            db->entries = grown;
+        }
+        db->entries[db->count++] = entry;
+    }
+
+    fclose(file);
+    qsort(db->entries, db->count, sizeof(RomDbEntry), compare_entries);
+    return 0;
+}
+
+void cleanup_rom_db(RomDatabase* db) {
+    free(db->entries);
+    db->entries = NULL;
+    db->count = 0;
+}
+
+int find_rom(const RomDatabase* db, uint64_t hash, QuirkProfile* quirks, Machine* machine) {
+    RomDbEntry key = { .hash = hash };
+    const RomDbEntry* entry = bsearch(&key, db->entries, db->count, sizeof(RomDbEntry), compare_entries);
+    if (entry == NULL) {
+        return 0;
+    }
+
+    *quirks = (QuirkProfile)entry->quirks;
+    if (entry->machine != ROMDB_ANY_MACHINE) {
+        *machine = (Machine)entry->machine;
+    }
+    return 1;
+}
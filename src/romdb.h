@@ -0,0 +1,49 @@
+#ifndef ROMDB_H
+#define ROMDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * ROM database: a text file that picks the quirk profile (and optionally
+ * the machine) for known ROMs, keyed by a hash of the ROM file.
+ * One ROM per line, '#' starts a comment:
+ *
+ *     # hash            profile  [machine]
+ *     6c3e5f5a0e2b9d41  vip
+ *     0f9b3c2d1a8e7f60  xochip   xochip
+ *
+ * The hash is FNV-1a 64 over the file, as 16 hex digits (see hash_rom()).
+ */
+
+#define ROMDB_ANY_MACHINE 0xFF     // Entry doesn't name a machine
+
+typedef struct {
+    uint64_t hash;
+    uint8_t quirks;         // QuirkProfile
+    uint8_t machine;        // Machine or ROMDB_ANY_MACHINE
+} RomDbEntry;
+
+typedef struct {
+    RomDbEntry* entries;    // Sorted by hash
+    uint32_t count;
+} RomDatabase;
+
+// Hash identifying a ROM by its contents
+uint64_t hash_rom(const uint8_t* data, size_t size);
+
+// Hashes the ROM file at `path`, returns -1 if it can't be read
+int hash_rom_file(const char* path, uint64_t* hash);
+
+// Reads the database at `path`, returns -1 if it can't be read or has a bad line
+int load_rom_db(RomDatabase* db, const char* path);
+void cleanup_rom_db(RomDatabase* db);
+
+/*
+ * Returns 1 and sets `quirks` (and `machine`, if the entry names one) when
+ * the ROM with this hash is listed, 0 when it isn't.
+ */
+int find_rom(const RomDatabase* db, uint64_t hash, QuirkProfile* quirks, Machine* machine);
+
+#endif
@@ -0,0 +1,127 @@
+#include <time.h>
+#include "scheduler.h"
+
+uint64_t scheduler_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ull;
+    ts.tv_nsec = deadline % 1000000000ull;
+
+    // clock_nanosleep returns EINTR if a signal arrives, the caller checks its own quit flag
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+void scheduler_init(Scheduler* scheduler, uint32_t clock_speed) {
+    uint64_t now = scheduler_now_ns();
+
+    scheduler->clock_speed = clock_speed;
+    scheduler->budget_remainder = 0;
+    scheduler->next_frame = now + FRAME_NS;
+
+    scheduler->start = now;
+    scheduler->frames = 0;
+    scheduler->instructions = 0;
+    scheduler->skipped_frames = 0;
+    scheduler->wakeups = 0;
+    scheduler->jitter_total = 0;
+    scheduler->jitter_max = 0;
+    scheduler->last_report = now;
+    scheduler->report_frames = 0;
+    scheduler->report_instructions = 0;
+}
+
+uint32_t scheduler_frame_budget(Scheduler* scheduler) {
+    uint32_t total = scheduler->clock_speed + scheduler->budget_remainder;
+    scheduler->budget_remainder = total % TIMER_HZ;
+    return total / TIMER_HZ;
+}
+
+uint32_t frame_budget(uint32_t clock_speed, uint64_t frame) {
+    return (uint32_t)(((frame + 1) * clock_speed) / TIMER_HZ - (frame * clock_speed) / TIMER_HZ);
+}
+
+uint32_t scheduler_wait(Scheduler* scheduler) {
+    uint64_t now = scheduler_now_ns();
+
+    if (now < scheduler->next_frame) {
+        sleep_until_ns(scheduler->next_frame);
+        now = scheduler_now_ns();
+    }
+
+    // Early wake-ups (signals) still count as zero lateness
+    uint64_t late = now > scheduler->next_frame ? now - scheduler->next_frame : 0;
+    scheduler->wakeups++;
+    scheduler->jitter_total += late;
+    if (late > scheduler->jitter_max) {
+        scheduler->jitter_max = late;
+    }
+
+    uint64_t due = late / FRAME_NS + 1;
+    if (due > MAX_CATCHUP_FRAMES) {
+        // We stalled for too long (debugger, suspended laptop, ...), drop the backlog
+        scheduler->skipped_frames += due - MAX_CATCHUP_FRAMES;
+        scheduler->next_frame = now + FRAME_NS;
+        return MAX_CATCHUP_FRAMES;
+    }
+
+    scheduler->next_frame += due * FRAME_NS;
+    return (uint32_t)due;
+}
+
+void scheduler_frame_done(Scheduler* scheduler, uint32_t instructions) {
+    scheduler_frames_done(scheduler, 1, instructions);
+}
+
+void scheduler_frames_done(Scheduler* scheduler, uint32_t frames, uint64_t instructions) {
+    scheduler->frames += frames;
+    scheduler->instructions += instructions;
+}
+
+int scheduler_report_periodic(Scheduler* scheduler, FILE* out) {
+    uint64_t now = scheduler_now_ns();
+    uint64_t elapsed = now - scheduler->last_report;
+    if (elapsed < 1000000000ull) {
+        return 0;
+    }
+
+    uint64_t frames = scheduler->frames - scheduler->report_frames;
+    uint64_t instructions = scheduler->instructions - scheduler->report_instructions;
+    double seconds = elapsed / 1e9;
+
+    fprintf(out, "%.0f IPS | %.1f FPS | jitter avg %.3f ms max %.3f ms | skipped %llu\n",
+            instructions / seconds,
+            frames / seconds,
+            scheduler->wakeups ? scheduler->jitter_total / 1e6 / scheduler->wakeups : 0.0,
+            scheduler->jitter_max / 1e6,
+            (unsigned long long)scheduler->skipped_frames);
+
+    scheduler->last_report = now;
+    scheduler->report_frames = scheduler->frames;
+    scheduler->report_instructions = scheduler->instructions;
+    return 1;
+}
+
+void scheduler_report(const Scheduler* scheduler, FILE* out) {
+    double elapsed = (scheduler_now_ns() - scheduler->start) / 1e9;
+    double virtual_seconds = (double)scheduler->frames / TIMER_HZ;
+
+    fprintf(out, "frames: %llu\n", (unsigned long long)scheduler->frames);
+    fprintf(out, "instructions: %llu\n", (unsigned long long)scheduler->instructions);
+    fprintf(out, "wall time: %.3f s\n", elapsed);
+    fprintf(out, "virtual time: %.3f s\n", virtual_seconds);
+    if (elapsed > 0) {
+        fprintf(out, "instructions/sec: %.0f\n", scheduler->instructions / elapsed);
+        fprintf(out, "speed: %.1fx real time\n", virtual_seconds / elapsed);
+    }
+    if (scheduler->wakeups > 0) {
+        fprintf(out, "frame jitter: avg %.3f ms, max %.3f ms\n",
+                scheduler->jitter_total / 1e6 / scheduler->wakeups,
+                scheduler->jitter_max / 1e6);
+    }
+    fprintf(out, "skipped frames: %llu\n", (unsigned long long)scheduler->skipped_frames);
+}
@@ -0,0 +1,64 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TIMER_HZ 60
+#define FRAME_NS (1000000000ull / TIMER_HZ)
+#define MAX_CATCHUP_FRAMES 5
+
+typedef struct {
+    uint32_t clock_speed;       // Instructions per second
+    uint32_t budget_remainder;  // Leftover instructions carried between frames (in 1/60ths)
+    uint64_t next_frame;        // Deadline of the next frame in ns (CLOCK_MONOTONIC)
+
+    // Statistics
+    uint64_t start;
+    uint64_t frames;
+    uint64_t instructions;
+    uint64_t skipped_frames;    // Frames dropped after a stall longer than MAX_CATCHUP_FRAMES
+    uint64_t wakeups;           // Number of scheduler_wait calls
+    uint64_t jitter_total;      // Sum of wake-up lateness in ns
+    uint64_t jitter_max;
+    uint64_t last_report;
+    uint64_t report_frames;
+    uint64_t report_instructions;
+} Scheduler;
+
+uint64_t scheduler_now_ns(void);
+
+void scheduler_init(Scheduler* scheduler, uint32_t clock_speed);
+
+/*
+ * Returns the number of instructions to run in the next frame.
+ * The budget is clock_speed / 60 with the remainder carried over,
+ * so e.g. 700 IPS alternates between 11 and 12 instructions per frame
+ * and still runs exactly 700 instructions every 60 frames.
+ */
+uint32_t scheduler_frame_budget(Scheduler* scheduler);
+
+// The same budget for frame number `frame` (counting from 0), without a Scheduler
+uint32_t frame_budget(uint32_t clock_speed, uint64_t frame);
+
+/*
+ * Sleeps until the next frame deadline and returns how many frames are due.
+ * Normally this is 1. After a stall it returns up to MAX_CATCHUP_FRAMES so
+ * the caller can catch up deterministically; anything beyond that is dropped
+ * and the schedule is re-synchronized to the current time.
+ */
+uint32_t scheduler_wait(Scheduler* scheduler);
+
+void scheduler_frame_done(Scheduler* scheduler, uint32_t instructions);
+
+// Same as scheduler_frame_done() for a batch of frames (e.g. across many instances)
+void scheduler_frames_done(Scheduler* scheduler, uint32_t frames, uint64_t instructions);
+
+/*
+ * Prints the measured instructions/sec and frame jitter since the last report
+ * once every second. Returns 1 if something was printed.
+ */
+int scheduler_report_periodic(Scheduler* scheduler, FILE* out);
+void scheduler_report(const Scheduler* scheduler, FILE* out);
+
+#endif
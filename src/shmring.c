@@ -0,0 +1,76 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "shmring.h"
+#include "error.h"
+
+int initialize_shm_ring(ShmRing* ring, const char* name) {
+    if (name[0] != '/' || strlen(name) >= sizeof(ring->name)) {
+        print_error(ERROR_SHM, "Shared memory names look like /name");
+        return -1;
+    }
+
+    ring->size = sizeof(ShmRingHeader) + SHM_RING_SLOTS * sizeof(ShmFrame);
+    strcpy(ring->name, name);
+
+    // Truncating to zero first leaves every slot zeroed, sequence 0 and frame 0
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, ring->size) < 0) {
+        print_error(ERROR_SHM, "Could not create the shared memory object");
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(name);
+        }
+        return -1;
+    }
+
+    ring->header = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring->header == MAP_FAILED) {
+        print_error(ERROR_SHM, "Could not map the shared memory object");
+        shm_unlink(name);
+        return -1;
+    }
+
+    ShmRingHeader* header = ring->header;
+    header->version = SHM_RING_VERSION;
+    header->slot_count = SHM_RING_SLOTS;
+    header->slot_size = sizeof(ShmFrame);
+    atomic_store_explicit(&header->writer_pid, (uint32_t)getpid(), memory_order_relaxed);
+    atomic_store_explicit(&header->latest, 0, memory_order_relaxed);
+
+    // Readers that opened it early wait for the magic
+    atomic_thread_fence(memory_order_release);
+    header->magic = SHM_RING_MAGIC;
+    return 0;
+}
+
+void publish_shm_frame(ShmRing* ring, const CPU* cpu, uint64_t number) {
+    ShmFrame* slot = &ring->header->slots[number % SHM_RING_SLOTS];
+
+    // Odd before any of the frame is written, readers copying meanwhile retry
+    uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->keys = keypad_mask(cpu);
+    slot->delay_timer = cpu->delay_timer;
+    slot->sound_timer = cpu->sound_timer;
+    slot->number = number;
+    slot->hires = cpu->hires;
+    slot->machine = cpu->machine;
+
+    // Only XO-CHIP draws on the other planes, they stay zero otherwise
+    size_t planes = cpu->machine == MACHINE_XOCHIP ? NUM_PLANES : 1;
+    memcpy(slot->framebuffer, cpu->framebuffer, planes * sizeof(cpu->framebuffer[0]));
+
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+    atomic_store_explicit(&ring->header->latest, number, memory_order_release);
+}
+
+void cleanup_shm_ring(ShmRing* ring) {
+    atomic_store_explicit(&ring->header->writer_pid, 0, memory_order_release);
+    munmap(ring->header, ring->size);
+    shm_unlink(ring->name);
+}
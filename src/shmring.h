@@ -0,0 +1,88 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+
+#define SHM_RING_MAGIC 0x52463843u      // "C8FR" in little-endian memory
+#define SHM_RING_VERSION 1
+#define SHM_RING_SLOTS 64               // About a second of frames at 60 Hz
+
+/*
+ * One published frame. `sequence` is a seqlock: odd while the emulator
+ * writes the slot, bumped by two for every frame written to it.
+ */
+typedef struct {
+    _Alignas(64) _Atomic uint32_t sequence;
+    uint16_t keys;                  // Keypad, key 0 in bit 0
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint64_t number;                // Frames run when it was published, from 1
+    uint8_t hires;
+    uint8_t machine;                // Machine
+    uint8_t reserved[6];
+    uint64_t framebuffer[NUM_PLANES][FRAMEBUFFER_HEIGHT][FRAMEBUFFER_WORDS];
+} ShmFrame;
+
+/*
+ * Layout of the shared memory object, in native byte order. Frame n is in
+ * slots[n % slot_count]; `latest` is the newest finished frame.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;             // sizeof(ShmFrame)
+    _Atomic uint64_t latest;        // 0 before the first frame
+    _Atomic uint32_t writer_pid;    // 0 once the emulator has exited
+    ShmFrame slots[];
+} ShmRingHeader;
+
+/*
+ * Emulator side: a POSIX shared memory object readers shm_open() and mmap()
+ * read-only. Publishing is plain stores into the mapping, no system calls.
+ */
+typedef struct {
+    ShmRingHeader* header;
+    size_t size;
+    char name[256];
+} ShmRing;
+
+// Creates (or replaces) the object `name`, e.g. "/chip8"
+int initialize_shm_ring(ShmRing* ring, const char* name);
+
+// Writes the CPU's frame, keypad and timers as frame `number`
+void publish_shm_frame(ShmRing* ring, const CPU* cpu, uint64_t number);
+
+// Marks the ring finished and removes the name, mapped readers keep their view
+void cleanup_shm_ring(ShmRing* ring);
+
+/*
+ * Reader side, needs nothing but this header. Copies frame `number` into
+ * `out`. Returns 0, or -1 if the slot holds another frame: not published
+ * yet, or already overwritten because the reader fell a whole ring behind
+ * (start again from `latest`).
+ */
+static inline int read_shm_frame(const ShmRingHeader* ring, uint64_t number, ShmFrame* out) {
+    const ShmFrame* slot = &ring->slots[number % ring->slot_count];
+    const size_t offset = offsetof(ShmFrame, keys);
+
+    for (;;) {
+        uint32_t before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;       // Being written, for well under a microsecond
+        }
+
+        memcpy((char*)out + offset, (const char*)slot + offset, sizeof(ShmFrame) - offset);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before) {
+            atomic_init(&out->sequence, before);
+            return out->number == number ? 0 : -1;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include "snapshot.h"
+#include "error.h"
+
+#define SP_OFFSET (SNAPSHOT_HEADER_SIZE + 4)
+#define QUIRKS_OFFSET (SNAPSHOT_HEADER_SIZE + 7)
+#define MACHINE_OFFSET (SNAPSHOT_HEADER_SIZE + 8)
+#define HIRES_OFFSET (SNAPSHOT_HEADER_SIZE + 9)
+#define PLANES_OFFSET (SNAPSHOT_HEADER_SIZE + 10)
+#define FRAMEBUFFER_OFFSET (SNAPSHOT_HEADER_SIZE + SNAPSHOT_STATE_SIZE)
+#define MEMORY_OFFSET (FRAMEBUFFER_OFFSET + SNAPSHOT_FRAMEBUFFER_SIZE)
+
+// Little-endian helpers, advance the cursor they're given
+static void put8(uint8_t** p, uint8_t value) {
+    *(*p)++ = value;
+}
+
+static void put16(uint8_t** p, uint16_t value) {
+    put8(p, value & 0xFF);
+    put8(p, value >> 8);
+}
+
+static void put32(uint8_t** p, uint32_t value) {
+    put16(p, value & 0xFFFF);
+    put16(p, value >> 16);
+}
+
+static void put64(uint8_t** p, uint64_t value) {
+    put32(p, value & 0xFFFFFFFF);
+    put32(p, value >> 32);
+}
+
+static uint8_t get8(const uint8_t** p) {
+    return *(*p)++;
+}
+
+static uint16_t get16(const uint8_t** p) {
+    uint16_t low = get8(p);
+    return low | (uint16_t)get8(p) << 8;
+}
+
+static uint32_t get32(const uint8_t** p) {
+    uint32_t low = get16(p);
+    return low | (uint32_t)get16(p) << 16;
+}
+
+static uint64_t get64(const uint8_t** p) {
+    uint64_t low = get32(p);
+    return low | (uint64_t)get32(p) << 32;
+}
+
+// FNV-1a over 64-bit words
+uint32_t hash_snapshot(const Snapshot* snapshot) {
+    uint64_t hash = 14695981039346656037ull;
+    const uint8_t* p = snapshot->data;
+    size_t i = 0;
+    for (; i + 8 <= snapshot->size; i += 8) {
+        hash = (hash ^ get64(&p)) * 1099511628211ull;
+    }
+    for (; i < snapshot->size; i++) {
+        hash = (hash ^ snapshot->data[i]) * 1099511628211ull;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static void put_header(uint8_t** p, uint16_t kind, uint32_t base_hash) {
+    memcpy(*p, SNAPSHOT_MAGIC, 4);
+    *p += 4;
+    put16(p, SNAPSHOT_VERSION);
+    put16(p, kind);
+    put32(p, base_hash);
+}
+
+static int check_header(const Snapshot* snapshot, uint16_t* kind, uint32_t* base_hash) {
+    if (snapshot->size < SNAPSHOT_HEADER_SIZE + SNAPSHOT_STATE_SIZE || memcmp(snapshot->data, SNAPSHOT_MAGIC, 4) != 0) {
+        return -1;
+    }
+
+    const uint8_t* p = snapshot->data + 4;
+    if (get16(&p) != SNAPSHOT_VERSION) {
+        return -1;
+    }
+    *kind = get16(&p);
+    *base_hash = get32(&p);
+    return 0;
+}
+
+static void put_state(uint8_t** p, const CPU* cpu) {
+    put16(p, cpu->PC);
+    put16(p, cpu->I);
+    put8(p, (uint8_t)cpu->SP);
+    put8(p, cpu->delay_timer);
+    put8(p, cpu->sound_timer);
+    put8(p, cpu->quirks);
+    put8(p, cpu->machine);
+    put8(p, cpu->hires);
+    put8(p, cpu->planes);
+    put8(p, cpu->vblank);
+    for (int i = 0; i < NUM_REGS; i++) {
+        put8(p, cpu->v[i]);
+    }
+    for (int i = 0; i < STACK_DEPTH; i++) {
+        put16(p, cpu->stack[i]);
+    }
+    for (int i = 0; i < NUM_KEYS; i++) {
+        put8(p, cpu->keypad[i]);
+    }
+    for (int i = 0; i < NUM_FLAGS; i++) {
+        put8(p, cpu->flags[i]);
+    }
+    put64(p, cpu->rng_state);
+    put8(p, cpu->pitch);
+    put8(p, cpu->pattern_set);
+    for (int i = 0; i < PATTERN_SIZE; i++) {
+        put8(p, cpu->pattern[i]);
+    }
+}
+
+static void get_state(const uint8_t** p, CPU* cpu) {
+    cpu->PC = get16(p);
+    cpu->I = get16(p);
+    cpu->SP = (int8_t)get8(p);
+    cpu->delay_timer = get8(p);
+    cpu->sound_timer = get8(p);
+    set_quirks(cpu, (QuirkProfile)get8(p));
+    set_machine(cpu, (Machine)get8(p));
+    cpu->hires = get8(p);
+    cpu->planes = get8(p);
+    cpu->vblank = get8(p);
+    for (int i = 0; i < NUM_REGS; i++) {
+        cpu->v[i] = get8(p);
+    }
+    for (int i = 0; i < STACK_DEPTH; i++) {
+        cpu->stack[i] = get16(p);
+    }
+    for (int i = 0; i < NUM_KEYS; i++) {
+        cpu->keypad[i] = get8(p);
+    }
+    for (int i = 0; i < NUM_FLAGS; i++) {
+        cpu->flags[i] = get8(p);
+    }
+    cpu->rng_state = get64(p);
+    cpu->pitch = get8(p);
+    cpu->pattern_set = get8(p);
+    for (int i = 0; i < PATTERN_SIZE; i++) {
+        cpu->pattern[i] = get8(p);
+    }
+}
+
+// Rows are numbered plane by plane
+static void put_row(uint8_t** p, const CPU* cpu, int row) {
+    for (int w = 0; w < FRAMEBUFFER_WORDS; w++) {
+        put64(p, cpu->framebuffer[row / FRAMEBUFFER_HEIGHT][row % FRAMEBUFFER_HEIGHT][w]);
+    }
+}
+
+static void get_row(const uint8_t** p, CPU* cpu, int row) {
+    for (int w = 0; w < FRAMEBUFFER_WORDS; w++) {
+        cpu->framebuffer[row / FRAMEBUFFER_HEIGHT][row % FRAMEBUFFER_HEIGHT][w] = get64(p);
+    }
+}
+
+// Memory held by snapshots of `machine`, 0 if there is no such machine
+static uint32_t machine_memory(uint8_t machine) {
+    switch (machine) {
+        case MACHINE_CHIP8:
+        case MACHINE_SCHIP:
+            return CHIP8_MEM_SIZE;
+        case MACHINE_XOCHIP:
+            return MEM_SIZE;
+        default:
+            return 0;
+    }
+}
+
+void save_snapshot(const CPU* cpu, Snapshot* snapshot) {
+    uint8_t* p = snapshot->data;
+
+    put_header(&p, SNAPSHOT_FULL, 0);
+    put_state(&p, cpu);
+    for (int row = 0; row < SNAPSHOT_NUM_ROWS; row++) {
+        put_row(&p, cpu, row);
+    }
+    memcpy(p, cpu->memory, memory_size(cpu));
+    p += memory_size(cpu);
+
+    snapshot->size = p - snapshot->data;
+}
+
+static int is_full_snapshot(const Snapshot* snapshot) {
+    uint16_t kind;
+    uint32_t base_hash;
+    return check_header(snapshot, &kind, &base_hash) == 0 && kind == SNAPSHOT_FULL
+        && snapshot->size == SNAPSHOT_FULL_SIZE(machine_memory(snapshot->data[MACHINE_OFFSET]));
+}
+
+int save_delta_snapshot(const CPU* cpu, const Snapshot* base, Snapshot* delta) {
+    if (!is_full_snapshot(base) || base->data[MACHINE_OFFSET] != cpu->machine) {
+        print_error(ERROR_SNAPSHOT, "Delta snapshots need a full base snapshot of the same machine");
+        return -1;
+    }
+
+    uint8_t* p = delta->data;
+    put_header(&p, SNAPSHOT_DELTA, hash_snapshot(base));
+    put_state(&p, cpu);
+
+    // Framebuffer rows that differ from the base, after a bitmap of them
+    const uint8_t* base_rows = base->data + FRAMEBUFFER_OFFSET;
+    uint8_t* row_mask = p;
+    memset(row_mask, 0, SNAPSHOT_NUM_ROWS / 8);
+    p += SNAPSHOT_NUM_ROWS / 8;
+    for (int row = 0; row < SNAPSHOT_NUM_ROWS; row++) {
+        uint8_t* at = p;
+        put_row(&p, cpu, row);
+        if (memcmp(at, base_rows + row * SNAPSHOT_ROW_SIZE, SNAPSHOT_ROW_SIZE) != 0) {
+            row_mask[row / 8] |= 1 << (row % 8);
+        } else {
+            p = at;
+        }
+    }
+
+    // Memory pages that differ from the base, likewise
+    const uint8_t* base_memory = base->data + MEMORY_OFFSET;
+    int pages = memory_size(cpu) / CODE_PAGE_SIZE;
+    uint8_t* page_mask = p;
+    memset(page_mask, 0, pages / 8);
+    p += pages / 8;
+    for (int page = 0; page < pages; page++) {
+        const uint8_t* current = cpu->memory + page * CODE_PAGE_SIZE;
+        if (memcmp(current, base_memory + page * CODE_PAGE_SIZE, CODE_PAGE_SIZE) != 0) {
+            page_mask[page / 8] |= 1 << (page % 8);
+            memcpy(p, current, CODE_PAGE_SIZE);
+            p += CODE_PAGE_SIZE;
+        }
+    }
+
+    delta->size = p - delta->data;
+    return 0;
+}
+
+// Copies one page into memory, dropping decoded instructions only if it changes
+static void restore_page(CPU* cpu, int page, const uint8_t* contents) {
+    uint8_t* target = cpu->memory + page * CODE_PAGE_SIZE;
+    if (memcmp(target, contents, CODE_PAGE_SIZE) != 0) {
+        memcpy(target, contents, CODE_PAGE_SIZE);
+        invalidate_decode_cache(cpu, page * CODE_PAGE_SIZE, CODE_PAGE_SIZE);
+    }
+}
+
+static int count_bits(const uint8_t* mask, int bytes) {
+    int count = 0;
+    for (int i = 0; i < bytes; i++) {
+        count += __builtin_popcount(mask[i]);
+    }
+    return count;
+}
+
+static int bit_set(const uint8_t* mask, int bit) {
+    return (mask[bit / 8] >> (bit % 8)) & 1;
+}
+
+int load_snapshot(CPU* cpu, const Snapshot* snapshot, const Snapshot* base) {
+    uint16_t kind;
+    uint32_t base_hash;
+    if (check_header(snapshot, &kind, &base_hash) < 0) {
+        print_error(ERROR_SNAPSHOT, "Not a snapshot of a supported version");
+        return -1;
+    }
+
+    uint32_t memory = machine_memory(snapshot->data[MACHINE_OFFSET]);
+    if (memory == 0 || snapshot->data[QUIRKS_OFFSET] >= QUIRKS_COUNT) {
+        print_error(ERROR_SNAPSHOT, "Snapshot of an unknown machine or quirk profile");
+        return -1;
+    }
+
+    // The stack pointer indexes cpu->stack and hires shifts the screen size, neither can be trusted
+    int8_t sp = (int8_t)snapshot->data[SP_OFFSET];
+    if (sp < -1 || sp >= STACK_DEPTH || snapshot->data[HIRES_OFFSET] > 1
+        || snapshot->data[PLANES_OFFSET] >= 1 << NUM_PLANES) {
+        print_error(ERROR_SNAPSHOT, "Snapshot with an invalid stack pointer, resolution or plane mask");
+        return -1;
+    }
+
+    if (kind == SNAPSHOT_FULL) {
+        if (snapshot->size != SNAPSHOT_FULL_SIZE(memory)) {
+            print_error(ERROR_SNAPSHOT, "Truncated snapshot");
+            return -1;
+        }
+        base = snapshot;
+    } else if (kind != SNAPSHOT_DELTA || base == NULL || !is_full_snapshot(base) || hash_snapshot(base) != base_hash
+               || base->data[MACHINE_OFFSET] != snapshot->data[MACHINE_OFFSET]) {
+        print_error(ERROR_SNAPSHOT, "Delta snapshot does not match its base");
+        return -1;
+    }
+
+    // Validate the masks against the size before touching the CPU
+    int pages = memory / CODE_PAGE_SIZE;
+    const uint8_t* end = snapshot->data + snapshot->size;
+    const uint8_t* p = snapshot->data + SNAPSHOT_HEADER_SIZE + SNAPSHOT_STATE_SIZE;
+    const uint8_t* row_mask = NULL;
+    const uint8_t* page_mask = NULL;
+    const uint8_t* rows = NULL;
+    const uint8_t* contents = NULL;
+
+    if (kind == SNAPSHOT_DELTA) {
+        if (end - p < SNAPSHOT_NUM_ROWS / 8) {
+            print_error(ERROR_SNAPSHOT, "Truncated snapshot");
+            return -1;
+        }
+        row_mask = p;
+        p += SNAPSHOT_NUM_ROWS / 8;
+        rows = p;
+        p += count_bits(row_mask, SNAPSHOT_NUM_ROWS / 8) * SNAPSHOT_ROW_SIZE;
+
+        if (end - p < pages / 8) {
+            print_error(ERROR_SNAPSHOT, "Truncated snapshot");
+            return -1;
+        }
+        page_mask = p;
+        p += pages / 8;
+        contents = p;
+        if (end - p != count_bits(page_mask, pages / 8) * CODE_PAGE_SIZE) {
+            print_error(ERROR_SNAPSHOT, "Truncated snapshot");
+            return -1;
+        }
+    }
+
+    p = snapshot->data + SNAPSHOT_HEADER_SIZE;
+    get_state(&p, cpu);
+
+    const uint8_t* base_rows = base->data + FRAMEBUFFER_OFFSET;
+    for (int row = 0; row < SNAPSHOT_NUM_ROWS; row++) {
+        const uint8_t* q = base_rows + row * SNAPSHOT_ROW_SIZE;
+        if (row_mask != NULL && bit_set(row_mask, row)) {
+            q = rows;
+            rows += SNAPSHOT_ROW_SIZE;
+        }
+        get_row(&q, cpu, row);
+    }
+    cpu->dirty_rows = ~0ull;
+
+    const uint8_t* base_memory = base->data + MEMORY_OFFSET;
+    for (int page = 0; page < pages; page++) {
+        const uint8_t* q = base_memory + page * CODE_PAGE_SIZE;
+        if (page_mask != NULL && bit_set(page_mask, page)) {
+            q = contents;
+            contents += CODE_PAGE_SIZE;
+        }
+        restore_page(cpu, page, q);
+    }
+
+    return 0;
+}
+
+int write_snapshot_file(const Snapshot* snapshot, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        print_error(ERROR_SNAPSHOT, "Could not open snapshot file for writing");
+        return -1;
+    }
+
+    size_t written = fwrite(snapshot->data, 1, snapshot->size, file);
+    if (fclose(file) != 0 || written != snapshot->size) {
+        print_error(ERROR_SNAPSHOT, "Could not write snapshot file");
+        return -1;
+    }
+    return 0;
+}
+
+int read_snapshot_file(Snapshot* snapshot, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        print_error(ERROR_SNAPSHOT, "Could not open snapshot file");
+        return -1;
+    }
+
+    snapshot->size = fread(snapshot->data, 1, SNAPSHOT_MAX_SIZE, file);
+    int too_large = fgetc(file) != EOF;
+    fclose(file);
+
+    if (too_large) {
+        print_error(ERROR_SNAPSHOT, "Snapshot file too large");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Save states. A full snapshot holds the whole machine (registers, stack,
+ * timers, keypad, quirk profile, display mode, audio pattern, framebuffer and as much memory
+ * as the machine has); a delta snapshot only holds the registers plus the
+ * framebuffer rows and memory pages that differ from a full base snapshot. The decode cache is not saved,
+ * restoring only invalidates the pages whose contents actually change.
+ *
+ * All fields are stored little-endian after a "C8SS" magic and a version.
+ */
+#define SNAPSHOT_MAGIC "C8SS"
+#define SNAPSHOT_VERSION 5    // 2: Cxnn generator state, 3: machine, planes, high resolution, flags, 4: quirk profile, vblank, 5: audio pattern
+
+#define SNAPSHOT_FULL 0
+#define SNAPSHOT_DELTA 1
+
+#define SNAPSHOT_HEADER_SIZE 12    // Magic, version, kind, base hash
+#define SNAPSHOT_STATE_SIZE 118    // Registers, stack, timers, keypad, quirks, machine, display mode, flags, RNG, audio pattern
+#define SNAPSHOT_ROW_SIZE (FRAMEBUFFER_WORDS * 8)
+#define SNAPSHOT_NUM_ROWS (NUM_PLANES * FRAMEBUFFER_HEIGHT)
+#define SNAPSHOT_FRAMEBUFFER_SIZE (SNAPSHOT_NUM_ROWS * SNAPSHOT_ROW_SIZE)
+
+// Size of a full snapshot of a machine with `memory` bytes of memory
+#define SNAPSHOT_FULL_SIZE(memory) (SNAPSHOT_HEADER_SIZE + SNAPSHOT_STATE_SIZE + SNAPSHOT_FRAMEBUFFER_SIZE + (memory))
+
+// A delta where everything changed: row and page bitmaps on top of a full XO-CHIP snapshot
+#define SNAPSHOT_MAX_SIZE (SNAPSHOT_FULL_SIZE(MEM_SIZE) + SNAPSHOT_NUM_ROWS / 8 + NUM_CODE_PAGES / 8)
+
+typedef struct {
+    size_t size;
+    uint8_t data[SNAPSHOT_MAX_SIZE];
+} Snapshot;
+
+void save_snapshot(const CPU* cpu, Snapshot* snapshot);
+
+// Records what changed since `base`, which must be a full snapshot
+int save_delta_snapshot(const CPU* cpu, const Snapshot* base, Snapshot* delta);
+
+/*
+ * Restores a full snapshot, or a delta snapshot on top of `base` (NULL for
+ * full snapshots). Returns -1 if the data is not a valid snapshot of this
+ * version or the delta was taken against a different base.
+ */
+int load_snapshot(CPU* cpu, const Snapshot* snapshot, const Snapshot* base);
+
+int write_snapshot_file(const Snapshot* snapshot, const char* path);
+int read_snapshot_file(Snapshot* snapshot, const char* path);
+
+// Hash of the snapshot bytes, equal states give equal hashes
+uint32_t hash_snapshot(const Snapshot* snapshot);
+
+#endif
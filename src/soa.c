@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include "soa.h"
+#include "error.h"
+
+#define SOA_SCALAR 0xFF
+
+// GCC vector extensions, lowered to SSE2/AVX2/NEON or plain code depending on the target.
+// Vectors are only returned from static functions here, the ABI warning doesn't apply.
+#pragma GCC diagnostic ignored "-Wpsabi"
+typedef uint8_t u8v __attribute__((vector_size(SOA_BLOCK)));
+
+static inline u8v load8(const uint8_t* p) {
+    u8v v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// A macro because vector parameters get GCC's ABI note without AVX, which no pragma silences
+#define STORE8_MASKED(p, value, mask) do {                                         \
+        uint8_t* store_p = (p);                                                    \
+        u8v store_mask = (mask);                                                   \
+        u8v store_value = ((value) & store_mask) | (load8(store_p) & ~store_mask); \
+        memcpy(store_p, &store_value, sizeof(store_value));                        \
+    } while (0)
+
+static inline u8v splat8(uint8_t value) {
+    u8v v;
+    for (int i = 0; i < SOA_BLOCK; i++) {
+        v[i] = value;
+    }
+    return v;
+}
+
+static void* allocate_lanes(uint32_t capacity, size_t element_size) {
+    void* lanes = aligned_alloc(SOA_BLOCK, capacity * element_size);
+    if (lanes != NULL) {
+        memset(lanes, 0, capacity * element_size);
+    }
+    return lanes;
+}
+
+SoaPool* create_soa_pool(const CPU* template, uint32_t count, uint64_t seed) {
+    SoaPool* pool = calloc(1, sizeof(SoaPool));
+    if (pool == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the SoA pool");
+        return NULL;
+    }
+
+    pool->count = count;
+    pool->capacity = (count + SOA_BLOCK - 1) / SOA_BLOCK * SOA_BLOCK;
+    pool->quirks = quirk_profiles[template->quirks];
+
+    int failed = 0;
+    for (int r = 0; r < NUM_REGS; r++) {
+        pool->v[r] = allocate_lanes(pool->capacity, 1);
+        failed |= pool->v[r] == NULL;
+    }
+    pool->PC = allocate_lanes(pool->capacity, sizeof(uint16_t));
+    pool->I = allocate_lanes(pool->capacity, sizeof(uint16_t));
+    pool->delay_timer = allocate_lanes(pool->capacity, 1);
+    pool->sound_timer = allocate_lanes(pool->capacity, 1);
+    pool->group = allocate_lanes(pool->capacity, 1);
+    pool->mask = allocate_lanes(pool->capacity, 1);
+    pool->taken = allocate_lanes(pool->capacity, 1);
+    pool->ops = malloc(pool->capacity * sizeof(DecodedOp));
+    pool->cold = malloc((size_t)count * sizeof(CPU));
+
+    failed |= pool->PC == NULL || pool->I == NULL || pool->delay_timer == NULL || pool->sound_timer == NULL;
+    failed |= pool->group == NULL || pool->mask == NULL || pool->taken == NULL || pool->ops == NULL || pool->cold == NULL;
+    if (failed) {
+        print_error(ERROR_MEMORY, "Could not allocate the SoA lanes");
+        destroy_soa_pool(pool);
+        return NULL;
+    }
+
+    for (uint32_t lane = 0; lane < count; lane++) {
+        pool->cold[lane] = *template;
+        seed_cpu(&pool->cold[lane], seed + lane);
+        for (int r = 0; r < NUM_REGS; r++) {
+            pool->v[r][lane] = template->v[r];
+        }
+        pool->PC[lane] = template->PC;
+        pool->I[lane] = template->I;
+        pool->delay_timer[lane] = template->delay_timer;
+        pool->sound_timer[lane] = template->sound_timer;
+    }
+
+    return pool;
+}
+
+void destroy_soa_pool(SoaPool* pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    for (int r = 0; r < NUM_REGS; r++) {
+        free(pool->v[r]);
+    }
+    free(pool->PC);
+    free(pool->I);
+    free(pool->delay_timer);
+    free(pool->sound_timer);
+    free(pool->group);
+    free(pool->mask);
+    free(pool->taken);
+    free(pool->ops);
+    free(pool->cold);
+    free(pool);
+}
+
+// Same lookup as step(), against the lane's own memory and decode cache
+static DecodedOp fetch_lane(SoaPool* pool, uint32_t lane) {
+    CPU* cpu = &pool->cold[lane];
+    uint16_t pc = pool->PC[lane];
+
+    if ((pc & 1) || pc >= DECODE_CACHE_SIZE) {
+        return decode((cpu->memory[pc] << 8) | cpu->memory[(uint16_t)(pc + 1)], cpu->machine);
+    }
+
+    DecodedOp* slot = &cpu->decode_cache[pc >> 1];
+    if (slot->op == OP_UNDECODED) {
+        *slot = decode((cpu->memory[pc] << 8) | cpu->memory[pc + 1], cpu->machine);
+    }
+    return *slot;
+}
+
+// Packs an instruction into an integer (DecodedOp has a padding byte, so no memcmp)
+static uint64_t op_key(const DecodedOp* d) {
+    return (uint64_t)d->op | (uint64_t)d->x << 8 | (uint64_t)d->y << 16 | (uint64_t)d->n << 24
+         | (uint64_t)d->nn << 32 | (uint64_t)d->nnn << 40;
+}
+
+static int is_vector_op(uint8_t op) {
+    switch (op) {
+        case OP_LD_VX_NN:
+        case OP_ADD_VX_NN:
+        case OP_LD_VX_VY:
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        case OP_ADD_VX_VY:
+        case OP_SUB:
+        case OP_SHR:
+        case OP_SUBN:
+        case OP_SHL:
+        case OP_LD_I:
+        case OP_JP:
+        case OP_SE_VX_NN:
+        case OP_SNE_VX_NN:
+        case OP_SE_VX_VY:
+        case OP_SNE_VX_VY:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Skips for the lanes in `mask` where `taken` is set
+static void skip_lanes(SoaPool* pool, const uint8_t* taken, const uint8_t* mask) {
+    for (uint32_t lane = 0; lane < pool->count; lane++) {
+        if (taken[lane] & (mask ? mask[lane] : 0xFF) & 1) {
+            pool->PC[lane] += skip_size(&pool->cold[lane], pool->PC[lane]);
+        }
+    }
+}
+
+/*
+ * Runs one instruction on every lane whose `mask` byte is 0xFF (all lanes
+ * when mask is NULL), after PC has already been advanced. The order of
+ * loads and stores follows the scalar handlers exactly, including when x
+ * or y is F.
+ */
+static void run_vector_op(SoaPool* pool, const DecodedOp* d, const uint8_t* mask) {
+    uint8_t* vx = pool->v[d->x];
+    uint8_t* vy = pool->v[d->y];
+    uint8_t* vf = pool->v[0xF];
+    const u8v one = splat8(1);
+    const u8v all = splat8(0xFF);
+
+    switch (d->op) {
+        case OP_LD_I:
+        case OP_JP: {
+            uint16_t* target = d->op == OP_LD_I ? pool->I : pool->PC;
+            for (uint32_t lane = 0; lane < pool->capacity; lane++) {
+                if (mask == NULL || mask[lane]) {
+                    target[lane] = d->nnn;
+                }
+            }
+            return;
+        }
+        case OP_SE_VX_NN:
+        case OP_SNE_VX_NN:
+        case OP_SE_VX_VY:
+        case OP_SNE_VX_VY: {
+            uint8_t* taken = pool->taken;
+            for (uint32_t base = 0; base < pool->capacity; base += SOA_BLOCK) {
+                u8v a = load8(vx + base);
+                u8v b = (d->op == OP_SE_VX_NN || d->op == OP_SNE_VX_NN) ? splat8(d->nn) : load8(vy + base);
+                u8v equal = (u8v)(a == b);
+                u8v result = (d->op == OP_SE_VX_NN || d->op == OP_SE_VX_VY) ? equal : ~equal;
+                memcpy(taken + base, &result, sizeof(result));
+            }
+            skip_lanes(pool, taken, mask);
+            return;
+        }
+    }
+
+    for (uint32_t base = 0; base < pool->capacity; base += SOA_BLOCK) {
+        u8v m = mask ? load8(mask + base) : all;
+        uint8_t* x = vx + base;
+        uint8_t* y = vy + base;
+        uint8_t* f = vf + base;
+
+        switch (d->op) {
+            case OP_LD_VX_NN:
+                STORE8_MASKED(x, splat8(d->nn), m);
+                break;
+            case OP_ADD_VX_NN:
+                STORE8_MASKED(x, load8(x) + splat8(d->nn), m);
+                break;
+            case OP_LD_VX_VY:
+                STORE8_MASKED(x, load8(y), m);
+                break;
+            case OP_OR:
+                STORE8_MASKED(x, load8(x) | load8(y), m);
+                if (pool->quirks.vf_reset) {
+                    STORE8_MASKED(f, splat8(0), m);
+                }
+                break;
+            case OP_AND:
+                STORE8_MASKED(x, load8(x) & load8(y), m);
+                if (pool->quirks.vf_reset) {
+                    STORE8_MASKED(f, splat8(0), m);
+                }
+                break;
+            case OP_XOR:
+                STORE8_MASKED(x, load8(x) ^ load8(y), m);
+                if (pool->quirks.vf_reset) {
+                    STORE8_MASKED(f, splat8(0), m);
+                }
+                break;
+            case OP_ADD_VX_VY: {
+                u8v a = load8(x);
+                u8v sum = a + load8(y);
+                STORE8_MASKED(f, (u8v)(sum < a) & one, m);
+                STORE8_MASKED(x, sum, m);
+                break;
+            }
+            case OP_SUB:
+                STORE8_MASKED(f, (u8v)(load8(x) > load8(y)) & one, m);
+                STORE8_MASKED(x, load8(x) - load8(y), m);
+                break;
+            case OP_SHR:
+                if (pool->quirks.shift_vy) {
+                    STORE8_MASKED(x, load8(y), m);
+                }
+                STORE8_MASKED(f, load8(x) & one, m);
+                STORE8_MASKED(x, load8(x) >> 1, m);
+                break;
+            case OP_SUBN:
+                STORE8_MASKED(f, (u8v)(load8(y) > load8(x)) & one, m);
+                STORE8_MASKED(x, load8(y) - load8(x), m);
+                break;
+            case OP_SHL:
+                if (pool->quirks.shift_vy) {
+                    STORE8_MASKED(x, load8(y), m);
+                }
+                STORE8_MASKED(f, (load8(x) >> 7) & one, m);
+                STORE8_MASKED(x, load8(x) << 1, m);
+                break;
+        }
+    }
+}
+
+// Runs one instruction on a single lane through the regular handlers
+static void run_lane_scalar(SoaPool* pool, uint32_t lane, const DecodedOp* d) {
+    CPU* cpu = &pool->cold[lane];
+
+    for (int r = 0; r < NUM_REGS; r++) {
+        cpu->v[r] = pool->v[r][lane];
+    }
+    cpu->PC = pool->PC[lane] + 2;
+    cpu->I = pool->I[lane];
+    cpu->delay_timer = pool->delay_timer[lane];
+    cpu->sound_timer = pool->sound_timer[lane];
+
+    op_handlers[cpu->quirks][d->op](cpu, d);
+
+    for (int r = 0; r < NUM_REGS; r++) {
+        pool->v[r][lane] = cpu->v[r];
+    }
+    pool->PC[lane] = cpu->PC;
+    pool->I[lane] = cpu->I;
+    pool->delay_timer[lane] = cpu->delay_timer;
+    pool->sound_timer[lane] = cpu->sound_timer;
+
+    pool->scalar_ops++;
+}
+
+static void step_soa(SoaPool* pool) {
+    uint32_t count = pool->count;
+    DecodedOp* ops = pool->ops;
+    pool->steps++;
+
+    for (uint32_t lane = 0; lane < count; lane++) {
+        ops[lane] = fetch_lane(pool, lane);
+    }
+
+    // Fast path: every lane is at the same vectorizable instruction (the common case
+    // for copies of one ROM that haven't diverged yet)
+    uint64_t first = op_key(&ops[0]);
+    uint32_t same = 1;
+    while (same < count && op_key(&ops[same]) == first) {
+        same++;
+    }
+
+    if (same == count && is_vector_op(ops[0].op)) {
+        for (uint32_t lane = 0; lane < pool->capacity; lane++) {
+            pool->PC[lane] += 2;
+        }
+        run_vector_op(pool, &ops[0], NULL);
+        pool->uniform_steps++;
+        return;
+    }
+
+    // Group the lanes by vectorizable instruction, everything else goes to the scalar path
+    uint64_t keys[SOA_MAX_GROUPS];
+    uint32_t sizes[SOA_MAX_GROUPS];
+    uint32_t groups = 0;
+
+    for (uint32_t lane = 0; lane < count; lane++) {
+        pool->group[lane] = SOA_SCALAR;
+        if (!is_vector_op(ops[lane].op)) {
+            continue;
+        }
+
+        uint64_t key = op_key(&ops[lane]);
+        uint32_t g = 0;
+        while (g < groups && keys[g] != key) {
+            g++;
+        }
+
+        if (g == groups) {
+            if (groups == SOA_MAX_GROUPS) {
+                continue;
+            }
+            keys[groups] = key;
+            sizes[groups] = 0;
+            groups++;
+        }
+
+        pool->group[lane] = g;
+        sizes[g]++;
+    }
+
+    for (uint32_t g = 0; g < groups; g++) {
+        if (sizes[g] < SOA_MIN_GROUP) {
+            continue;
+        }
+
+        // Padding lanes past `count` are never part of a group
+        DecodedOp d;
+        for (uint32_t lane = 0; lane < pool->capacity; lane++) {
+            int member = lane < count && pool->group[lane] == g;
+            pool->mask[lane] = member ? 0xFF : 0;
+            if (member) {
+                d = ops[lane];
+            }
+        }
+
+        for (uint32_t lane = 0; lane < count; lane++) {
+            pool->PC[lane] += pool->mask[lane] & 2;
+        }
+        run_vector_op(pool, &d, pool->mask);
+        pool->vector_groups++;
+    }
+
+    for (uint32_t lane = 0; lane < count; lane++) {
+        uint8_t g = pool->group[lane];
+        if (g == SOA_SCALAR || sizes[g] < SOA_MIN_GROUP) {
+            run_lane_scalar(pool, lane, &ops[lane]);
+        }
+    }
+}
+
+void run_soa(SoaPool* pool, uint32_t count) {
+    if (pool->count == 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        step_soa(pool);
+    }
+}
+
+void tick_soa_timers(SoaPool* pool) {
+    const u8v one = splat8(1);
+    const u8v all = splat8(0xFF);
+
+    for (uint32_t base = 0; base < pool->capacity; base += SOA_BLOCK) {
+        u8v delay = load8(pool->delay_timer + base);
+        u8v sound = load8(pool->sound_timer + base);
+        STORE8_MASKED(pool->delay_timer + base, delay - ((u8v)(delay != 0) & one), all);
+        STORE8_MASKED(pool->sound_timer + base, sound - ((u8v)(sound != 0) & one), all);
+    }
+
+    // Only Dxyn reads it, and that runs on the scalar path
+    for (uint32_t lane = 0; lane < pool->count; lane++) {
+        pool->cold[lane].vblank = 1;
+    }
+}
+
+void export_soa_lane(const SoaPool* pool, uint32_t lane, CPU* out) {
+    *out = pool->cold[lane];
+
+    for (int r = 0; r < NUM_REGS; r++) {
+        out->v[r] = pool->v[r][lane];
+    }
+    out->PC = pool->PC[lane];
+    out->I = pool->I[lane];
+    out->delay_timer = pool->delay_timer[lane];
+    out->sound_timer = pool->sound_timer[lane];
+}
+
+void set_soa_keypad(SoaPool* pool, uint32_t lane, const uint8_t keypad[NUM_KEYS]) {
+    memcpy(pool->cold[lane].keypad, keypad, NUM_KEYS);
+}
@@ -0,0 +1,62 @@
+#ifndef SOA_H
+#define SOA_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+#define SOA_BLOCK 32        // Lanes per vector operation
+#define SOA_MAX_GROUPS 8    // Distinct instructions vectorized per step
+#define SOA_MIN_GROUP 8     // Smaller groups are not worth a masked pass, they run on the scalar path
+
+/*
+ * Many instances of the same ROM stepped in lockstep, one instruction at a
+ * time across all lanes. The registers, PC, I and timers are stored as
+ * structure-of-arrays (v[register][lane]) so the ALU instructions (6xnn,
+ * 7xnn, 8xyN, Annn), jumps and register skips run as SIMD operations over
+ * every lane executing them.
+ * Everything else (memory, stack, framebuffer, keypad) stays in a CPU per
+ * lane and those instructions run through the scalar handlers.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;          // count rounded up to SOA_BLOCK
+    Quirks quirks;              // Shared by all lanes, they run the same ROM
+
+    uint8_t* v[NUM_REGS];
+    uint16_t* PC;
+    uint16_t* I;
+    uint8_t* delay_timer;
+    uint8_t* sound_timer;
+
+    CPU* cold;                  // The rest of each lane's state, hot fields in here are stale
+
+    // Scratch space for one step
+    DecodedOp* ops;
+    uint8_t* group;
+    uint8_t* mask;
+    uint8_t* taken;             // Skip condition per lane
+
+    // Statistics
+    uint64_t steps;
+    uint64_t uniform_steps;     // Every lane ran the same vectorizable instruction
+    uint64_t vector_groups;     // Masked SIMD passes over part of the lanes
+    uint64_t scalar_ops;        // Lane instructions that went through the scalar handlers
+} SoaPool;
+
+// Creates `count` lanes, each a copy of `template` with lane i seeded with seed + i. Returns NULL on failure.
+SoaPool* create_soa_pool(const CPU* template, uint32_t count, uint64_t seed);
+void destroy_soa_pool(SoaPool* pool);
+
+// Runs `count` instructions on every lane
+void run_soa(SoaPool* pool, uint32_t count);
+
+// tick_timers() for every lane
+void tick_soa_timers(SoaPool* pool);
+
+// Copies lane `lane` out as a regular CPU
+void export_soa_lane(const SoaPool* pool, uint32_t lane, CPU* out);
+
+// Sets the keys held on lane `lane`, each lane has its own keypad
+void set_soa_keypad(SoaPool* pool, uint32_t lane, const uint8_t keypad[NUM_KEYS]);
+
+#endif
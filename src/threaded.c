@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include "threaded.h"
+#include "profile.h"
+
+ThreadedCache* create_threaded_cache(uint32_t memory_size) {
+    uint32_t capacity = memory_size / BLOCK_BYTES;
+    ThreadedCache* cache = malloc(sizeof(ThreadedCache) + capacity * sizeof(Block));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->capacity = capacity;
+    cache->translations = 0;
+    cache->invalidations = 0;
+    cache->evictions = 0;
+    flush_threaded_cache(cache);
+    return cache;
+}
+
+void destroy_threaded_cache(ThreadedCache* cache) {
+    free(cache);
+}
+
+void flush_threaded_cache(ThreadedCache* cache) {
+    memset(cache->lookup, 0xFF, sizeof(cache->lookup));
+    cache->used = 0;
+    cache->hand = 0;
+}
+
+// Whether a block has to stop after this instruction
+static int ends_block(uint8_t op) {
+    switch (op) {
+        case OP_RET:
+        case OP_JP:
+        case OP_CALL:
+        case OP_JP_V0:
+        // Skips change PC
+        case OP_SE_VX_NN:
+        case OP_SNE_VX_NN:
+        case OP_SE_VX_VY:
+        case OP_SNE_VX_VY:
+        case OP_SKP:
+        case OP_SKNP:
+        // Rewinds PC while waiting for a key, or for good
+        case OP_LD_VX_K:
+        case OP_EXIT:
+        // Skips over its own operand
+        case OP_LD_I_LONG:
+        // Frame boundary, the display may want to see it
+        case OP_DRW:
+        // May overwrite the code that follows
+        case OP_LD_B_VX:
+        case OP_LD_I_VX:
+        case OP_SAVE_VX_VY:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int block_is_valid(const CPU* cpu, const Block* block) {
+    // A block is at most MAX_BLOCK_OPS * 2 bytes long, so it spans at most two pages
+    uint16_t end = block->start + block->length * 2 - 1;
+    return block->quirks == cpu->quirks
+        && block->page_generation[0] == cpu->page_generation[block->start / CODE_PAGE_SIZE]
+        && block->page_generation[1] == cpu->page_generation[end / CODE_PAGE_SIZE];
+}
+
+// Frees a block for a new translation once they are all in use (see ThreadedCache)
+static uint16_t evict_block(const CPU* cpu, ThreadedCache* cache) {
+    // Every referenced block passed is cleared, so this ends within two sweeps
+    for (;;) {
+        uint16_t index = cache->hand;
+        Block* block = &cache->blocks[index];
+        cache->hand = index + 1 < cache->capacity ? index + 1 : 0;
+
+        if (block->referenced && block_is_valid(cpu, block)) {
+            block->referenced = 0;
+            continue;
+        }
+
+        cache->lookup[block->start >> 1] = NO_BLOCK;
+        cache->evictions++;
+        return index;
+    }
+}
+
+static Block* translate(CPU* cpu, ThreadedCache* cache, uint16_t start) {
+    // Stale blocks are translated again in place
+    uint16_t index = cache->lookup[start >> 1];
+    if (index == NO_BLOCK) {
+        index = cache->used < cache->capacity ? cache->used++ : evict_block(cpu, cache);
+    }
+
+    Block* block = &cache->blocks[index];
+    block->start = start;
+    block->length = 0;
+    block->quirks = cpu->quirks;
+    block->referenced = 1;
+
+    uint32_t pc = start;
+    while (block->length < MAX_BLOCK_OPS && pc < MEM_SIZE - 1) {
+        DecodedOp d = decode((cpu->memory[pc] << 8) | cpu->memory[pc + 1], cpu->machine);
+        block->ops[block->length].handler = op_handlers[cpu->quirks][d.op];
+        block->ops[block->length].d = d;
+        block->length++;
+        pc += 2;
+
+        if (ends_block(d.op)) {
+            break;
+        }
+    }
+
+    block->page_generation[0] = cpu->page_generation[start / CODE_PAGE_SIZE];
+    block->page_generation[1] = cpu->page_generation[(pc - 1) / CODE_PAGE_SIZE];
+
+    cache->lookup[start >> 1] = index;
+    cache->translations++;
+    return block;
+}
+
+int prewarm_threaded_block(CPU* cpu, ThreadedCache* cache, uint16_t start) {
+    uint16_t index = cache->lookup[start >> 1];
+    if (index == NO_BLOCK) {
+        // Past that, it would evict blocks that are already warm
+        if (cache->used == cache->capacity) {
+            return -1;
+        }
+        return start + translate(cpu, cache, start)->length * 2;
+    }
+    return start + cache->blocks[index].length * 2;
+}
+
+uint32_t run_block(CPU* cpu, ThreadedCache* cache, uint32_t max) {
+    uint16_t pc = cpu->PC;
+
+    // Odd addresses and the very end of memory go through the interpreter
+    if ((pc & 1) || pc >= MEM_SIZE - 1) {
+        step(cpu);
+        return 1;
+    }
+
+    Block* block = NULL;
+    uint16_t index = cache->lookup[pc >> 1];
+    if (index != NO_BLOCK) {
+        block = &cache->blocks[index];
+        if (!block_is_valid(cpu, block)) {
+            cache->invalidations++;
+            block = NULL;
+        } else {
+            block->referenced = 1;
+        }
+    }
+
+    if (block == NULL) {
+        block = translate(cpu, cache, pc);
+    }
+
+    uint32_t length = block->length < max ? block->length : max;
+    for (uint32_t i = 0; i < length; i++) {
+        const ThreadedOp* op = &block->ops[i];
+        PROFILE_OP(cpu, &op->d, cpu->PC);
+        cpu->PC += 2;
+        op->handler(cpu, &op->d);
+    }
+
+    return length;
+}
+
+void run_threaded(CPU* cpu, ThreadedCache* cache, uint32_t count) {
+    while (count > 0) {
+        count -= run_block(cpu, cache, count);
+    }
+}
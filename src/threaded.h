@@ -0,0 +1,77 @@
+#ifndef THREADED_H
+#define THREADED_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+#define MAX_BLOCK_OPS 32
+#define BLOCK_BYTES 16                  // Memory per cached block: 256 blocks for 4 KB, 4096 for 64 KB
+#define NO_BLOCK 0xFFFF
+
+// One instruction of threaded code: the handler to call and its operands
+typedef struct {
+    OpHandler handler;
+    DecodedOp d;
+} ThreadedOp;
+
+/*
+ * A straight-line run of CHIP-8 code starting at `start`.
+ * It ends at the first instruction that can change the flow of control
+ * (jumps, calls, returns, skips, Fx0A, 00FD, F000 nnnn), draws (Dxyn),
+ * or writes memory (Fx33/Fx55/5xy2), or after MAX_BLOCK_OPS instructions.
+ */
+typedef struct {
+    uint16_t start;
+    uint8_t length;
+    uint8_t quirks;                 // Profile whose handlers the block calls
+    uint8_t referenced;             // Ran since the eviction hand last went past it
+    uint32_t page_generation[2];    // Generations of the first and last code page when translated
+    ThreadedOp ops[MAX_BLOCK_OPS];
+} Block;
+
+/*
+ * Once every block is in use, translating a new one evicts an old one,
+ * CLOCK style: a stale block (its code was overwritten) goes right away,
+ * otherwise the first block that hasn't run since the hand last passed it.
+ */
+typedef struct {
+    uint16_t lookup[MEM_SIZE / 2];  // Block index by PC / 2, NO_BLOCK when not translated
+    uint16_t used;
+    uint16_t capacity;
+    uint16_t hand;                  // Next block eviction looks at
+
+    // Statistics
+    uint64_t translations;
+    uint64_t invalidations;
+    uint64_t evictions;
+
+    Block blocks[];                 // `capacity` of them
+} ThreadedCache;
+
+// A cache sized for `memory_size` bytes of memory
+ThreadedCache* create_threaded_cache(uint32_t memory_size);
+void destroy_threaded_cache(ThreadedCache* cache);
+
+// Forgets every translated block, e.g. after loading a new ROM or restoring state
+void flush_threaded_cache(ThreadedCache* cache);
+
+/*
+ * Runs the block at PC, translating it first if needed, but never more
+ * than `max` instructions. Returns the number of instructions executed.
+ */
+uint32_t run_block(CPU* cpu, ThreadedCache* cache, uint32_t max);
+
+/*
+ * Translates the block at `start` ahead of time, unless it already is.
+ * Returns the address after it, or -1 once the cache is full.
+ */
+int prewarm_threaded_block(CPU* cpu, ThreadedCache* cache, uint16_t start);
+
+/*
+ * Runs exactly `count` instructions using translated blocks.
+ * If the budget ends in the middle of a block, only part of it runs,
+ * so the result is identical to calling step() `count` times.
+ */
+void run_threaded(CPU* cpu, ThreadedCache* cache, uint32_t count);
+
+#endif
@@ -0,0 +1,491 @@
+#include <stdlib.h>
+#include <string.h>
+#include "video.h"
+#include "error.h"
+
+#define VIDEO_HEADER_SIZE 16
+#define MAX_RECORD_SIZE (2 + NUM_PLANES * (8 + 2 * FRAMEBUFFER_HEIGHT * FRAMEBUFFER_WORDS * 8))
+
+static void put_le(uint8_t* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t get_le(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+// Area of the framebuffer a frame codes: rows, and bytes per row
+static void coded_area(uint8_t flags, int* rows, int* bytes) {
+    int whole = flags & (VIDEO_HIRES | VIDEO_FULL);
+    *rows = whole ? FRAMEBUFFER_HEIGHT : LORES_HEIGHT;
+    *bytes = whole ? FRAMEBUFFER_WORDS * 8 : LORES_WIDTH / 8;
+}
+
+/*
+ * PackBits: a control byte n < 128 is followed by n + 1 literal bytes,
+ * n > 128 by one byte repeated 257 - n times.
+ */
+static size_t pack_bits(const uint8_t* in, size_t size, uint8_t* out) {
+    size_t written = 0;
+    size_t i = 0;
+
+    while (i < size) {
+        size_t run = 1;
+        while (i + run < size && run < 128 && in[i + run] == in[i]) {
+            run++;
+        }
+        if (run > 1) {
+            out[written++] = (uint8_t)(257 - run);
+            out[written++] = in[i];
+            i += run;
+            continue;
+        }
+
+        // Literals up to the next pair of equal bytes
+        size_t start = i;
+        while (i < size && i - start < 128 && !(i + 1 < size && in[i] == in[i + 1])) {
+            i++;
+        }
+        out[written++] = (uint8_t)(i - start - 1);
+        memcpy(out + written, in + start, i - start);
+        written += i - start;
+    }
+
+    return written;
+}
+
+/*
+ * Codes `frame` XORed with `base` into `out`: flags, then per plane the
+ * mask of changed rows and those rows packed. Returns the bytes written.
+ */
+static size_t encode_frame(const VideoFrame* frame, const VideoFrame* base, uint8_t planes, uint8_t* out) {
+    uint64_t diff[NUM_PLANES][FRAMEBUFFER_HEIGHT][FRAMEBUFFER_WORDS];
+    uint8_t flags = frame->hires ? VIDEO_HIRES : 0;
+
+    // Low resolution only draws the top-left quarter, anything else still has to be kept
+    for (int plane = 0; plane < planes; plane++) {
+        for (int y = 0; y < FRAMEBUFFER_HEIGHT; y++) {
+            for (int w = 0; w < FRAMEBUFFER_WORDS; w++) {
+                diff[plane][y][w] = frame->framebuffer[plane][y][w] ^ base->framebuffer[plane][y][w];
+            }
+            if (!frame->hires && (diff[plane][y][1] != 0 || (y >= LORES_HEIGHT && diff[plane][y][0] != 0))) {
+                flags |= VIDEO_FULL;
+            }
+        }
+    }
+
+    int rows, bytes;
+    coded_area(flags, &rows, &bytes);
+
+    size_t written = 0;
+    out[written++] = flags;
+    for (int plane = 0; plane < planes; plane++) {
+        uint8_t changed[FRAMEBUFFER_HEIGHT * FRAMEBUFFER_WORDS * 8];
+        size_t size = 0;
+        uint64_t mask = 0;
+
+        for (int y = 0; y < rows; y++) {
+            if ((diff[plane][y][0] | diff[plane][y][1]) == 0) {
+                continue;
+            }
+            mask |= 1ull << y;
+            for (int i = 0; i < bytes; i++) {
+                changed[size++] = (uint8_t)(diff[plane][y][i / 8] >> (56 - 8 * (i % 8)));
+            }
+        }
+
+        put_le(out + written, mask, 8);
+        written += 8;
+        written += pack_bits(changed, size, out + written);
+    }
+
+    return written;
+}
+
+static void write_record(VideoRecorder* video, const uint8_t* record, size_t size) {
+    if (fwrite(record, 1, size, video->file) != size) {
+        video->failed = 1;
+    }
+    video->bytes += size;
+}
+
+static void flush_repeats(VideoRecorder* video) {
+    if (video->repeats == 0) {
+        return;
+    }
+
+    // LEB128, seven bits per byte
+    uint8_t record[11];
+    size_t size = 0;
+    record[size++] = VIDEO_REPEAT;
+    uint64_t count = video->repeats;
+    do {
+        record[size++] = (uint8_t)((count & 0x7F) | (count >= 0x80 ? 0x80 : 0));
+        count >>= 7;
+    } while (count != 0);
+
+    write_record(video, record, size);
+    video->repeats = 0;
+}
+
+// Runs on the encoder thread
+static void encode_video_frame(VideoRecorder* video, const VideoFrame* frame, uint64_t number) {
+    static const VideoFrame blank;
+    uint8_t record[MAX_RECORD_SIZE];
+
+    if (number % VIDEO_KEYFRAME_INTERVAL == 0) {
+        flush_repeats(video);
+        if (video->index_count == video->index_capacity) {
+            uint32_t capacity = video->index_capacity ? 2 * video->index_capacity : 64;
+            VideoKeyframe* index = realloc(video->index, capacity * sizeof(VideoKeyframe));
+            if (index == NULL) {
+                video->failed = 1;
+                return;
+            }
+            video->index = index;
+            video->index_capacity = capacity;
+        }
+        video->index[video->index_count++] = (VideoKeyframe){ number, VIDEO_HEADER_SIZE + video->bytes };
+
+        record[0] = VIDEO_KEYFRAME;
+        write_record(video, record, 1 + encode_frame(frame, &blank, video->planes, record + 1));
+    } else if (frame->hires == video->previous.hires
+               && memcmp(frame->framebuffer, video->previous.framebuffer,
+                         video->planes * sizeof(frame->framebuffer[0])) == 0) {
+        video->repeats++;
+        return;
+    } else {
+        flush_repeats(video);
+        record[0] = VIDEO_DELTA;
+        write_record(video, record, 1 + encode_frame(frame, &video->previous, video->planes, record + 1));
+    }
+
+    memcpy(video->previous.framebuffer, frame->framebuffer, video->planes * sizeof(frame->framebuffer[0]));
+    video->previous.hires = frame->hires;
+}
+
+// Takes every queued frame at once, so the lock is held once per batch
+static void* encoder_thread(void* arg) {
+    VideoRecorder* video = arg;
+
+    pthread_mutex_lock(&video->lock);
+    while (1) {
+        while (video->tail == video->head && !video->closing) {
+            pthread_cond_wait(&video->not_empty, &video->lock);
+        }
+        uint64_t first = video->tail;
+        uint64_t last = video->head;
+        if (first == last) {
+            break;
+        }
+        pthread_mutex_unlock(&video->lock);
+
+        for (uint64_t number = first; number < last; number++) {
+            encode_video_frame(video, &video->queue[number % VIDEO_QUEUE_SIZE], number);
+        }
+
+        pthread_mutex_lock(&video->lock);
+        video->tail = last;
+        pthread_cond_signal(&video->not_full);
+    }
+    pthread_mutex_unlock(&video->lock);
+
+    flush_repeats(video);
+    return NULL;
+}
+
+int initialize_video(VideoRecorder* video, const char* path, const CPU* cpu) {
+    memset(video, 0, sizeof(*video));
+    video->planes = cpu->machine == MACHINE_XOCHIP ? NUM_PLANES : 1;
+
+    video->queue = calloc(VIDEO_QUEUE_SIZE, sizeof(VideoFrame));
+    if (video->queue == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the video queue");
+        return -1;
+    }
+
+    video->file = fopen(path, "wb");
+    if (video->file == NULL) {
+        print_error(ERROR_VIDEO, "Could not create the video file");
+        free(video->queue);
+        return -1;
+    }
+
+    uint8_t header[VIDEO_HEADER_SIZE] = {0};
+    memcpy(header, VIDEO_MAGIC, 4);
+    put_le(header + 4, VIDEO_VERSION, 2);
+    header[6] = video->planes;
+    put_le(header + 8, VIDEO_KEYFRAME_INTERVAL, 4);
+
+    pthread_mutex_init(&video->lock, NULL);
+    pthread_cond_init(&video->not_empty, NULL);
+    pthread_cond_init(&video->not_full, NULL);
+
+    if (fwrite(header, 1, sizeof(header), video->file) != sizeof(header)
+        || pthread_create(&video->thread, NULL, encoder_thread, video) != 0) {
+        print_error(ERROR_VIDEO, "Could not start recording the video");
+        pthread_cond_destroy(&video->not_full);
+        pthread_cond_destroy(&video->not_empty);
+        pthread_mutex_destroy(&video->lock);
+        fclose(video->file);
+        free(video->queue);
+        return -1;
+    }
+    return 0;
+}
+
+void record_video_frame(VideoRecorder* video, const CPU* cpu) {
+    pthread_mutex_lock(&video->lock);
+    while (video->head - video->tail == VIDEO_QUEUE_SIZE) {
+        pthread_cond_wait(&video->not_full, &video->lock);
+    }
+
+    VideoFrame* frame = &video->queue[video->head % VIDEO_QUEUE_SIZE];
+    memcpy(frame->framebuffer, cpu->framebuffer, video->planes * sizeof(cpu->framebuffer[0]));
+    frame->hires = cpu->hires;
+    video->head++;
+
+    pthread_cond_signal(&video->not_empty);
+    pthread_mutex_unlock(&video->lock);
+}
+
+int cleanup_video(VideoRecorder* video) {
+    pthread_mutex_lock(&video->lock);
+    video->closing = 1;
+    pthread_cond_signal(&video->not_empty);
+    pthread_mutex_unlock(&video->lock);
+    pthread_join(video->thread, NULL);
+
+    // Index: magic, keyframe count, frame count, the keyframes, then where the index starts
+    uint64_t index_offset = VIDEO_HEADER_SIZE + video->bytes;
+    uint8_t entry[16];
+    memcpy(entry, VIDEO_INDEX_MAGIC, 4);
+    put_le(entry + 4, video->index_count, 4);
+    put_le(entry + 8, video->head, 8);
+    write_record(video, entry, 16);
+    for (uint32_t i = 0; i < video->index_count; i++) {
+        put_le(entry, video->index[i].frame, 8);
+        put_le(entry + 8, video->index[i].offset, 8);
+        write_record(video, entry, 16);
+    }
+    put_le(entry, index_offset, 8);
+    write_record(video, entry, 8);
+
+    int status = 0;
+    if (fclose(video->file) != 0 || video->failed) {
+        print_error(ERROR_VIDEO, "Could not write the video file");
+        status = -1;
+    }
+
+    pthread_cond_destroy(&video->not_full);
+    pthread_cond_destroy(&video->not_empty);
+    pthread_mutex_destroy(&video->lock);
+    free(video->index);
+    free(video->queue);
+    return status;
+}
+
+void video_report(const VideoRecorder* video, FILE* out) {
+    uint64_t bytes = VIDEO_HEADER_SIZE + video->bytes;
+    fprintf(out, "video: %llu frames, %llu bytes (%.1f bytes/frame)\n",
+            (unsigned long long)video->head, (unsigned long long)bytes,
+            video->head ? (double)bytes / video->head : 0.0);
+}
+
+int open_video(VideoReader* reader, const char* path) {
+    memset(reader, 0, sizeof(*reader));
+
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) {
+        print_error(ERROR_VIDEO, "Could not open the video file");
+        return -1;
+    }
+
+    uint8_t header[VIDEO_HEADER_SIZE];
+    uint8_t trailer[16];
+    if (fread(header, 1, sizeof(header), reader->file) != sizeof(header)
+        || memcmp(header, VIDEO_MAGIC, 4) != 0 || get_le(header + 4, 2) != VIDEO_VERSION
+        || (header[6] != 1 && header[6] != NUM_PLANES)
+        || fseek(reader->file, -8, SEEK_END) != 0 || fread(trailer, 1, 8, reader->file) != 8) {
+        print_error(ERROR_VIDEO, "Not a video file, or not this version");
+        fclose(reader->file);
+        return -1;
+    }
+    reader->planes = header[6];
+    reader->keyframe_interval = (uint32_t)get_le(header + 8, 4);
+    reader->index_offset = get_le(trailer, 8);
+
+    if (fseek(reader->file, (long)reader->index_offset, SEEK_SET) != 0
+        || fread(trailer, 1, 16, reader->file) != 16 || memcmp(trailer, VIDEO_INDEX_MAGIC, 4) != 0) {
+        print_error(ERROR_VIDEO, "The video file has no index, it was not closed");
+        fclose(reader->file);
+        return -1;
+    }
+    reader->index_count = (uint32_t)get_le(trailer + 4, 4);
+    reader->frames = get_le(trailer + 8, 8);
+
+    reader->index = malloc((reader->index_count + 1) * sizeof(VideoKeyframe));
+    if (reader->index == NULL) {
+        print_error(ERROR_MEMORY, "Could not allocate the video index");
+        fclose(reader->file);
+        return -1;
+    }
+    for (uint32_t i = 0; i < reader->index_count; i++) {
+        uint8_t entry[16];
+        if (fread(entry, 1, 16, reader->file) != 16) {
+            print_error(ERROR_VIDEO, "The video index is truncated");
+            close_video(reader);
+            return -1;
+        }
+        reader->index[i] = (VideoKeyframe){ get_le(entry, 8), get_le(entry + 8, 8) };
+    }
+
+    return seek_video(reader, 0);
+}
+
+// Applies a coded frame onto reader->frame
+static int decode_frame(VideoReader* reader) {
+    FILE* file = reader->file;
+    int flags = getc(file);
+    if (flags == EOF) {
+        return -1;
+    }
+    reader->frame.hires = flags & VIDEO_HIRES;
+
+    int rows, bytes;
+    coded_area((uint8_t)flags, &rows, &bytes);
+
+    for (int plane = 0; plane < reader->planes; plane++) {
+        uint8_t mask_bytes[8];
+        if (fread(mask_bytes, 1, 8, file) != 8) {
+            return -1;
+        }
+        uint64_t mask = get_le(mask_bytes, 8);
+        if (rows < 64 && (mask >> rows) != 0) {
+            return -1;
+        }
+
+        // Unpack exactly the bytes of the changed rows
+        uint8_t changed[FRAMEBUFFER_HEIGHT * FRAMEBUFFER_WORDS * 8];
+        size_t size = (size_t)__builtin_popcountll(mask) * bytes;
+        size_t done = 0;
+        while (done < size) {
+            int control = getc(file);
+            if (control == EOF) {
+                return -1;
+            }
+            if (control < 128) {
+                size_t count = (size_t)control + 1;
+                if (done + count > size || fread(changed + done, 1, count, file) != count) {
+                    return -1;
+                }
+                done += count;
+            } else if (control > 128) {
+                size_t count = 257 - (size_t)control;
+                int value = getc(file);
+                if (value == EOF || done + count > size) {
+                    return -1;
+                }
+                memset(changed + done, value, count);
+                done += count;
+            }
+        }
+
+        const uint8_t* row = changed;
+        for (int y = 0; y < rows; y++) {
+            if (!(mask >> y & 1)) {
+                continue;
+            }
+            for (int i = 0; i < bytes; i++) {
+                reader->frame.framebuffer[plane][y][i / 8] ^= (uint64_t)row[i] << (56 - 8 * (i % 8));
+            }
+            row += bytes;
+        }
+    }
+
+    return 0;
+}
+
+int read_video_frame(VideoReader* reader) {
+    if (reader->next >= reader->frames) {
+        return 0;
+    }
+    if (reader->repeats > 0) {
+        reader->repeats--;
+        reader->next++;
+        return 1;
+    }
+
+    int type = getc(reader->file);
+    switch (type) {
+        case VIDEO_KEYFRAME:
+            memset(&reader->frame, 0, sizeof(reader->frame));
+            // Fall through
+        case VIDEO_DELTA:
+            if (decode_frame(reader) < 0) {
+                return -1;
+            }
+            reader->next++;
+            return 1;
+
+        case VIDEO_REPEAT: {
+            uint64_t count = 0;
+            int shift = 0;
+            int byte;
+            do {
+                byte = getc(reader->file);
+                if (byte == EOF || shift > 63) {
+                    return -1;
+                }
+                count |= (uint64_t)(byte & 0x7F) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+
+            if (count == 0) {
+                return -1;
+            }
+            reader->repeats = count - 1;
+            reader->next++;
+            return 1;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+int seek_video(VideoReader* reader, uint64_t frame) {
+    // Last keyframe at or before `frame`, the stream always starts with one
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < reader->index_count && reader->index[i].frame <= frame; i++) {
+        found = i;
+    }
+
+    uint64_t start = reader->index_count > 0 ? reader->index[found].frame : 0;
+    uint64_t offset = reader->index_count > 0 ? reader->index[found].offset : VIDEO_HEADER_SIZE;
+    if (fseek(reader->file, (long)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    reader->next = start;
+    reader->repeats = 0;
+    memset(&reader->frame, 0, sizeof(reader->frame));
+
+    while (reader->next < frame) {
+        int read = read_video_frame(reader);
+        if (read <= 0) {
+            return read < 0 ? -1 : 0;
+        }
+    }
+    return 0;
+}
+
+void close_video(VideoReader* reader) {
+    fclose(reader->file);
+    free(reader->index);
+}
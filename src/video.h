@@ -0,0 +1,112 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+
+/*
+ * Frame stream files. After a 16-byte header ("C8VD", version, planes,
+ * keyframe interval) every frame is one record:
+ *
+ *   VIDEO_KEYFRAME  flags, then the frame coded against a blank screen
+ *   VIDEO_DELTA     flags, then the frame XORed with the previous one
+ *   VIDEO_REPEAT    LEB128 count: the previous frame that many more times
+ *
+ * A coded frame is, per plane, a 64-bit mask of the rows that are not zero
+ * followed by those rows PackBits-compressed. Only the visible area is
+ * coded (64x32 or 128x64) unless VIDEO_FULL is set in the flags. Every
+ * keyframe_interval-th frame is a keyframe; closing the file appends an
+ * index of them for seeking. All fields are little-endian.
+ */
+#define VIDEO_MAGIC "C8VD"
+#define VIDEO_INDEX_MAGIC "C8VI"
+#define VIDEO_VERSION 1
+#define VIDEO_KEYFRAME_INTERVAL 600     // 10 seconds
+#define VIDEO_QUEUE_SIZE 64             // Frames waiting for the encoder
+
+#define VIDEO_KEYFRAME 0
+#define VIDEO_DELTA 1
+#define VIDEO_REPEAT 2
+
+#define VIDEO_HIRES 1                   // Flags
+#define VIDEO_FULL 2
+
+typedef struct {
+    uint64_t framebuffer[NUM_PLANES][FRAMEBUFFER_HEIGHT][FRAMEBUFFER_WORDS];
+    uint8_t hires;
+} VideoFrame;
+
+typedef struct {
+    uint64_t frame;
+    uint64_t offset;
+} VideoKeyframe;
+
+/*
+ * Records frames on a background thread. The emulator only copies the
+ * framebuffer into a bounded queue, and waits only when the encoder is a
+ * whole queue behind, so no frame is ever dropped.
+ */
+typedef struct {
+    FILE* file;
+    uint8_t planes;                 // 1, all of them for XO-CHIP
+    pthread_t thread;
+
+    // Queue, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    VideoFrame* queue;
+    uint64_t head;                  // Frames queued
+    uint64_t tail;                  // Frames taken by the encoder
+    int closing;
+
+    // Encoder thread
+    VideoFrame previous;
+    uint64_t repeats;               // Not written yet
+    VideoKeyframe* index;
+    uint32_t index_count;
+    uint32_t index_capacity;
+    uint64_t bytes;
+    int failed;
+} VideoRecorder;
+
+// Creates the file and starts the encoder, `cpu` gives the machine
+int initialize_video(VideoRecorder* video, const char* path, const CPU* cpu);
+
+// Queues the CPU's current frame
+void record_video_frame(VideoRecorder* video, const CPU* cpu);
+
+// Encodes what is still queued, writes the keyframe index and closes the file
+int cleanup_video(VideoRecorder* video);
+
+// Frames, bytes and bytes per frame
+void video_report(const VideoRecorder* video, FILE* out);
+
+// Reads a frame stream back, one frame at a time
+typedef struct {
+    FILE* file;
+    uint8_t planes;
+    uint32_t keyframe_interval;
+    uint64_t frames;                // In the whole file
+    VideoKeyframe* index;
+    uint32_t index_count;
+    uint64_t index_offset;          // Where the records end
+
+    uint64_t next;                  // Frame read by the next read_video_frame()
+    uint64_t repeats;               // Of the current frame still to return
+    VideoFrame frame;
+} VideoReader;
+
+int open_video(VideoReader* reader, const char* path);
+
+// Decodes the next frame into reader->frame. Returns 1, 0 after the last frame or -1 on a corrupt file
+int read_video_frame(VideoReader* reader);
+
+// Continues from `frame`, decoding from the keyframe before it
+int seek_video(VideoReader* reader, uint64_t frame);
+
+void close_video(VideoReader* reader);
+
+#endif
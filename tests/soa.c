@@ -0,0 +1,196 @@
+/*
+ * Checks the SoA executor (src/soa.h) against step(). Every ROM runs on
+ * LANES lanes under each quirk profile, every lane with its own seed and
+ * its own key presses, next to one scalar CPU per lane that runs the same
+ * instructions through step(). Any lane that differs from its scalar CPU
+ * at the end of a frame fails the check.
+ *
+ * The built-in ROMs branch on Cxnn and the keypad, so the lanes split up
+ * and the per-instruction grouping is exercised; ROMs given on the command
+ * line (make check passes the bench ROMs) are checked the same way.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpu.h"
+#include "soa.h"
+
+#define LANES 100                   // Not a multiple of SOA_BLOCK, so the padding lanes are covered too
+#define FRAMES 600
+#define INSTRUCTIONS_PER_FRAME 12
+#define SEED 1
+
+typedef struct {
+    const char* name;
+    const uint8_t* data;
+    size_t size;
+    int must_group;                 // Fails unless some step vectorized part of the lanes
+} Rom;
+
+// Random keys decide between an ALU/BCD path and a path that calls a Dxyn subroutine
+static const uint8_t branches_rom[] = {
+    0x6A, 0x00,     // 200: LD VA, 0
+    0xC3, 0x0F,     // 202: RND V3, 0F
+    0xE3, 0x9E,     // 204: SKP V3
+    0x12, 0x20,     // 206: JP 220
+    0x80, 0x34,     // 208: ADD V0, V3
+    0x81, 0x06,     // 20A: SHR V1, V0
+    0x71, 0x07,     // 20C: ADD V1, 07
+    0x82, 0x15,     // 20E: SUB V2, V1
+    0xA3, 0x00,     // 210: LD I, 300
+    0xF2, 0x33,     // 212: LD B, V2
+    0xF2, 0x65,     // 214: LD V2, [I]
+    0x12, 0x30,     // 216: JP 230
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xC4, 0xFF,     // 220: RND V4, FF
+    0x44, 0x80,     // 222: SNE V4, 80
+    0x74, 0x01,     // 224: ADD V4, 01
+    0x85, 0x41,     // 226: OR V5, V4
+    0x85, 0x4E,     // 228: SHL V5, V4
+    0x22, 0x40,     // 22A: CALL 240
+    0x12, 0x30,     // 22C: JP 230
+    0x00, 0x00,
+    0x54, 0x50,     // 230: SE V4, V5
+    0x76, 0x01,     // 232: ADD V6, 01
+    0x95, 0x60,     // 234: SNE V5, V6
+    0x87, 0x52,     // 236: AND V7, V5
+    0x87, 0x63,     // 238: XOR V7, V6
+    0x88, 0x77,     // 23A: SUBN V8, V7
+    0xF8, 0x15,     // 23C: LD DT, V8
+    0x12, 0x02,     // 23E: JP 202
+    0xF3, 0x29,     // 240: LD F, V3
+    0xD4, 0x55,     // 242: DRW V4, V5, 5
+    0xF7, 0x07,     // 244: LD V7, DT
+    0x3A, 0x00,     // 246: SE VA, 00
+    0x7A, 0xFF,     // 248: ADD VA, FF
+    0x00, 0xEE,     // 24A: RET
+};
+
+// Waits for keys and counts them, the lanes drift apart as their keys come and go
+static const uint8_t keys_rom[] = {
+    0x60, 0x00,     // 200: LD V0, 0
+    0xF1, 0x0A,     // 202: LD V1, K
+    0x80, 0x14,     // 204: ADD V0, V1
+    0x82, 0x10,     // 206: LD V2, V1
+    0x82, 0x03,     // 208: XOR V2, V0
+    0x30, 0x40,     // 20A: SE V0, 40
+    0x12, 0x02,     // 20C: JP 202
+    0xF1, 0x18,     // 20E: LD ST, V1
+    0x60, 0x00,     // 210: LD V0, 0
+    0x12, 0x02,     // 212: JP 202
+};
+
+// Keys held on lane `lane` in frame `frame`, changing every few frames
+static uint16_t lane_keys(uint32_t lane, uint32_t frame) {
+    uint64_t z = ((uint64_t)lane << 32 | (frame / 8)) * 0x9E3779B97F4A7C15ull;
+    return (uint16_t)(z >> 48);
+}
+
+static uint8_t* read_rom(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    uint8_t* data = malloc(CHIP8_MEM_SIZE);
+    *size = data ? fread(data, 1, CHIP8_MEM_SIZE - START_PROGRAM_MEM, file) : 0;
+    fclose(file);
+    return data;
+}
+
+// Returns 0 if every lane matched step() on every frame
+static int check_rom(const Rom* rom, QuirkProfile quirks, CPU* template, CPU* reference, CPU* lane) {
+    if (initialize_cpu(template) < 0) {
+        return -1;
+    }
+    set_quirks(template, quirks);
+    if (load_rom_data(template, rom->data, rom->size) < 0) {
+        return -1;
+    }
+
+    SoaPool* pool = create_soa_pool(template, LANES, SEED);
+    if (pool == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < LANES; i++) {
+        reference[i] = *template;
+        seed_cpu(&reference[i], SEED + i);
+    }
+
+    int status = 0;
+    for (uint32_t frame = 0; frame < FRAMES && status == 0; frame++) {
+        for (uint32_t i = 0; i < LANES; i++) {
+            set_keypad_mask(&reference[i], lane_keys(i, frame));
+            set_soa_keypad(pool, i, reference[i].keypad);
+        }
+
+        run_soa(pool, INSTRUCTIONS_PER_FRAME);
+        tick_soa_timers(pool);
+
+        for (uint32_t i = 0; i < LANES; i++) {
+            for (uint32_t n = 0; n < INSTRUCTIONS_PER_FRAME; n++) {
+                step(&reference[i]);
+            }
+            tick_timers(&reference[i]);
+
+            export_soa_lane(pool, i, lane);
+            if (cpu_diff(&reference[i], lane, NULL) != 0) {
+                fprintf(stderr, "FAIL %s (%s): lane %u differs from step() after frame %u\n",
+                        rom->name, quirks_name(quirks), i, frame);
+                cpu_diff(&reference[i], lane, stderr);
+                status = -1;
+                break;
+            }
+        }
+    }
+
+    if (status == 0 && rom->must_group && pool->vector_groups == 0) {
+        fprintf(stderr, "FAIL %s (%s): the lanes never ran as separate vector groups\n", rom->name, quirks_name(quirks));
+        status = -1;
+    }
+    if (status == 0) {
+        printf("ok   %-24s %-7s %u lanes, %u frames (uniform %llu, vector groups %llu, scalar lane ops %llu)\n",
+               rom->name, quirks_name(quirks), LANES, FRAMES, (unsigned long long)pool->uniform_steps,
+               (unsigned long long)pool->vector_groups, (unsigned long long)pool->scalar_ops);
+    }
+
+    destroy_soa_pool(pool);
+    return status;
+}
+
+int main(int argc, char* argv[]) {
+    int num_roms = 2 + (argc - 1);
+    Rom* roms = calloc(num_roms, sizeof(Rom));
+    CPU* template = malloc(sizeof(CPU));
+    CPU* reference = malloc(LANES * sizeof(CPU));
+    CPU* lane = malloc(sizeof(CPU));
+    if (roms == NULL || template == NULL || reference == NULL || lane == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    roms[0] = (Rom){ "branches", branches_rom, sizeof(branches_rom), 1 };
+    roms[1] = (Rom){ "keys", keys_rom, sizeof(keys_rom), 1 };
+    for (int i = 1; i < argc; i++) {
+        size_t size;
+        uint8_t* data = read_rom(argv[i], &size);
+        if (data == NULL) {
+            fprintf(stderr, "Could not read %s\n", argv[i]);
+            return 1;
+        }
+        roms[1 + i] = (Rom){ argv[i], data, size, 0 };
+    }
+
+    int failures = 0;
+    for (int r = 0; r < num_roms; r++) {
+        for (int q = 0; q < QUIRKS_COUNT; q++) {
+            failures += check_rom(&roms[r], (QuirkProfile)q, template, reference, lane) != 0;
+        }
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d SoA check(s) failed\n", failures);
+        return 1;
+    }
+    printf("SoA matches step() on every lane\n");
+    return 0;
+}
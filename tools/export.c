@@ -0,0 +1,239 @@
+/*
+ * Exports a frame stream recorded with --video to a PNG sequence, one
+ * palette image per frame named PREFIX000000.png, PREFIX000001.png, ...
+ * The PNGs use stored (uncompressed) deflate blocks, so no zlib is needed.
+ *
+ * Usage: chip8-export [--from N] [--count N] [--scale S] [--info] VIDEO PREFIX
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "video.h"
+
+#define MAX_SCALE 16
+
+// Same colors as the window's defaults, by plane bits
+static const uint32_t plane_colors[1 << NUM_PLANES] = {
+    0x000000, 0xFFFFFF, 0xAAAAAA, 0x555555,
+    0xFF0000, 0x00FF00, 0x0000FF, 0xFFFF00,
+    0x880000, 0x008800, 0x000088, 0x888800,
+    0xFF00FF, 0x00FFFF, 0x880088, 0x008888
+};
+
+static uint32_t crc_table[256];
+
+static void initialize_crc(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t update_crc(uint32_t crc, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void put_be(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static int write_chunk(FILE* file, const char* type, const uint8_t* data, uint32_t size) {
+    uint8_t length[4], crc[4];
+    put_be(length, size);
+    uint32_t c = update_crc(0xFFFFFFFFu, (const uint8_t*)type, 4);
+    put_be(crc, update_crc(c, data, size) ^ 0xFFFFFFFFu);
+
+    return fwrite(length, 1, 4, file) == 4 && fwrite(type, 1, 4, file) == 4
+        && fwrite(data, 1, size, file) == size && fwrite(crc, 1, 4, file) == 4 ? 0 : -1;
+}
+
+/*
+ * `pixels` is `height` rows of a filter byte (0) and `width` palette
+ * indexes. They go into zlib stored blocks of at most 65535 bytes.
+ */
+static int write_png(const char* path, const uint8_t* pixels, uint32_t width, uint32_t height, int colors) {
+    size_t raw = (size_t)height * (width + 1);
+    size_t blocks = raw / 65535 + 1;
+    uint8_t* idat = malloc(2 + raw + 5 * blocks + 4);
+    if (idat == NULL) {
+        return -1;
+    }
+
+    size_t size = 0;
+    idat[size++] = 0x78;    // Deflate, 32 KB window
+    idat[size++] = 0x01;    // No compression, check bits
+    uint32_t a = 1, b = 0;
+    for (size_t done = 0; done < raw;) {
+        size_t count = raw - done < 65535 ? raw - done : 65535;
+        idat[size++] = done + count == raw;
+        idat[size++] = count & 0xFF;
+        idat[size++] = count >> 8;
+        idat[size++] = ~count & 0xFF;
+        idat[size++] = (~count >> 8) & 0xFF;
+        memcpy(idat + size, pixels + done, count);
+        size += count;
+        done += count;
+    }
+    for (size_t i = 0; i < raw; i++) {
+        a = (a + pixels[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    put_be(idat + size, b << 16 | a);
+    size += 4;
+
+    uint8_t header[13];
+    put_be(header, width);
+    put_be(header + 4, height);
+    header[8] = 8;          // Bits per index
+    header[9] = 3;          // Palette
+    header[10] = header[11] = header[12] = 0;
+
+    uint8_t palette[3 << NUM_PLANES];
+    for (int i = 0; i < colors; i++) {
+        palette[3 * i] = plane_colors[i] >> 16;
+        palette[3 * i + 1] = plane_colors[i] >> 8;
+        palette[3 * i + 2] = plane_colors[i];
+    }
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    FILE* file = fopen(path, "wb");
+    int status = file != NULL
+              && fwrite(signature, 1, 8, file) == 8
+              && write_chunk(file, "IHDR", header, sizeof(header)) == 0
+              && write_chunk(file, "PLTE", palette, 3 * colors) == 0
+              && write_chunk(file, "IDAT", idat, (uint32_t)size) == 0
+              && write_chunk(file, "IEND", NULL, 0) == 0 ? 0 : -1;
+    if (file != NULL && fclose(file) != 0) {
+        status = -1;
+    }
+    free(idat);
+    return status;
+}
+
+// The visible screen, every pixel `scale` times in both directions
+static void frame_pixels(const VideoFrame* frame, int planes, int scale, uint8_t* out, uint32_t* width, uint32_t* height) {
+    int w = frame->hires ? FRAMEBUFFER_WIDTH : LORES_WIDTH;
+    int h = frame->hires ? FRAMEBUFFER_HEIGHT : LORES_HEIGHT;
+    *width = w * scale;
+    *height = h * scale;
+
+    for (int y = 0; y < h; y++) {
+        uint8_t* row = out + (size_t)y * scale * (*width + 1);
+        row[0] = 0;
+        for (int x = 0; x < w; x++) {
+            uint8_t index = 0;
+            for (int plane = 0; plane < planes; plane++) {
+                index |= (frame->framebuffer[plane][y][x / 64] >> (63 - x % 64) & 1) << plane;
+            }
+            memset(row + 1 + x * scale, index, scale);
+        }
+        for (int copy = 1; copy < scale; copy++) {
+            memcpy(row + copy * (*width + 1), row, *width + 1);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    uint64_t from = 0;
+    uint64_t count = UINT64_MAX;
+    int scale = 1;
+    int info = 0;
+    int usage = 0;
+
+    static const struct option long_options[] = {
+        {"from",  required_argument, NULL, 'f'},
+        {"count", required_argument, NULL, 'n'},
+        {"scale", required_argument, NULL, 's'},
+        {"info",  no_argument,       NULL, 'i'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:n:s:i", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                from = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                count = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                scale = atoi(optarg);
+                break;
+            case 'i':
+                info = 1;
+                break;
+            default:
+                usage = 1;
+                break;
+        }
+    }
+    if (usage || optind != argc - 2 + info || scale < 1 || scale > MAX_SCALE) {
+        fprintf(stderr, "Usage: %s [--from N] [--count N] [--scale S] VIDEO PREFIX\n"
+                        "       %s --info VIDEO\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    VideoReader reader;
+    if (open_video(&reader, argv[optind]) < 0) {
+        return 1;
+    }
+
+    if (info) {
+        printf("%llu frames, %u planes, %u keyframes every %u frames\n",
+               (unsigned long long)reader.frames, reader.planes, reader.index_count, reader.keyframe_interval);
+        close_video(&reader);
+        return 0;
+    }
+
+    const char* prefix = argv[optind + 1];
+    uint8_t* pixels = malloc((size_t)FRAMEBUFFER_HEIGHT * MAX_SCALE * (FRAMEBUFFER_WIDTH * MAX_SCALE + 1));
+    if (pixels == NULL || seek_video(&reader, from) < 0) {
+        fprintf(stderr, "Could not start exporting\n");
+        free(pixels);
+        close_video(&reader);
+        return 1;
+    }
+
+    initialize_crc();
+    int status = 0;
+    uint64_t written = 0;
+    while (written < count) {
+        uint64_t number = reader.next;
+        int read = read_video_frame(&reader);
+        if (read <= 0) {
+            if (read < 0) {
+                fprintf(stderr, "Frame %llu is corrupt\n", (unsigned long long)number);
+                status = 1;
+            }
+            break;
+        }
+
+        uint32_t width, height;
+        frame_pixels(&reader.frame, reader.planes, scale, pixels, &width, &height);
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s%06llu.png", prefix, (unsigned long long)number);
+        if (write_png(path, pixels, width, height, 1 << reader.planes) < 0) {
+            fprintf(stderr, "Could not write %s\n", path);
+            status = 1;
+            break;
+        }
+        written++;
+    }
+
+    printf("%llu frames exported\n", (unsigned long long)written);
+    free(pixels);
+    close_video(&reader);
+    return status;
+}